@@ -173,6 +173,20 @@ static void ferret_bv_scan_sparse()
     }
 }
 
+static void ferret_bv_scan_n_sparse()
+{
+    int i, j, n, buf[256];
+
+    for (i = 0; i < N; i++) {
+        bv_scan_reset(bv);
+        j = SCAN_INC;
+        while ((n = bv_scan_next_n(bv, buf, NELEMS(buf))) > 0) {
+            assert(j == buf[0]);
+            j += n * SCAN_INC;
+        }
+    }
+}
+
 static void ferret_bv_set_dense()
 {
     int i;
@@ -195,6 +209,21 @@ static void ferret_bv_scan_dense()
     }
 }
 
+static void ferret_bv_scan_n_dense()
+{
+    int i, j, n, buf[256];
+
+    for (i = 0; i < N; i++) {
+        bv_scan_reset(bv);
+        j = 0;
+        while ((n = bv_scan_next_n(bv, buf, NELEMS(buf))) > 0) {
+            assert(j == buf[0]);
+            j += n;
+        }
+        assert(DENSE_SCAN_SIZE == j);
+    }
+}
+
 BENCH(bitvector_implementations)
 {
     BM_SETUP(setup);
@@ -215,6 +244,7 @@ BENCH(bitvector_implementations)
 #endif
     BM_ADD(ferret_bv_set_sparse);
     BM_ADD(ferret_bv_scan_sparse);
+    BM_ADD(ferret_bv_scan_n_sparse);
     BM_ADD(ferret_bv_and_sparse);
     BM_ADD(ferret_bv_or_sparse);
     BM_ADD(ferret_bv_not_sparse);
@@ -222,6 +252,7 @@ BENCH(bitvector_implementations)
 
     BM_ADD(ferret_bv_set_dense);
     BM_ADD(ferret_bv_scan_dense);
+    BM_ADD(ferret_bv_scan_n_dense);
     BM_ADD(ferret_bv_and_dense);
     BM_ADD(ferret_bv_or_dense);
     BM_ADD(ferret_bv_not_dense);
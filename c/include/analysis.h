@@ -9,6 +9,7 @@ extern "C" {
 #include "hash.h"
 #include "symbol.h"
 #include "multimapper.h"
+#include "threading.h"
 #include <wchar.h>
 
 /****************************************************************************
@@ -197,6 +198,11 @@ typedef struct FrtAnalyzer
     FrtTokenStream *(*get_ts)(struct FrtAnalyzer *a, FrtSymbol field, char *text);
     void (*destroy_i)(struct FrtAnalyzer *a);
     int ref_cnt;
+    /* each thread resets its own clone of current_ts for every field rather
+     * than cloning a new one. NULL if the analyzer has no current_ts */
+    void **ts_bucket;
+    frt_thread_key_t thread_ts;
+    frt_mutex_t mutex;
 } FrtAnalyzer;
 
 extern void frt_a_deref(FrtAnalyzer *a);
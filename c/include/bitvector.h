@@ -9,15 +9,18 @@ extern "C" {
 
 #define FRT_BV_INIT_CAPA 256
 
+/* the number of 64-bit words needed to hold +n+ bits */
+#define FRT_BV_WORDS(n) (((n) + 63) >> 6)
+
 typedef struct FrtBitVector
 {
-    /** The bits are held in an array of 32-bit integers */
-    frt_u32 *bits;
+    /** The bits are held in an array of 64-bit integers */
+    frt_u64 *bits;
 
     /** size is equal to 1 + the highest order bit set */
     int size;
 
-    /** capa is the number of words (U32) allocated for the bits */
+    /** capa is the number of words (U64) allocated for the bits */
     int capa;
 
     /** count is the running count of bits set. This is kept up to
@@ -61,6 +64,30 @@ FrtBitVector *frt_bv_new_capa(int capa);
  */
 extern void frt_bv_destroy(FrtBitVector *bv);
 
+/**
+ * Grow the FrtBitVector so that it holds at least +size+ bits. The new words
+ * are filled according to +extends_as_ones+.
+ *
+ * @param bv the FrtBitVector to grow
+ * @param size the number of bits the FrtBitVector must hold
+ */
+static FRT_ATTR_ALWAYS_INLINE
+void frt_bv_grow(FrtBitVector *bv, int size)
+{
+    int word = (size - 1) >> 6;
+    bv->size = size;
+    if (word >= bv->capa) {
+        int capa = bv->capa << 1;
+        while (capa <= word) {
+            capa <<= 1;
+        }
+        FRT_REALLOC_N(bv->bits, frt_u64, capa);
+        memset(bv->bits + bv->capa, (bv->extends_as_ones ? 0xFF : 0),
+               sizeof(frt_u64) * (capa - bv->capa));
+        bv->capa = capa;
+    }
+}
+
 /**
  * Set the bit at position +index+ with +value+. If +index+ is outside
  * of the range of the FrtBitVector, that is >= FrtBitVector.size,
@@ -81,23 +108,13 @@ extern void frt_bv_destroy(FrtBitVector *bv);
 static FRT_ATTR_ALWAYS_INLINE
 void frt_bv_set_value(FrtBitVector *bv, int bit, bool value)
 {
-    frt_u32 *word_p;
-    int word = bit >> 5;
-    frt_u32 bitmask = 1 << (bit & 31);
+    frt_u64 *word_p;
+    int word = bit >> 6;
+    frt_u64 bitmask = (frt_u64)1 << (bit & 63);
 
     /* Check to see if we need to grow the BitVector */
     if (unlikely(bit >= bv->size)) {
-        bv->size = bit + 1; /* size is max range of bits set */
-        if (word >= bv->capa) {
-            int capa = bv->capa << 1;
-            while (capa <= word) {
-                capa <<= 1;
-            }
-            FRT_REALLOC_N(bv->bits, frt_u32, capa);
-            memset(bv->bits + bv->capa, (bv->extends_as_ones ? 0xFF : 0),
-                   sizeof(frt_u32) * (capa - bv->capa));
-            bv->capa = capa;
-        }
+        frt_bv_grow(bv, bit + 1); /* size is max range of bits set */
     }
 
     /* Set the required bit */
@@ -162,7 +179,7 @@ void frt_bv_set_fast(FrtBitVector *bv, int bit)
 {
     bv->count++;
     bv->size = bit + 1;
-    bv->bits[bit >> 5] |= (1 << (bit & 31));
+    bv->bits[bit >> 6] |= ((frt_u64)1 << (bit & 63));
 }
 
 /**
@@ -181,7 +198,7 @@ int frt_bv_get(FrtBitVector *bv, int bit)
     if (unlikely(bit >= bv->size)) {
         return bv->extends_as_ones;
     }
-    return (bv->bits[bit >> 5] >> (bit & 31)) & 0x01;
+    return (int)((bv->bits[bit >> 6] >> (bit & 63)) & 0x01);
 }
 
 /**
@@ -198,6 +215,17 @@ void frt_bv_unset(FrtBitVector *bv, int bit)
     frt_bv_set_value(bv, bit, 0);
 }
 
+/**
+ * Set all the bits from +from+ up to but not including +to+. This is the
+ * same as calling frt_bv_set on each bit in the range but it sets a whole
+ * word at a time.
+ *
+ * @param bv the FrtBitVector to set the bits in
+ * @param from the index of the first bit to set
+ * @param to the index after the last bit to set
+ */
+extern void frt_bv_set_range(FrtBitVector *bv, int from, int to);
+
 /**
  * Clear all set bits. This function will set all set bits to 0.
  *
@@ -217,37 +245,7 @@ extern void frt_bv_clear(FrtBitVector *bv);
  * @return the number of set bits in the FrtBitVector. FrtBitVector.count is also
  *   set
  */
-static FRT_ATTR_ALWAYS_INLINE
-int frt_bv_recount(FrtBitVector *bv)
-{
-    unsigned int extra = ((bv->size & 31) >> 3) + 1;
-    unsigned int len   = bv->size >> 5;
-    unsigned int idx, count = 0;
-
-    if (bv->extends_as_ones) {
-        for (idx = 0; idx < len; ++idx) {
-            count += frt_count_zeros(bv->bits[idx]);
-        }
-        switch (extra) {
-            case 4: count += frt_count_zeros(bv->bits[idx] | 0x00ffffff);
-            case 3: count += frt_count_zeros(bv->bits[idx] | 0xff00ffff);
-            case 2: count += frt_count_zeros(bv->bits[idx] | 0xffff00ff);
-            case 1: count += frt_count_zeros(bv->bits[idx] | 0xffffff00);
-        }
-    }
-    else {
-        for (idx = 0; idx < len; ++idx) {
-            count += frt_count_ones(bv->bits[idx]);
-        }
-        switch (extra) {
-            case 4: count += frt_count_ones(bv->bits[idx] & 0xff000000);
-            case 3: count += frt_count_ones(bv->bits[idx] & 0x00ff0000);
-            case 2: count += frt_count_ones(bv->bits[idx] & 0x0000ff00);
-            case 1: count += frt_count_ones(bv->bits[idx] & 0x000000ff);
-        }
-    }
-    return bv->count = count;
-}
+extern int frt_bv_recount(FrtBitVector *bv);
 
 /**
  * Reset the FrtBitVector for scanning. This function should be called
@@ -270,28 +268,24 @@ extern void frt_bv_scan_reset(FrtBitVector *bv);
 static FRT_ATTR_ALWAYS_INLINE
 int frt_bv_scan_next_from(FrtBitVector *bv, const int bit)
 {
-    frt_u32 pos  = bit >> 5;
-    frt_u32 word = bv->bits[pos];
+    int pos = bit >> 6;
+    const int word_size = FRT_BV_WORDS(bv->size);
+    frt_u64 word;
 
     if (bit >= bv->size)
         return -1;
 
     /* Keep only the bits above this position */
-    word &= ~0 << (bit & 31);
-    if (word) {
-        goto done;
-    }
-    else {
-        frt_u32 word_size = FRT_TO_WORD(bv->size);
-        for (pos++; pos < word_size; ++pos)
-        {
-            if ( (word = bv->bits[pos]) )
-                goto done;
-        }
+    word = bv->bits[pos] & (~(frt_u64)0 << (bit & 63));
+    while (!word) {
+        if (++pos >= word_size)
+            return -1;
+        word = bv->bits[pos];
     }
+    pos = (pos << 6) + frt_count_trailing_zeros64(word);
+    if (pos >= bv->size)
         return -1;
- done:
-    return bv->curr_bit = (pos << 5) + frt_count_trailing_zeros(word);
+    return bv->curr_bit = pos;
 }
 
 /**
@@ -320,28 +314,24 @@ int frt_bv_scan_next(FrtBitVector *bv)
 static FRT_ATTR_ALWAYS_INLINE
 int frt_bv_scan_next_unset_from(FrtBitVector *bv, const int bit)
 {
-    frt_u32 pos  = bit >> 5;
-    frt_u32 word = bv->bits[pos];
+    int pos = bit >> 6;
+    const int word_size = FRT_BV_WORDS(bv->size);
+    frt_u64 word;
 
     if (bit >= bv->size)
         return -1;
 
     /* Set all of the bits below this position */
-    word |= (1 << (bit & 31)) - 1;
-    if (~word) {
-        goto done;
-    }
-    else {
-        frt_u32 word_size = FRT_TO_WORD(bv->size);
-        for (pos++; pos < word_size; ++pos)
-        {
-            if ( ~(word = bv->bits[pos]) )
-                goto done;
-        }
+    word = bv->bits[pos] | (((frt_u64)1 << (bit & 63)) - 1);
+    while (!~word) {
+        if (++pos >= word_size)
+            return -1;
+        word = bv->bits[pos];
     }
-    return -1;
- done:
-    return bv->curr_bit = (pos << 5) + frt_count_trailing_ones(word);
+    pos = (pos << 6) + frt_count_trailing_ones64(word);
+    if (pos >= bv->size)
+        return -1;
+    return bv->curr_bit = pos;
 }
 
 /**
@@ -359,6 +349,20 @@ int frt_bv_scan_next_unset(FrtBitVector *bv)
     return frt_bv_scan_next_unset_from(bv, bv->curr_bit + 1);
 }
 
+/**
+ * Scan the FrtBitVector for up to +cnt+ of the next set bits, storing their
+ * indexes in +buf+. This works like calling frt_bv_scan_next +cnt+ times
+ * but it extracts all the set bits from a word at a time so it is much
+ * faster for consumers like filters which want every set bit.
+ *
+ * @param bv the FrtBitVector to scan
+ * @param buf the buffer to store the indexes of the set bits in
+ * @param cnt the size of +buf+
+ * @return the number of indexes stored in +buf+. This will only be less than
+ *   +cnt+ if there are no more bits set
+ */
+extern int frt_bv_scan_next_n(FrtBitVector *bv, int *buf, int cnt);
+
 /**
  * Check whether the two BitVectors have the same bits set.
  *
@@ -376,109 +380,31 @@ extern int frt_bv_eq(FrtBitVector *bv1, FrtBitVector *bv2);
  */
 extern unsigned long frt_bv_hash(FrtBitVector *bv);
 
-static FRT_ATTR_ALWAYS_INLINE
-void frt_bv_capa(FrtBitVector *bv, int capa, int size)
-{
-    int word_size = FRT_TO_WORD(size);
-    if (bv->capa < capa)
-    {
-        FRT_REALLOC_N(bv->bits, frt_u32, capa);
-        bv->capa = capa;
-        memset(bv->bits + word_size, (bv->extends_as_ones ? 0xFF : 0),
-               sizeof(frt_u32) * (capa - word_size));
-    }
-    bv->size = size;
-}
-
-#define frt_bv_and_ext(dest, src, extends_as_ones, i, max) do { \
-    if (extends_as_ones)                                        \
-         memcpy(&dest[i], &src[i], sizeof(*dest)*(max - i));    \
-    else memset(&dest[i], 0x00   , sizeof(*dest)*(max - i));    \
-} while(0)
-
-#define frt_bv_or_ext(dest, src, extends_as_ones, i, max) do { \
-    if (extends_as_ones)                                       \
-         memset(&dest[i], 0xFF   , sizeof(*dest)*(max - i));   \
-    else memcpy(&dest[i], &src[i], sizeof(*dest)*(max - i));   \
-} while(0)
-
-#define frt_bv_xor_ext(dest, src, extends_as_ones, i, max) do { \
-    frt_u32 n = (extends_as_ones ? 0xffffffff : 0);             \
-    for (; i < max; ++i)                                        \
-        dest[i] = src[i] ^ n;                                   \
-} while(0)
-
-#define FRT_BV_OP(bv, a, b, op, ext_cb) do {                          \
-    int i;                                                            \
-    int a_wsz = FRT_TO_WORD(a->size);                                 \
-    int b_wsz = FRT_TO_WORD(b->size);                                 \
-    int max_size = frt_max2(a->size, b->size);                        \
-    int min_size = frt_min2(a->size, b->size);                        \
-    int max_word_size = FRT_TO_WORD(max_size);                        \
-    int min_word_size = FRT_TO_WORD(min_size);                        \
-    int capa = frt_max2(frt_round2(max_word_size), 4);                \
-                                                                      \
-    bv->extends_as_ones = (a->extends_as_ones op b->extends_as_ones); \
-    frt_bv_capa(bv, capa, max_size);                                  \
-                                                                      \
-    for (i = 0; i < min_word_size; ++i)                               \
-        bv->bits[i] = a->bits[i] op b->bits[i];                       \
-                                                                      \
-    if (a_wsz != b_wsz) {                                             \
-        frt_u32 *bits = a->bits;                                      \
-        bool extends_as_ones = b->extends_as_ones;                    \
-        if (a_wsz < b_wsz) {                                          \
-            bits = b->bits;                                           \
-            extends_as_ones = a->extends_as_ones;                     \
-        }                                                             \
-        ext_cb(bv->bits, bits, extends_as_ones, i, max_word_size);    \
-    }                                                                 \
-    frt_bv_recount(bv);                                               \
-} while(0)
-
-static FRT_ATTR_ALWAYS_INLINE
-FrtBitVector *frt_bv_and_i(FrtBitVector *bv,
-                           FrtBitVector *a, FrtBitVector *b)
-{
-    FRT_BV_OP(bv, a, b, &, frt_bv_and_ext);
-    return bv;
-}
-
-static FRT_ATTR_ALWAYS_INLINE
-FrtBitVector *frt_bv_or_i(FrtBitVector *bv,
-                          FrtBitVector *a, FrtBitVector *b)
-{
-    FRT_BV_OP(bv, a, b, |, frt_bv_or_ext);
-    return bv;
-}
-
-static FRT_ATTR_ALWAYS_INLINE
-FrtBitVector *frt_bv_xor_i(FrtBitVector *bv,
-                           FrtBitVector *a, FrtBitVector *b)
-{
-    FRT_BV_OP(bv, a, b, ^, frt_bv_xor_ext);
-    return bv;
-}
-
-static FRT_ATTR_ALWAYS_INLINE
-FrtBitVector *frt_bv_not_i(FrtBitVector *bv, FrtBitVector *bv1)
-{
-    int i;
-    int word_size = FRT_TO_WORD(bv1->size);
-    int capa = frt_max2(frt_round2(word_size), 4);
-
-    bv->extends_as_ones = !bv1->extends_as_ones;
-    frt_bv_capa(bv, capa, bv1->size);
-
-    for (i = 0; i < word_size; i++)
-        bv->bits[i] = ~(bv1->bits[i]);
-
-    memset(bv->bits + word_size, (bv->extends_as_ones ? 0xFF : 0),
-           sizeof(frt_u32) * (bv->capa - word_size));
+/**
+ * ANDs, ORs or XORs +a+ and +b+ storing the result in +bv+. +bv+ may be
+ * either +a+ or +b+. The words are combined with AVX2 instructions if the CPU
+ * supports them.
+ *
+ * @param bv the FrtBitVector to store the result in
+ * @param a first FrtBitVector operand
+ * @param b second FrtBitVector operand
+ * @return +bv+
+ */
+extern FrtBitVector *frt_bv_and_i(FrtBitVector *bv,
+                                  FrtBitVector *a, FrtBitVector *b);
+extern FrtBitVector *frt_bv_or_i(FrtBitVector *bv,
+                                 FrtBitVector *a, FrtBitVector *b);
+extern FrtBitVector *frt_bv_xor_i(FrtBitVector *bv,
+                                  FrtBitVector *a, FrtBitVector *b);
 
-    frt_bv_recount(bv);
-    return bv;
-}
+/**
+ * Flips all the bits in +bv1+ storing the result in +bv+. +bv+ may be +bv1+.
+ *
+ * @param bv the FrtBitVector to store the result in
+ * @param bv1 the FrtBitVector to flip
+ * @return +bv+
+ */
+extern FrtBitVector *frt_bv_not_i(FrtBitVector *bv, FrtBitVector *bv1);
 
 /**
  * ANDs two BitVectors (+bv1+ and +bv2+) together and return the resultant
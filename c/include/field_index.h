@@ -13,19 +13,60 @@ extern "C" {
  *
  ***************************************************************************/
 
+/**
+ * An array of +size+ integers packed into +bits+ bits each. Values are
+ * stored as their offset from +base+ so the width only depends on the range
+ * of the values. Setting a value outside of the current range repacks the
+ * array with a wider range so it can be filled without knowing the range in
+ * advance. Every value starts as +min+. Floats are stored as integers which
+ * sort in the same order.
+ */
+typedef struct FrtPackedInts {
+    int size;
+    int bits;
+    frt_i64 base;
+    frt_u64 *words;
+} FrtPackedInts;
+
+extern FrtPackedInts *frt_pi_new(int size, frt_i64 min, frt_i64 max);
+extern FRT_INLINE frt_i64 frt_pi_get(FrtPackedInts *pi, int i);
+extern void frt_pi_set(FrtPackedInts *pi, int i, frt_i64 val);
+extern FRT_INLINE float frt_pi_get_float(FrtPackedInts *pi, int i);
+extern void frt_pi_set_float(FrtPackedInts *pi, int i, float val);
+extern void frt_pi_resize(FrtPackedInts *pi, int size);
+extern void frt_pi_destroy(FrtPackedInts *pi);
+
+/**
+ * The string values are stored null terminated, end to end in +values+.
+ * +offsets+ holds the offset of each value and +index+ the ordinal of each
+ * document's value. Ordinal 0 is the NULL value of documents without one.
+ */
 typedef struct FrtStringIndex {
     int size;
-    long *index;
-    char **values;
+    FrtPackedInts *index;
+    FrtPackedInts *offsets;
+    char *values;
+    long values_len;
+    long values_capa;
     int v_size;
-    int v_capa;
 } FrtStringIndex;
 
+#define FRT_STRING_INDEX_VALUE(si, ord) \
+    ((ord) ? (si)->values + frt_pi_get((si)->offsets, (int)(ord)) : NULL)
+
 typedef struct FrtFieldIndexClass {
     const char *type;
     void *(*create_index)(int size);
     void  (*destroy_index)(void *p);
     void  (*handle_term)(void *index, FrtTermDocEnum *tde, const char *text);
+    void *(*create_index_from_doc_values)(FrtDocValues *dv);
+    /* join the indexes of each segment of a multi-segment reader, starting
+     * at +starts+. An index is NULL if its segment has no such field */
+    void *(*merge_indexes)(void **indexes, const int *starts, int cnt,
+                           int size);
+    /* the class of the segment indexes given to merge_indexes if it isn't
+     * this one */
+    const struct FrtFieldIndexClass *segment_class;
 } FrtFieldIndexClass;
 
 typedef struct FrtFieldIndex {
@@ -0,0 +1,159 @@
+#ifndef FRT_FST_H
+#define FRT_FST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "store.h"
+#include "hash.h"
+
+/* keys must be shorter than this */
+#define FRT_FST_MAX_KEY_LEN FRT_MAX_WORD_SIZE
+
+/**
+ * A finite state transducer mapping a sorted set of byte string keys to
+ * their ordinal in that set. Common prefixes share the same arcs and common
+ * suffixes the same nodes so a large set of similar keys fits in a single
+ * compact byte array.
+ *
+ * Each node is a VInt holding (arc count << 1 | final) followed, if it has
+ * arcs, by a byte holding the widths in bytes of the outputs (high nibble)
+ * and targets (low nibble) of its arcs and then the arcs sorted by label.
+ * Each arc is its label byte, its output and the address of its target node.
+ * The ordinal of a key is the sum of the outputs of the arcs it follows.
+ * Since all arcs in a node have the same width they can be binary searched.
+ */
+typedef struct FrtFst
+{
+    const frt_uchar *bytes;
+    frt_uchar *buf;     /* the bytes if they aren't read straight from a map */
+    int len;
+    int root;
+    int size;           /* number of keys */
+} FrtFst;
+
+typedef struct FrtFstArc
+{
+    frt_uchar label;
+    int target;
+    int count;          /* number of keys reachable through the arc */
+} FrtFstArc;
+
+typedef struct FrtFstFrontierNode
+{
+    FrtFstArc *arcs;
+    int arc_cnt;
+    int arc_capa;
+    bool final : 1;
+} FrtFstFrontierNode;
+
+/**
+ * Builds an FrtFst from keys added in sorted order. The nodes on the path of
+ * the last key added are kept uncompiled on the frontier. Once a key has
+ * been added which leaves a node, that node can't change so it is compiled,
+ * reusing an identical node if one has already been compiled.
+ */
+typedef struct FrtFstBuilder
+{
+    frt_uchar *bytes;
+    int len;
+    int capa;
+    FrtHash *registry;  /* compiled nodes by their bytes */
+    FrtFstFrontierNode frontier[FRT_FST_MAX_KEY_LEN + 1];
+    char last_key[FRT_FST_MAX_KEY_LEN];
+    int last_key_len;
+    int size;
+} FrtFstBuilder;
+
+/**
+ * Create a new FrtFstBuilder.
+ *
+ * @return a newly allocated FrtFstBuilder
+ */
+extern FrtFstBuilder *frt_fstb_new();
+
+/**
+ * Add +key+ to the FrtFst being built. Its ordinal will be the number of
+ * keys added before it.
+ *
+ * @param b the FrtFstBuilder to add the key to
+ * @param key the key to add
+ * @param key_len the length of +key+ in bytes
+ * @raise FRT_ARG_ERROR if +key+ isn't greater than the last key added or is
+ *   too long
+ */
+extern void frt_fstb_add(FrtFstBuilder *b, const char *key, int key_len);
+
+/**
+ * Compile the keys added so far into an FrtFst and reset the builder so that
+ * it can be used to build another.
+ *
+ * @param b the FrtFstBuilder to finish
+ * @return a newly allocated FrtFst
+ */
+extern FrtFst *frt_fstb_finish(FrtFstBuilder *b);
+
+/**
+ * Destroy the FrtFstBuilder.
+ *
+ * @param b the FrtFstBuilder to destroy
+ */
+extern void frt_fstb_destroy(FrtFstBuilder *b);
+
+/**
+ * Write +fst+ to +os+.
+ *
+ * @param fst the FrtFst to write
+ * @param os the FrtOutStream to write to
+ */
+extern void frt_fst_write(FrtFst *fst, FrtOutStream *os);
+
+/**
+ * Read an FrtFst written by frt_fst_write. If +is+ is memory-mapped the
+ * FrtFst points straight at the mapping so +is+ must stay open for as long
+ * as the FrtFst is used.
+ *
+ * @param is the FrtInStream to read from
+ * @return a newly allocated FrtFst
+ */
+extern FrtFst *frt_fst_read(FrtInStream *is);
+
+/**
+ * Find the greatest key which is less than or equal to +key+.
+ *
+ * @param fst the FrtFst to search
+ * @param key the key to search for
+ * @param key_len the length of +key+ in bytes
+ * @param buf a buffer of at least FRT_FST_MAX_KEY_LEN bytes to store the key
+ *   found in. It is not null terminated
+ * @param len the length of the key found
+ * @return the ordinal of the key found or -1 if all keys are greater than
+ *   +key+
+ */
+extern int frt_fst_floor(FrtFst *fst, const char *key, int key_len,
+                         char *buf, int *len);
+
+/**
+ * Get the key with the ordinal +ord+.
+ *
+ * @param fst the FrtFst to get the key from
+ * @param ord the ordinal of the key. It must be less than fst->size
+ * @param buf a buffer of at least FRT_FST_MAX_KEY_LEN bytes to store the key
+ *   in. It is not null terminated
+ * @return the length of the key
+ */
+extern int frt_fst_get_key(FrtFst *fst, int ord, char *buf);
+
+/**
+ * Destroy the FrtFst.
+ *
+ * @param fst the FrtFst to destroy
+ */
+extern void frt_fst_destroy(FrtFst *fst);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
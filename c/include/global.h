@@ -259,6 +259,53 @@ int frt_count_zeros(frt_u32 word)
     return frt_count_ones(~word);
 }
 
+/**
+ * 64-bit versions of the bit counting functions above.
+ */
+static FRT_ATTR_ALWAYS_INLINE FRT_ATTR_CONST
+int frt_count_leading_zeros64(frt_u64 word)
+{
+#ifdef __GNUC__
+    if (word)
+        return __builtin_clzll(word);
+    return 64;
+#else
+    if (word >> 32)
+        return frt_count_leading_zeros((frt_u32)(word >> 32));
+    return frt_count_leading_zeros((frt_u32)word) + 32;
+#endif
+}
+
+static FRT_ATTR_ALWAYS_INLINE FRT_ATTR_CONST
+int frt_count_trailing_zeros64(frt_u64 word)
+{
+#ifdef __GNUC__
+    if (word)
+        return __builtin_ctzll(word);
+    return 64;
+#else
+    if ((frt_u32)word)
+        return frt_count_trailing_zeros((frt_u32)word);
+    return frt_count_trailing_zeros((frt_u32)(word >> 32)) + 32;
+#endif
+}
+
+static FRT_ATTR_ALWAYS_INLINE FRT_ATTR_CONST
+int frt_count_trailing_ones64(frt_u64 word)
+{
+    return frt_count_trailing_zeros64(~word);
+}
+
+static FRT_ATTR_ALWAYS_INLINE FRT_ATTR_CONST
+int frt_count_ones64(frt_u64 word)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(word);
+#else
+    return frt_count_ones((frt_u32)word) + frt_count_ones((frt_u32)(word >> 32));
+#endif
+}
+
 /**
  * Round up to the next power of 2
  */
@@ -15,6 +15,7 @@ extern "C" {
 #include "similarity.h"
 #include "bitvector.h"
 #include "priorityqueue.h"
+#include "fst.h"
 
 typedef struct FrtIndexReader FrtIndexReader;
 typedef struct FrtMultiReader FrtMultiReader;
@@ -28,6 +29,22 @@ extern bool frt_file_name_filter_is_index_file(const char *file_name, bool inclu
  *
  ****************************************************************************/
 
+/* The encoding of doc numbers and frequencies in the .frq file.
+ *
+ * FRT_POSTINGS_VINT stores every doc delta and frequency as a VInt.
+ * FRT_POSTINGS_BLOCK bit-packs them in blocks of FRT_POSTINGS_BLOCK_SIZE docs
+ * which are decoded a whole block at a time. This is much faster for terms
+ * which appear in a lot of documents. The last partial block of each term is
+ * stored as VInts. Each segment records its own format so indexes may mix
+ * both. */
+typedef enum
+{
+    FRT_POSTINGS_VINT = 0,
+    FRT_POSTINGS_BLOCK = 1
+} FrtPostingsFormat;
+
+#define FRT_POSTINGS_BLOCK_SIZE 128
+
 typedef struct FrtConfig
 {
     int chunk_size;
@@ -39,6 +56,21 @@ typedef struct FrtConfig
     int max_merge_docs;
     int max_field_length;
     bool use_compound_file;
+    FrtPostingsFormat postings_format;
+    int merge_threads;      /* 0 merges in the thread which commits */
+    /* limit the combined I/O rate of merges while searches are running on
+     * the index's store. 0 for no limit */
+    double max_merge_mb_per_sec;
+    /* threads each merge uses to merge the postings, stored fields and norms
+     * at the same time. 1 merges them one after the other */
+    int merge_workers;
+    /* keep the docs of each segment ordered by the integer value of this
+     * field so sorted searches can stop early. NULL keeps insertion order */
+    FrtSymbol sort_field;
+    bool sort_reverse;
+    /* threads each flush uses to sort the terms of the buffered fields. 1
+     * sorts them one field after the other */
+    int flush_workers;
 } FrtConfig;
 
 extern const FrtConfig frt_default_config;
@@ -103,6 +135,8 @@ typedef enum
 #define FRT_FI_STORE_TERM_VECTOR_BM 0x020
 #define FRT_FI_STORE_POSITIONS_BM   0x040
 #define FRT_FI_STORE_OFFSETS_BM     0x080
+#define FRT_FI_IS_KEY_BM            0x100
+#define FRT_FI_STORE_DOC_VALUES_BM  0x200
 
 typedef struct FrtFieldInfo
 {
@@ -128,6 +162,8 @@ extern void frt_fi_deref(FrtFieldInfo *fi);
 #define fi_store_term_vector(fi) (((fi)->bits & FRT_FI_STORE_TERM_VECTOR_BM) != 0)
 #define fi_store_positions(fi)   (((fi)->bits & FRT_FI_STORE_POSITIONS_BM) != 0)
 #define fi_store_offsets(fi)     (((fi)->bits & FRT_FI_STORE_OFFSETS_BM) != 0)
+#define fi_is_key(fi)            (((fi)->bits & FRT_FI_IS_KEY_BM) != 0)
+#define fi_store_doc_values(fi)  (((fi)->bits & FRT_FI_STORE_DOC_VALUES_BM) != 0)
 #define fi_has_norms(fi)\
     (((fi)->bits & (FRT_FI_OMIT_NORMS_BM|FRT_FI_IS_INDEXED_BM)) == FRT_FI_IS_INDEXED_BM)
 
@@ -183,6 +219,12 @@ typedef struct FrtSegmentInfo
     int *norm_gens;
     int norm_gens_size;
     bool use_compound_file;
+    bool merging;           /* an IndexWriter merge thread is merging it */
+    off_t size;             /* bytes on disk. 0 until frt_si_size is called */
+    int del_cnt;            /* the number of docs deleted as of del_cnt_gen */
+    int del_cnt_gen;
+    FrtSymbol sort_field;   /* the field the docs are ordered by or NULL */
+    bool sort_reverse;
 } FrtSegmentInfo;
 
 extern FrtSegmentInfo *frt_si_new(char *name, int doc_cnt, FrtStore *store);
@@ -191,6 +233,10 @@ extern bool frt_si_has_deletions(FrtSegmentInfo *si);
 extern bool frt_si_uses_compound_file(FrtSegmentInfo *si);
 extern bool frt_si_has_separate_norms(FrtSegmentInfo *si);
 extern void frt_si_advance_norm_gen(FrtSegmentInfo *si, int field_num);
+/* the bytes used by the segment's files, not counting deletions */
+extern off_t frt_si_size(FrtSegmentInfo *si);
+/* the number of deleted docs in the segment */
+extern int frt_si_del_cnt(FrtSegmentInfo *si);
 
 /****************************************************************************
  *
@@ -261,8 +307,8 @@ typedef struct FrtTermEnum FrtTermEnum;
 
 struct FrtTermEnum
 {
-    char        curr_term[FRT_MAX_WORD_SIZE];
-    char        prev_term[FRT_MAX_WORD_SIZE];
+    char        curr_term[FRT_MAX_WORD_SIZE + 1];
+    char        prev_term[FRT_MAX_WORD_SIZE + 1];
     FrtTermInfo    curr_ti;
     int         curr_term_len;
     int         field_num;
@@ -284,16 +330,25 @@ FrtTermInfo *frt_te_get_ti(struct FrtTermEnum *te);
 
 /* * FrtSegmentTermIndex * */
 
+/* tis ptr, doc_freq, frq_ptr, prx_ptr and skip_offset */
+#define FRT_TIX_ENTRY_COLS 5
+
 typedef struct FrtSegmentTermIndex
 {
     off_t       index_ptr;
     off_t       ptr;
     int         index_cnt;
     int         size;
-    char      **index_terms;
-    int        *index_term_lens;
-    FrtTermInfo   *index_term_infos;
-    off_t      *index_ptrs;
+    FrtFst     *index_fst;      /* index terms after the first, "" */
+    const frt_uchar *index_entries;
+    frt_uchar  *index_entries_buf;
+    int         index_entry_len;
+    frt_uchar   index_widths[FRT_TIX_ENTRY_COLS];
+    bool        bloom_is_read;
+    const frt_uchar *bloom;     /* NULL if the field has no Bloom filter */
+    frt_uchar  *bloom_buf;
+    int         bloom_len;      /* in bytes */
+    int         bloom_hash_cnt;
 } FrtSegmentTermIndex;
 
 /* * FrtSegmentFieldIndex * */
@@ -304,9 +359,14 @@ typedef struct FrtSegmentFieldIndex
 {
     frt_mutex_t     mutex;
     int         skip_interval;
+    int         skip_multiplier;
+    int         max_skip_levels;
     int         index_interval;
-    off_t       index_ptr;
-    FrtTermEnum   *index_te;
+    FrtPostingsFormat postings_format;
+    bool        has_impacts;
+    bool        has_fst_index;
+    bool        has_bloom_filters;
+    FrtInStream *index_in;
     FrtHash  *field_dict;
 } FrtSegmentFieldIndex;
 
@@ -365,6 +425,10 @@ extern void frt_tir_close(FrtTermInfosReader *tir);
 
 #define FRT_INDEX_INTERVAL 128
 #define FRT_SKIP_INTERVAL 16
+#define FRT_SKIP_MULTIPLIER 8
+#define FRT_MAX_SKIP_LEVELS 10
+#define FRT_BLOOM_BITS_PER_TERM 10
+#define FRT_BLOOM_HASH_CNT 7
 
 typedef struct FrtTermWriter
 {
@@ -379,17 +443,27 @@ typedef struct FrtTermInfosWriter
     int field_count;
     int index_interval;
     int skip_interval;
-    off_t last_index_ptr;
+    FrtPostingsFormat postings_format;
+    int index_cnt;
+    int index_capa;
+    off_t *index_entries;
+    FrtFstBuilder *index_fst;
+    bool with_bloom;
+    int bloom_cnt;
+    int bloom_capa;
+    frt_u64 *bloom_hashes;
     FrtOutStream *tfx_out;
-    FrtTermWriter *tix_writer;
+    FrtOutStream *tix_out;
     FrtTermWriter *tis_writer;
 } FrtTermInfosWriter;
 
 extern FrtTermInfosWriter *frt_tiw_open(FrtStore *store,
                                  const char *segment,
                                  int index_interval,
-                                 int skip_interval);
-extern void frt_tiw_start_field(FrtTermInfosWriter *tiw, int field_num);
+                                 int skip_interval,
+                                 FrtPostingsFormat postings_format);
+extern void frt_tiw_start_field(FrtTermInfosWriter *tiw, int field_num,
+                                bool with_bloom);
 extern void frt_tiw_add(FrtTermInfosWriter *tiw,
                     const char *term,
                     int t_len,
@@ -415,8 +489,32 @@ struct FrtTermDocEnum
     bool (*skip_to)(FrtTermDocEnum *tde, int target);
     int  (*next_position)(FrtTermDocEnum *tde);
     void (*close)(FrtTermDocEnum *tde);
+    /* Find the block of postings holding the first doc >= +target+ without
+     * moving the enum and set the maximum freq and norm of the docs in it.
+     * Returns the last doc the maximums cover or -1 if there is no impact
+     * data. +target+ must be greater than the current doc. May be NULL. */
+    int  (*block_max)(FrtTermDocEnum *tde, int target, int *max_freq,
+                      frt_uchar *max_norm);
 };
 
+/* * FrtSkipLevel * */
+
+/* State for one level of a term's skip list. Each entry on level n skips
+ * skip_interval * skip_multiplier^n documents. */
+typedef struct FrtSkipLevel
+{
+    FrtInStream *in;
+    off_t ptr;               /* start of this level in the .frq file */
+    off_t frq_ptr;
+    off_t prx_ptr;
+    off_t child_ptr;         /* matching entry in the level below */
+    int   doc;
+    int   skipped;           /* number of docs skipped by this level */
+    int   interval;
+    int   max_freq;          /* impacts of the docs up to doc. Level 0 only */
+    frt_uchar max_norm;
+} FrtSkipLevel;
+
 /* * FrtSegmentTermDocEnum * */
 
 typedef struct FrtSegmentTermDocEnum FrtSegmentTermDocEnum;
@@ -425,34 +523,48 @@ struct FrtSegmentTermDocEnum
     FrtTermDocEnum tde;
     void (*seek_prox)(FrtSegmentTermDocEnum *stde, off_t prx_ptr);
     void (*skip_prox)(FrtSegmentTermDocEnum *stde);
+    bool (*next_doc)(FrtTermDocEnum *tde);
     FrtTermInfosReader *tir;
     FrtInStream        *frq_in;
     FrtInStream        *prx_in;
-    FrtInStream        *skip_in;
     FrtBitVector       *deleted_docs;
     int count;               /* number of docs for this term  skipped */
     int doc_freq;            /* number of doc this term appears in */
     int doc_num;
     int freq;
-    int num_skips;
     int skip_interval;
-    int skip_count;
-    int skip_doc;
+    int skip_multiplier;
+    int max_skip_levels;
+    int num_skip_levels;
+    int last_skip_doc;
     int prx_cnt;
     int position;
     off_t frq_ptr;
     off_t prx_ptr;
     off_t skip_ptr;
+    off_t last_frq_ptr;
+    off_t last_prx_ptr;
+    off_t last_child_ptr;
+    FrtSkipLevel skip_levels[FRT_MAX_SKIP_LEVELS];
+    int tail_max_freq;       /* impacts of the docs after the last skip */
+    frt_uchar tail_max_norm;
+    const bool *norms_modified; /* set_norm has invalidated stored impacts */
+    int *block_docs;         /* decoded block. Only used by FRT_POSTINGS_BLOCK */
+    int *block_freqs;
+    int block_pos;
+    int block_len;
     bool have_skipped : 1;
+    bool has_impacts : 1;
 };
 
 extern FrtTermDocEnum *frt_stde_new(FrtTermInfosReader *tir, FrtInStream *frq_in,
-                             FrtBitVector *deleted_docs, int skip_interval);
+                             FrtBitVector *deleted_docs,
+                             FrtSegmentFieldIndex *sfi);
 
 /* * FrtSegmentTermDocEnum * */
 extern FrtTermDocEnum *frt_stpe_new(FrtTermInfosReader *tir, FrtInStream *frq_in,
                              FrtInStream *prx_in, FrtBitVector *deleted_docs,
-                             int skip_interval);
+                             FrtSegmentFieldIndex *sfi);
 
 /****************************************************************************
  * MultipleTermDocPosEnum
@@ -489,39 +601,89 @@ typedef struct FrtOccurence
 
 /****************************************************************************
  *
- * FrtPosting
+ * FrtByteBlockPool
+ *
+ * Streams of bytes are written in slices of a pool of fixed size blocks. A
+ * stream starts with a small slice and each slice it outgrows links to a
+ * bigger one, so the many short streams of rare terms take little memory.
+ * Streams are addressed by their offsets in the pool.
  *
  ****************************************************************************/
 
-typedef struct FrtPosting
-{
-    int freq;
-    int doc_num;
-    FrtOccurence *first_occ;
-    struct FrtPosting *next;
-} FrtPosting;
+#define FRT_BYTE_BLOCK_SHIFT 15
+#define FRT_BYTE_BLOCK_SIZE (1 << FRT_BYTE_BLOCK_SHIFT)
+#define FRT_BYTE_BLOCK_MASK (FRT_BYTE_BLOCK_SIZE - 1)
 
-extern FrtPosting *frt_p_new(FrtMemoryPool *mp, int doc_num, int pos);
+typedef struct FrtByteBlockPool
+{
+    frt_uchar **blocks;
+    int block_cnt;          /* blocks in use. The last is being filled */
+    int block_alloc;        /* blocks allocated. They're kept when reset */
+    int block_capa;
+    int upto;               /* the next free byte of the last block */
+} FrtByteBlockPool;
+
+extern FrtByteBlockPool *frt_bbp_new();
+extern void frt_bbp_reset(FrtByteBlockPool *bbp);
+extern void frt_bbp_destroy(FrtByteBlockPool *bbp);
+extern int frt_bbp_used(FrtByteBlockPool *bbp);
+extern int frt_bbp_new_slice(FrtByteBlockPool *bbp);
+extern void frt_bbp_write_byte(FrtByteBlockPool *bbp, int *upto, frt_uchar b);
+extern void frt_bbp_write_vint(FrtByteBlockPool *bbp, int *upto,
+                               unsigned int i);
+
+typedef struct FrtByteSliceReader
+{
+    FrtByteBlockPool *bbp;
+    frt_uchar *buf;         /* the block of the slice being read */
+    int buf_start;          /* the address of buf */
+    int upto;               /* the next byte to read in buf */
+    int limit;              /* the end of the slice's bytes in buf */
+    int level;
+    int end;                /* the address the stream ends at */
+} FrtByteSliceReader;
+
+extern void frt_bsr_init(FrtByteSliceReader *bsr, FrtByteBlockPool *bbp,
+                         int start, int end);
+extern bool frt_bsr_eof(FrtByteSliceReader *bsr);
+extern frt_uchar frt_bsr_read_byte(FrtByteSliceReader *bsr);
+extern unsigned int frt_bsr_read_vint(FrtByteSliceReader *bsr);
+extern void frt_bsr_copy_vints(FrtByteSliceReader *bsr, FrtOutStream *os,
+                               int cnt);
 
 /****************************************************************************
  *
  * FrtPostingList
  *
+ * The postings of a term buffered by a DocWriter. The postings of the docs
+ * before doc_num are encoded in its frq stream as they are in a .frq file
+ * and the position deltas of every doc in its prx stream as they are in a
+ * .prx file.
+ *
  ****************************************************************************/
 
 typedef struct FrtPostingList
 {
     const char *term;
     int term_len;
-    FrtPosting *first;
-    FrtPosting *last;
+    int doc_num;            /* the last doc the term was added to */
+    int freq;               /* the term's frequency in doc_num */
+    int last_pos;           /* the term's last position in doc_num */
+    int last_doc;           /* the last doc in the frq stream */
+    int frq_start;
+    int frq_upto;
+    int prx_start;
+    int prx_upto;
+    /* the positions in doc_num, only kept for term vectors */
+    FrtOccurence *first_occ;
     FrtOccurence *last_occ;
 } FrtPostingList;
 
 extern FrtPostingList *frt_pl_new(FrtMemoryPool *mp, const char *term,
-                           int term_len, FrtPosting *p);
+                                  int term_len);
 extern void frt_pl_add_occ(FrtMemoryPool *mp, FrtPostingList *pl, int pos);
 extern int frt_pl_cmp(const FrtPostingList **pl1, const FrtPostingList **pl2);
+extern void frt_pl_sort(FrtPostingList **plists, int cnt);
 
 /****************************************************************************
  *
@@ -689,6 +851,35 @@ extern void frt_deleter_find_deletable_files(FrtDeleter *dlr);
 extern void frt_deleter_commit_pending_files(FrtDeleter *dlr);
 extern void frt_deleter_delete_files(FrtDeleter *dlr, char **files, int file_cnt);
 
+/****************************************************************************
+ *
+ * FrtDocValues
+ *
+ ****************************************************************************/
+
+/**
+ * The values of a field stored in a segment's .dvs file, one per document.
+ * Each document refers to its value by its ordinal in the sorted +values+,
+ * starting at 1. Documents without a value have the ordinal 0. If a document
+ * has more than one term in the field then the greatest term is its value.
+ *
+ * The ordinals may point straight into a memory-mapped file so FrtDocValues
+ * mustn't outlive the FrtIndexReader they came from.
+ */
+typedef struct FrtDocValues
+{
+    int size;                   /* number of documents */
+    int value_cnt;
+    char **values;              /* values[0] is NULL */
+    const frt_uchar *ords;
+    int ord_width;              /* width of each ordinal in bytes */
+    frt_uchar *ords_buf;        /* the ords if they aren't read from a map */
+    FrtMemoryPool *mp;
+} FrtDocValues;
+
+extern int frt_dv_get_ord(FrtDocValues *dv, int doc_num);
+extern void frt_dv_destroy(FrtDocValues *dv);
+
 /****************************************************************************
  *
  * FrtIndexReader
@@ -707,6 +898,7 @@ struct FrtIndexReader
     frt_uchar              *(*get_norms)(FrtIndexReader *ir, int field_num);
     frt_uchar              *(*get_norms_into)(FrtIndexReader *ir, int field_num,
                                           frt_uchar *buf);
+    FrtDocValues          *(*get_doc_values)(FrtIndexReader *ir, int field_num);
     FrtTermEnum           *(*terms)(FrtIndexReader *ir, int field_num);
     FrtTermEnum           *(*terms_from)(FrtIndexReader *ir, int field_num,
                                       const char *term);
@@ -739,6 +931,8 @@ struct FrtIndexReader
     frt_mutex_t             field_index_mutex;
     frt_uchar              *fake_norms;
     frt_mutex_t             mutex;
+    int                 deletion_gen; /* bumped when the segment's docs are
+                                         deleted or undeleted */
     bool                has_changes : 1;
     bool                is_stale    : 1;
     bool                is_owner    : 1;
@@ -746,6 +940,11 @@ struct FrtIndexReader
 
 extern FrtIndexReader *frt_ir_create(FrtStore *store, FrtSegmentInfos *sis, int is_owner);
 extern FrtIndexReader *frt_ir_open(FrtStore *store);
+/* Open the latest version of the index +ir+ was opened on, sharing the
+ * readers of segments which haven't changed. Returns +ir+ itself with an
+ * extra reference if it is already the latest. Either way +ir+ must still be
+ * closed. */
+extern FrtIndexReader *frt_ir_reopen(FrtIndexReader *ir);
 extern int frt_ir_get_field_num(FrtIndexReader *ir, FrtSymbol field);
 extern bool frt_ir_index_exists(FrtStore *store);
 extern void frt_ir_close(FrtIndexReader *ir);
@@ -758,6 +957,7 @@ extern void frt_ir_set_norm(FrtIndexReader *ir, int doc_num, FrtSymbol field,
 extern frt_uchar *frt_ir_get_norms_i(FrtIndexReader *ir, int field_num);
 extern frt_uchar *frt_ir_get_norms(FrtIndexReader *ir, FrtSymbol field);
 extern frt_uchar *frt_ir_get_norms_into(FrtIndexReader *ir, FrtSymbol field, frt_uchar *buf);
+extern FrtDocValues *frt_ir_get_doc_values(FrtIndexReader *ir, FrtSymbol field);
 extern void frt_ir_destroy(FrtIndexReader *self);
 extern FrtDocument *frt_ir_get_doc_with_term(FrtIndexReader *ir, FrtSymbol field,
                                       const char *term);
@@ -771,6 +971,8 @@ extern FrtTermDocEnum *frt_ir_term_positions_for(FrtIndexReader *ir,
                                                  const char *t);
 extern void frt_ir_add_cache(FrtIndexReader *ir);
 extern bool frt_ir_is_latest(FrtIndexReader *ir);
+extern int frt_ir_segment_end(FrtIndexReader *ir, int doc_num, FrtSymbol field,
+                              bool reverse, bool *sorted);
 
 /****************************************************************************
  * FrtMultiReader
@@ -791,6 +993,14 @@ struct FrtMultiReader {
 extern int frt_mr_get_field_num(FrtMultiReader *mr, int ir_num, int f_num);
 extern FrtIndexReader *frt_mr_open(FrtIndexReader **sub_readers, const int r_cnt);
 
+/**
+ * Return +ir+ as an FrtMultiReader or NULL if it reads a single segment.
+ * Caches which are costly to build for a whole index, like filter results
+ * and sort indexes, are built for each sub reader and then joined so that
+ * readers which share segments can share most of the work.
+ */
+extern FrtMultiReader *frt_ir_as_multi(FrtIndexReader *ir);
+
 
 /****************************************************************************
  *
@@ -839,6 +1049,8 @@ typedef struct FrtDocWriter
     FrtFieldInfos *fis;
     FrtFieldsWriter *fw;
     FrtMemoryPool *mp;
+    FrtByteBlockPool *bbp;      /* the postings of the buffered docs */
+    FrtMemoryPool *tv_mp;       /* the term vector positions of a doc */
     FrtAnalyzer *analyzer;
     FrtHash *curr_plists;
     FrtHash *fields;
@@ -851,12 +1063,19 @@ typedef struct FrtDocWriter
     int skip_interval;
     int max_field_length;
     int max_buffered_docs;
+    int flush_workers;
+    FrtPostingsFormat postings_format;
+    FrtSymbol sort_field;   /* the docs are sorted by it when flushed */
+    bool sort_reverse;
+    bool in_use;            /* a thread is adding a doc with this writer */
+    int counted_memory;     /* frt_dw_used when last added to the total */
 } FrtDocWriter;
 
 extern FrtDocWriter *frt_dw_open(FrtIndexWriter *is, FrtSegmentInfo *si);
 extern void frt_dw_close(FrtDocWriter *dw);
 extern void frt_dw_add_doc(FrtDocWriter *dw, FrtDocument *doc);
 extern void frt_dw_new_segment(FrtDocWriter *dw, FrtSegmentInfo *si);
+extern int frt_dw_used(FrtDocWriter *dw);
 /* For testing. need to remove somehow. FIXME */
 extern FrtHash *frt_dw_invert_field(FrtDocWriter *dw,
                                   FrtFieldInverter *fld_inv,
@@ -864,12 +1083,71 @@ extern FrtHash *frt_dw_invert_field(FrtDocWriter *dw,
 extern FrtFieldInverter *frt_dw_get_fld_inv(FrtDocWriter *dw, FrtFieldInfo *fi);
 extern void frt_dw_reset_postings(FrtHash *postings);
 
+/****************************************************************************
+ *
+ * FrtMergePolicy
+ *
+ ****************************************************************************/
+
+/**
+ * Picks the segments an FrtIndexWriter merges. Segments which a merge thread
+ * is already merging have +merging+ set and must not be picked.
+ *
+ * find_merge is called after each commit and is called again after each
+ * merge it picks is started until it returns 0. find_expunge_merge is used
+ * the same way by frt_iw_expunge_deletes to pick segments to rewrite without
+ * their deleted docs. Both store the segments of iw->sis to merge in +segs+,
+ * which has room for all of them, and return how many there are.
+ */
+typedef struct FrtMergePolicy
+{
+    int  (*find_merge)(struct FrtMergePolicy *mp, FrtIndexWriter *iw,
+                       FrtSegmentInfo **segs);
+    int  (*find_expunge_merge)(struct FrtMergePolicy *mp, FrtIndexWriter *iw,
+                               FrtSegmentInfo **segs);
+    void (*destroy)(struct FrtMergePolicy *mp);
+} FrtMergePolicy;
+
+/**
+ * Merges merge_factor segments of about the same number of docs at a time,
+ * never merging segments holding more than max_merge_docs. This is the
+ * default policy and takes its settings from the FrtIndexWriter's FrtConfig.
+ */
+extern FrtMergePolicy *frt_log_merge_policy_new();
+
+/**
+ * Sorts segments by their size in bytes less their deleted docs and allows
+ * segs_per_tier segments of each size tier, each tier being
+ * max_merge_at_once times bigger than the last. When there are more
+ * segments than that it picks the merge of up to max_merge_at_once segments
+ * whose sizes are most even, favouring merges which reclaim more deleted
+ * docs. Segments too small to tell apart are treated as floor_segment_bytes
+ * and no merge produces a segment bigger than max_merged_segment_bytes.
+ */
+typedef struct FrtTieredMergePolicy
+{
+    FrtMergePolicy super;
+    int max_merge_at_once;
+    int segs_per_tier;
+    off_t max_merged_segment_bytes;
+    off_t floor_segment_bytes;
+    /* frt_iw_expunge_deletes rewrites segments with more deleted docs */
+    double expunge_deletes_pct_allowed;
+    /* how strongly merges which reclaim deleted docs are favoured */
+    double reclaim_deletes_weight;
+} FrtTieredMergePolicy;
+
+extern FrtMergePolicy *frt_tiered_merge_policy_new();
+
 /****************************************************************************
  *
  * FrtIndexWriter
  *
  ****************************************************************************/
 
+/* a merge of segments handed to the IndexWriter's merge threads */
+typedef struct FrtMergeTask FrtMergeTask;
+
 typedef struct FrtDelTerm
 {
     int field_num;
@@ -884,10 +1162,25 @@ struct FrtIndexWriter
     FrtAnalyzer *analyzer;
     FrtSegmentInfos *sis;
     FrtFieldInfos *fis;
-    FrtDocWriter *dw;
+    frt_rwlock_t fis_lock;      /* write locked while fields are added */
+    FrtDocWriter **dws;         /* one for each thread adding docs */
     FrtSimilarity *similarity;
     FrtLock *write_lock;
     FrtDeleter *deleter;
+    FrtMergePolicy *merge_policy;
+    FrtRateLimiter *merge_rate_limiter;
+    FrtIndexReader *reader;     /* the last reader opened by iw_get_reader */
+    int uncommitted_cnt;        /* segments flushed since the last commit */
+    bool merges_uncommitted;    /* merge threads have installed segments */
+    int buffered_memory;        /* memory used by all the DocWriters */
+    frt_thread_t *merge_threads;
+    int merge_thread_cnt;
+    frt_cond_t merge_cond;      /* signalled when merges are queued or done */
+    FrtMergeTask *merge_queue;  /* merges waiting for a merge thread */
+    int running_merges;
+    bool closing;
+    int merge_excode;
+    char *merge_error;          /* the message of the last failed merge */
 };
 
 extern void frt_index_create(FrtStore *store, FrtFieldInfos *fis);
@@ -899,10 +1192,26 @@ extern void frt_iw_delete_term(FrtIndexWriter *iw, FrtSymbol field,
 extern void frt_iw_delete_terms(FrtIndexWriter *iw, FrtSymbol field,
                             char **terms, const int term_cnt);
 extern void frt_iw_close(FrtIndexWriter *iw);
+/* Open a reader on the writer's segments including the docs added since
+ * the last commit. The buffered docs are flushed to a new segment but it
+ * isn't committed so no segments file is written. The reader is read-only
+ * and shares the segment readers of the last reader opened this way. */
+extern FrtIndexReader *frt_iw_get_reader(FrtIndexWriter *iw);
 extern void frt_iw_add_doc(FrtIndexWriter *iw, FrtDocument *doc);
 extern int frt_iw_doc_count(FrtIndexWriter *iw);
 extern void frt_iw_commit(FrtIndexWriter *iw);
 extern void frt_iw_optimize(FrtIndexWriter *iw);
+/* Rewrite the segments the merge policy's find_expunge_merge picks without
+ * their deleted docs. This is much cheaper than frt_iw_optimize on a large
+ * index as segments with few deletions are left alone. */
+extern void frt_iw_expunge_deletes(FrtIndexWriter *iw);
+/* Replace the FrtIndexWriter's merge policy. The FrtIndexWriter takes
+ * ownership of +mp+ and destroys it when it is closed. */
+extern void frt_iw_set_merge_policy(FrtIndexWriter *iw, FrtMergePolicy *mp);
+/* Change the writer's max_merge_mb_per_sec. Running merges pick up the new
+ * rate straight away. */
+extern void frt_iw_set_max_merge_mb_per_sec(FrtIndexWriter *iw,
+                                            double mb_per_sec);
 extern void frt_iw_add_readers(FrtIndexWriter *iw, FrtIndexReader **readers,
                            const int r_cnt);
 
@@ -17,12 +17,17 @@
 #define BC_MUST                            FRT_BC_MUST
 #define BC_MUST_NOT                        FRT_BC_MUST_NOT
 #define BC_SHOULD                          FRT_BC_SHOULD
+#define BLOOM_BITS_PER_TERM                FRT_BLOOM_BITS_PER_TERM
+#define BLOOM_HASH_CNT                     FRT_BLOOM_HASH_CNT
 #define BODY                               FRT_BODY
 #define BOOLEAN_CLAUSES_START_CAPA         FRT_BOOLEAN_CLAUSES_START_CAPA
 #define BOOLEAN_QUERY                      FRT_BOOLEAN_QUERY
 #define BUFFER_SIZE                        FRT_BUFFER_SIZE
 #define BV_INIT_CAPA                       FRT_BV_INIT_CAPA
-#define BV_OP                              FRT_BV_OP
+#define BV_WORDS                           FRT_BV_WORDS
+#define BYTE_BLOCK_MASK                    FRT_BYTE_BLOCK_MASK
+#define BYTE_BLOCK_SHIFT                   FRT_BYTE_BLOCK_SHIFT
+#define BYTE_BLOCK_SIZE                    FRT_BYTE_BLOCK_SIZE
 #define BYTE_FIELD_INDEX_CLASS             FRT_BYTE_FIELD_INDEX_CLASS
 #define COMMIT_LOCK_NAME                   FRT_COMMIT_LOCK_NAME
 #define CONSTANT_QUERY                     FRT_CONSTANT_QUERY
@@ -48,12 +53,17 @@
 #define FERRET_ERROR                       FRT_FERRET_ERROR
 #define FILE_NOT_FOUND_ERROR               FRT_FILE_NOT_FOUND_ERROR
 #define FILTERED_QUERY                     FRT_FILTERED_QUERY
+#define FILT_SPARSE_RATIO                  FRT_FILT_SPARSE_RATIO
 #define FINALLY                            FRT_FINALLY
+#define FST_MAX_KEY_LEN                    FRT_FST_MAX_KEY_LEN
+#define FS_MAX_OPEN_FILES                  FRT_FS_MAX_OPEN_FILES
 #define FI_IS_COMPRESSED_BM                FRT_FI_IS_COMPRESSED_BM
 #define FI_IS_INDEXED_BM                   FRT_FI_IS_INDEXED_BM
+#define FI_IS_KEY_BM                       FRT_FI_IS_KEY_BM
 #define FI_IS_STORED_BM                    FRT_FI_IS_STORED_BM
 #define FI_IS_TOKENIZED_BM                 FRT_FI_IS_TOKENIZED_BM
 #define FI_OMIT_NORMS_BM                   FRT_FI_OMIT_NORMS_BM
+#define FI_STORE_DOC_VALUES_BM             FRT_FI_STORE_DOC_VALUES_BM
 #define FI_STORE_OFFSETS_BM                FRT_FI_STORE_OFFSETS_BM
 #define FI_STORE_POSITIONS_BM              FRT_FI_STORE_POSITIONS_BM
 #define FI_STORE_TERM_VECTOR_BM            FRT_FI_STORE_TERM_VECTOR_BM
@@ -102,6 +112,7 @@
 #define MAX                                FRT_MAX
 #define MAX3                               FRT_MAX3
 #define MAX_FILE_PATH                      FRT_MAX_FILE_PATH
+#define MAX_SKIP_LEVELS                    FRT_MAX_SKIP_LEVELS
 #define MAX_WORD_SIZE                      FRT_MAX_WORD_SIZE
 #define MEM_ERROR                          FRT_MEM_ERROR
 #define MIN                                FRT_MIN
@@ -122,6 +133,9 @@
 #define PARSE_ERROR                        FRT_PARSE_ERROR
 #define PHQ_INIT_CAPA                      FRT_PHQ_INIT_CAPA
 #define PHRASE_QUERY                       FRT_PHRASE_QUERY
+#define POSTINGS_BLOCK                     FRT_POSTINGS_BLOCK
+#define POSTINGS_BLOCK_SIZE                FRT_POSTINGS_BLOCK_SIZE
+#define POSTINGS_VINT                      FRT_POSTINGS_VINT
 #define PQ_ADDED                           FRT_PQ_ADDED
 #define PQ_DROPPED                         FRT_PQ_DROPPED
 #define PQ_INSERTED                        FRT_PQ_INSERTED
@@ -133,6 +147,11 @@
 #define QUERY_STRING_START_SIZE            FRT_QUERY_STRING_START_SIZE
 #define RAISE                              FRT_RAISE
 #define RANGE_QUERY                        FRT_RANGE_QUERY
+#define RC_ARRAY                           FRT_RC_ARRAY
+#define RC_ARRAY_MAX                       FRT_RC_ARRAY_MAX
+#define RC_BITMAP                          FRT_RC_BITMAP
+#define RC_BITMAP_WORDS                    FRT_RC_BITMAP_WORDS
+#define RC_RUN                             FRT_RC_RUN
 #define REALLOC_N                          FRT_REALLOC_N
 #define RECAPA                             FRT_RECAPA
 #define REF                                FRT_REF
@@ -143,6 +162,7 @@
 #define SEGMENTS_FILE_NAME                 FRT_SEGMENTS_FILE_NAME
 #define SEGMENT_NAME_MAX_LENGTH            FRT_SEGMENT_NAME_MAX_LENGTH
 #define SKIP_INTERVAL                      FRT_SKIP_INTERVAL
+#define SKIP_MULTIPLIER                    FRT_SKIP_MULTIPLIER
 #define SLOW_DOWN                          FRT_SLOW_DOWN
 #define SORT_FIELD_DOC                     FRT_SORT_FIELD_DOC
 #define SORT_FIELD_DOC_REV                 FRT_SORT_FIELD_DOC_REV
@@ -169,6 +189,7 @@
 #define STORE_NO                           FRT_STORE_NO
 #define STORE_YES                          FRT_STORE_YES
 #define STRING_FIELD_INDEX_CLASS           FRT_STRING_FIELD_INDEX_CLASS
+#define STRING_INDEX_VALUE                 FRT_STRING_INDEX_VALUE
 #define STT_ASCII                          FRT_STT_ASCII
 #define STT_MB                             FRT_STT_MB
 #define STT_UTF8                           FRT_STT_UTF8
@@ -180,6 +201,7 @@
 #define TERM_VECTOR_YES                    FRT_TERM_VECTOR_YES
 #define TE_BUCKET_INIT_CAPA                FRT_TE_BUCKET_INIT_CAPA
 #define THREAD_ONCE_INIT                   FRT_THREAD_ONCE_INIT
+#define TIX_ENTRY_COLS                     FRT_TIX_ENTRY_COLS
 #define TO_WORD                            FRT_TO_WORD
 #define TRY                                FRT_TRY
 #define TV_FIELD_INIT_CAPA                 FRT_TV_FIELD_INIT_CAPA
@@ -209,6 +231,8 @@
 #define BooleanQuery            FrtBooleanQuery
 #define Boost                   FrtBoost
 #define Buffer                  FrtBuffer
+#define ByteBlockPool           FrtByteBlockPool
+#define ByteSliceReader         FrtByteSliceReader
 #define CWFileEntry             FrtCWFileEntry
 #define CacheObject             FrtCacheObject
 #define CachedTokenStream       FrtCachedTokenStream
@@ -222,6 +246,8 @@
 #define Deleter                 FrtDeleter
 #define DeterministicState      FrtDeterministicState
 #define DocField                FrtDocField
+#define DocIdSetIterator        FrtDocIdSetIterator
+#define DocValues               FrtDocValues
 #define DocWriter               FrtDocWriter
 #define Document                FrtDocument
 #define Explanation             FrtExplanation
@@ -236,6 +262,10 @@
 #define FieldsWriter            FrtFieldsWriter
 #define Filter                  FrtFilter
 #define FilteredQuery           FrtFilteredQuery
+#define Fst                     FrtFst
+#define FstArc                  FrtFstArc
+#define FstBuilder              FrtFstBuilder
+#define FstFrontierNode         FrtFstFrontierNode
 #define FuzzyQuery              FrtFuzzyQuery
 #define Hash                    FrtHash
 #define HashEntry               FrtHashEntry
@@ -264,6 +294,8 @@
 #define MatchRange              FrtMatchRange
 #define MatchVector             FrtMatchVector
 #define MemoryPool              FrtMemoryPool
+#define MergePolicy             FrtMergePolicy
+#define MergeTask               FrtMergeTask
 #define MultiByteTokenStream    FrtMultiByteTokenStream
 #define MultiMapper             FrtMultiMapper
 #define MultiReader             FrtMultiReader
@@ -273,12 +305,13 @@
 #define Offset                  FrtOffset
 #define OutStream               FrtOutStream
 #define OutStreamMethods        FrtOutStreamMethods
+#define PackedInts              FrtPackedInts
 #define PerFieldAnalyzer        FrtPerFieldAnalyzer
 #define PhrasePosition          FrtPhrasePosition
 #define PhraseQuery             FrtPhraseQuery
 #define PostFilter              FrtPostFilter
-#define Posting                 FrtPosting
 #define PostingList             FrtPostingList
+#define PostingsFormat          FrtPostingsFormat
 #define PrefixQuery             FrtPrefixQuery
 #define PriorityQueue           FrtPriorityQueue
 #define PriorityQueueInsertEnum FrtPriorityQueueInsertEnum
@@ -288,6 +321,9 @@
 #define QueryType               FrtQueryType
 #define RAMFile                 FrtRAMFile
 #define RangeQuery              FrtRangeQuery
+#define RateLimiter             FrtRateLimiter
+#define Roaring                 FrtRoaring
+#define RoaringContainer        FrtRoaringContainer
 #define Scorer                  FrtScorer
 #define Searcher                FrtSearcher
 #define SegmentFieldIndex       FrtSegmentFieldIndex
@@ -296,6 +332,7 @@
 #define SegmentTermDocEnum      FrtSegmentTermDocEnum
 #define SegmentTermEnum         FrtSegmentTermEnum
 #define SegmentTermIndex        FrtSegmentTermIndex
+#define SkipLevel               FrtSkipLevel
 #define Similarity              FrtSimilarity
 #define Sort                    FrtSort
 #define SortField               FrtSortField
@@ -329,6 +366,7 @@
 #define TermVector              FrtTermVector
 #define TermVectorValue         FrtTermVectorValue
 #define TermWriter              FrtTermWriter
+#define TieredMergePolicy       FrtTieredMergePolicy
 #define Token                   FrtToken
 #define TokenFilter             FrtTokenFilter
 #define TokenStream             FrtTokenStream
@@ -380,6 +418,13 @@
 #define ary_type_size                                  frt_ary_type_size
 #define ary_unshift                                    frt_ary_unshift
 #define ary_unshift_i                                  frt_ary_unshift_i
+#define bbp_destroy                                    frt_bbp_destroy
+#define bbp_new                                        frt_bbp_new
+#define bbp_new_slice                                  frt_bbp_new_slice
+#define bbp_reset                                      frt_bbp_reset
+#define bbp_used                                       frt_bbp_used
+#define bbp_write_byte                                 frt_bbp_write_byte
+#define bbp_write_vint                                 frt_bbp_write_vint
 #define bc_deref                                       frt_bc_deref
 #define bc_new                                         frt_bc_new
 #define bc_set_occur                                   frt_bc_set_occur
@@ -389,15 +434,19 @@
 #define bq_add_query_nr                                frt_bq_add_query_nr
 #define bq_new                                         frt_bq_new
 #define bq_new_max                                     frt_bq_new_max
+#define bsr_copy_vints                                 frt_bsr_copy_vints
+#define bsr_eof                                        frt_bsr_eof
+#define bsr_init                                       frt_bsr_init
+#define bsr_read_byte                                  frt_bsr_read_byte
+#define bsr_read_vint                                  frt_bsr_read_vint
 #define bv_and                                         frt_bv_and
-#define bv_and_ext                                     frt_bv_and_ext
 #define bv_and_i                                       frt_bv_and_i
 #define bv_and_x                                       frt_bv_and_x
-#define bv_capa                                        frt_bv_capa
 #define bv_clear                                       frt_bv_clear
 #define bv_destroy                                     frt_bv_destroy
 #define bv_eq                                          frt_bv_eq
 #define bv_get                                         frt_bv_get
+#define bv_grow                                        frt_bv_grow
 #define bv_hash                                        frt_bv_hash
 #define bv_new                                         frt_bv_new
 #define bv_new_capa                                    frt_bv_new_capa
@@ -405,21 +454,21 @@
 #define bv_not_i                                       frt_bv_not_i
 #define bv_not_x                                       frt_bv_not_x
 #define bv_or                                          frt_bv_or
-#define bv_or_ext                                      frt_bv_or_ext
 #define bv_or_i                                        frt_bv_or_i
 #define bv_or_x                                        frt_bv_or_x
 #define bv_recount                                     frt_bv_recount
 #define bv_scan_next                                   frt_bv_scan_next
 #define bv_scan_next_from                              frt_bv_scan_next_from
+#define bv_scan_next_n                                 frt_bv_scan_next_n
 #define bv_scan_next_unset                             frt_bv_scan_next_unset
 #define bv_scan_next_unset_from                        frt_bv_scan_next_unset_from
 #define bv_scan_reset                                  frt_bv_scan_reset
 #define bv_set                                         frt_bv_set
 #define bv_set_fast                                    frt_bv_set_fast
+#define bv_set_range                                   frt_bv_set_range
 #define bv_set_value                                   frt_bv_set_value
 #define bv_unset                                       frt_bv_unset
 #define bv_xor                                         frt_bv_xor
-#define bv_xor_ext                                     frt_bv_xor_ext
 #define bv_xor_i                                       frt_bv_xor_i
 #define bv_xor_x                                       frt_bv_xor_x
 #define byte2float                                     frt_byte2float
@@ -428,11 +477,20 @@
 #define close_lock                                     frt_close_lock
 #define co_create                                      frt_co_create
 #define co_hash_create                                 frt_co_hash_create
+#define cond_broadcast                                 frt_cond_broadcast
+#define cond_destroy                                   frt_cond_destroy
+#define cond_init                                      frt_cond_init
+#define cond_t                                         frt_cond_t
+#define cond_wait                                      frt_cond_wait
 #define count_leading_ones                             frt_count_leading_ones
 #define count_leading_zeros                            frt_count_leading_zeros
+#define count_leading_zeros64                          frt_count_leading_zeros64
 #define count_ones                                     frt_count_ones
+#define count_ones64                                   frt_count_ones64
 #define count_trailing_ones                            frt_count_trailing_ones
+#define count_trailing_ones64                          frt_count_trailing_ones64
 #define count_trailing_zeros                           frt_count_trailing_zeros
+#define count_trailing_zeros64                         frt_count_trailing_zeros64
 #define count_zeros                                    frt_count_zeros
 #define csq_new                                        frt_csq_new
 #define csq_new_nr                                     frt_csq_new_nr
@@ -459,6 +517,8 @@
 #define doc_new                                        frt_doc_new
 #define doc_to_s                                       frt_doc_to_s
 #define dummy_free                                     frt_dummy_free
+#define dv_destroy                                     frt_dv_destroy
+#define dv_get_ord                                     frt_dv_get_ord
 #define dw_add_doc                                     frt_dw_add_doc
 #define dw_close                                       frt_dw_close
 #define dw_get_fld_inv                                 frt_dw_get_fld_inv
@@ -466,6 +526,7 @@
 #define dw_new_segment                                 frt_dw_new_segment
 #define dw_open                                        frt_dw_open
 #define dw_reset_postings                              frt_dw_reset_postings
+#define dw_used                                        frt_dw_used
 #define ecalloc                                        frt_ecalloc
 #define emalloc                                        frt_emalloc
 #define ensure_reader_open                             frt_ensure_reader_open
@@ -495,7 +556,10 @@
 #define filt_destroy_i                                 frt_filt_destroy_i
 #define filt_eq                                        frt_filt_eq
 #define filt_get_bv                                    frt_filt_get_bv
+#define filt_get_iterator                              frt_filt_get_iterator
+#define filt_get_roaring                               frt_filt_get_roaring
 #define filt_hash                                      frt_filt_hash
+#define filt_is_sparse                                 frt_filt_is_sparse
 #define filter_clone_size                              frt_filter_clone_size
 #define filter_ft                                      frt_filter_ft
 #define fis_add_field                                  frt_fis_add_field
@@ -520,12 +584,22 @@
 #define fr_get_tv                                      frt_fr_get_tv
 #define fr_open                                        frt_fr_open
 #define free_ft                                        frt_free_ft
+#define fs_max_open_files                              frt_fs_max_open_files
 #define fshq_pq_destroy                                frt_fshq_pq_destroy
 #define fshq_pq_down                                   frt_fshq_pq_down
 #define fshq_pq_insert                                 frt_fshq_pq_insert
 #define fshq_pq_new                                    frt_fshq_pq_new
 #define fshq_pq_pop                                    frt_fshq_pq_pop
 #define fshq_pq_pop_fd                                 frt_fshq_pq_pop_fd
+#define fst_destroy                                    frt_fst_destroy
+#define fst_floor                                      frt_fst_floor
+#define fst_get_key                                    frt_fst_get_key
+#define fst_read                                       frt_fst_read
+#define fst_write                                      frt_fst_write
+#define fstb_add                                       frt_fstb_add
+#define fstb_destroy                                   frt_fstb_destroy
+#define fstb_finish                                    frt_fstb_finish
+#define fstb_new                                       frt_fstb_new
 #define fuzq_new                                       frt_fuzq_new
 #define fuzq_new_conf                                  frt_fuzq_new_conf
 #define fuzq_score                                     frt_fuzq_score
@@ -619,12 +693,14 @@
 #define intern                                         frt_intern
 #define intern_and_free                                frt_intern_and_free
 #define ir_add_cache                                   frt_ir_add_cache
+#define ir_as_multi                                    frt_ir_as_multi
 #define ir_close                                       frt_ir_close
 #define ir_commit                                      frt_ir_commit
 #define ir_create                                      frt_ir_create
 #define ir_delete_doc                                  frt_ir_delete_doc
 #define ir_destroy                                     frt_ir_destroy
 #define ir_doc_freq                                    frt_ir_doc_freq
+#define ir_get_doc_values                              frt_ir_get_doc_values
 #define ir_get_doc_with_term                           frt_ir_get_doc_with_term
 #define ir_get_field_num                               frt_ir_get_field_num
 #define ir_get_norms                                   frt_ir_get_norms
@@ -633,6 +709,8 @@
 #define ir_index_exists                                frt_ir_index_exists
 #define ir_is_latest                                   frt_ir_is_latest
 #define ir_open                                        frt_ir_open
+#define ir_reopen                                      frt_ir_reopen
+#define ir_segment_end                                 frt_ir_segment_end
 #define ir_set_norm                                    frt_ir_set_norm
 #define ir_term_docs_for                               frt_ir_term_docs_for
 #define ir_term_positions_for                          frt_ir_term_positions_for
@@ -667,8 +745,12 @@
 #define iw_delete_term                                 frt_iw_delete_term
 #define iw_delete_terms                                frt_iw_delete_terms
 #define iw_doc_count                                   frt_iw_doc_count
+#define iw_expunge_deletes                             frt_iw_expunge_deletes
+#define iw_get_reader                                  frt_iw_get_reader
 #define iw_open                                        frt_iw_open
 #define iw_optimize                                    frt_iw_optimize
+#define iw_set_max_merge_mb_per_sec                    frt_iw_set_max_merge_mb_per_sec
+#define iw_set_merge_policy                            frt_iw_set_merge_policy
 #define lazy_df_get_bytes                              frt_lazy_df_get_bytes
 #define lazy_df_get_data                               frt_lazy_df_get_data
 #define lazy_doc_close                                 frt_lazy_doc_close
@@ -680,6 +762,7 @@
 #define letter_analyzer_new                            frt_letter_analyzer_new
 #define letter_tokenizer_new                           frt_letter_tokenizer_new
 #define lmalloc                                        frt_lmalloc
+#define log_merge_policy_new                           frt_log_merge_policy_new
 #define lowercase_filter_new                           frt_lowercase_filter_new
 #define lt_ft                                          frt_lt_ft
 #define mapping_filter_add                             frt_mapping_filter_add
@@ -747,6 +830,7 @@
 #define open_cw                                        frt_open_cw
 #define open_fs_store                                  frt_open_fs_store
 #define open_lock                                      frt_open_lock
+#define open_mmap_store                                frt_open_mmap_store
 #define open_ram_store                                 frt_open_ram_store
 #define open_ram_store_and_copy                        frt_open_ram_store_and_copy
 #define os_close                                       frt_os_close
@@ -765,7 +849,6 @@
 #define os_write_vint                                  frt_os_write_vint
 #define os_write_vll                                   frt_os_write_vll
 #define os_write_voff_t                                frt_os_write_voff_t
-#define p_new                                          frt_p_new
 #define per_field_analyzer_new                         frt_per_field_analyzer_new
 #define pfa_add_field                                  frt_pfa_add_field
 #define phq_add_term                                   frt_phq_add_term
@@ -773,9 +856,17 @@
 #define phq_append_multi_term                          frt_phq_append_multi_term
 #define phq_new                                        frt_phq_new
 #define phq_set_slop                                   frt_phq_set_slop
+#define pi_destroy                                     frt_pi_destroy
+#define pi_get                                         frt_pi_get
+#define pi_get_float                                   frt_pi_get_float
+#define pi_new                                         frt_pi_new
+#define pi_resize                                      frt_pi_resize
+#define pi_set                                         frt_pi_set
+#define pi_set_float                                   frt_pi_set_float
 #define pl_add_occ                                     frt_pl_add_occ
 #define pl_cmp                                         frt_pl_cmp
 #define pl_new                                         frt_pl_new
+#define pl_sort                                        frt_pl_sort
 #define pq_clear                                       frt_pq_clear
 #define pq_clone                                       frt_pq_clone
 #define pq_destroy                                     frt_pq_destroy
@@ -817,17 +908,41 @@
 #define ramo_length                                    frt_ramo_length
 #define ramo_reset                                     frt_ramo_reset
 #define ramo_write_to                                  frt_ramo_write_to
+#define rate_limiter_destroy                           frt_rate_limiter_destroy
+#define rate_limiter_new                               frt_rate_limiter_new
+#define rate_limiter_pause                             frt_rate_limiter_pause
+#define rate_limiter_set_mb_per_sec                    frt_rate_limiter_set_mb_per_sec
 #define register_for_cleanup                           frt_register_for_cleanup
 #define rfilt_new                                      frt_rfilt_new
+#define roar_add                                       frt_roar_add
+#define roar_and                                       frt_roar_and
+#define roar_destroy                                   frt_roar_destroy
+#define roar_from_bv                                   frt_roar_from_bv
+#define roar_get                                       frt_roar_get
+#define roar_memory                                    frt_roar_memory
+#define roar_new                                       frt_roar_new
+#define roar_next_from                                 frt_roar_next_from
+#define roar_next_n                                    frt_roar_next_n
+#define roar_optimize                                  frt_roar_optimize
+#define roar_read                                      frt_roar_read
+#define roar_to_bv                                     frt_roar_to_bv
+#define roar_write                                     frt_roar_write
 #define round2                                         frt_round2
 #define rq_new                                         frt_rq_new
 #define rq_new_less                                    frt_rq_new_less
 #define rq_new_more                                    frt_rq_new_more
+#define rwlock_destroy                                 frt_rwlock_destroy
+#define rwlock_init                                    frt_rwlock_init
+#define rwlock_rdlock                                  frt_rwlock_rdlock
+#define rwlock_t                                       frt_rwlock_t
+#define rwlock_unlock                                  frt_rwlock_unlock
+#define rwlock_wrlock                                  frt_rwlock_wrlock
 #define scmp                                           frt_scmp
 #define scorer_create                                  frt_scorer_create
 #define scorer_destroy_i                               frt_scorer_destroy_i
 #define scorer_doc_cmp                                 frt_scorer_doc_cmp
 #define scorer_doc_less_than                           frt_scorer_doc_less_than
+#define scorer_leapfrog                                frt_scorer_leapfrog
 #define scorer_less_than                               frt_scorer_less_than
 #define scorer_new                                     frt_scorer_new
 #define searcher_close                                 frt_searcher_close
@@ -850,9 +965,11 @@
 #define sfi_open                                       frt_sfi_open
 #define si_advance_norm_gen                            frt_si_advance_norm_gen
 #define si_deref                                       frt_si_deref
+#define si_del_cnt                                     frt_si_del_cnt
 #define si_has_deletions                               frt_si_has_deletions
 #define si_has_separate_norms                          frt_si_has_separate_norms
 #define si_new                                         frt_si_new
+#define si_size                                        frt_si_size
 #define si_uses_compound_file                          frt_si_uses_compound_file
 #define sim_coord                                      frt_sim_coord
 #define sim_create_default                             frt_sim_create_default
@@ -927,6 +1044,10 @@
 #define store_deref                                    frt_store_deref
 #define store_destroy                                  frt_store_destroy
 #define store_new                                      frt_store_new
+#define store_search_finish                            frt_store_search_finish
+#define store_search_start                             frt_store_search_start
+#define store_searching                                frt_store_searching
+#define store_share_searches                           frt_store_share_searches
 #define store_to_s                                     frt_store_to_s
 #define stpe_new                                       frt_stpe_new
 #define str_hash                                       frt_str_hash
@@ -946,15 +1067,21 @@
 #define term_hash                                      frt_term_hash
 #define term_new                                       frt_term_new
 #define tf_new_i                                       frt_tf_new_i
+#define thread_create                                  frt_thread_create
 #define thread_exit                                    frt_thread_exit
+#define thread_get_rate_limiter                        frt_thread_get_rate_limiter
 #define thread_getspecific                             frt_thread_getspecific
+#define thread_join                                    frt_thread_join
 #define thread_key_create                              frt_thread_key_create
 #define thread_key_delete                              frt_thread_key_delete
 #define thread_key_t                                   frt_thread_key_t
 #define thread_once                                    frt_thread_once
 #define thread_once_t                                  frt_thread_once_t
+#define thread_set_rate_limiter                        frt_thread_set_rate_limiter
 #define thread_setspecific                             frt_thread_setspecific
+#define thread_t                                       frt_thread_t
 #define ti_set                                         frt_ti_set
+#define tiered_merge_policy_new                        frt_tiered_merge_policy_new
 #define tir_close                                      frt_tir_close
 #define tir_get_term                                   frt_tir_get_term
 #define tir_get_ti                                     frt_tir_get_ti
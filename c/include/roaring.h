@@ -0,0 +1,176 @@
+#ifndef FRT_ROARING_H
+#define FRT_ROARING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "bitvector.h"
+#include "store.h"
+
+/* an array container holding more docs than this is stored as a bitmap */
+#define FRT_RC_ARRAY_MAX 4096
+#define FRT_RC_BITMAP_WORDS 1024
+
+enum FRT_RC_TYPE
+{
+    FRT_RC_ARRAY = 0,
+    FRT_RC_BITMAP,
+    FRT_RC_RUN
+};
+
+/**
+ * The docs of an FrtRoaring whose numbers share the same high 16 bits. The
+ * low 16 bits are held in whichever of these takes the least space;
+ *
+ * - array:  the sorted low bits of each doc in +shorts+
+ * - bitmap: a bit for each of the 65536 possible docs in +words+
+ * - run:    the start and (length - 1) of each run of docs in +shorts+
+ */
+typedef struct FrtRoaringContainer
+{
+    frt_u16 key;        /* the high 16 bits of the docs in the container */
+    frt_uchar type;
+    int card;           /* the number of docs in the container */
+    int len;            /* the number of shorts used by arrays and runs */
+    int capa;           /* the number of shorts allocated */
+    frt_u16 *shorts;
+    frt_u64 *words;
+} FrtRoaringContainer;
+
+/**
+ * A compressed set of doc numbers. The docs are split into chunks of 65536
+ * and each chunk which has any docs is stored in an FrtRoaringContainer so a
+ * sparse set takes a couple of bytes per doc and a dense set a bit per doc
+ * rather than the bit per doc in the index of an FrtBitVector.
+ */
+typedef struct FrtRoaring
+{
+    FrtRoaringContainer *containers;    /* sorted by key */
+    int size;                           /* the number of containers */
+    int capa;
+    int count;                          /* the number of docs */
+    int ref_cnt;
+} FrtRoaring;
+
+/**
+ * Create a new empty FrtRoaring.
+ *
+ * @return a newly allocated FrtRoaring
+ */
+extern FRT_ATTR_MALLOC
+FrtRoaring *frt_roar_new();
+
+/**
+ * Dereference the FrtRoaring, destroying it when it is no longer referenced.
+ *
+ * @param r the FrtRoaring to destroy
+ */
+extern void frt_roar_destroy(FrtRoaring *r);
+
+/**
+ * Add +doc+ to the FrtRoaring. Adding docs in order is fastest.
+ *
+ * @param r the FrtRoaring to add the doc to
+ * @param doc the doc number to add
+ */
+extern void frt_roar_add(FrtRoaring *r, int doc);
+
+/**
+ * Return 1 if +doc+ is in the FrtRoaring or 0 otherwise.
+ *
+ * @param r the FrtRoaring to check
+ * @param doc the doc number to check for
+ * @return 1 if +doc+ has been added, 0 otherwise
+ */
+extern int frt_roar_get(FrtRoaring *r, int doc);
+
+/**
+ * Find the first doc in the FrtRoaring which is greater than or equal to
+ * +doc+.
+ *
+ * @param r the FrtRoaring to search
+ * @param doc the doc number to start from
+ * @return the next doc or -1 if there are none
+ */
+extern int frt_roar_next_from(FrtRoaring *r, int doc);
+
+/**
+ * Store up to +cnt+ of the docs in the FrtRoaring which are greater than or
+ * equal to +doc+ in +buf+.
+ *
+ * @param r the FrtRoaring to search
+ * @param doc the doc number to start from
+ * @param buf the buffer to store the docs in
+ * @param cnt the size of +buf+
+ * @return the number of docs stored. This will only be less than +cnt+ if
+ *   there are no more docs
+ */
+extern int frt_roar_next_n(FrtRoaring *r, int doc, int *buf, int cnt);
+
+/**
+ * Convert each container to whichever of the array, bitmap and run types
+ * takes the least space.
+ *
+ * @param r the FrtRoaring to optimize
+ */
+extern void frt_roar_optimize(FrtRoaring *r);
+
+/**
+ * Create an optimized FrtRoaring holding the bits set in +bv+ which are less
+ * than +size+. If +bv+ extends as ones, the bits from its size up to +size+
+ * are set too.
+ *
+ * @param bv the FrtBitVector to copy
+ * @param size the number of docs in the index
+ * @return a newly allocated FrtRoaring
+ */
+extern FrtRoaring *frt_roar_from_bv(FrtBitVector *bv, int size);
+
+/**
+ * Create an FrtBitVector with the docs in the FrtRoaring set.
+ *
+ * @param r the FrtRoaring to copy
+ * @return a newly allocated FrtBitVector
+ */
+extern FrtBitVector *frt_roar_to_bv(FrtRoaring *r);
+
+/**
+ * Intersect two FrtRoarings.
+ *
+ * @param r1 the first FrtRoaring
+ * @param r2 the second FrtRoaring
+ * @return a newly allocated FrtRoaring holding the docs in both +r1+ and +r2+
+ */
+extern FrtRoaring *frt_roar_and(FrtRoaring *r1, FrtRoaring *r2);
+
+/**
+ * Return the number of bytes used to hold the docs in the FrtRoaring. This
+ * is also roughly the number of bytes frt_roar_write will write.
+ *
+ * @param r the FrtRoaring to measure
+ * @return the number of bytes used by the containers
+ */
+extern int frt_roar_memory(FrtRoaring *r);
+
+/**
+ * Write the FrtRoaring to +os+.
+ *
+ * @param r the FrtRoaring to write
+ * @param os the FrtOutStream to write to
+ */
+extern void frt_roar_write(FrtRoaring *r, FrtOutStream *os);
+
+/**
+ * Read an FrtRoaring written by frt_roar_write.
+ *
+ * @param is the FrtInStream to read from
+ * @return a newly allocated FrtRoaring
+ */
+extern FrtRoaring *frt_roar_read(FrtInStream *is);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
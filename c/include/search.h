@@ -11,6 +11,7 @@ typedef struct FrtScorer FrtScorer;
 
 #include "index.h"
 #include "bitvector.h"
+#include "roaring.h"
 #include "similarity.h"
 #include "field_index.h"
 
@@ -97,27 +98,85 @@ extern FrtTopDocs *frt_td_new(int total_hits, int size, FrtHit **hits,
 extern void frt_td_destroy(FrtTopDocs *td);
 extern char *frt_td_to_s(FrtTopDocs *td);
 
+/***************************************************************************
+ *
+ * FrtDocIdSetIterator
+ *
+ ***************************************************************************/
+
+/**
+ * Iterates in order through a set of doc numbers such as the docs matched by
+ * an FrtFilter. As with an FrtScorer, +doc+ is only valid once +next+ or
+ * +skip_to+ has returned true and neither should be called again once they
+ * have returned false.
+ */
+typedef struct FrtDocIdSetIterator
+{
+    int     doc;
+    int     cost;       /* roughly the number of docs in the set */
+    bool    (*next)(struct FrtDocIdSetIterator *self);
+    /* move to the first doc after the current one which is >= +doc_num+ */
+    bool    (*skip_to)(struct FrtDocIdSetIterator *self, int doc_num);
+    void    (*close)(struct FrtDocIdSetIterator *self);
+} FrtDocIdSetIterator;
+
 /***************************************************************************
  *
  * FrtFilter
  *
  ***************************************************************************/
 
+/* filters matching fewer than one in this many docs are applied by skipping
+ * the scorer to each doc they match rather than checking each doc scored */
+#define FRT_FILT_SPARSE_RATIO 32
+
 typedef struct FrtFilter
 {
     FrtSymbol     name;
     FrtHash       *cache;
     FrtBitVector  *(*get_bv_i)(struct FrtFilter *self, FrtIndexReader *ir);
+    FrtDocIdSetIterator *(*get_iterator_i)(struct FrtFilter *self,
+                                           FrtIndexReader *ir);
     char          *(*to_s)(struct FrtFilter *self);
     unsigned long (*hash)(struct FrtFilter *self);
     int           (*eq)(struct FrtFilter *self, struct FrtFilter *o);
     void          (*destroy_i)(struct FrtFilter *self);
     int           ref_cnt;
+    /* get_bv_i is run on each segment of a multi-segment reader and the
+     * results are joined. Unset this if it must be given the whole index */
+    bool          per_segment;
 } FrtFilter;
 
 #define filt_new(type) frt_filt_create(sizeof(type), frt_intern(#type))
 extern FrtFilter *frt_filt_create(size_t size, FrtSymbol name);
+
+/**
+ * Get the docs matched by the filter in +ir+. The result of +get_bv_i+ is
+ * compressed and cached for as long as +ir+ and the filter are open so the
+ * FrtRoaring returned belongs to the cache.
+ */
+extern FrtRoaring *frt_filt_get_roaring(FrtFilter *filt, FrtIndexReader *ir);
+
+/**
+ * Get the docs matched by the filter in +ir+ as a newly allocated
+ * FrtBitVector which the caller must destroy.
+ */
 extern FrtBitVector *frt_filt_get_bv(FrtFilter *filt, FrtIndexReader *ir);
+
+/**
+ * Get an iterator over the docs matched by the filter in +ir+ which the
+ * caller must close. By default this walks the cached docs returned by
+ * frt_filt_get_roaring.
+ */
+extern FrtDocIdSetIterator *frt_filt_get_iterator(FrtFilter *filt,
+                                                  FrtIndexReader *ir);
+
+/**
+ * Return true if the filter matches few enough of the docs in +ir+ that it
+ * should drive the search through an FrtDocIdSetIterator rather than be
+ * checked against every doc the query matches.
+ */
+extern bool frt_filt_is_sparse(FrtFilter *filt, FrtIndexReader *ir);
 extern void frt_filt_destroy_i(FrtFilter *filt);
 extern void frt_filt_deref(FrtFilter *filt);
 extern unsigned long frt_filt_hash(FrtFilter *filt);
@@ -630,6 +689,13 @@ struct FrtScorer
     bool         (*skip_to)(FrtScorer *self, int doc_num);
     FrtExplanation *(*explain)(FrtScorer *self, int doc_num);
     void         (*destroy)(FrtScorer *self);
+    /* Optional. Returns an upper bound of the score of every doc from
+     * +doc_num+ up to and including *up_to, which is set to a doc number >=
+     * +doc_num+. */
+    float        (*max_score)(FrtScorer *self, int doc_num, int *up_to);
+    /* Optional. Tells the scorer that docs scoring no higher than
+     * +min_score+ are not competitive so it may skip them. */
+    void         (*set_min_score)(FrtScorer *self, float min_score);
 };
 
 #define frt_scorer_new(type, similarity) frt_scorer_create(sizeof(type), similarity)
@@ -637,6 +703,15 @@ struct FrtScorer
 extern void frt_scorer_destroy_i(FrtScorer *self);
 extern FrtScorer *frt_scorer_create(size_t size, FrtSimilarity *similarity);
 extern bool frt_scorer_less_than(void *p1, void *p2);
+
+/**
+ * Advance +scorer+ and +it+ until they are on the same doc, each in turn
+ * skipping to the doc the other is on. +scorer+ must already be positioned
+ * on a doc.
+ *
+ * @return false if either runs out of docs
+ */
+extern bool frt_scorer_leapfrog(FrtScorer *scorer, FrtDocIdSetIterator *it);
 extern bool frt_scorer_doc_less_than(const FrtScorer *s1, const FrtScorer *s2);
 extern int frt_scorer_doc_cmp(const void *p1, const void *p2);
 
@@ -864,6 +939,11 @@ typedef struct FrtIndexSearcher {
     FrtSearcher        super;
     FrtIndexReader    *ir;
     bool            close_ir : 1;
+    /* When false, unsorted searches without a PostFilter, and searches
+     * sorted the way the index is sorted (see FrtConfig#sort_field), may skip
+     * docs which can't make the top hits so TopDocs#total_hits is only a
+     * lower bound. true by default. */
+    bool            count_total_hits : 1;
 } FrtIndexSearcher;
 
 extern FrtSearcher *frt_isea_new(FrtIndexReader *ir);
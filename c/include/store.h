@@ -9,6 +9,14 @@
 
 #define FRT_LOCK_PREFIX "ferret-"
 #define FRT_LOCK_EXT ".lck"
+#define FRT_FS_MAX_OPEN_FILES 512
+
+/**
+ * The maximum number of file descriptors file-system stores will keep open
+ * for reading. When the limit is reached the least recently used descriptor
+ * is closed and reopened again when next needed. Set this to 0 for no limit.
+ */
+extern int frt_fs_max_open_files;
 
 typedef struct FrtBuffer
 {
@@ -56,6 +64,7 @@ typedef struct FrtRAMFile
     int     bufcnt;
     off_t   len;
     int     ref_cnt;
+    struct FrtStore *store; /* whose mutex guards ref_cnt, NULL if unshared */
 } FrtRAMFile;
 
 struct FrtOutStream
@@ -117,15 +126,18 @@ struct FrtInStreamMethods
 struct FrtInStream
 {
     FrtBuffer buf;
+    /* the bytes currently being read. Normally this points to buf.buf but
+     * memory-mapped streams point it directly at the mapping so that
+     * buf.len covers the whole stream and no refills are ever needed */
+    const frt_uchar *data;
     union
     {
-        int fd;
+        struct FrtFileHandle *fh;   /* only used by FSIn */
         FrtRAMFile *rf;
     } file;
     union
     {
         off_t pointer;          /* only used by RAMIn */
-        char *path;             /* only used by FSIn */
         FrtCompoundInStream *cis;
     } d;
     int *ref_cnt_ptr;
@@ -140,6 +152,8 @@ struct FrtCompoundInStream
 };
 
 #define is_length(mis) mis->m->length_i(mis)
+/* true if +mis+ reads straight from a memory mapping rather than its buffer */
+#define is_mapped(mis) ((mis)->data != (mis)->buf.buf)
 
 typedef struct FrtStore FrtStore;
 typedef struct FrtLock FrtLock;
@@ -178,6 +192,9 @@ struct FrtStore
     mode_t file_mode;
 #endif
     FrtHashSet *locks;
+    /* searches running, see frt_store_searching. Shared by all the stores
+     * opened on the same directory */
+    struct FrtSearchCount *searches;
 
     /**
      * Create the file +filename+ in the +store+.
@@ -331,6 +348,19 @@ struct FrtStore
  */
 extern FrtStore *frt_open_fs_store(const char *pathname);
 
+/**
+ * Create a newly allocated memory-mapped FrtStore at the pathname designated.
+ * Files are written exactly as they are in a file-system FrtStore but input
+ * streams are read directly from a read-only mapping of the file so reads
+ * require neither system calls nor copying into a buffer. On platforms
+ * without mmap or if a file cannot be mapped the store falls back to regular
+ * buffered file-system input streams.
+ *
+ * @param pathname the pathname of the directory to be used by the index
+ * @return a newly allocated memory-mapped FrtStore.
+ */
+extern FrtStore *frt_open_mmap_store(const char *pathname);
+
 /**
  * Create a newly allocated in-memory or RAM FrtStore.
  *
@@ -448,6 +478,90 @@ extern void frt_with_lock_name(FrtStore *store, const char *lock_name,
  */
 extern void frt_store_deref(FrtStore *store);
 
+/**
+ * Searchers call frt_store_search_start and frt_store_search_finish around
+ * each search of an index in +store+ so that merges can tell whether they are
+ * competing with searches for I/O.
+ *
+ * @param store the store being searched
+ */
+extern void frt_store_search_start(FrtStore *store);
+extern void frt_store_search_finish(FrtStore *store);
+
+/**
+ * Return true if any searches are currently running on the +store+. The FS
+ * and mmap stores of a directory count the searches of both stores.
+ *
+ * @param store the store to check
+ * @return true if a search is running on the store
+ */
+extern bool frt_store_searching(FrtStore *store);
+
+/**
+ * A FrtRateLimiter limits the rate at which bytes are written to and read from
+ * the stores by the threads which use it. This is used to stop large merges
+ * from starving concurrent searches of I/O. The limiter may be shared by
+ * several threads in which case their combined rate is limited.
+ *
+ * The clock and sleep functions default to the system's. Tests may replace
+ * them before the limiter is used so that pauses can be checked through
+ * +paused+ without waiting for them.
+ */
+typedef struct FrtRateLimiter
+{
+    double mb_per_sec;          /* 0 for no limit */
+    double next_time;           /* when the bytes paused for so far are due */
+    double paused;              /* the total seconds slept for */
+    FrtStore *store;            /* if set, only limit while it's searched */
+    double (*now)(void);        /* the clock, in seconds */
+    void (*sleep)(double secs);
+    frt_mutex_t mutex;
+} FrtRateLimiter;
+
+/**
+ * Create a new FrtRateLimiter.
+ *
+ * @param mb_per_sec the maximum number of megabytes per second. 0 for no limit
+ * @param store if not NULL the rate is only limited while searches are
+ *   running on +store+. The limiter doesn't hold a reference to the store.
+ * @return a new FrtRateLimiter
+ */
+extern FrtRateLimiter *frt_rate_limiter_new(double mb_per_sec,
+                                            FrtStore *store);
+extern void frt_rate_limiter_destroy(FrtRateLimiter *rl);
+
+/**
+ * Change the rate of the limiter. This can be done while it is in use.
+ *
+ * @param rl self
+ * @param mb_per_sec the maximum number of megabytes per second. 0 for no limit
+ */
+extern void frt_rate_limiter_set_mb_per_sec(FrtRateLimiter *rl,
+                                            double mb_per_sec);
+
+/**
+ * Sleep for as long as it should take to transfer +bytes+ bytes at the
+ * limiter's rate, less the time since the last pause.
+ *
+ * @param rl self
+ * @param bytes the number of bytes just transferred
+ */
+extern void frt_rate_limiter_pause(FrtRateLimiter *rl, int bytes);
+
+/**
+ * Set the FrtRateLimiter used by the calling thread. All FrtOutStream flushes
+ * and FrtInStream refills in the thread will pause on +rl+ until it is unset
+ * again by passing NULL.
+ *
+ * @param rl the limiter for the thread or NULL for no limit
+ */
+extern void frt_thread_set_rate_limiter(FrtRateLimiter *rl);
+
+/**
+ * Return the FrtRateLimiter set for the calling thread or NULL if it has none.
+ */
+extern FrtRateLimiter *frt_thread_get_rate_limiter();
+
 /**
  * Flush the buffered contents of the FrtOutStream to the store.
  *
@@ -757,14 +871,16 @@ extern char *frt_is_read_string(FrtInStream *is);
 extern char *frt_is_read_string_safe(FrtInStream *is);
 
 /**
- * Copy cnt bytes from Instream _is_ to FrtOutStream _os_.
+ * Copy cnt bytes from Instream _is_ to FrtOutStream _os_. Memory-mapped
+ * streams are written straight out of the mapping.
  *
  * @param is the FrtInStream to read from
  * @param os the FrtOutStream to write to
+ * @param cnt the number of bytes to copy
  * @raise FRT_IO_ERROR
  * @raise FRT_EOF_ERROR
  */
-extern void frt_is2os_copy_bytes(FrtInStream *is, FrtOutStream *os, int cnt);
+extern void frt_is2os_copy_bytes(FrtInStream *is, FrtOutStream *os, off_t cnt);
 
 /**
  * Copy cnt vints from Instream _is_ to FrtOutStream _os_.
@@ -790,6 +906,7 @@ extern void frt_close_lock(FrtLock *lock);
  * FIXME document. Perhaps include in different header?? */
 extern FrtStore *frt_store_new();
 extern void frt_store_destroy(FrtStore *store);
+extern void frt_store_share_searches(FrtStore *store, FrtStore *other);
 extern FrtOutStream *frt_os_new();
 extern FrtInStream *frt_is_new();
 extern int frt_file_is_lock(const char *filename);
@@ -10,6 +10,9 @@ extern "C" {
 typedef pthread_mutex_t frt_mutex_t;
 typedef pthread_key_t frt_thread_key_t;
 typedef pthread_once_t frt_thread_once_t;
+typedef pthread_rwlock_t frt_rwlock_t;
+typedef pthread_cond_t frt_cond_t;
+typedef pthread_t frt_thread_t;
 #define FRT_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 #define FRT_MUTEX_RECURSIVE_INITIALIZER PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
 #define FRT_THREAD_ONCE_INIT PTHREAD_ONCE_INIT
@@ -18,6 +21,17 @@ typedef pthread_once_t frt_thread_once_t;
 #define frt_mutex_trylock(a) pthread_mutex_trylock(a)
 #define frt_mutex_unlock(a) pthread_mutex_unlock(a)
 #define frt_mutex_destroy(a) pthread_mutex_destroy(a)
+#define frt_rwlock_init(a) pthread_rwlock_init(a, NULL)
+#define frt_rwlock_rdlock(a) pthread_rwlock_rdlock(a)
+#define frt_rwlock_wrlock(a) pthread_rwlock_wrlock(a)
+#define frt_rwlock_unlock(a) pthread_rwlock_unlock(a)
+#define frt_rwlock_destroy(a) pthread_rwlock_destroy(a)
+#define frt_cond_init(a) pthread_cond_init(a, NULL)
+#define frt_cond_wait(a, b) pthread_cond_wait(a, b)
+#define frt_cond_broadcast(a) pthread_cond_broadcast(a)
+#define frt_cond_destroy(a) pthread_cond_destroy(a)
+#define frt_thread_create(a, b, c) pthread_create(a, NULL, b, c)
+#define frt_thread_join(a) pthread_join(a, NULL)
 #define frt_thread_key_create(a, b) pthread_key_create(a, b)
 #define frt_thread_key_delete(a) pthread_key_delete(a)
 #define frt_thread_setspecific(a, b) pthread_setspecific(a, b)
@@ -1,5 +1,6 @@
 #include "analysis.h"
 #include "hash.h"
+#include "array.h"
 #include "libstemmer.h"
 #include <string.h>
 #include <ctype.h>
@@ -200,6 +201,13 @@ static TokenStream *mb_ts_new()
 void a_deref(Analyzer *a)
 {
     if (--a->ref_cnt <= 0) {
+        if (a->ts_bucket) {
+            /* fix for some dodgy old versions of pthread */
+            thread_setspecific(a->thread_ts, NULL);
+            thread_key_delete(a->thread_ts);
+            ary_destroy(a->ts_bucket, (free_ft)&ts_deref);
+            mutex_destroy(&a->mutex);
+        }
         a->destroy_i(a);
     }
 }
@@ -216,9 +224,21 @@ static TokenStream *a_standard_get_ts(Analyzer *a,
                                       Symbol field,
                                       char *text)
 {
-    TokenStream *ts;
+    TokenStream *ts = (TokenStream *)thread_getspecific(a->thread_ts);
     (void)field;
-    ts = ts_clone(a->current_ts);
+    if (NULL == ts) {
+        ts = ts_clone(a->current_ts);
+        mutex_lock(&a->mutex);
+        ary_push(a->ts_bucket, ts);
+        mutex_unlock(&a->mutex);
+        thread_setspecific(a->thread_ts, ts);
+    }
+    else if (ts->ref_cnt > 1) {
+        /* the thread's stream hasn't been dereferenced yet */
+        ts = ts_clone(a->current_ts);
+        return ts->reset(ts, text);
+    }
+    REF(ts);
     return ts->reset(ts, text);
 }
 
@@ -233,6 +253,12 @@ Analyzer *analyzer_new(TokenStream *ts,
     a->destroy_i = (destroy_i ? destroy_i : &a_standard_destroy_i);
     a->get_ts = (get_ts ? get_ts : &a_standard_get_ts);
     a->ref_cnt = 1;
+    a->ts_bucket = NULL;
+    if (ts) {
+        a->ts_bucket = ary_new();
+        thread_key_create(&a->thread_ts, NULL);
+        mutex_init(&a->mutex, NULL);
+    }
     return a;
 }
 
@@ -1327,11 +1353,20 @@ static Token *hf_next(TokenStream *ts)
     return tk;
 }
 
+static TokenStream *hf_reset(TokenStream *ts, char *text)
+{
+    /* drop the rest of the last hyphenated word */
+    HyphenFilt(ts)->pos = HyphenFilt(ts)->len = 0;
+    filter_reset(ts, text);
+    return ts;
+}
+
 TokenStream *hyphen_filter_new(TokenStream *sub_ts)
 {
     TokenStream *ts = tf_new(HyphenFilter, sub_ts);
     ts->next        = &hf_next;
     ts->clone_i     = &hf_clone_i;
+    ts->reset       = &hf_reset;
     return ts;
 }
 
@@ -1,15 +1,147 @@
 #include "bitvector.h"
+#include "threading.h"
 #include "internal.h"
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define BV_X86_DISPATCH
+# include <immintrin.h>
+#endif
+
+/****************************************************************************
+ *
+ * Word Operations
+ *
+ * The loops over whole words are picked once at runtime so that the AVX2 and
+ * POPCNT versions are only used on CPUs which support them.
+ *
+ ****************************************************************************/
+
+typedef void (*bv_op_ft)(u64 *dest, const u64 *a, const u64 *b, int cnt);
+
+static struct BVWordOps
+{
+    bv_op_ft and_words;
+    bv_op_ft or_words;
+    bv_op_ft xor_words;
+    void (*not_words)(u64 *dest, const u64 *a, int cnt);
+    int (*count_words)(const u64 *words, int cnt);
+} bv_ops;
+
+static thread_once_t bv_ops_once = THREAD_ONCE_INIT;
+
+#define BV_WORD_OP(name, op)\
+static void name(u64 *dest, const u64 *a, const u64 *b, int cnt)\
+{\
+    int i;\
+    for (i = 0; i < cnt; i++) {\
+        dest[i] = a[i] op b[i];\
+    }\
+}
+
+BV_WORD_OP(bv_and_words, &)
+BV_WORD_OP(bv_or_words, |)
+BV_WORD_OP(bv_xor_words, ^)
+
+static void bv_not_words(u64 *dest, const u64 *a, int cnt)
+{
+    int i;
+    for (i = 0; i < cnt; i++) {
+        dest[i] = ~a[i];
+    }
+}
+
+static int bv_count_words(const u64 *words, int cnt)
+{
+    int i, count = 0;
+    for (i = 0; i < cnt; i++) {
+        count += count_ones64(words[i]);
+    }
+    return count;
+}
+
+#ifdef BV_X86_DISPATCH
+#define BV_AVX2_WORD_OP(name, intrinsic, op)\
+static __attribute__((target("avx2")))\
+void name(u64 *dest, const u64 *a, const u64 *b, int cnt)\
+{\
+    int i;\
+    for (i = 0; i + 4 <= cnt; i += 4) {\
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));\
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));\
+        _mm256_storeu_si256((__m256i *)(dest + i), intrinsic(va, vb));\
+    }\
+    for (; i < cnt; i++) {\
+        dest[i] = a[i] op b[i];\
+    }\
+}
+
+BV_AVX2_WORD_OP(bv_and_words_avx2, _mm256_and_si256, &)
+BV_AVX2_WORD_OP(bv_or_words_avx2, _mm256_or_si256, |)
+BV_AVX2_WORD_OP(bv_xor_words_avx2, _mm256_xor_si256, ^)
+
+static __attribute__((target("avx2")))
+void bv_not_words_avx2(u64 *dest, const u64 *a, int cnt)
+{
+    int i;
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    for (i = 0; i + 4 <= cnt; i += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(va, ones));
+    }
+    for (; i < cnt; i++) {
+        dest[i] = ~a[i];
+    }
+}
+
+static __attribute__((target("popcnt")))
+int bv_count_words_popcnt(const u64 *words, int cnt)
+{
+    int i, count = 0;
+    for (i = 0; i < cnt; i++) {
+        count += __builtin_popcountll(words[i]);
+    }
+    return count;
+}
+#endif
+
+static void bv_ops_init()
+{
+    bv_ops.and_words = &bv_and_words;
+    bv_ops.or_words = &bv_or_words;
+    bv_ops.xor_words = &bv_xor_words;
+    bv_ops.not_words = &bv_not_words;
+    bv_ops.count_words = &bv_count_words;
+#ifdef BV_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        bv_ops.and_words = &bv_and_words_avx2;
+        bv_ops.or_words = &bv_or_words_avx2;
+        bv_ops.xor_words = &bv_xor_words_avx2;
+        bv_ops.not_words = &bv_not_words_avx2;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        bv_ops.count_words = &bv_count_words_popcnt;
+    }
+#endif
+}
+
+#define BV_OPS() (thread_once(&bv_ops_once, &bv_ops_init), &bv_ops)
+
+/****************************************************************************
+ *
+ * BitVector
+ *
+ ****************************************************************************/
+
 BitVector *bv_new_capa(int capa)
 {
     BitVector *bv = ALLOC_AND_ZERO(BitVector);
 
     /* The capacity passed by the user is number of bits allowed, however we
-     * store capacity as the number of words (U32) allocated. */
-    bv->capa = max2(TO_WORD(capa), 4);
-    bv->bits = ALLOC_AND_ZERO_N(u32, bv->capa);
+     * store capacity as the number of words (U64) allocated. */
+    bv->capa = max2(BV_WORDS(capa), 4);
+    bv->bits = ALLOC_AND_ZERO_N(u64, bv->capa);
     bv->curr_bit = -1;
     bv->ref_cnt = 1;
     return bv;
@@ -30,21 +162,197 @@ void bv_destroy(BitVector *bv)
 
 void bv_clear(BitVector *bv)
 {
-    memset(bv->bits, 0, bv->capa * sizeof(u32));
+    memset(bv->bits, 0, bv->capa * sizeof(u64));
     bv->extends_as_ones = 0;
     bv->count = 0;
     bv->size = 0;
 }
 
+void bv_set_range(BitVector *bv, int from, int to)
+{
+    int word, last_word;
+    u64 mask, last_mask;
+    if (from >= to) {
+        return;
+    }
+    if (to > bv->size) {
+        bv_grow(bv, to);
+    }
+    word = from >> 6;
+    last_word = (to - 1) >> 6;
+    mask = ~(u64)0 << (from & 63);
+    last_mask = ~(u64)0 >> (63 - ((to - 1) & 63));
+    for (; word < last_word; word++, mask = ~(u64)0) {
+        bv->count += count_ones64(mask & ~bv->bits[word]);
+        bv->bits[word] |= mask;
+    }
+    mask &= last_mask;
+    bv->count += count_ones64(mask & ~bv->bits[word]);
+    bv->bits[word] |= mask;
+}
+
+int bv_recount(BitVector *bv)
+{
+    const int len = bv->size >> 6;
+    const int extra = bv->size & 63;
+    int count = BV_OPS()->count_words(bv->bits, len);
+
+    if (bv->extends_as_ones) {
+        count = (len << 6) - count;
+        if (extra) {
+            count += count_ones64(~bv->bits[len] & ~(~(u64)0 << extra));
+        }
+    }
+    else if (extra) {
+        count += count_ones64(bv->bits[len] & ~(~(u64)0 << extra));
+    }
+    return bv->count = count;
+}
+
 void bv_scan_reset(BitVector *bv)
 {
     bv->curr_bit = -1;
 }
 
+int bv_scan_next_n(BitVector *bv, int *buf, int cnt)
+{
+    int n = 0;
+    int pos = bv->curr_bit + 1;
+    const int size = bv->size;
+    const int word_size = BV_WORDS(size);
+    int i = pos >> 6;
+    u64 word;
+
+    if (pos >= size || cnt <= 0) {
+        return 0;
+    }
+    word = bv->bits[i] & (~(u64)0 << (pos & 63));
+    while (true) {
+        if (i == word_size - 1 && (size & 63)) {
+            word &= ~(~(u64)0 << (size & 63));
+        }
+        while (word) {
+            buf[n++] = (i << 6) + count_trailing_zeros64(word);
+            if (n == cnt) {
+                bv->curr_bit = buf[n - 1];
+                return n;
+            }
+            word &= word - 1;
+        }
+        if (++i >= word_size) {
+            break;
+        }
+        word = bv->bits[i];
+    }
+    bv->curr_bit = size;
+    return n;
+}
+
+static void bv_resize(BitVector *bv, int capa, int size)
+{
+    if (bv->capa < capa) {
+        REALLOC_N(bv->bits, u64, capa);
+        bv->capa = capa;
+    }
+    bv->size = size;
+}
+
+/* fill the words after the first +word_size+ according to extends_as_ones */
+static void bv_fill_tail(BitVector *bv, int word_size)
+{
+    memset(bv->bits + word_size, (bv->extends_as_ones ? 0xFF : 0),
+           sizeof(u64) * (bv->capa - word_size));
+}
+
+typedef enum { BV_AND, BV_OR, BV_XOR } BVOp;
+
+static BitVector *bv_op(BitVector *bv, BitVector *a, BitVector *b, BVOp op)
+{
+    const struct BVWordOps *ops = BV_OPS();
+    const int a_wsz = BV_WORDS(a->size);
+    const int b_wsz = BV_WORDS(b->size);
+    const int max_size = max2(a->size, b->size);
+    const int max_word_size = BV_WORDS(max_size);
+    const int min_word_size = min2(a_wsz, b_wsz);
+    const bool a_ext = a->extends_as_ones, b_ext = b->extends_as_ones;
+    /* the longer operand and the value the shorter one extends with */
+    BitVector *longer = a_wsz < b_wsz ? b : a;
+    const bool short_ext = a_wsz < b_wsz ? a_ext : b_ext;
+    const int ext_cnt = max_word_size - min_word_size;
+
+    bv_resize(bv, max2(round2(max_word_size), 4), max_size);
+    switch (op) {
+        case BV_AND:
+            ops->and_words(bv->bits, a->bits, b->bits, min_word_size);
+            if (short_ext) {
+                memmove(bv->bits + min_word_size,
+                        longer->bits + min_word_size, sizeof(u64) * ext_cnt);
+            }
+            else {
+                memset(bv->bits + min_word_size, 0, sizeof(u64) * ext_cnt);
+            }
+            bv->extends_as_ones = a_ext & b_ext;
+            break;
+        case BV_OR:
+            ops->or_words(bv->bits, a->bits, b->bits, min_word_size);
+            if (short_ext) {
+                memset(bv->bits + min_word_size, 0xFF, sizeof(u64) * ext_cnt);
+            }
+            else {
+                memmove(bv->bits + min_word_size,
+                        longer->bits + min_word_size, sizeof(u64) * ext_cnt);
+            }
+            bv->extends_as_ones = a_ext | b_ext;
+            break;
+        case BV_XOR:
+            ops->xor_words(bv->bits, a->bits, b->bits, min_word_size);
+            if (short_ext) {
+                ops->not_words(bv->bits + min_word_size,
+                               longer->bits + min_word_size, ext_cnt);
+            }
+            else {
+                memmove(bv->bits + min_word_size,
+                        longer->bits + min_word_size, sizeof(u64) * ext_cnt);
+            }
+            bv->extends_as_ones = a_ext ^ b_ext;
+            break;
+    }
+    bv_fill_tail(bv, max_word_size);
+    bv_recount(bv);
+    return bv;
+}
+
+BitVector *bv_and_i(BitVector *bv, BitVector *a, BitVector *b)
+{
+    return bv_op(bv, a, b, BV_AND);
+}
+
+BitVector *bv_or_i(BitVector *bv, BitVector *a, BitVector *b)
+{
+    return bv_op(bv, a, b, BV_OR);
+}
+
+BitVector *bv_xor_i(BitVector *bv, BitVector *a, BitVector *b)
+{
+    return bv_op(bv, a, b, BV_XOR);
+}
+
+BitVector *bv_not_i(BitVector *bv, BitVector *bv1)
+{
+    const int word_size = BV_WORDS(bv1->size);
+
+    bv_resize(bv, max2(round2(word_size), 4), bv1->size);
+    BV_OPS()->not_words(bv->bits, bv1->bits, word_size);
+    bv->extends_as_ones = !bv1->extends_as_ones;
+    bv_fill_tail(bv, word_size);
+    bv_recount(bv);
+    return bv;
+}
+
 int bv_eq(BitVector *bv1, BitVector *bv2)
 {
-    u32 *bits, *bits2;
-    int min_size, word_size, ext_word_size = 0, i;
+    u64 *bits;
+    int word_size, ext_word_size = 0, i;
     if (bv1 == bv2) {
         return true;
     }
@@ -53,26 +361,20 @@ int bv_eq(BitVector *bv1, BitVector *bv2)
         return false;
     }
 
-    bits = bv1->bits;
-    bits2 = bv2->bits;
-    min_size = min2(bv1->size, bv2->size);
-    word_size = TO_WORD(min_size);
-
-    for (i = 0; i < word_size; i++) {
-        if (bits[i] != bits2[i]) {
-            return false;
-        }
+    word_size = BV_WORDS(min2(bv1->size, bv2->size));
+    if (0 != memcmp(bv1->bits, bv2->bits, sizeof(u64) * word_size)) {
+        return false;
     }
-    if (bv1->size > min_size) {
+    if (bv1->size > bv2->size) {
         bits = bv1->bits;
-        ext_word_size = TO_WORD(bv1->size);
+        ext_word_size = BV_WORDS(bv1->size);
     }
-    else if (bv2->size > min_size) {
+    else {
         bits = bv2->bits;
-        ext_word_size = TO_WORD(bv2->size);
+        ext_word_size = BV_WORDS(bv2->size);
     }
-    if (ext_word_size) {
-        const u32 expected = (bv1->extends_as_ones ? 0xFFFFFFFF : 0);
+    if (ext_word_size > word_size) {
+        const u64 expected = (bv1->extends_as_ones ? ~(u64)0 : 0);
         for (i = word_size; i < ext_word_size; i++) {
             if (bits[i] != expected) {
                 return false;
@@ -85,12 +387,12 @@ int bv_eq(BitVector *bv1, BitVector *bv2)
 unsigned long bv_hash(BitVector *bv)
 {
     unsigned long hash = 0;
-    const u32 empty_word = bv->extends_as_ones ? 0xFFFFFFFF : 0;
+    const u64 empty_word = bv->extends_as_ones ? ~(u64)0 : 0;
     int i;
-    for (i = TO_WORD(bv->size) - 1; i >= 0; i--) {
-        const u32 word = bv->bits[i];
+    for (i = BV_WORDS(bv->size) - 1; i >= 0; i--) {
+        const u64 word = bv->bits[i];
         if (word != empty_word)
-            hash = (hash << 1) ^ word;
+            hash = (hash << 1) ^ (unsigned long)(word ^ (word >> 32));
     }
     return (hash << 1) | bv->extends_as_ones;
 }
@@ -160,6 +160,13 @@ static InStream *cmpd_create_input(InStream *sub_is, off_t offset, off_t length)
     is->d.cis = cis;
     is->m = &CMPD_IN_STREAM_METHODS;
 
+    if (is_mapped(sub_is)) {
+        /* the compound file is memory-mapped so read the sub-file straight
+         * out of the parent mapping */
+        is->data = sub_is->data + offset;
+        is->buf.len = length;
+    }
+
     return is;
 }
 
@@ -306,26 +313,12 @@ static void cw_copy_file(CompoundWriter *cw, CWFileEntry *src, OutStream *os)
 {
     off_t start_ptr = os_pos(os);
     off_t end_ptr;
-    off_t remainder, length, len;
-    uchar buffer[BUFFER_SIZE];
+    off_t length, len;
 
     InStream *is = cw->store->open_input(cw->store, src->name);
 
-    remainder = length = is_length(is);
-
-    while (remainder > 0) {
-        len = MIN(remainder, BUFFER_SIZE);
-        is_read_bytes(is, buffer, len);
-        os_write_bytes(os, buffer, len);
-        remainder -= len;
-    }
-
-    /* Verify that remainder is 0 */
-    if (remainder != 0) {
-        RAISE(IO_ERROR, "There seems to be an error in the compound file "
-              "should have read to the end but there are <%"OFF_T_PFX"d> "
-              "bytes left", remainder);
-    }
+    length = is_length(is);
+    is2os_copy_bytes(is, os, length);
 
     /* Verify that the output length diff is equal to original file */
     end_ptr = os_pos(os);
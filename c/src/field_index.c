@@ -2,6 +2,148 @@
 #include "field_index.h"
 #include "internal.h"
 
+/***************************************************************************
+ *
+ * PackedInts
+ *
+ ***************************************************************************/
+
+#define PI_WORD_CNT(size, bits) ((((i64)(size) * (bits)) >> 6) + 2)
+
+static int pi_bits_for(u64 range)
+{
+    int bits = 0;
+    while (range) {
+        bits++;
+        range >>= 1;
+    }
+    return bits;
+}
+
+static INLINE u64 pi_max_offset(int bits)
+{
+    return bits == 64 ? ~(u64)0 : ((u64)1 << bits) - 1;
+}
+
+static INLINE void pi_put(u64 *words, int bits, int i, u64 offset)
+{
+    u64 bit = (u64)i * bits;
+    int w = (int)(bit >> 6);
+    int shift = (int)(bit & 63);
+    u64 mask = pi_max_offset(bits);
+    if (0 == bits) {
+        return;
+    }
+    words[w] = (words[w] & ~(mask << shift)) | (offset << shift);
+    if (shift + bits > 64) {
+        words[w + 1] = (words[w + 1] & ~(mask >> (64 - shift)))
+            | (offset >> (64 - shift));
+    }
+}
+
+PackedInts *pi_new(int size, i64 min, i64 max)
+{
+    PackedInts *pi = ALLOC(PackedInts);
+    pi->size = size;
+    pi->base = min;
+    pi->bits = max > min ? pi_bits_for((u64)max - (u64)min) : 0;
+    pi->words = ALLOC_AND_ZERO_N(u64, PI_WORD_CNT(size, pi->bits));
+    return pi;
+}
+
+INLINE i64 pi_get(PackedInts *pi, int i)
+{
+    const int bits = pi->bits;
+    u64 bit, offset;
+    int shift;
+    if (0 == bits) {
+        return pi->base;
+    }
+    bit = (u64)i * bits;
+    shift = (int)(bit & 63);
+    offset = pi->words[bit >> 6] >> shift;
+    if (shift + bits > 64) {
+        offset |= pi->words[(bit >> 6) + 1] << (64 - shift);
+    }
+    return (i64)((u64)pi->base + (offset & pi_max_offset(bits)));
+}
+
+/* repack the values with a range wide enough to hold +val+ */
+static void pi_widen(PackedInts *pi, i64 val)
+{
+    int i;
+    const int size = pi->size;
+    const u64 room = (u64)0x7fffffffffffffffLL - (u64)pi->base;
+    const u64 max_offset = pi_max_offset(pi->bits);
+    i64 max = max_offset > room ? 0x7fffffffffffffffLL
+                                : (i64)((u64)pi->base + max_offset);
+    i64 min = MIN(pi->base, val);
+    int bits;
+    u64 *words;
+
+    max = MAX(max, val);
+    bits = pi_bits_for((u64)max - (u64)min);
+    words = ALLOC_AND_ZERO_N(u64, PI_WORD_CNT(size, bits));
+    for (i = 0; i < size; i++) {
+        pi_put(words, bits, i, (u64)pi_get(pi, i) - (u64)min);
+    }
+    free(pi->words);
+    pi->words = words;
+    pi->bits = bits;
+    pi->base = min;
+}
+
+void pi_set(PackedInts *pi, int i, i64 val)
+{
+    /* 64 bits can hold any value */
+    if (pi->bits < 64 && (val < pi->base
+        || (u64)val - (u64)pi->base > pi_max_offset(pi->bits))) {
+        pi_widen(pi, val);
+    }
+    pi_put(pi->words, pi->bits, i, (u64)val - (u64)pi->base);
+}
+
+/* flip the bits of negative floats so that the integers sort like the
+ * floats. 0.0 is stored as 0 */
+static INLINE i64 float_to_sortable(float val)
+{
+    i32 bits;
+    memcpy(&bits, &val, sizeof(bits));
+    return bits >= 0 ? bits : bits ^ 0x7fffffff;
+}
+
+INLINE float pi_get_float(PackedInts *pi, int i)
+{
+    i32 bits = (i32)pi_get(pi, i);
+    float val;
+    bits = bits >= 0 ? bits : bits ^ 0x7fffffff;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+void pi_set_float(PackedInts *pi, int i, float val)
+{
+    pi_set(pi, i, float_to_sortable(val));
+}
+
+/* new values start as the base */
+void pi_resize(PackedInts *pi, int size)
+{
+    i64 old_cnt = PI_WORD_CNT(pi->size, pi->bits);
+    i64 new_cnt = PI_WORD_CNT(size, pi->bits);
+    REALLOC_N(pi->words, u64, new_cnt);
+    if (new_cnt > old_cnt) {
+        memset(pi->words + old_cnt, 0, (new_cnt - old_cnt) * sizeof(u64));
+    }
+    pi->size = size;
+}
+
+void pi_destroy(PackedInts *pi)
+{
+    free(pi->words);
+    free(pi);
+}
+
 /***************************************************************************
  *
  * FieldIndex
@@ -31,15 +173,47 @@ static void field_index_destroy(void *p)
     free(self);
 }
 
+static void *field_index_merge(MultiReader *mr, Symbol field,
+                               const FieldIndexClass *klass)
+{
+    const FieldIndexClass *sub_klass = klass->segment_class
+                                     ? klass->segment_class : klass;
+    void **indexes = ALLOC_AND_ZERO_N(void *, mr->r_cnt);
+    void *index;
+    int i;
+
+    for (i = 0; i < mr->r_cnt; i++) {
+        IndexReader *sub_reader = mr->sub_readers[i];
+        if (fis_get_field(sub_reader->fis, field)) {
+            FieldIndex *sub_index;
+            mutex_lock(&sub_reader->field_index_mutex);
+            TRY
+                sub_index = field_index_get(sub_reader, field, sub_klass);
+                indexes[i] = sub_index->index;
+            XCATCHALL
+                mutex_unlock(&sub_reader->field_index_mutex);
+                free(indexes);
+            XENDTRY
+            mutex_unlock(&sub_reader->field_index_mutex);
+        }
+    }
+    index = klass->merge_indexes(indexes, mr->starts, mr->r_cnt,
+                                 mr->starts[mr->r_cnt]);
+    free(indexes);
+    return index;
+}
+
 FieldIndex *field_index_get(IndexReader *ir, Symbol field,
                             const FieldIndexClass *klass)
 {
     int length = 0;
     TermEnum *volatile te = NULL;
     TermDocEnum *volatile tde = NULL;
+    DocValues *volatile dv = NULL;
     FieldInfo *fi = fis_get_field(ir->fis, field);
     const volatile int field_num = fi ? fi->number : -1;
     FieldIndex *volatile self = NULL;
+    MultiReader *mr;
     FieldIndex key;
 
     if (field_num < 0) {
@@ -65,7 +239,23 @@ FieldIndex *field_index_get(IndexReader *ir, Symbol field,
         self->field = fi->name;
 
         length = ir->max_doc(ir);
-        if (length > 0) {
+        self->index = NULL;
+        /* the indexes of each segment are cached on the segment so only
+         * segments which haven't been sorted on before need to be read */
+        if (length > 0 && NULL != (mr = ir_as_multi(ir))) {
+            self->index = field_index_merge(mr, field, klass);
+        }
+        /* fields with doc values don't need to be uninverted */
+        else if (length > 0 && fi_store_doc_values(fi)
+            && klass->create_index_from_doc_values
+            && NULL != (dv = ir->get_doc_values(ir, field_num))) {
+            TRY
+                self->index = klass->create_index_from_doc_values(dv);
+            XFINALLY
+                dv_destroy(dv);
+            XENDTRY
+        }
+        else if (length > 0) {
             TRY
             {
                 void *index;
@@ -91,41 +281,75 @@ FieldIndex *field_index_get(IndexReader *ir, Symbol field,
 /******************************************************************************
  * ByteFieldIndex < FieldIndex
  *
- * The ByteFieldIndex holds an array of integers for each document in the
- * index where the integer represents the sort value for the document.  This
- * index should only be used for sorting and not as a field cache of the
- * column's value.
+ * The ByteFieldIndex holds an ordinal for each document in the index which
+ * represents the sort value for the document. This index should only be used
+ * for sorting and not as a field cache of the column's value. The next
+ * ordinal is kept after the last document.
  ******************************************************************************/
 static void byte_handle_term(void *index_ptr,
                              TermDocEnum *tde,
                              const char *text)
 {
-    long *index = (long *)index_ptr;
-    long val = index[-1]++;
+    PackedInts *index = (PackedInts *)index_ptr;
+    const int size = index->size - 1;
+    i64 val = pi_get(index, size);
     (void)text;
+    pi_set(index, size, val + 1);
     while (tde->next(tde)) {
-        index[tde->doc_num(tde)] = val;
+        pi_set(index, tde->doc_num(tde), val);
     }
 }
 
+static void packed_destroy_index(void *p)
+{
+    pi_destroy((PackedInts *)p);
+}
+
+static void *packed_merge_indexes(void **indexes, const int *starts, int cnt,
+                                  int size)
+{
+    PackedInts *index = pi_new(size, 0, 0);
+    int i, j;
+    for (i = 0; i < cnt; i++) {
+        PackedInts *sub_index = (PackedInts *)indexes[i];
+        if (sub_index) {
+            for (j = 0; j < sub_index->size; j++) {
+                pi_set(index, starts[i] + j, pi_get(sub_index, j));
+            }
+        }
+    }
+    return index;
+}
+
 static void *byte_create_index(int size)
 {
-    long *index = ALLOC_AND_ZERO_N(long, size + 1);
-    index[0] = 1;
-    return &index[1];
+    PackedInts *index = pi_new(size + 1, 0, 0);
+    pi_set(index, size, 1);
+    return index;
 }
 
-static void byte_destroy_index(void *p)
+static void *byte_create_index_from_doc_values(DocValues *dv)
 {
-    long *index = (long *)p;
-    free(&index[-1]);
+    PackedInts *index = pi_new(dv->size + 1, 0, dv->value_cnt + 1);
+    int i;
+    pi_set(index, dv->size, dv->value_cnt + 1);
+    for (i = 0; i < dv->size; i++) {
+        pi_set(index, i, dv_get_ord(dv, i));
+    }
+    return index;
 }
 
+static void *byte_merge_indexes(void **indexes, const int *starts, int cnt,
+                                int size);
+
 const FieldIndexClass BYTE_FIELD_INDEX_CLASS = {
     "byte",
     &byte_create_index,
-    &byte_destroy_index,
-    &byte_handle_term
+    &packed_destroy_index,
+    &byte_handle_term,
+    &byte_create_index_from_doc_values,
+    &byte_merge_indexes,
+    &STRING_FIELD_INDEX_CLASS
 };
 
 /******************************************************************************
@@ -133,32 +357,65 @@ const FieldIndexClass BYTE_FIELD_INDEX_CLASS = {
  ******************************************************************************/
 static void *integer_create_index(int size)
 {
-    return ALLOC_AND_ZERO_N(long, size);
+    return pi_new(size, 0, 0);
 }
 
 static void integer_handle_term(void *index_ptr,
                                 TermDocEnum *tde,
                                 const char *text)
 {
-    long *index = (long *)index_ptr;
-    long val;
+    PackedInts *index = (PackedInts *)index_ptr;
+    long val = 0;
     sscanf(text, "%ld", &val);
     while (tde->next(tde)) {
-        index[tde->doc_num(tde)] = val;
+        pi_set(index, tde->doc_num(tde), val);
     }
 }
 
+/* each distinct value only needs to be parsed once and the index can be
+ * given its range up front */
+static void *integer_create_index_from_doc_values(DocValues *dv)
+{
+    PackedInts *index;
+    long *vals = ALLOC_N(long, dv->value_cnt + 1);
+    long min = 0, max = 0;
+    int i;
+    for (i = 1; i <= dv->value_cnt; i++) {
+        vals[i] = 0;
+        sscanf(dv->values[i], "%ld", &vals[i]);
+        if (1 == i || vals[i] < min) min = vals[i];
+        if (1 == i || vals[i] > max) max = vals[i];
+    }
+    vals[0] = 0;
+    for (i = 0; i < dv->size; i++) {
+        if (0 == dv_get_ord(dv, i)) {
+            min = MIN(min, 0);
+            max = MAX(max, 0);
+            break;
+        }
+    }
+    index = pi_new(dv->size, min, max);
+    for (i = 0; i < dv->size; i++) {
+        pi_set(index, i, vals[dv_get_ord(dv, i)]);
+    }
+    free(vals);
+    return index;
+}
+
 const FieldIndexClass INTEGER_FIELD_INDEX_CLASS = {
     "integer",
     &integer_create_index,
-    &free,
-    &integer_handle_term
+    &packed_destroy_index,
+    &integer_handle_term,
+    &integer_create_index_from_doc_values,
+    &packed_merge_indexes,
+    NULL
 };
 
 long get_integer_value(FieldIndex *field_index, long doc_num)
 {
     if (field_index->klass == &INTEGER_FIELD_INDEX_CLASS && doc_num >= 0) {
-        return ((long *)field_index->index)[doc_num];
+        return (long)pi_get((PackedInts *)field_index->index, (int)doc_num);
     }
     return 0l;
 }
@@ -170,32 +427,64 @@ long get_integer_value(FieldIndex *field_index, long doc_num)
 #define VALUES_ARRAY_START_SIZE 8
 static void *float_create_index(int size)
 {
-    return ALLOC_AND_ZERO_N(float, size);
+    return pi_new(size, 0, 0);
 }
 
 static void float_handle_term(void *index_ptr,
                               TermDocEnum *tde,
                               const char *text)
 {
-    float *index = (float *)index_ptr;
-    float val;
+    PackedInts *index = (PackedInts *)index_ptr;
+    float val = 0.0f;
     sscanf(text, "%g", &val);
     while (tde->next(tde)) {
-        index[tde->doc_num(tde)] = val;
+        pi_set_float(index, tde->doc_num(tde), val);
     }
 }
 
+static void *float_create_index_from_doc_values(DocValues *dv)
+{
+    PackedInts *index;
+    i64 *vals = ALLOC_N(i64, dv->value_cnt + 1);
+    i64 min = 0, max = 0;
+    int i;
+    for (i = 1; i <= dv->value_cnt; i++) {
+        float val = 0.0f;
+        sscanf(dv->values[i], "%g", &val);
+        vals[i] = float_to_sortable(val);
+        if (1 == i || vals[i] < min) min = vals[i];
+        if (1 == i || vals[i] > max) max = vals[i];
+    }
+    vals[0] = float_to_sortable(0.0f);
+    for (i = 0; i < dv->size; i++) {
+        if (0 == dv_get_ord(dv, i)) {
+            min = MIN(min, vals[0]);
+            max = MAX(max, vals[0]);
+            break;
+        }
+    }
+    index = pi_new(dv->size, min, max);
+    for (i = 0; i < dv->size; i++) {
+        pi_set(index, i, vals[dv_get_ord(dv, i)]);
+    }
+    free(vals);
+    return index;
+}
+
 const FieldIndexClass FLOAT_FIELD_INDEX_CLASS = {
     "float",
     &float_create_index,
-    &free,
-    &float_handle_term
+    &packed_destroy_index,
+    &float_handle_term,
+    &float_create_index_from_doc_values,
+    &packed_merge_indexes,
+    NULL
 };
 
 float get_float_value(FieldIndex *field_index, long doc_num)
 {
     if (field_index->klass == &FLOAT_FIELD_INDEX_CLASS && doc_num >= 0) {
-        return ((float *)field_index->index)[doc_num];
+        return pi_get_float((PackedInts *)field_index->index, (int)doc_num);
     }
     return 0.0f;
 }
@@ -203,59 +492,203 @@ float get_float_value(FieldIndex *field_index, long doc_num)
 /******************************************************************************
  * StringFieldIndex < FieldIndex
  ******************************************************************************/
- 
+
 static void *string_create_index(int size)
 {
     StringIndex *self = ALLOC_AND_ZERO(StringIndex);
     self->size = size;
-    self->index = ALLOC_AND_ZERO_N(long, size);
-    self->v_capa = VALUES_ARRAY_START_SIZE;
+    self->index = pi_new(size, 0, 0);
+    self->offsets = pi_new(VALUES_ARRAY_START_SIZE, 0, 0);
+    self->values_capa = VALUES_ARRAY_START_SIZE * 8;
+    self->values = ALLOC_N(char, self->values_capa);
     self->v_size = 1; /* leave the first value as NULL */
-    self->values = ALLOC_AND_ZERO_N(char *, VALUES_ARRAY_START_SIZE);
     return self;
 }
 
 static void string_destroy_index(void *p)
 {
     StringIndex *self = (StringIndex *)p;
-    int i;
-    free(self->index);
-    for (i = 0; i < self->v_size; i++) {
-        free(self->values[i]);
-    }
+    pi_destroy(self->index);
+    pi_destroy(self->offsets);
     free(self->values);
     free(self);
 }
 
+static void string_add_value(StringIndex *self, const char *text, long len)
+{
+    if (self->v_size >= self->offsets->size) {
+        pi_resize(self->offsets, self->offsets->size * 2);
+    }
+    if (self->values_len + len + 1 > self->values_capa) {
+        do {
+            self->values_capa *= 2;
+        } while (self->values_len + len + 1 > self->values_capa);
+        REALLOC_N(self->values, char, self->values_capa);
+    }
+    memcpy(self->values + self->values_len, text, len + 1);
+    pi_set(self->offsets, self->v_size, self->values_len);
+    self->values_len += len + 1;
+    self->v_size++;
+}
+
 static void string_handle_term(void *index_ptr,
                                TermDocEnum *tde,
                                const char *text)
 {
     StringIndex *index = (StringIndex *)index_ptr;
-    if (index->v_size >= index->v_capa) {
-        index->v_capa *= 2;
-        REALLOC_N(index->values, char *, index->v_capa);
-    }
-    index->values[index->v_size] = estrdup(text);
+    const int ord = index->v_size;
+    string_add_value(index, text, (long)strlen(text));
     while (tde->next(tde)) {
-        index->index[tde->doc_num(tde)] = index->v_size;
+        pi_set(index->index, tde->doc_num(tde), ord);
+    }
+}
+
+static void *string_create_index_from_doc_values(DocValues *dv)
+{
+    StringIndex *self = ALLOC_AND_ZERO(StringIndex);
+    long *lens = ALLOC_N(long, dv->value_cnt + 1);
+    int i;
+
+    self->size = dv->size;
+    self->values_capa = 1;
+    for (i = 1; i <= dv->value_cnt; i++) {
+        lens[i] = (long)strlen(dv->values[i]);
+        self->values_capa += lens[i] + 1;
     }
-    index->v_size++;
+    self->values = ALLOC_N(char, self->values_capa);
+    self->offsets = pi_new(dv->value_cnt + 1, 0, self->values_capa);
+    self->v_size = 1;
+    for (i = 1; i <= dv->value_cnt; i++) {
+        string_add_value(self, dv->values[i], lens[i]);
+    }
+    free(lens);
+
+    self->index = pi_new(dv->size, 0, dv->value_cnt);
+    for (i = 0; i < dv->size; i++) {
+        pi_set(self->index, i, dv_get_ord(dv, i));
+    }
+    return self;
+}
+
+/* the value of non-zero ordinal +ord+ */
+static INLINE const char *string_value(StringIndex *si, int ord)
+{
+    return si->values + pi_get(si->offsets, ord);
+}
+
+/* merge the sorted values of the sub indexes into +self+, returning the map
+ * from each sub index's ordinals to the merged ordinals */
+static int **string_merge_values(StringIndex *self, StringIndex **subs,
+                                 int cnt)
+{
+    int **ord_maps = ALLOC_AND_ZERO_N(int *, cnt);
+    int *positions = ALLOC_AND_ZERO_N(int, cnt);
+    int i, value_cnt = 0;
+
+    self->values_capa = 1;
+    for (i = 0; i < cnt; i++) {
+        if (subs[i]) {
+            value_cnt += subs[i]->v_size - 1;
+            self->values_capa += subs[i]->values_len;
+            ord_maps[i] = ALLOC_AND_ZERO_N(int, subs[i]->v_size);
+            positions[i] = 1;
+        }
+    }
+    self->values = ALLOC_N(char, self->values_capa);
+    self->offsets = pi_new(value_cnt + 1, 0, self->values_capa);
+    self->v_size = 1;
+
+    while (true) {
+        const char *min = NULL;
+        for (i = 0; i < cnt; i++) {
+            if (subs[i] && positions[i] < subs[i]->v_size) {
+                const char *value = string_value(subs[i], positions[i]);
+                if (NULL == min || strcmp(value, min) < 0) {
+                    min = value;
+                }
+            }
+        }
+        if (NULL == min) {
+            break;
+        }
+        string_add_value(self, min, (long)strlen(min));
+        min = string_value(self, self->v_size - 1);
+        for (i = 0; i < cnt; i++) {
+            if (subs[i] && positions[i] < subs[i]->v_size
+                && 0 == strcmp(string_value(subs[i], positions[i]), min)) {
+                ord_maps[i][positions[i]++] = self->v_size - 1;
+            }
+        }
+    }
+    free(positions);
+    return ord_maps;
+}
+
+/* set the merged ordinal of each doc in +index+ */
+static void string_merge_ords(PackedInts *index, StringIndex **subs,
+                              int **ord_maps, const int *starts, int cnt)
+{
+    int i, j;
+    for (i = 0; i < cnt; i++) {
+        if (subs[i]) {
+            for (j = 0; j < subs[i]->size; j++) {
+                pi_set(index, starts[i] + j,
+                       ord_maps[i][pi_get(subs[i]->index, j)]);
+            }
+        }
+        free(ord_maps[i]);
+    }
+    free(ord_maps);
+}
+
+static void *string_merge_indexes(void **indexes, const int *starts, int cnt,
+                                  int size)
+{
+    StringIndex *self = ALLOC_AND_ZERO(StringIndex);
+    int **ord_maps = string_merge_values(self, (StringIndex **)indexes, cnt);
+    self->size = size;
+    self->index = pi_new(size, 0, self->v_size - 1);
+    string_merge_ords(self->index, (StringIndex **)indexes, ord_maps,
+                      starts, cnt);
+    return self;
 }
 
 const FieldIndexClass STRING_FIELD_INDEX_CLASS = {
     "string",
     &string_create_index,
     &string_destroy_index,
-    &string_handle_term
+    &string_handle_term,
+    &string_create_index_from_doc_values,
+    &string_merge_indexes,
+    NULL
 };
 
+/* the byte indexes of segments can't be merged as they only hold ordinals so
+ * the string indexes of the segments are merged instead */
+static void *byte_merge_indexes(void **indexes, const int *starts, int cnt,
+                                int size)
+{
+    StringIndex values;
+    PackedInts *index;
+    int **ord_maps;
+
+    memset(&values, 0, sizeof(StringIndex));
+    ord_maps = string_merge_values(&values, (StringIndex **)indexes, cnt);
+    index = pi_new(size + 1, 0, values.v_size);
+    pi_set(index, size, values.v_size);
+    string_merge_ords(index, (StringIndex **)indexes, ord_maps, starts, cnt);
+    pi_destroy(values.offsets);
+    free(values.values);
+    return index;
+}
+
 const char *get_string_value(FieldIndex *field_index, long doc_num)
 {
     if (field_index->klass == &STRING_FIELD_INDEX_CLASS) {
         StringIndex *string_index = (StringIndex *)field_index->index;
         if (doc_num >= 0 && doc_num < string_index->size) {
-            return string_index->values[string_index->index[doc_num]];
+            return STRING_INDEX_VALUE(string_index,
+                                      pi_get(string_index->index, doc_num));
         }
     }
     return NULL;
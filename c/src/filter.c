@@ -1,6 +1,7 @@
 #include "search.h"
 #include "symbol.h"
 #include <string.h>
+#include <limits.h>
 #include "internal.h"
 
 /***************************************************************************
@@ -21,20 +22,180 @@ void filt_deref(Filter *filt)
     }
 }
 
-BitVector *filt_get_bv(Filter *filt, IndexReader *ir)
+/* the docs matched in a reader along with the deletion_gen of the reader
+ * when they were found, since deleting docs may change what matches */
+typedef struct FilterDocs
+{
+    Roaring *docs;
+    int deletion_gen;
+} FilterDocs;
+
+static void filter_docs_destroy(FilterDocs *fd)
+{
+    roar_destroy(fd->docs);
+    free(fd);
+}
+
+/* a MultiReader's deletions are those of its sub readers */
+static int filt_deletion_gen(IndexReader *ir)
+{
+    MultiReader *mr = ir_as_multi(ir);
+    int i, gen = ir->deletion_gen;
+    if (mr) {
+        for (i = 0; i < mr->r_cnt; i++) {
+            gen += filt_deletion_gen(mr->sub_readers[i]);
+        }
+    }
+    return gen;
+}
+
+static Roaring *filt_find_roaring(Filter *filt, IndexReader *ir)
+{
+    MultiReader *mr = filt->per_segment ? ir_as_multi(ir) : NULL;
+    Roaring *docs;
+
+    if (mr) {
+        /* join the docs matched in each sub reader so that only readers
+         * which haven't been seen before need to be filtered */
+        int i, j, n;
+        int buf[128];
+        docs = roar_new();
+        for (i = 0; i < mr->r_cnt; i++) {
+            Roaring *sub_docs = filt_get_roaring(filt, mr->sub_readers[i]);
+            const int start = mr->starts[i];
+            int doc = 0;
+            while ((n = roar_next_n(sub_docs, doc, buf, NELEMS(buf))) > 0) {
+                for (j = 0; j < n; j++) {
+                    roar_add(docs, start + buf[j]);
+                }
+                doc = buf[n - 1] + 1;
+            }
+        }
+        roar_optimize(docs);
+    }
+    else {
+        /* only the compressed docs are kept in the cache */
+        BitVector *bv = filt->get_bv_i(filt, ir);
+        docs = roar_from_bv(bv, ir->max_doc(ir));
+        bv_destroy(bv);
+    }
+    return docs;
+}
+
+Roaring *filt_get_roaring(Filter *filt, IndexReader *ir)
 {
     CacheObject *co = (CacheObject *)h_get(filt->cache, ir);
+    const int deletion_gen = filt_deletion_gen(ir);
+    FilterDocs *fd;
 
     if (!co) {
-        BitVector *bv;
         if (!ir->cache) {
             ir_add_cache(ir);
         }
-        bv = filt->get_bv_i(filt, ir);
+        fd = ALLOC(FilterDocs);
+        fd->deletion_gen = deletion_gen;
+        fd->docs = filt_find_roaring(filt, ir);
         co = co_create(filt->cache, ir->cache, filt, ir,
-                       (free_ft)&bv_destroy, (void *)bv);
+                       (free_ft)&filter_docs_destroy, (void *)fd);
+    }
+    else if ((fd = (FilterDocs *)co->obj)->deletion_gen != deletion_gen) {
+        roar_destroy(fd->docs);
+        fd->deletion_gen = deletion_gen;
+        fd->docs = filt_find_roaring(filt, ir);
+    }
+    return ((FilterDocs *)co->obj)->docs;
+}
+
+BitVector *filt_get_bv(Filter *filt, IndexReader *ir)
+{
+    return roar_to_bv(filt_get_roaring(filt, ir));
+}
+
+/***************************************************************************
+ * RoaringDocIdSetIterator
+ ***************************************************************************/
+
+#define RDSI(it) ((RoaringDocIdSetIterator *)(it))
+#define RDSI_DOC_BUF_SIZE 128
+
+typedef struct RoaringDocIdSetIterator
+{
+    DocIdSetIterator super;
+    Roaring *docs;
+    int buf[RDSI_DOC_BUF_SIZE];
+    int doc_cnt;
+    int pointer;
+} RoaringDocIdSetIterator;
+
+static bool rdsi_next(DocIdSetIterator *self)
+{
+    RoaringDocIdSetIterator *rdsi = RDSI(self);
+    if (++rdsi->pointer >= rdsi->doc_cnt) {
+        rdsi->doc_cnt = roar_next_n(rdsi->docs, self->doc + 1,
+                                    rdsi->buf, RDSI_DOC_BUF_SIZE);
+        rdsi->pointer = 0;
+        if (rdsi->doc_cnt == 0) {
+            self->doc = INT_MAX - 1;
+            return false;
+        }
+    }
+    self->doc = rdsi->buf[rdsi->pointer];
+    return true;
+}
+
+static bool rdsi_skip_to(DocIdSetIterator *self, int doc_num)
+{
+    RoaringDocIdSetIterator *rdsi = RDSI(self);
+    /* skip within the buffered docs if we can */
+    while (++rdsi->pointer < rdsi->doc_cnt) {
+        if (rdsi->buf[rdsi->pointer] >= doc_num) {
+            self->doc = rdsi->buf[rdsi->pointer];
+            return true;
+        }
     }
-    return (BitVector *)co->obj;
+    rdsi->doc_cnt = rdsi->pointer = 0;
+    if ((self->doc = roar_next_from(rdsi->docs, doc_num)) < 0) {
+        self->doc = INT_MAX - 1;
+        return false;
+    }
+    return true;
+}
+
+static void rdsi_close(DocIdSetIterator *self)
+{
+    roar_destroy(RDSI(self)->docs);
+    free(self);
+}
+
+static DocIdSetIterator *rdsi_new(Roaring *docs)
+{
+    DocIdSetIterator *self = (DocIdSetIterator *)ALLOC(RoaringDocIdSetIterator);
+    RDSI(self)->docs    = docs;
+    RDSI(self)->doc_cnt = RDSI(self)->pointer = 0;
+    docs->ref_cnt++;
+
+    self->doc     = -1;
+    self->cost    = docs->count;
+    self->next    = &rdsi_next;
+    self->skip_to = &rdsi_skip_to;
+    self->close   = &rdsi_close;
+    return self;
+}
+
+static DocIdSetIterator *filt_get_iterator_i(Filter *filt, IndexReader *ir)
+{
+    return rdsi_new(filt_get_roaring(filt, ir));
+}
+
+DocIdSetIterator *filt_get_iterator(Filter *filt, IndexReader *ir)
+{
+    return filt->get_iterator_i(filt, ir);
+}
+
+bool filt_is_sparse(Filter *filt, IndexReader *ir)
+{
+    return filt_get_roaring(filt, ir)->count
+        < ir->max_doc(ir) / FILT_SPARSE_RATIO;
 }
 
 static char *filt_to_s_i(Filter *filt)
@@ -56,14 +217,16 @@ static int filt_eq_default(Filter *filt, Filter *o)
 
 Filter *filt_create(size_t size, Symbol name)
 {
-    Filter *filt    = (Filter *)emalloc(size);
-    filt->cache     = co_hash_create();
-    filt->name      = name;
-    filt->to_s      = &filt_to_s_i;
-    filt->hash      = &filt_hash_default;
-    filt->eq        = &filt_eq_default;
-    filt->destroy_i = &filt_destroy_i;
-    filt->ref_cnt   = 1;
+    Filter *filt         = (Filter *)emalloc(size);
+    filt->cache          = co_hash_create();
+    filt->name           = name;
+    filt->get_iterator_i = &filt_get_iterator_i;
+    filt->to_s           = &filt_to_s_i;
+    filt->hash           = &filt_hash_default;
+    filt->eq             = &filt_eq_default;
+    filt->destroy_i      = &filt_destroy_i;
+    filt->ref_cnt        = 1;
+    filt->per_segment    = true;
     return filt;
 }
 
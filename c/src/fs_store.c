@@ -28,6 +28,7 @@
 # define DIR_SEPARATOR_CHAR '/'
 # include <unistd.h>
 # include <dirent.h>
+# include <sys/mman.h>
 #endif
 #ifndef O_BINARY
 # define O_BINARY 0
@@ -44,6 +45,284 @@ static char *join_path(char *buf, const char *base, const char *filename)
   return buf;
 }
 
+/****************************************************************************
+ *
+ * FileHandle
+ *
+ * All InStreams opened on the same file share a single FileHandle and read
+ * from it by position so neither clones nor repeated opens of a file use up
+ * extra file descriptors. Open descriptors are kept in least recently used
+ * order and once more than +fs_max_open_files+ of them are open, the least
+ * recently used idle descriptor is closed. It is transparently reopened the
+ * next time the file is read. Descriptors of removed files can't be reopened
+ * so they are pinned open until their readers are closed. They still count
+ * against +fs_max_open_files+ and a file won't be removed while doing so
+ * would leave no room for the descriptors of other files.
+ *
+ ****************************************************************************/
+
+int fs_max_open_files = FRT_FS_MAX_OPEN_FILES;
+
+typedef struct FrtFileHandle FileHandle;
+struct FrtFileHandle
+{
+    char       *path;
+    int         fd;             /* -1 while the descriptor is evicted */
+    int         ref_cnt;        /* number of InStreams sharing the handle */
+    int         in_use;         /* number of reads in progress */
+    bool        pinned;         /* file was removed so it can't be reopened */
+    bool        shared;         /* still registered in fh_table */
+    off_t       length;
+    dev_t       dev;
+    ino_t       ino;
+    FileHandle *lru_prev;
+    FileHandle *lru_next;
+};
+
+static Hash *fh_table = NULL;
+static FileHandle *fh_lru_head = NULL;  /* most recently used */
+static FileHandle *fh_lru_tail = NULL;  /* least recently used */
+static int fh_open_cnt = 0;
+static int fh_pinned_cnt = 0;
+
+#ifndef UNTHREADED
+static mutex_t fh_mutex = MUTEX_INITIALIZER;
+#endif
+
+/* The following fh_ functions must be called with fh_mutex locked */
+static void fh_lru_remove(FileHandle *fh)
+{
+    if (fh->lru_prev) fh->lru_prev->lru_next = fh->lru_next;
+    else              fh_lru_head = fh->lru_next;
+    if (fh->lru_next) fh->lru_next->lru_prev = fh->lru_prev;
+    else              fh_lru_tail = fh->lru_prev;
+    fh->lru_prev = fh->lru_next = NULL;
+}
+
+static void fh_lru_push(FileHandle *fh)
+{
+    fh->lru_prev = NULL;
+    fh->lru_next = fh_lru_head;
+    if (fh_lru_head) fh_lru_head->lru_prev = fh;
+    else             fh_lru_tail = fh;
+    fh_lru_head = fh;
+}
+
+/**
+ * Close the least recently used descriptor which isn't currently being read
+ * from. Returns false if there are no descriptors that can be closed.
+ */
+static bool fh_evict()
+{
+    FileHandle *fh;
+    for (fh = fh_lru_tail; fh; fh = fh->lru_prev) {
+        if (fh->in_use == 0 && !fh->pinned) {
+            fh_lru_remove(fh);
+            close(fh->fd);
+            fh->fd = -1;
+            fh_open_cnt--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int fh_open_fd(const char *path)
+{
+    int fd;
+    while (fs_max_open_files > 0 && fh_open_cnt >= fs_max_open_files
+           && fh_evict()) {
+    }
+    while ((fd = open(path, O_RDONLY | O_BINARY)) < 0
+           && (errno == EMFILE || errno == ENFILE) && fh_evict()) {
+    }
+    return fd;
+}
+
+static int fh_acquire(FileHandle *fh)
+{
+    if (fh->fd < 0) {
+        struct stat stt;
+        int fd = fh_open_fd(fh->path);
+        if (fd < 0) {
+            mutex_unlock(&fh_mutex);
+            RAISE(IO_ERROR, "couldn't reopen %s: <%s>", fh->path,
+                  strerror(errno));
+        }
+        if (fstat(fd, &stt) || stt.st_dev != fh->dev || stt.st_ino != fh->ino) {
+            close(fd);
+            mutex_unlock(&fh_mutex);
+            RAISE(IO_ERROR, "couldn't reopen %s: file has been replaced",
+                  fh->path);
+        }
+        fh->fd = fd;
+        fh_open_cnt++;
+    }
+    else {
+        fh_lru_remove(fh);
+    }
+    fh_lru_push(fh);
+    fh->in_use++;
+    return fh->fd;
+}
+
+/* Handles still open at exit are left to their InStreams */
+static void fh_table_destroy(Hash *table)
+{
+    mutex_lock(&fh_mutex);
+    h_destroy(table);
+    fh_table = NULL;
+    mutex_unlock(&fh_mutex);
+}
+
+static FileHandle *fh_open(const char *path)
+{
+    struct stat stt;
+    FileHandle *fh;
+    int fd;
+
+    mutex_lock(&fh_mutex);
+    if (!fh_table) {
+        fh_table = h_new_str(NULL, NULL);
+        register_for_cleanup(fh_table, (free_ft)&fh_table_destroy);
+    }
+
+    fh = (FileHandle *)h_get(fh_table, path);
+    if (fh) {
+        if (!stat(path, &stt) && stt.st_dev == fh->dev
+            && stt.st_ino == fh->ino) {
+            fh->ref_cnt++;
+            mutex_unlock(&fh_mutex);
+            return fh;
+        }
+        /* the file has been replaced so leave the old handle to its
+         * current readers */
+        h_rem(fh_table, path, false);
+        fh->shared = false;
+    }
+
+    if ((fd = fh_open_fd(path)) < 0) {
+        mutex_unlock(&fh_mutex);
+        RAISE(FILE_NOT_FOUND_ERROR,
+              "tried to open \"%s\" but it doesn't exist: <%s>",
+              path, strerror(errno));
+    }
+    if (fstat(fd, &stt)) {
+        close(fd);
+        mutex_unlock(&fh_mutex);
+        RAISE(IO_ERROR, "fstat failed: <%s>", strerror(errno));
+    }
+
+    fh = ALLOC_AND_ZERO(FileHandle);
+    fh->path = estrdup(path);
+    fh->fd = fd;
+    fh->ref_cnt = 1;
+    fh->shared = true;
+    fh->length = stt.st_size;
+    fh->dev = stt.st_dev;
+    fh->ino = stt.st_ino;
+    h_set(fh_table, fh->path, fh);
+    fh_open_cnt++;
+    fh_lru_push(fh);
+    mutex_unlock(&fh_mutex);
+    return fh;
+}
+
+static void fh_close(FileHandle *fh)
+{
+    mutex_lock(&fh_mutex);
+    if (--fh->ref_cnt > 0) {
+        mutex_unlock(&fh_mutex);
+        return;
+    }
+    if (fh->shared && fh_table) {
+        h_rem(fh_table, fh->path, false);
+    }
+    if (fh->fd >= 0) {
+        fh_lru_remove(fh);
+        close(fh->fd);
+        fh_open_cnt--;
+    }
+    if (fh->pinned) {
+        fh_pinned_cnt--;
+    }
+    mutex_unlock(&fh_mutex);
+    free(fh->path);
+    free(fh);
+}
+
+/**
+ * Called before the file at +path+ is removed, renamed or rewritten. Any open
+ * handle on the file keeps its descriptor open from now on as it won't be
+ * able to reopen it by name. The handle is also unregistered so that a new
+ * file created with the same name gets a handle of its own.
+ *
+ * Pinned descriptors can't be evicted so at least one descriptor is always
+ * left for the other files. If pinning the handle would take that one, the
+ * handle is left as it is and false is returned, unless +force+ is set.
+ */
+static bool fh_detach(const char *path, bool force)
+{
+    FileHandle *fh;
+    mutex_lock(&fh_mutex);
+    if (fh_table && (fh = (FileHandle *)h_get(fh_table, path))) {
+        if (!force && fs_max_open_files > 0
+            && fh_pinned_cnt + 1 >= fs_max_open_files) {
+            mutex_unlock(&fh_mutex);
+            return false;
+        }
+        h_rem(fh_table, path, false);
+        fh->shared = false;
+        if (fh->fd < 0) {
+            if ((fh->fd = fh_open_fd(fh->path)) >= 0) {
+                fh_open_cnt++;
+                fh_lru_push(fh);
+            }
+        }
+        fh->pinned = true;
+        fh_pinned_cnt++;
+    }
+    mutex_unlock(&fh_mutex);
+    return true;
+}
+
+static void fh_read(FileHandle *fh, uchar *buf, int len, off_t pos)
+{
+    int cnt = 0;
+    ssize_t n;
+    int fd;
+
+    mutex_lock(&fh_mutex);
+    fd = fh_acquire(fh);
+#ifdef POSH_OS_WIN32
+    /* there is no pread on windows so the seek and read must be done while
+     * the descriptor is locked */
+    if (lseek(fd, pos, SEEK_SET) >= 0) {
+        while (cnt < len && (n = read(fd, buf + cnt, len - cnt)) > 0) {
+            cnt += n;
+        }
+    }
+#else
+    mutex_unlock(&fh_mutex);
+    while (cnt < len) {
+        n = pread(fd, buf + cnt, len - cnt, pos + cnt);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        cnt += n;
+    }
+    mutex_lock(&fh_mutex);
+#endif
+    fh->in_use--;
+    mutex_unlock(&fh_mutex);
+
+    if (cnt != len) {
+        RAISE(IO_ERROR, "couldn't read %d chars from %s: <%s>",
+              len, fh->path, strerror(errno));
+    }
+}
+
 static void fs_touch(Store *store, const char *filename)
 {
     int f;
@@ -76,19 +355,29 @@ static int fs_exists(Store *store, const char *filename)
 static int fs_remove(Store *store, const char *filename)
 {
     char path[MAX_FILE_PATH];
-    return remove(join_path(path, store->dir.path, filename));
+    /* the deleter retries files which couldn't be removed once readers of
+     * the other removed files have been closed */
+    if (!fh_detach(join_path(path, store->dir.path, filename), false)) {
+        RAISE(IO_ERROR, "couldn't remove %s: too many removed files are "
+              "still open", path);
+    }
+    return remove(path);
 }
 
 static void fs_rename(Store *store, const char *from, const char *to)
 {
     char path1[MAX_FILE_PATH], path2[MAX_FILE_PATH];
 
+    join_path(path1, store->dir.path, from);
+    join_path(path2, store->dir.path, to);
+    fh_detach(path1, true);
+    fh_detach(path2, true);
+
 #ifdef POSH_OS_WIN32
-    remove(join_path(path1, store->dir.path, to));
+    remove(path2);
 #endif
 
-    if (rename(join_path(path1, store->dir.path, from),
-               join_path(path2, store->dir.path, to)) < 0) {
+    if (rename(path1, path2) < 0) {
         RAISE(IO_ERROR, "couldn't rename file \"%s\" to \"%s\": <%s>",
               path1, path2, strerror(errno));
     }
@@ -163,6 +452,7 @@ static void remove_if_index_file(const char *base_path, const char *file_name)
     basename = (basename ? basename + 1 : path);
     /* we don't want to delete non-index files here */
     if (file_name_filter_is_index_file(basename, true)) {
+        fh_detach(path, true);
         remove(path);
     }
 }
@@ -270,9 +560,13 @@ static const struct OutStreamMethods FS_OUT_STREAM_METHODS = {
 static OutStream *fs_new_output(Store *store, const char *filename)
 {
     char path[MAX_FILE_PATH];
-    int fd = open(join_path(path, store->dir.path, filename),
-                  O_WRONLY | O_CREAT | O_BINARY, store->file_mode);
     OutStream *os;
+    int fd;
+
+    /* files like segments.gen are rewritten in place so the length cached
+     * by a handle already open on the file would go stale */
+    fh_detach(join_path(path, store->dir.path, filename), true);
+    fd = open(path, O_WRONLY | O_CREAT | O_BINARY, store->file_mode);
     if (fd < 0) {
         RAISE(IO_ERROR, "couldn't create OutStream %s: <%s>",
               path, strerror(errno));
@@ -284,45 +578,31 @@ static OutStream *fs_new_output(Store *store, const char *filename)
     return os;
 }
 
-static void fsi_read_i(InStream *is, uchar *path, int len)
+/*
+ * FS InStreams read from a shared FileHandle at the InStream's own position
+ * so there is no need to seek the underlying descriptor.
+ */
+static void fsi_read_i(InStream *is, uchar *buf, int len)
 {
-    int fd = is->file.fd;
-    off_t pos = is_pos(is);
-    if (pos != lseek(fd, 0, SEEK_CUR)) {
-        lseek(fd, pos, SEEK_SET);
-    }
-    if (read(fd, path, len) != len) {
-        /* win: the wrong value can be returned for some reason so double check */
-        if (lseek(fd, 0, SEEK_CUR) != (pos + len)) {
-            RAISE(IO_ERROR, "couldn't read %d chars from %s: <%s>",
-                  len, path, strerror(errno));
-        }
-    }
+    fh_read(is->file.fh, buf, len, is_pos(is));
 }
 
 static void fsi_seek_i(InStream *is, off_t pos)
 {
-    if (lseek(is->file.fd, pos, SEEK_SET) < 0) {
-        RAISE(IO_ERROR, "seeking pos %"OFF_T_PFX"d: <%s>",
-              pos, strerror(errno));
-    }
+    (void)is;
+    (void)pos;
 }
 
 static void fsi_close_i(InStream *is)
 {
-    if (close(is->file.fd)) {
-        RAISE(IO_ERROR, "%s", strerror(errno));
-    }
-    free(is->d.path);
+    fh_close(is->file.fh);
 }
 
+/* a file rewritten by fs_new_output gets a new handle so the length of the
+ * file a handle was opened on can't change */
 static off_t fsi_length_i(InStream *is)
 {
-    struct stat stt;
-    if (fstat(is->file.fd, &stt)) {
-        RAISE(IO_ERROR, "fstat failed: <%s>", strerror(errno));
-    }
-    return stt.st_size;
+    return is->file.fh->length;
 }
 
 static const struct InStreamMethods FS_IN_STREAM_METHODS = {
@@ -336,18 +616,86 @@ static InStream *fs_open_input(Store *store, const char *filename)
 {
     InStream *is;
     char path[MAX_FILE_PATH];
+    FileHandle *fh = fh_open(join_path(path, store->dir.path, filename));
+    is = is_new();
+    is->file.fh = fh;
+    is->m = &FS_IN_STREAM_METHODS;
+    return is;
+}
+
+#ifndef POSH_OS_WIN32
+/*
+ * Memory-mapped InStreams. The whole file is mapped read-only and the
+ * InStream's data pointer is set to the start of the mapping so every read
+ * comes straight out of the page cache. The mapping is shared by all clones
+ * and unmapped when the last of them is closed.
+ */
+static void mmapi_read_i(InStream *is, uchar *buf, int len)
+{
+    off_t pos = is_pos(is);
+    if ((pos + len) > is->buf.len) {
+        RAISE(EOF_ERROR, "Tried to read past end of file. File length is "
+              "<%"OFF_T_PFX"d> and tried to read to <%"OFF_T_PFX"d>",
+              is->buf.len, pos + len);
+    }
+    memcpy(buf, is->data + pos, len);
+}
+
+static void mmapi_seek_i(InStream *is, off_t pos)
+{
+    (void)is;
+    (void)pos;
+}
+
+static off_t mmapi_length_i(InStream *is)
+{
+    return is->buf.len;
+}
+
+static void mmapi_close_i(InStream *is)
+{
+    if (munmap((void *)is->data, (size_t)is->buf.len)) {
+        RAISE(IO_ERROR, "%s", strerror(errno));
+    }
+}
+
+static const struct InStreamMethods MMAP_IN_STREAM_METHODS = {
+    mmapi_read_i,
+    mmapi_seek_i,
+    mmapi_length_i,
+    mmapi_close_i
+};
+
+static InStream *mmap_open_input(Store *store, const char *filename)
+{
+    InStream *is;
+    struct stat stt;
+    void *data;
+    char path[MAX_FILE_PATH];
     int fd = open(join_path(path, store->dir.path, filename), O_RDONLY | O_BINARY);
     if (fd < 0) {
         RAISE(FILE_NOT_FOUND_ERROR,
               "tried to open \"%s\" but it doesn't exist: <%s>",
               path, strerror(errno));
     }
+    if (fstat(fd, &stt) || stt.st_size == 0
+        || (off_t)(size_t)stt.st_size != stt.st_size
+        || (data = mmap(NULL, (size_t)stt.st_size, PROT_READ, MAP_SHARED,
+                        fd, 0)) == MAP_FAILED) {
+        /* empty or unmappable file so fall back to a buffered stream */
+        close(fd);
+        return fs_open_input(store, filename);
+    }
+    /* the mapping stays valid after the file descriptor is closed */
+    close(fd);
+
     is = is_new();
-    is->file.fd = fd;
-    is->d.path = estrdup(path);
-    is->m = &FS_IN_STREAM_METHODS;
+    is->data = (const uchar *)data;
+    is->buf.len = stt.st_size;
+    is->m = &MMAP_IN_STREAM_METHODS;
     return is;
 }
+#endif
 
 #define LOCK_OBTAIN_TIMEOUT 10
 
@@ -414,6 +762,7 @@ static void fs_close_lock_i(Lock *lock)
 }
 
 static Hash *stores = NULL;
+static Hash *mmap_stores = NULL;
 
 #ifndef UNTHREADED
 static mutex_t stores_mutex = MUTEX_INITIALIZER;
@@ -426,6 +775,13 @@ static void fs_close_i(Store *store)
     mutex_unlock(&stores_mutex);
 }
 
+static void mmap_close_i(Store *store)
+{
+    mutex_lock(&stores_mutex);
+    h_del(mmap_stores, store->dir.path);
+    mutex_unlock(&stores_mutex);
+}
+
 static Store *fs_store_new(const char *pathname)
 {
     struct stat stt;
@@ -475,27 +831,56 @@ static Store *fs_store_new(const char *pathname)
     return new_store;
 }
 
-Store *open_fs_store(const char *pathname)
+/**
+ * Return the store for +pathname+ from +store_cache+ creating it if it isn't
+ * already open. Stores are shared so that all readers and writers of a
+ * directory use the same locks.
+ */
+static Store *open_cached_store(Hash **store_cache, const char *pathname,
+                                bool use_mmap)
 {
     Store *store = NULL;
 
-    if (!stores) {
-        stores = h_new_str(NULL, (free_ft)fs_destroy);
-        register_for_cleanup(stores, (free_ft)h_destroy);
+    if (!*store_cache) {
+        *store_cache = h_new_str(NULL, (free_ft)fs_destroy);
+        register_for_cleanup(*store_cache, (free_ft)h_destroy);
     }
 
     mutex_lock(&stores_mutex);
-    store = (Store *)h_get(stores, pathname);
+    store = (Store *)h_get(*store_cache, pathname);
     if (store) {
         mutex_lock(&store->mutex);
         store->ref_cnt++;
         mutex_unlock(&store->mutex);
     }
     else {
+        Hash *other_cache = use_mmap ? stores : mmap_stores;
+        Store *other = other_cache
+            ? (Store *)h_get(other_cache, pathname) : NULL;
         store = fs_store_new(pathname);
-        h_set(stores, store->dir.path, store);
+        if (use_mmap) {
+#ifndef POSH_OS_WIN32
+            store->open_input = &mmap_open_input;
+#endif
+            store->close_i    = &mmap_close_i;
+        }
+        if (other) {
+            /* merges through one store must see searches through the other */
+            store_share_searches(store, other);
+        }
+        h_set(*store_cache, store->dir.path, store);
     }
     mutex_unlock(&stores_mutex);
 
     return store;
 }
+
+Store *open_fs_store(const char *pathname)
+{
+    return open_cached_store(&stores, pathname, false);
+}
+
+Store *open_mmap_store(const char *pathname)
+{
+    return open_cached_store(&mmap_stores, pathname, true);
+}
@@ -0,0 +1,438 @@
+#include <string.h>
+#include "fst.h"
+#include "internal.h"
+
+/* enough for the header, the width and 256 arcs of 4 byte ints */
+#define FST_MAX_NODE_BYTES (5 + 1 + 256 * 9)
+#define FST_INIT_CAPA 256
+
+/****************************************************************************
+ *
+ * FstBuilder
+ *
+ ****************************************************************************/
+
+/* A compiled node in the registry. Nodes are equal if their bytes are */
+typedef struct FstNode
+{
+    int len;
+    int addr;
+    uchar bytes[1];
+} FstNode;
+
+static unsigned long fst_node_hash(const void *key)
+{
+    const FstNode *node = (const FstNode *)key;
+    unsigned long hash = (unsigned long)node->len;
+    int i;
+    for (i = 0; i < node->len; i++) {
+        hash = hash * 31 + node->bytes[i];
+    }
+    return hash;
+}
+
+static int fst_node_eq(const void *key1, const void *key2)
+{
+    const FstNode *node1 = (const FstNode *)key1;
+    const FstNode *node2 = (const FstNode *)key2;
+    return node1->len == node2->len
+        && 0 == memcmp(node1->bytes, node2->bytes, node1->len);
+}
+
+static int fst_int_width(unsigned int val)
+{
+    int width = 1;
+    while (val >>= 8) {
+        width++;
+    }
+    return width;
+}
+
+static uchar *fst_write_int(uchar *p, unsigned int val, int width)
+{
+    for (; width > 0; width--) {
+        *p++ = (uchar)val;
+        val >>= 8;
+    }
+    return p;
+}
+
+static uchar *fst_write_vint(uchar *p, unsigned int val)
+{
+    while (val > 127) {
+        *p++ = (uchar)((val & 0x7f) | 0x80);
+        val >>= 7;
+    }
+    *p++ = (uchar)val;
+    return p;
+}
+
+static void fstb_reset(FstBuilder *b)
+{
+    b->len = 0;
+    b->size = 0;
+    b->last_key_len = 0;
+    b->frontier[0].arc_cnt = 0;
+    b->frontier[0].final = false;
+    h_clear(b->registry);
+}
+
+FstBuilder *fstb_new()
+{
+    FstBuilder *b = ALLOC_AND_ZERO(FstBuilder);
+    b->capa = FST_INIT_CAPA;
+    b->bytes = ALLOC_N(uchar, b->capa);
+    b->registry = h_new(&fst_node_hash, &fst_node_eq, &free, NULL);
+    return b;
+}
+
+/* Compile +fnode+, or find an identical node which has already been
+ * compiled, and return its address. The outputs of its arcs are the number of
+ * keys which come before the arc's keys within the node */
+static int fstb_compile(FstBuilder *b, FstFrontierNode *fnode, int *count)
+{
+    uchar buf[FST_MAX_NODE_BYTES];
+    uchar *p;
+    FstNode *node, *existing;
+    int i, output = fnode->final ? 1 : 0, output_width = 1, target_width = 1;
+    const int arc_cnt = fnode->arc_cnt;
+
+    for (i = 0; i < arc_cnt; i++) {
+        output_width = MAX(output_width, fst_int_width(output));
+        target_width = MAX(target_width,
+                           fst_int_width(fnode->arcs[i].target));
+        output += fnode->arcs[i].count;
+    }
+
+    p = fst_write_vint(buf, (arc_cnt << 1) | (fnode->final ? 1 : 0));
+    if (arc_cnt > 0) {
+        *p++ = (uchar)((output_width << 4) | target_width);
+        output = fnode->final ? 1 : 0;
+        for (i = 0; i < arc_cnt; i++) {
+            *p++ = fnode->arcs[i].label;
+            p = fst_write_int(p, output, output_width);
+            p = fst_write_int(p, fnode->arcs[i].target, target_width);
+            output += fnode->arcs[i].count;
+        }
+    }
+    *count = output;
+
+    node = (FstNode *)emalloc(sizeof(FstNode) + (p - buf));
+    node->len = (int)(p - buf);
+    memcpy(node->bytes, buf, node->len);
+    fnode->arc_cnt = 0;
+    fnode->final = false;
+
+    existing = (FstNode *)h_get(b->registry, node);
+    if (NULL != existing) {
+        free(node);
+        return existing->addr;
+    }
+
+    if (b->len + node->len > b->capa) {
+        do {
+            b->capa <<= 1;
+        } while (b->len + node->len > b->capa);
+        REALLOC_N(b->bytes, uchar, b->capa);
+    }
+    node->addr = b->len;
+    memcpy(b->bytes + b->len, node->bytes, node->len);
+    b->len += node->len;
+    h_set(b->registry, node, node);
+    return node->addr;
+}
+
+/* compile the frontier nodes deeper than +depth+ */
+static void fstb_freeze(FstBuilder *b, int depth)
+{
+    int d;
+    for (d = b->last_key_len; d > depth; d--) {
+        FstFrontierNode *parent = &b->frontier[d - 1];
+        FstArc *arc = &parent->arcs[parent->arc_cnt - 1];
+        arc->target = fstb_compile(b, &b->frontier[d], &arc->count);
+    }
+}
+
+void fstb_add(FstBuilder *b, const char *key, int key_len)
+{
+    int prefix_len = 0, d;
+    const int last_key_len = b->last_key_len;
+
+    if (key_len > FST_MAX_KEY_LEN) {
+        RAISE(ARG_ERROR, "FST keys must be at most %d bytes long",
+              FST_MAX_KEY_LEN);
+    }
+    while (prefix_len < key_len && prefix_len < last_key_len
+           && key[prefix_len] == b->last_key[prefix_len]) {
+        prefix_len++;
+    }
+    if (b->size > 0
+        && (prefix_len == key_len
+            || (prefix_len < last_key_len
+                && (uchar)key[prefix_len]
+                    < (uchar)b->last_key[prefix_len]))) {
+        RAISE(ARG_ERROR, "FST keys must be added in sorted order without "
+              "duplicates");
+    }
+
+    fstb_freeze(b, prefix_len);
+
+    for (d = prefix_len; d < key_len; d++) {
+        FstFrontierNode *fnode = &b->frontier[d];
+        if (fnode->arc_cnt == fnode->arc_capa) {
+            fnode->arc_capa = fnode->arc_capa ? fnode->arc_capa << 1 : 4;
+            REALLOC_N(fnode->arcs, FstArc, fnode->arc_capa);
+        }
+        fnode->arcs[fnode->arc_cnt].label = (uchar)key[d];
+        fnode->arc_cnt++;
+        b->frontier[d + 1].arc_cnt = 0;
+        b->frontier[d + 1].final = false;
+    }
+    b->frontier[key_len].final = true;
+
+    memcpy(b->last_key, key, key_len);
+    b->last_key_len = key_len;
+    b->size++;
+}
+
+Fst *fstb_finish(FstBuilder *b)
+{
+    Fst *fst = ALLOC(Fst);
+    int count;
+
+    fstb_freeze(b, 0);
+    fst->root = fstb_compile(b, &b->frontier[0], &count);
+    fst->size = b->size;
+    fst->len = b->len;
+    fst->buf = b->bytes;
+    fst->bytes = fst->buf;
+
+    b->capa = FST_INIT_CAPA;
+    b->bytes = ALLOC_N(uchar, b->capa);
+    fstb_reset(b);
+    return fst;
+}
+
+void fstb_destroy(FstBuilder *b)
+{
+    int i;
+    for (i = 0; i <= FST_MAX_KEY_LEN; i++) {
+        free(b->frontier[i].arcs);
+    }
+    h_destroy(b->registry);
+    free(b->bytes);
+    free(b);
+}
+
+/****************************************************************************
+ *
+ * Fst
+ *
+ ****************************************************************************/
+
+typedef struct FstNodeReader
+{
+    const uchar *arcs;
+    int arc_cnt;
+    int output_width;
+    int target_width;
+    int stride;
+    bool final;
+} FstNodeReader;
+
+static void fst_read_node(const Fst *fst, int addr, FstNodeReader *node)
+{
+    const uchar *p = fst->bytes + addr;
+    unsigned int header = *p & 0x7f;
+    int shift = 7;
+    while (*p++ & 0x80) {
+        header |= (unsigned int)(*p & 0x7f) << shift;
+        shift += 7;
+    }
+    node->final = header & 1;
+    node->arc_cnt = (int)(header >> 1);
+    if (node->arc_cnt > 0) {
+        node->output_width = *p >> 4;
+        node->target_width = *p++ & 0xf;
+        node->stride = 1 + node->output_width + node->target_width;
+        node->arcs = p;
+    }
+}
+
+static INLINE int fst_read_int(const uchar *p, int width)
+{
+    unsigned int val = 0;
+    while (width-- > 0) {
+        val = (val << 8) | p[width];
+    }
+    return (int)val;
+}
+
+#define ARC(node, i) ((node)->arcs + (i) * (node)->stride)
+#define ARC_LABEL(node, i) (*ARC(node, i))
+#define ARC_OUTPUT(node, i) \
+    fst_read_int(ARC(node, i) + 1, (node)->output_width)
+#define ARC_TARGET(node, i) \
+    fst_read_int(ARC(node, i) + 1 + (node)->output_width, (node)->target_width)
+
+/* Binary search for +label+. Returns its arc or, if there is no such arc,
+ * -(the arc that would follow it) - 1 */
+static int fst_find_arc(const FstNodeReader *node, uchar label)
+{
+    int lo = 0, hi = node->arc_cnt - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) >> 1;
+        uchar mid_label = ARC_LABEL(node, mid);
+        if (mid_label < label) {
+            lo = mid + 1;
+        }
+        else if (mid_label > label) {
+            hi = mid - 1;
+        }
+        else {
+            return mid;
+        }
+    }
+    return -lo - 1;
+}
+
+/* follow the last arcs from +addr+ to the greatest key beneath it */
+static int fst_last_key(const Fst *fst, int addr, int ord, char *buf,
+                        int *len)
+{
+    FstNodeReader node;
+    int depth = *len;
+    fst_read_node(fst, addr, &node);
+    while (node.arc_cnt > 0) {
+        const int last = node.arc_cnt - 1;
+        buf[depth++] = (char)ARC_LABEL(&node, last);
+        ord += ARC_OUTPUT(&node, last);
+        fst_read_node(fst, ARC_TARGET(&node, last), &node);
+    }
+    *len = depth;
+    return ord;
+}
+
+int fst_floor(Fst *fst, const char *key, int key_len, char *buf, int *len)
+{
+    int addrs[FST_MAX_KEY_LEN + 1];
+    int ords[FST_MAX_KEY_LEN + 1];
+    int arcs[FST_MAX_KEY_LEN + 1];
+    FstNodeReader node;
+    int depth = 0, addr = fst->root, ord = 0, arc;
+
+    while (true) {
+        fst_read_node(fst, addr, &node);
+        if (depth == key_len) {
+            if (node.final) {
+                *len = depth;
+                return ord;
+            }
+            break;                  /* every key below is greater */
+        }
+        arc = node.arc_cnt > 0 ? fst_find_arc(&node, (uchar)key[depth]) : -1;
+        if (arc >= 0) {
+            addrs[depth] = addr;
+            ords[depth] = ord;
+            arcs[depth] = arc;
+            buf[depth] = (char)ARC_LABEL(&node, arc);
+            ord += ARC_OUTPUT(&node, arc);
+            addr = ARC_TARGET(&node, arc);
+            depth++;
+            continue;
+        }
+        arc = -arc - 2;             /* the arc before the key's label */
+        if (arc >= 0) {
+            buf[depth] = (char)ARC_LABEL(&node, arc);
+            *len = depth + 1;
+            return fst_last_key(fst, ARC_TARGET(&node, arc),
+                                ord + ARC_OUTPUT(&node, arc), buf, len);
+        }
+        if (node.final) {
+            *len = depth;
+            return ord;
+        }
+        break;
+    }
+
+    /* every key beneath the path taken is greater than +key+ so back up to
+     * the last node with a lesser key */
+    while (depth-- > 0) {
+        fst_read_node(fst, addrs[depth], &node);
+        arc = arcs[depth] - 1;
+        if (arc >= 0) {
+            buf[depth] = (char)ARC_LABEL(&node, arc);
+            *len = depth + 1;
+            return fst_last_key(fst, ARC_TARGET(&node, arc),
+                                ords[depth] + ARC_OUTPUT(&node, arc), buf,
+                                len);
+        }
+        if (node.final) {
+            *len = depth;
+            return ords[depth];
+        }
+    }
+    *len = 0;
+    return -1;
+}
+
+int fst_get_key(Fst *fst, int ord, char *buf)
+{
+    FstNodeReader node;
+    int depth = 0;
+
+    fst_read_node(fst, fst->root, &node);
+    while (!(node.final && 0 == ord)) {
+        /* find the last arc whose keys start at or before ord */
+        int lo = 0, hi = node.arc_cnt - 1;
+        if (hi < 0) {
+            RAISE(ARG_ERROR, "FST ordinal out of range");
+        }
+        while (lo < hi) {
+            int mid = (lo + hi + 1) >> 1;
+            if (ARC_OUTPUT(&node, mid) <= ord) {
+                lo = mid;
+            }
+            else {
+                hi = mid - 1;
+            }
+        }
+        buf[depth++] = (char)ARC_LABEL(&node, lo);
+        ord -= ARC_OUTPUT(&node, lo);
+        fst_read_node(fst, ARC_TARGET(&node, lo), &node);
+    }
+    return depth;
+}
+
+void fst_write(Fst *fst, OutStream *os)
+{
+    os_write_vint(os, fst->size);
+    os_write_vint(os, fst->root);
+    os_write_vint(os, fst->len);
+    os_write_bytes(os, fst->bytes, fst->len);
+}
+
+Fst *fst_read(InStream *is)
+{
+    Fst *fst = ALLOC(Fst);
+    fst->size = is_read_vint(is);
+    fst->root = is_read_vint(is);
+    fst->len = is_read_vint(is);
+    if (is_mapped(is) && is->buf.pos + fst->len <= is->buf.len) {
+        fst->buf = NULL;
+        fst->bytes = is->data + is->buf.pos;    /* read straight from the map */
+        is->buf.pos += fst->len;
+    }
+    else {
+        fst->buf = ALLOC_N(uchar, fst->len);
+        is_read_bytes(is, fst->buf, fst->len);
+        fst->bytes = fst->buf;
+    }
+    return fst;
+}
+
+void fst_destroy(Fst *fst)
+{
+    free(fst->buf);
+    free(fst);
+}
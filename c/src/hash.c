@@ -1,5 +1,6 @@
 #include "hash.h"
 #include "global.h"
+#include "threading.h"
 #include <string.h>
 #include "internal.h"
 
@@ -20,6 +21,7 @@ static char *dummy_int_key = "i";
 
 static Hash *free_hts[MAX_FREE_HASH_TABLES];
 static int num_free_hts = 0;
+static mutex_t free_hts_mutex = MUTEX_INITIALIZER;
 
 unsigned long str_hash(const char *const str)
 {
@@ -91,10 +93,15 @@ static HashEntry *h_lookup_ptr(Hash *self, const void *key)
     register HashEntry *he = &he0[i];
     register HashEntry *freeslot = NULL;
 
-    if (he->key == NULL || he->hash == hash) {
+    /* only empty slots are written to so that concurrent readers of a table
+     * which isn't being modified don't interfere with each other */
+    if (he->key == NULL) {
         he->hash = hash;
         return he;
     }
+    if (he->hash == hash) {
+        return he;
+    }
     if (he->key == dummy_key) {
         freeslot = he;
     }
@@ -129,10 +136,13 @@ HashEntry *h_lookup(Hash *self, register const void *key)
     register HashEntry *freeslot = NULL;
     eq_ft eq = self->eq_i;
 
-    if (he->key == NULL || he->key == key) {
+    if (he->key == NULL) {
         he->hash = hash;
         return he;
     }
+    if (he->key == key) {
+        return he;
+    }
     if (he->key == dummy_key) {
         freeslot = he;
     }
@@ -165,11 +175,13 @@ HashEntry *h_lookup(Hash *self, register const void *key)
 
 Hash *h_new_str(free_ft free_key, free_ft free_value)
 {
-    Hash *self;
+    Hash *self = NULL;
+    mutex_lock(&free_hts_mutex);
     if (num_free_hts > 0) {
         self = free_hts[--num_free_hts];
     }
-    else {
+    mutex_unlock(&free_hts_mutex);
+    if (!self) {
         self = ALLOC(Hash);
     }
     self->fill = 0;
@@ -242,12 +254,13 @@ void h_destroy(Hash *self)
             free(self->table);
         }
 
+        mutex_lock(&free_hts_mutex);
         if (num_free_hts < MAX_FREE_HASH_TABLES) {
             free_hts[num_free_hts++] = self;
+            self = NULL;
         }
-        else {
-            free(self);
-        }
+        mutex_unlock(&free_hts_mutex);
+        free(self);
     }
 }
 
@@ -518,7 +531,9 @@ void h_str_print_keys(Hash *self, FILE *out)
 
 void hash_finalize()
 {
+    mutex_lock(&free_hts_mutex);
     while (num_free_hts > 0) {
         free(free_hts[--num_free_hts]);
     }
+    mutex_unlock(&free_hts_mutex);
 }
@@ -3,9 +3,11 @@
 #include "similarity.h"
 #include "helper.h"
 #include "array.h"
+#include "roaring.h"
 #include <string.h>
 #include <limits.h>
 #include <ctype.h>
+#include <math.h>
 #ifdef USE_ZLIB
 # include <zlib.h>
 #else
@@ -13,6 +15,11 @@
 #endif
 #include "internal.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PB_X86_DISPATCH
+# include <immintrin.h>
+#endif
+
 #define GET_LOCK(lock, name, store, err_msg) do {\
     lock = store->open_lock(store, name);\
     if (!lock->obtain(lock)) {\
@@ -34,13 +41,26 @@ const Config default_config = {
     10000,          /* max_buffered_docs */
     INT_MAX,        /* max_merge_docs */
     10000,          /* maximum field length (number of terms) */
-    true            /* use compound file by default */
+    true,           /* use compound file by default */
+    POSTINGS_VINT,  /* postings format */
+    0,              /* merge in the committing thread */
+    0.0,            /* don't limit the I/O rate of merges */
+    1,              /* merge the parts of a segment one after the other */
+    NULL,           /* keep docs in the order they were added */
+    false,          /* sort ascending when a sort field is set */
+    1               /* sort the terms of each field one after the other */
 };
 
 static void ste_reset(TermEnum *te);
 static char *ste_next(TermEnum *te);
 
-#define FORMAT 0
+#define FORMAT -1
+#define SIS_FORMAT_INDEX_SORT -1
+#define TFX_FORMAT_SKIP_LEVELS -1
+#define TFX_FORMAT_POSTINGS_FORMAT -2
+#define TFX_FORMAT_IMPACTS -3
+#define TFX_FORMAT_FST_INDEX -4
+#define TFX_FORMAT_BLOOM_FILTERS -5
 #define SEGMENTS_GEN_FILE_NAME "segments"
 #define MAX_EXT_LEN 10
 #define ZIP_BUFFER_SIZE 16348
@@ -48,7 +68,7 @@ static char *ste_next(TermEnum *te);
 
 /* *** Must be three characters *** */
 static const char *INDEX_EXTENSIONS[] = {
-    "frq", "prx", "fdx", "fdt", "tfx", "tix", "tis", "del", "gen", "cfs"
+    "frq", "prx", "fdx", "fdt", "tfx", "tix", "tis", "dvs", "del", "gen", "cfs"
 };
 
 /* *** Must be three characters *** */
@@ -310,7 +330,7 @@ char *fi_to_s(FieldInfo *fi)
 {
     char *str = ALLOC_N(char, strlen((char *)fi->name) + 200);
     char *s = str;
-    s += sprintf(str, "[\"%s\":(%s%s%s%s%s%s%s%s", (char *)fi->name,
+    s += sprintf(str, "[\"%s\":(%s%s%s%s%s%s%s%s%s%s", (char *)fi->name,
                  fi_is_stored(fi) ? "is_stored, " : "",
                  fi_is_compressed(fi) ? "is_compressed, " : "",
                  fi_is_indexed(fi) ? "is_indexed, " : "",
@@ -318,7 +338,9 @@ char *fi_to_s(FieldInfo *fi)
                  fi_omit_norms(fi) ? "omit_norms, " : "",
                  fi_store_term_vector(fi) ? "store_term_vector, " : "",
                  fi_store_positions(fi) ? "store_positions, " : "",
-                 fi_store_offsets(fi) ? "store_offsets, " : "");
+                 fi_store_offsets(fi) ? "store_offsets, " : "",
+                 fi_is_key(fi) ? "is_key, " : "",
+                 fi_store_doc_values(fi) ? "store_doc_values, " : "");
     s -= 2;
     if (*s != ',') {
         s += 2;
@@ -439,6 +461,22 @@ FieldInfos *fis_read(InStream *is)
     return fis;
 }
 
+/*
+ * Copy +fis+ so that the copy isn't changed by fields added to +fis+.
+ */
+static FieldInfos *fis_clone(FieldInfos *fis)
+{
+    int i;
+    FieldInfos *clone = fis_new(fis->store, fis->index, fis->term_vector);
+    for (i = 0; i < fis->size; i++) {
+        FieldInfo *fi = ALLOC(FieldInfo);
+        *fi = *fis->fields[i];
+        fis_add_field(clone, fi);
+        fi->ref_cnt = 1;
+    }
+    return clone;
+}
+
 void fis_write(FieldInfos *fis, OutStream *os)
 {
     int i;
@@ -556,6 +594,19 @@ static bool fis_has_vectors(FieldInfos *fis)
     return false;
 }
 
+static bool fis_has_doc_values(FieldInfos *fis)
+{
+    int i;
+    const int fis_size = fis->size;
+
+    for (i = 0; i < fis_size; i++) {
+        if (fi_store_doc_values(fis->fields[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /****************************************************************************
  *
  * SegmentInfo
@@ -573,10 +624,32 @@ SegmentInfo *si_new(char *name, int doc_cnt, Store *store)
     si->norm_gens_size = 0;
     si->ref_cnt = 1;
     si->use_compound_file = false;
+    si->merging = false;
+    si->size = 0;
+    si->del_cnt = 0;
+    si->del_cnt_gen = -1;
+    si->sort_field = NULL;
+    si->sort_reverse = false;
     return si;
 }
 
-static SegmentInfo *si_read(Store *store, InStream *is)
+static SegmentInfo *si_clone(SegmentInfo *si)
+{
+    SegmentInfo *clone = si_new(estrdup(si->name), si->doc_cnt, si->store);
+    clone->del_gen = si->del_gen;
+    clone->use_compound_file = si->use_compound_file;
+    clone->sort_field = si->sort_field;
+    clone->sort_reverse = si->sort_reverse;
+    if (si->norm_gens) {
+        clone->norm_gens = ALLOC_N(int, si->norm_gens_size);
+        memcpy(clone->norm_gens, si->norm_gens,
+               si->norm_gens_size * sizeof(int));
+        clone->norm_gens_size = si->norm_gens_size;
+    }
+    return clone;
+}
+
+static SegmentInfo *si_read(Store *store, InStream *is, int format)
 {
     SegmentInfo *volatile si = ALLOC_AND_ZERO(SegmentInfo);
     TRY
@@ -586,6 +659,7 @@ static SegmentInfo *si_read(Store *store, InStream *is)
         si->del_gen = is_read_vint(is);
         si->norm_gens_size = is_read_vint(is);
         si->ref_cnt = 1;
+        si->del_cnt_gen = -1;
         if (0 < si->norm_gens_size) {
             int i;
             si->norm_gens = ALLOC_N(int, si->norm_gens_size);
@@ -594,6 +668,12 @@ static SegmentInfo *si_read(Store *store, InStream *is)
             }
         }
         si->use_compound_file = (bool)is_read_byte(is);
+        if (format <= SIS_FORMAT_INDEX_SORT) {
+            char *sort_field = is_read_string_safe(is);
+            si->sort_field = *sort_field ? intern(sort_field) : NULL;
+            free(sort_field);
+            si->sort_reverse = (bool)is_read_byte(is);
+        }
     XCATCHALL
         free(si->name);
         free(si);
@@ -614,6 +694,8 @@ static void si_write(SegmentInfo *si, OutStream *os)
         }
     }
     os_write_byte(os, (uchar)si->use_compound_file);
+    os_write_string(os, si->sort_field ? S(si->sort_field) : "");
+    os_write_byte(os, (uchar)si->sort_reverse);
 }
 
 void si_deref(SegmentInfo *si)
@@ -680,6 +762,56 @@ static char *si_norm_file_name(SegmentInfo *si, char *buf, int field_num)
     }
 }
 
+off_t si_size(SegmentInfo *si)
+{
+    /* the segment's files aren't changed once written so only separate
+     * norms can change the size and they are small enough to ignore */
+    if (0 == si->size) {
+        Store *store = si->store;
+        char file_name[SEGMENT_NAME_MAX_LENGTH];
+        int i;
+        if (si->use_compound_file) {
+            sprintf(file_name, "%s.cfs", si->name);
+            si->size = store->length(store, file_name);
+        }
+        else {
+            for (i = 0; i < NELEMS(COMPOUND_EXTENSIONS); i++) {
+                sprintf(file_name, "%s.%s", si->name, COMPOUND_EXTENSIONS[i]);
+                si->size += store->length(store, file_name);
+            }
+            sprintf(file_name, "%s.dvs", si->name);
+            if (store->exists(store, file_name)) {
+                si->size += store->length(store, file_name);
+            }
+            for (i = si->norm_gens_size - 1; i >= 0; i--) {
+                if (si_norm_file_name(si, file_name, i)) {
+                    si->size += store->length(store, file_name);
+                }
+            }
+        }
+    }
+    return si->size;
+}
+
+static BitVector *bv_read(Store *store, char *name);
+
+int si_del_cnt(SegmentInfo *si)
+{
+    if (si->del_cnt_gen != si->del_gen) {
+        si->del_cnt = 0;
+        if (si->del_gen >= 0) {
+            char file_name[SEGMENT_NAME_MAX_LENGTH];
+            BitVector *bv;
+            fn_for_generation(file_name, si->name, "del", si->del_gen);
+            bv = bv_read(si->store, file_name);
+            si->del_cnt = bv->count;
+            bv_destroy(bv);
+        }
+        si->del_cnt_gen = si->del_gen;
+    }
+    return si->del_cnt;
+}
+
 static void deleter_queue_file(Deleter *dlr, const char *file_name);
 #define DEL(file_name) deleter_queue_file(dlr, file_name)
 
@@ -737,6 +869,7 @@ static char *new_segment(i64 generation)
 
 typedef struct FindSegmentsFile {
     i64  generation;
+    IndexReader *prev_ir;   /* the reader being reopened by ir_reopen */
     union {
       SegmentInfos *sis;
       IndexReader  *ir;
@@ -768,6 +901,10 @@ static void si_put(SegmentInfo *si, FILE *stream)
         fprintf(stream, "\t\t\t%d\n", si->norm_gens[i]);
     }
     fprintf(stream, "\t\t}\n");
+    if (si->sort_field) {
+        fprintf(stream, "\t\tsort_field = %s%s\n", S(si->sort_field),
+                si->sort_reverse ? " (reversed)" : "");
+    }
     fprintf(stream, "\t\tref_cnt = %d\n", si->ref_cnt);
     fprintf(stream, "\t}\n");
 }
@@ -1020,6 +1157,27 @@ SegmentInfos *sis_new(FieldInfos *fis)
     return sis;
 }
 
+/*
+ * Copy +sis+ so that a reader can be opened on the segments of an
+ * IndexWriter without being affected by the writer's later changes.
+ */
+static SegmentInfos *sis_clone(SegmentInfos *sis)
+{
+    int i;
+    FieldInfos *fis = fis_clone(sis->fis);
+    SegmentInfos *clone = sis_new(fis);
+    fis_deref(fis);
+    clone->format = sis->format;
+    clone->version = sis->version;
+    clone->counter = sis->counter;
+    clone->generation = sis->generation;
+    clone->store = sis->store;
+    for (i = 0; i < sis->size; i++) {
+        sis_add_si(clone, si_clone(sis->segs[i]));
+    }
+    return clone;
+}
+
 SegmentInfo *sis_new_segment(SegmentInfos *sis, int doc_cnt, Store *store)
 {
     return sis_add_si(sis, si_new(new_segment(sis->counter++), doc_cnt, store));
@@ -1094,7 +1252,7 @@ static void sis_read_i(Store *store, FindSegmentsFile *fsf)
         sis->store = store;
 
         sis->generation = fsf->generation;
-        sis->format = is_read_u32(is); /* do nothing. it's the first version */
+        sis->format = is_read_u32(is);
         sis->version = is_read_u64(is);
         sis->counter = is_read_u64(is);
         seg_cnt = is_read_vint(is);
@@ -1106,7 +1264,7 @@ static void sis_read_i(Store *store, FindSegmentsFile *fsf)
         sis->segs = ALLOC_N(SegmentInfo *, sis->capa);
 
         for (i = 0; i < seg_cnt; i++) {
-            sis_add_si(sis, si_read(store, is));
+            sis_add_si(sis, si_read(store, is, sis->format));
         }
         sis->fis = fis_read(is);
         success = true;
@@ -1973,7 +2131,6 @@ void fw_add_postings(FieldsWriter *fw,
     OutStream *fdt_out = fw->fdt_out;
     off_t fdt_start_pos = os_pos(fdt_out);
     PostingList *plist;
-    Posting *posting;
     Occurence *occ;
     FieldInfo *fi = fw->fis->fields[field_num];
     int store_positions = fi_store_positions(fi);
@@ -1984,7 +2141,6 @@ void fw_add_postings(FieldsWriter *fw,
     os_write_vint(fdt_out, posting_count);
     for (i = 0; i < posting_count; i++) {
         plist = plists[i];
-        posting = plist->last;
         delta_start = hlp_string_diff(last_term, plist->term);
         delta_length = plist->term_len - delta_start;
 
@@ -1994,13 +2150,13 @@ void fw_add_postings(FieldsWriter *fw,
         os_write_bytes(fdt_out,
                        (uchar *)(plist->term + delta_start),
                        delta_length);
-        os_write_vint(fdt_out, posting->freq);
+        os_write_vint(fdt_out, plist->freq);
         last_term = plist->term;
 
         if (store_positions) {
             /* use delta encoding for positions */
             int last_pos = 0;
-            for (occ = posting->first_occ; occ; occ = occ->next) {
+            for (occ = plist->first_occ; occ; occ = occ->next) {
                 os_write_vint(fdt_out, occ->pos - last_pos);
                 last_pos = occ->pos;
             }
@@ -2067,72 +2223,213 @@ static char *te_skip_to(TermEnum *te, const char *term)
 
 static void sti_destroy(SegmentTermIndex *sti)
 {
-    if (sti->index_terms) {
-        int i;
-        const int sti_index_cnt = sti->index_cnt;
-        for (i = 0; i < sti_index_cnt; i++) {
-            free(sti->index_terms[i]);
-        }
-        free(sti->index_terms);
-        free(sti->index_term_lens);
-        free(sti->index_term_infos);
-        free(sti->index_ptrs);
+    if (sti->index_fst) {
+        fst_destroy(sti->index_fst);
     }
+    free(sti->index_entries_buf);
+    free(sti->bloom_buf);
     free(sti);
 }
 
-static void sti_ensure_index_is_read(SegmentTermIndex *sti,
-                                     TermEnum *index_te)
+static int tix_int_width(off_t val)
 {
-    if (NULL == sti->index_terms) {
-        int i;
-        int index_cnt = sti->index_cnt;
-        off_t index_ptr = 0;
-        ste_reset(index_te);
-        is_seek(STE(index_te)->is, sti->index_ptr);
-        STE(index_te)->size = sti->index_cnt;
-
-        sti->index_terms = ALLOC_N(char *, index_cnt);
-        sti->index_term_lens = ALLOC_N(int, index_cnt);
-        sti->index_term_infos = ALLOC_N(TermInfo, index_cnt);
-        sti->index_ptrs = ALLOC_N(off_t, index_cnt);
-
-        for (i = 0; NULL != ste_next(index_te); i++) {
-#ifdef DEBUG
-            if (i >= index_cnt) {
-                RAISE(FERRET_ERROR, "index term enum read too many terms");
-            }
-#endif
-            sti->index_terms[i] = te_get_term(index_te);
-            sti->index_term_lens[i] = index_te->curr_term_len;
-            sti->index_term_infos[i] = index_te->curr_ti;
-            index_ptr += is_read_voff_t(STE(index_te)->is);
-            sti->index_ptrs[i] = index_ptr;
+    int width = 1;
+    while (val >>= 8) {
+        width++;
+    }
+    return width;
+}
+
+/* Pack +cnt+ index entries of TIX_ENTRY_COLS values each. Every column gets
+ * the width of its largest value so that entries can be found by ordinal */
+static uchar *tix_pack_entries(const off_t *vals, int cnt, uchar *widths,
+                               int *entry_len)
+{
+    uchar *buf, *p;
+    int i, col;
+    for (col = 0; col < TIX_ENTRY_COLS; col++) {
+        widths[col] = 1;
+    }
+    for (i = 0; i < cnt * TIX_ENTRY_COLS; i++) {
+        col = i % TIX_ENTRY_COLS;
+        widths[col] = MAX(widths[col], tix_int_width(vals[i]));
+    }
+    *entry_len = 0;
+    for (col = 0; col < TIX_ENTRY_COLS; col++) {
+        *entry_len += widths[col];
+    }
+    p = buf = ALLOC_N(uchar, cnt * *entry_len + 1);
+    for (i = 0; i < cnt * TIX_ENTRY_COLS; i++) {
+        off_t val = vals[i];
+        int width = widths[i % TIX_ENTRY_COLS];
+        for (; width > 0; width--) {
+            *p++ = (uchar)val;
+            val >>= 8;
+        }
+    }
+    return buf;
+}
+
+static void sti_get_entry(SegmentTermIndex *sti, int idx, off_t *tis_ptr,
+                          TermInfo *ti)
+{
+    off_t vals[TIX_ENTRY_COLS];
+    const uchar *p = sti->index_entries + idx * sti->index_entry_len;
+    int col;
+    for (col = 0; col < TIX_ENTRY_COLS; col++) {
+        int width = sti->index_widths[col];
+        off_t val = 0;
+        while (width-- > 0) {
+            val = (val << 8) | p[width];
         }
+        p += sti->index_widths[col];
+        vals[col] = val;
     }
+    *tis_ptr = vals[0];
+    ti->doc_freq = (int)vals[1];
+    ti->frq_ptr = vals[2];
+    ti->prx_ptr = vals[3];
+    ti->skip_offset = vals[4];
 }
 
-static int sti_get_index_offset(SegmentTermIndex *sti, const char *term)
+/* Index terms written before the FST term index are read from the old
+ * prefix coded .tix and converted to the same in-memory form */
+static void sti_convert_index(SegmentTermIndex *sti, SegmentFieldIndex *sfi)
 {
-    int lo = 0;
-    int hi = sti->index_cnt - 1;
-    int mid, delta;
-    char **index_terms = sti->index_terms;
+    const int index_cnt = sti->index_cnt;
+    off_t *vals = ALLOC_N(off_t, index_cnt * TIX_ENTRY_COLS + 1);
+    off_t *v = vals;
+    off_t index_ptr = 0;
+    FstBuilder *b = fstb_new();
+    TermEnum *index_te = ste_new(is_clone(sfi->index_in), sfi);
+    int i;
 
-    while (hi >= lo) {
-        mid = (lo + hi) >> 1;
-        delta = strcmp(term, index_terms[mid]);
-        if (delta < 0) {
-            hi = mid - 1;
+    is_seek(STE(index_te)->is, sti->index_ptr);
+    STE(index_te)->size = index_cnt;
+    for (i = 0; NULL != ste_next(index_te); i++) {
+        TermInfo *ti = &index_te->curr_ti;
+        if (i > 0) {
+            fstb_add(b, index_te->curr_term, index_te->curr_term_len);
         }
-        else if (delta > 0) {
-            lo = mid + 1;
+        index_ptr += is_read_voff_t(STE(index_te)->is);
+        *v++ = index_ptr;
+        *v++ = ti->doc_freq;
+        *v++ = ti->frq_ptr;
+        *v++ = ti->prx_ptr;
+        *v++ = ti->doc_freq >= sfi->skip_interval ? ti->skip_offset : 0;
+    }
+    ste_close(index_te);
+
+    sti->index_fst = fstb_finish(b);
+    fstb_destroy(b);
+    sti->index_entries_buf = tix_pack_entries(vals, index_cnt,
+                                              sti->index_widths,
+                                              &sti->index_entry_len);
+    sti->index_entries = sti->index_entries_buf;
+    free(vals);
+}
+
+static void sti_ensure_index_is_read(SegmentTermIndex *sti,
+                                     SegmentFieldIndex *sfi)
+{
+    if (NULL == sti->index_fst) {
+        InStream *is = sfi->index_in;
+        int col, len;
+        if (!sfi->has_fst_index) {
+            sti_convert_index(sti, sfi);
+            return;
+        }
+        is_seek(is, sti->index_ptr);
+        if (sfi->has_bloom_filters) {
+            int bloom_len = is_read_vint(is);
+            if (bloom_len > 0) {
+                is_seek(is, is_pos(is) + 1 + bloom_len);
+            }
+        }
+        sti->index_fst = fst_read(is);
+        sti->index_entry_len = 0;
+        for (col = 0; col < TIX_ENTRY_COLS; col++) {
+            sti->index_widths[col] = is_read_byte(is);
+            sti->index_entry_len += sti->index_widths[col];
+        }
+        len = sti->index_cnt * sti->index_entry_len;
+        if (is_mapped(is) && is->buf.pos + len <= is->buf.len) {
+            sti->index_entries = is->data + is->buf.pos;
         }
         else {
-            return mid;
+            sti->index_entries_buf = ALLOC_N(uchar, len + 1);
+            is_read_bytes(is, sti->index_entries_buf, len);
+            sti->index_entries = sti->index_entries_buf;
         }
     }
-    return hi;
+}
+
+/* 64-bit FNV-1a. It is written to disk as part of the Bloom filters so it
+ * mustn't depend on the platform */
+static u64 bloom_hash(const char *term, int term_len)
+{
+    u64 hash = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = 0; i < term_len; i++) {
+        hash ^= (uchar)term[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* The bits for the i-th hash are derived from the two halves of +hash+ */
+#define BLOOM_BIT(hash, i, bit_cnt) \
+    (((hash) + (i) * (((hash) >> 32) | 1)) % (bit_cnt))
+
+static void sti_ensure_bloom_is_read(SegmentTermIndex *sti,
+                                     SegmentFieldIndex *sfi)
+{
+    if (!sti->bloom_is_read) {
+        InStream *is = sfi->index_in;
+        if (sfi->has_bloom_filters) {
+            is_seek(is, sti->index_ptr);
+            sti->bloom_len = is_read_vint(is);
+            if (sti->bloom_len > 0) {
+                sti->bloom_hash_cnt = is_read_byte(is);
+                if (is_mapped(is)
+                    && is->buf.pos + sti->bloom_len <= is->buf.len) {
+                    sti->bloom = is->data + is->buf.pos;
+                }
+                else {
+                    sti->bloom_buf = ALLOC_N(uchar, sti->bloom_len);
+                    is_read_bytes(is, sti->bloom_buf, sti->bloom_len);
+                    sti->bloom = sti->bloom_buf;
+                }
+            }
+        }
+        sti->bloom_is_read = true;
+    }
+}
+
+/* Returns false if +term+ is definitely not in the field. Fields without a
+ * Bloom filter may contain any term */
+static bool sti_may_contain(SegmentTermIndex *sti, SegmentFieldIndex *sfi,
+                            const char *term)
+{
+    u64 hash, bit_cnt;
+    int i;
+    if (!sti->bloom_is_read) {
+        mutex_lock(&sfi->mutex);
+        sti_ensure_bloom_is_read(sti, sfi);
+        mutex_unlock(&sfi->mutex);
+    }
+    if (NULL == sti->bloom) {
+        return true;
+    }
+    hash = bloom_hash(term, (int)strlen(term));
+    bit_cnt = (u64)sti->bloom_len << 3;
+    for (i = 0; i < sti->bloom_hash_cnt; i++) {
+        u64 bit = BLOOM_BIT(hash, (u64)i, bit_cnt);
+        if (0 == (sti->bloom[bit >> 3] & (1 << (bit & 7)))) {
+            return false;
+        }
+    }
+    return true;
 }
 
 /****************************************************************************
@@ -2140,9 +2437,9 @@ static int sti_get_index_offset(SegmentTermIndex *sti, const char *term)
  ****************************************************************************/
 
 #define SFI_ENSURE_INDEX_IS_READ(sfi, sti) do {\
-    if (NULL == sti->index_terms) {\
+    if (NULL == sti->index_fst) {\
         mutex_lock(&sfi->mutex);\
-        sti_ensure_index_is_read(sti, sfi->index_te);\
+        sti_ensure_index_is_read(sti, sfi);\
         mutex_unlock(&sfi->mutex);\
     }\
 } while (0)
@@ -2158,7 +2455,39 @@ SegmentFieldIndex *sfi_open(Store *store, const char *segment)
 
     sprintf(file_name, "%s.tfx", segment);
     is = store->open_input(store, file_name);
-    field_count = (int)is_read_u32(is);
+    field_count = (int)is_read_i32(is);
+    if (field_count < 0) {
+        /* multi-level skip lists. Older files have a single level */
+        int format = field_count;
+        field_count = (int)is_read_u32(is);
+        sfi->skip_multiplier = is_read_vint(is);
+        sfi->max_skip_levels = is_read_vint(is);
+        sfi->postings_format = POSTINGS_VINT;
+        if (format <= TFX_FORMAT_POSTINGS_FORMAT) {
+            sfi->postings_format = (PostingsFormat)is_read_vint(is);
+        }
+        sfi->has_impacts = (format <= TFX_FORMAT_IMPACTS);
+        sfi->has_fst_index = (format <= TFX_FORMAT_FST_INDEX);
+        sfi->has_bloom_filters = (format <= TFX_FORMAT_BLOOM_FILTERS);
+        if (format < TFX_FORMAT_BLOOM_FILTERS
+            || sfi->max_skip_levels > MAX_SKIP_LEVELS
+            || sfi->postings_format > POSTINGS_BLOCK) {
+            int max_skip_levels = sfi->max_skip_levels;
+            is_close(is);
+            mutex_destroy(&sfi->mutex);
+            free(sfi);
+            RAISE(IO_ERROR, "unsupported term index format %d (%d skip "
+                  "levels) in segment %s", format, max_skip_levels, segment);
+        }
+    }
+    else {
+        sfi->skip_multiplier = SKIP_MULTIPLIER;
+        sfi->max_skip_levels = 1;
+        sfi->postings_format = POSTINGS_VINT;
+        sfi->has_impacts = false;
+        sfi->has_fst_index = false;
+        sfi->has_bloom_filters = false;
+    }
     sfi->index_interval = is_read_vint(is);
     sfi->skip_interval = is_read_vint(is);
 
@@ -2176,16 +2505,15 @@ SegmentFieldIndex *sfi_open(Store *store, const char *segment)
     is_close(is);
 
     sprintf(file_name, "%s.tix", segment);
-    is = store->open_input(store, file_name);
-    sfi->index_te = ste_new(is, sfi);
+    sfi->index_in = store->open_input(store, file_name);
     return sfi;
 }
 
 void sfi_close(SegmentFieldIndex *sfi)
 {
     mutex_destroy(&sfi->mutex);
-    ste_close(sfi->index_te);
     h_destroy(sfi->field_dict);
+    is_close(sfi->index_in);
     free(sfi);
 }
 
@@ -2253,16 +2581,17 @@ static TermEnum *ste_set_field(TermEnum *te, int field_num)
     return te;
 }
 
-static void ste_index_seek(TermEnum *te, SegmentTermIndex *sti, int idx_offset)
+/* seek to index entry +idx+ whose term, +key_len+ bytes long, has already
+ * been copied to te->curr_term */
+static void ste_index_seek(TermEnum *te, SegmentTermIndex *sti, int idx,
+                           int key_len)
 {
-    int term_len = sti->index_term_lens[idx_offset];
-    is_seek(STE(te)->is, sti->index_ptrs[idx_offset]);
-    STE(te)->pos = STE(te)->sfi->index_interval * idx_offset - 1;
-    memcpy(te->curr_term,
-           sti->index_terms[idx_offset],
-           term_len + 1);
-    te->curr_term_len = term_len;
-    te->curr_ti = sti->index_term_infos[idx_offset];
+    off_t tis_ptr;
+    sti_get_entry(sti, idx, &tis_ptr, &te->curr_ti);
+    is_seek(STE(te)->is, tis_ptr);
+    STE(te)->pos = STE(te)->sfi->index_interval * idx - 1;
+    te->curr_term[key_len] = '\0';
+    te->curr_term_len = key_len;
 }
 
 static char *ste_scan_to(TermEnum *te, const char *term)
@@ -2271,22 +2600,26 @@ static char *ste_scan_to(TermEnum *te, const char *term)
     SegmentTermIndex *sti
         = (SegmentTermIndex *)h_get_int(sfi->field_dict, te->field_num);
     if (sti && sti->size > 0) {
+        char key[FST_MAX_KEY_LEN + 1];
+        int key_len = 0, idx;
         SFI_ENSURE_INDEX_IS_READ(sfi, sti);
         if (term[0] == '\0') {
-            ste_index_seek(te, sti, 0);
+            ste_index_seek(te, sti, 0, 0);
             return ste_next(te);;
         }
+        /* the first index entry, "", isn't in the FST */
+        idx = fst_floor(sti->index_fst, term, (int)strlen(term), key,
+                        &key_len) + 1;
         /* if current term is less than seek term */
         if (STE(te)->pos < STE(te)->size && strcmp(te->curr_term, term) <= 0) {
-            int enum_offset = (int)(STE(te)->pos / sfi->index_interval) + 1;
-            /* if we are at the end of the index or before the next index
-             * ptr then a simple scan suffices */
-            if (sti->index_cnt == enum_offset ||
-                strcmp(term, sti->index_terms[enum_offset]) < 0) {
+            /* if the closest index term isn't ahead of us then a simple
+             * scan suffices */
+            if (idx <= (int)(STE(te)->pos / sfi->index_interval)) {
                 return te_skip_to(te, term);
             }
         }
-        ste_index_seek(te, sti, sti_get_index_offset(sti, term));
+        memcpy(te->curr_term, key, key_len);
+        ste_index_seek(te, sti, idx, key_len);
         return te_skip_to(te, term);
     }
     else {
@@ -2345,8 +2678,12 @@ static char *ste_get_term(TermEnum *te, int pos)
         if ((pos < ste->pos) || pos > (1 + ste->pos / idx_int) * idx_int) {
             SegmentTermIndex *sti = (SegmentTermIndex *)h_get_int(
                 ste->sfi->field_dict, te->field_num);
+            int idx = pos / idx_int, key_len = 0;
             SFI_ENSURE_INDEX_IS_READ(ste->sfi, sti);
-            ste_index_seek(te, sti, pos / idx_int);
+            if (idx > 0) {
+                key_len = fst_get_key(sti->index_fst, idx - 1, te->curr_term);
+            }
+            ste_index_seek(te, sti, idx, key_len);
         }
         while (ste->pos < pos) {
             if (NULL == ste_next(te)) {
@@ -2651,12 +2988,23 @@ TermInfosReader *tir_set_field(TermInfosReader *tir, int field_num)
     return tir;
 }
 
+/* consult the field's Bloom filter, if it has one, before scanning for a
+ * term which may not be there */
+static INLINE bool ste_may_contain(TermEnum *te, const char *term)
+{
+    SegmentFieldIndex *sfi = STE(te)->sfi;
+    SegmentTermIndex *sti
+        = (SegmentTermIndex *)h_get_int(sfi->field_dict, te->field_num);
+    return NULL != sti && sti_may_contain(sti, sfi, term);
+}
+
 TermInfo *tir_get_ti(TermInfosReader *tir, const char *term)
 {
     TermEnum *te = tir_enum(tir);
     char *match;
 
-    if (NULL != (match = ste_scan_to(te, term))
+    if (ste_may_contain(te, term)
+        && NULL != (match = ste_scan_to(te, term))
         && 0 == strcmp(match, term)) {
         return &(te->curr_ti);
     }
@@ -2674,7 +3022,8 @@ static TermInfo *tir_get_ti_field(TermInfosReader *tir, int field_num,
         tir->field_num = field_num;
     }
 
-    if (NULL != (match = ste_scan_to(te, term))
+    if (ste_may_contain(te, term)
+        && NULL != (match = ste_scan_to(te, term))
         && 0 == strcmp(match, term)) {
         return &(te->curr_ti);
     }
@@ -2726,7 +3075,8 @@ static void tw_close(TermWriter *tw)
 TermInfosWriter *tiw_open(Store *store,
                           const char *segment,
                           int index_interval,
-                          int skip_interval)
+                          int skip_interval,
+                          PostingsFormat postings_format)
 {
     char file_name[SEGMENT_NAME_MAX_LENGTH];
     TermInfosWriter *tiw = ALLOC(TermInfosWriter);
@@ -2737,20 +3087,31 @@ TermInfosWriter *tiw_open(Store *store,
     tiw->field_count = 0;
     tiw->index_interval = index_interval;
     tiw->skip_interval = skip_interval;
-    tiw->last_index_ptr = 0;
+    tiw->postings_format = postings_format;
+    tiw->index_capa = 16;
+    tiw->index_entries = ALLOC_N(off_t, tiw->index_capa * TIX_ENTRY_COLS);
+    tiw->index_fst = fstb_new();
+    tiw->with_bloom = false;
+    tiw->bloom_cnt = 0;
+    tiw->bloom_capa = 0;
+    tiw->bloom_hashes = NULL;
 
     strcpy(file_name + segment_len, ".tix");
-    tiw->tix_writer = tw_new(store, file_name);
+    tiw->tix_out = store->new_output(store, file_name);
     strcpy(file_name + segment_len, ".tis");
     tiw->tis_writer = tw_new(store, file_name);
     strcpy(file_name + segment_len, ".tfx");
     tiw->tfx_out = store->new_output(store, file_name);
+    os_write_i32(tiw->tfx_out, TFX_FORMAT_BLOOM_FILTERS);
     os_write_u32(tiw->tfx_out, 0); /* make space for field_count */
+    os_write_vint(tiw->tfx_out, SKIP_MULTIPLIER);
+    os_write_vint(tiw->tfx_out, MAX_SKIP_LEVELS);
+    os_write_vint(tiw->tfx_out, postings_format);
 
     /* The following two numbers are the first numbers written to the field
      * index when tiw_start_field is called. But they'll be zero to start with
      * so we'll write index interval and skip interval instead. */
-    tiw->tix_writer->counter = tiw->index_interval;
+    tiw->index_cnt = tiw->index_interval;
     tiw->tis_writer->counter = tiw->skip_interval;
 
     return tiw;
@@ -2811,22 +3172,39 @@ void tiw_add(TermInfosWriter *tiw,
              int term_len,
              TermInfo *ti)
 {
-    off_t tis_pos;
-
     /*
     printf("%s:%d:%d:%d:%d\n", term, term_len, ti->doc_freq,
            ti->frq_ptr, ti->prx_ptr);
     */
     if (0 == (tiw->tis_writer->counter % tiw->index_interval)) {
-        /* add an index term */
-        tw_add(tiw->tix_writer,
-               tiw->tis_writer->last_term,
-               strlen(tiw->tis_writer->last_term),
-               &(tiw->tis_writer->last_term_info),
-               tiw->skip_interval);
-        tis_pos = os_pos(tiw->tis_writer->os);
-        os_write_voff_t(tiw->tix_writer->os, tis_pos - tiw->last_index_ptr);
-        tiw->last_index_ptr = tis_pos;  /* write ptr */
+        /* add an index term. The first one is always "" so it is left out
+         * of the FST */
+        TermInfo *last_ti = &(tiw->tis_writer->last_term_info);
+        off_t *entry;
+        if (tiw->index_cnt > 0) {
+            fstb_add(tiw->index_fst, tiw->tis_writer->last_term,
+                     (int)strlen(tiw->tis_writer->last_term));
+        }
+        if (tiw->index_cnt == tiw->index_capa) {
+            tiw->index_capa <<= 1;
+            REALLOC_N(tiw->index_entries, off_t,
+                      tiw->index_capa * TIX_ENTRY_COLS);
+        }
+        entry = tiw->index_entries + tiw->index_cnt * TIX_ENTRY_COLS;
+        entry[0] = os_pos(tiw->tis_writer->os);
+        entry[1] = last_ti->doc_freq;
+        entry[2] = last_ti->frq_ptr;
+        entry[3] = last_ti->prx_ptr;
+        entry[4] = last_ti->doc_freq >= tiw->skip_interval
+                 ? last_ti->skip_offset : 0;
+        tiw->index_cnt++;
+    }
+    if (tiw->with_bloom) {
+        if (tiw->bloom_cnt == tiw->bloom_capa) {
+            tiw->bloom_capa = tiw->bloom_capa ? tiw->bloom_capa << 1 : 64;
+            REALLOC_N(tiw->bloom_hashes, u64, tiw->bloom_capa);
+        }
+        tiw->bloom_hashes[tiw->bloom_cnt++] = bloom_hash(term, term_len);
     }
 
     tw_add(tiw->tis_writer, term, term_len, ti, tiw->skip_interval);
@@ -2839,219 +3217,763 @@ static INLINE void tw_reset(TermWriter *tw)
     ZEROSET(&(tw->last_term_info), TermInfo);
 }
 
-void tiw_start_field(TermInfosWriter *tiw, int field_num)
+/* write the Bloom filter of the field just finished, if it needs one. A
+ * zero length means there isn't one */
+static void tiw_write_bloom(TermInfosWriter *tiw)
+{
+    const int bloom_cnt = tiw->bloom_cnt;
+    int len, i, j;
+    u64 bit_cnt;
+    uchar *bloom;
+
+    if (!tiw->with_bloom || 0 == bloom_cnt) {
+        os_write_vint(tiw->tix_out, 0);
+        return;
+    }
+    len = (MAX(64, bloom_cnt * BLOOM_BITS_PER_TERM) + 7) >> 3;
+    bit_cnt = (u64)len << 3;
+    bloom = ALLOC_AND_ZERO_N(uchar, len);
+    for (i = 0; i < bloom_cnt; i++) {
+        const u64 hash = tiw->bloom_hashes[i];
+        for (j = 0; j < BLOOM_HASH_CNT; j++) {
+            u64 bit = BLOOM_BIT(hash, (u64)j, bit_cnt);
+            bloom[bit >> 3] |= (uchar)(1 << (bit & 7));
+        }
+    }
+    os_write_vint(tiw->tix_out, len);
+    os_write_byte(tiw->tix_out, BLOOM_HASH_CNT);
+    os_write_bytes(tiw->tix_out, bloom, len);
+    free(bloom);
+}
+
+/* write the index of the field just finished to the .tix file */
+static void tiw_write_index(TermInfosWriter *tiw)
+{
+    uchar widths[TIX_ENTRY_COLS];
+    uchar *entries;
+    int entry_len;
+    Fst *fst = fstb_finish(tiw->index_fst);
+
+    tiw_write_bloom(tiw);
+    fst_write(fst, tiw->tix_out);
+    fst_destroy(fst);
+    entries = tix_pack_entries(tiw->index_entries, tiw->index_cnt, widths,
+                               &entry_len);
+    os_write_bytes(tiw->tix_out, widths, TIX_ENTRY_COLS);
+    os_write_bytes(tiw->tix_out, entries, tiw->index_cnt * entry_len);
+    free(entries);
+}
+
+void tiw_start_field(TermInfosWriter *tiw, int field_num, bool with_bloom)
 {
     OutStream *tfx_out = tiw->tfx_out;
-    os_write_vint(tfx_out, tiw->tix_writer->counter);    /* write tix size */
+    if (tiw->field_count > 0) {
+        tiw_write_index(tiw);
+    }
+    os_write_vint(tfx_out, tiw->index_cnt);              /* write tix size */
     os_write_vint(tfx_out, tiw->tis_writer->counter);    /* write tis size */
     os_write_vint(tfx_out, field_num);
-    os_write_voff_t(tfx_out, os_pos(tiw->tix_writer->os)); /* write tix ptr */
+    os_write_voff_t(tfx_out, os_pos(tiw->tix_out));      /* write tix ptr */
     os_write_voff_t(tfx_out, os_pos(tiw->tis_writer->os)); /* write tis ptr */
-    tw_reset(tiw->tix_writer);
+    tiw->index_cnt = 0;
+    tiw->with_bloom = with_bloom;
+    tiw->bloom_cnt = 0;
     tw_reset(tiw->tis_writer);
-    tiw->last_index_ptr = 0;
     tiw->field_count++;
 }
 
 void tiw_close(TermInfosWriter *tiw)
 {
     OutStream *tfx_out = tiw->tfx_out;
-    os_write_vint(tfx_out, tiw->tix_writer->counter);
+    if (tiw->field_count > 0) {
+        tiw_write_index(tiw);
+    }
+    os_write_vint(tfx_out, tiw->index_cnt);
     os_write_vint(tfx_out, tiw->tis_writer->counter);
-    os_seek(tfx_out, 0);
+    os_seek(tfx_out, 4); /* skip format */
     os_write_u32(tfx_out, tiw->field_count);
     os_close(tfx_out);
 
-    tw_close(tiw->tix_writer);
+    os_close(tiw->tix_out);
     tw_close(tiw->tis_writer);
+    fstb_destroy(tiw->index_fst);
+    free(tiw->index_entries);
+    free(tiw->bloom_hashes);
 
     free(tiw);
 }
 
 /****************************************************************************
  *
- * TermDocEnum
+ * DocValues
  *
  ****************************************************************************/
 
-/****************************************************************************
- * SegmentTermDocEnum
- ****************************************************************************/
+/* The .dvs file starts with a pointer to its directory of fields. Each
+ * field's values are prefix coded in sorted order like the terms in the .tis
+ * file. They are followed by the width of the ordinals in bytes and the
+ * ordinal of every document's value, least significant byte first. */
+typedef struct DocValuesFieldEntry {
+    int field_num;
+    int value_cnt;
+    off_t values_ptr;
+    off_t ords_ptr;
+} DocValuesFieldEntry;
 
-#define STDE(tde) ((SegmentTermDocEnum *)(tde))
-#define TDE(stde) ((TermDocEnum *)(stde))
+static DocValuesFieldEntry *dvs_read_directory(InStream *is, int *entry_cnt)
+{
+    int i;
+    DocValuesFieldEntry *entries;
 
-#define CHECK_STATE(method) do {\
-    if (0 == STDE(tde)->count) {\
-        RAISE(STATE_ERROR, "Illegal state of TermDocEnum. You must call #next "\
-              "before you call #"method);\
-    }\
-} while (0)
+    is_seek(is, (off_t)is_read_u64(is));
+    *entry_cnt = is_read_vint(is);
+    entries = ALLOC_N(DocValuesFieldEntry, *entry_cnt + 1);
+    for (i = 0; i < *entry_cnt; i++) {
+        entries[i].field_num = is_read_vint(is);
+        entries[i].value_cnt = is_read_vint(is);
+        entries[i].values_ptr = is_read_voff_t(is);
+        entries[i].ords_ptr = is_read_voff_t(is);
+    }
+    return entries;
+}
 
-static void stde_seek_ti(SegmentTermDocEnum *stde, TermInfo *ti)
+static void dvs_write_directory(OutStream *os, DocValuesFieldEntry *entries,
+                                int entry_cnt, int *field_map)
 {
-    if (NULL == ti) {
-        stde->doc_freq = 0;
-    }
-    else {
-        stde->count = 0;
-        stde->doc_freq = ti->doc_freq;
-        stde->doc_num = 0;
-        stde->skip_doc = 0;
-        stde->skip_count = 0;
-        stde->num_skips = stde->doc_freq / stde->skip_interval;
-        stde->frq_ptr = ti->frq_ptr;
-        stde->prx_ptr = ti->prx_ptr;
-        stde->skip_ptr = ti->frq_ptr + ti->skip_offset;
-        is_seek(stde->frq_in, ti->frq_ptr);
-        stde->have_skipped = false;
+    int i;
+    os_write_vint(os, entry_cnt);
+    for (i = 0; i < entry_cnt; i++) {
+        int field_num = entries[i].field_num;
+        os_write_vint(os, field_map ? field_map[field_num] : field_num);
+        os_write_vint(os, entries[i].value_cnt);
+        os_write_voff_t(os, entries[i].values_ptr);
+        os_write_voff_t(os, entries[i].ords_ptr);
     }
 }
 
-static void stde_seek(TermDocEnum *tde, int field_num, const char *term)
+static DocValues *dv_new(int size)
 {
-    TermInfo *ti = tir_get_ti_field(STDE(tde)->tir, field_num, term);
-    stde_seek_ti(STDE(tde), ti);
+    DocValues *dv = ALLOC_AND_ZERO(DocValues);
+    dv->size = size;
+    dv->mp = mp_new();
+    return dv;
 }
 
-static void stde_seek_te(TermDocEnum *tde, TermEnum *te)
+/* the doc values of a field which has no terms in a segment */
+static DocValues *dv_new_empty(int size)
 {
-#ifdef DEBUG
-    if (te->set_field != &ste_set_field) {
-        RAISE(ARG_ERROR, "Passed an incorrect TermEnum type");
-    }
-#endif
-    stde_seek_ti(STDE(tde), &(te->curr_ti));
+    DocValues *dv = dv_new(size);
+    dv->values = ALLOC_AND_ZERO_N(char *, 1);
+    dv->ord_width = 1;
+    dv->ords = dv->ords_buf = ALLOC_AND_ZERO_N(uchar, size + 1);
+    return dv;
 }
 
-static int stde_doc_num(TermDocEnum *tde)
+static DocValues *dv_read(InStream *is, DocValuesFieldEntry *entry,
+                          int doc_cnt)
 {
-    CHECK_STATE("doc_num");
-    return STDE(tde)->doc_num;
+    char buf[MAX_WORD_SIZE + 1];
+    int i, len;
+    DocValues *dv = dv_new(doc_cnt);
+
+    dv->value_cnt = entry->value_cnt;
+    dv->values = ALLOC_N(char *, dv->value_cnt + 1);
+    dv->values[0] = NULL;
+    is_seek(is, entry->values_ptr);
+    for (i = 1; i <= dv->value_cnt; i++) {
+        int start = is_read_vint(is);
+        len = is_read_vint(is);
+        if (start < 0 || len < 0 || start + len > MAX_WORD_SIZE) {
+            dv_destroy(dv);
+            RAISE(IO_ERROR, "corrupt doc value of length %d", start + len);
+        }
+        is_read_bytes(is, (uchar *)buf + start, len);
+        buf[start + len] = '\0';
+        dv->values[i] = (char *)mp_memdup(dv->mp, buf, start + len + 1);
+    }
+
+    dv->ord_width = is_read_byte(is);
+    len = doc_cnt * dv->ord_width;
+    if (is_mapped(is) && is->buf.pos + len <= is->buf.len) {
+        dv->ords = is->data + is->buf.pos;
+    }
+    else {
+        dv->ords_buf = ALLOC_N(uchar, len + 1);
+        is_read_bytes(is, dv->ords_buf, len);
+        dv->ords = dv->ords_buf;
+    }
+    return dv;
 }
 
-static int stde_freq(TermDocEnum *tde)
+int dv_get_ord(DocValues *dv, int doc_num)
 {
-    CHECK_STATE("freq");
-    return STDE(tde)->freq;
+    const uchar *p = dv->ords + doc_num * dv->ord_width;
+    int width = dv->ord_width;
+    int ord = 0;
+    while (width-- > 0) {
+        ord = (ord << 8) | p[width];
+    }
+    return ord;
 }
 
-static bool stde_next(TermDocEnum *tde)
+void dv_destroy(DocValues *dv)
 {
-    int doc_code;
-    SegmentTermDocEnum *stde = STDE(tde);
+    mp_destroy(dv->mp);
+    free(dv->values);
+    free(dv->ords_buf);
+    free(dv);
+}
 
-    while (true) {
-        if (stde->count >= stde->doc_freq) {
-            return false;
-        }
+/****************************************************************************
+ *
+ * DocValuesWriter
+ *
+ ****************************************************************************/
 
-        doc_code = is_read_vint(stde->frq_in);
-        stde->doc_num += doc_code >> 1;    /* shift off low bit */
-        if (0 != (doc_code & 1)) {         /* if low bit is set */
-            stde->freq = 1;                /* freq is one */
-        }
-        else {
-            stde->freq = (int)is_read_vint(stde->frq_in); /* read freq */
-        }
+#define DVW_ENTRIES_INIT_CAPA 8
 
-        stde->count++;
+typedef struct DocValuesWriter {
+    OutStream *os;
+    int doc_cnt;
+    int *ords;          /* ordinal of each document's value in this field */
+    int value_cnt;
+    char last_value[MAX_WORD_SIZE + 1];
+    DocValuesFieldEntry *entries;
+    int entry_cnt;
+    int entry_capa;
+} DocValuesWriter;
 
-        if (NULL == stde->deleted_docs
-            || 0 == bv_get(stde->deleted_docs, stde->doc_num)) {
-            break; /* We found an undeleted doc so return */
-        }
+static DocValuesWriter *dvw_open(Store *store, const char *segment,
+                                 int doc_cnt)
+{
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    DocValuesWriter *dvw = ALLOC_AND_ZERO(DocValuesWriter);
 
-        stde->skip_prox(stde);
+    sprintf(file_name, "%s.dvs", segment);
+    dvw->os = store->new_output(store, file_name);
+    os_write_u64(dvw->os, 0); /* the directory pointer is written on close */
+    dvw->doc_cnt = doc_cnt;
+    dvw->ords = ALLOC_N(int, doc_cnt + 1);
+    dvw->entry_capa = DVW_ENTRIES_INIT_CAPA;
+    dvw->entries = ALLOC_N(DocValuesFieldEntry, dvw->entry_capa);
+    return dvw;
+}
+
+static void dvw_start_field(DocValuesWriter *dvw, int field_num)
+{
+    DocValuesFieldEntry *entry;
+    if (dvw->entry_cnt >= dvw->entry_capa) {
+        dvw->entry_capa <<= 1;
+        REALLOC_N(dvw->entries, DocValuesFieldEntry, dvw->entry_capa);
     }
-    return true;
+    entry = &dvw->entries[dvw->entry_cnt++];
+    entry->field_num = field_num;
+    entry->values_ptr = os_pos(dvw->os);
+    dvw->value_cnt = 0;
+    dvw->last_value[0] = '\0';
+    memset(dvw->ords, 0, dvw->doc_cnt * sizeof(int));
 }
 
-static int stde_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
+/* Values must be added in sorted order. Returns the ordinal of +value+ */
+static int dvw_add_value(DocValuesWriter *dvw, const char *value, int len)
 {
-    SegmentTermDocEnum *stde = STDE(tde);
-    int i = 0;
-    int doc_code;
+    OutStream *os = dvw->os;
+    int start = hlp_string_diff(dvw->last_value, value);
 
-    while (i < req_num && stde->count < stde->doc_freq) {
-        /* manually inlined call to next() for speed */
-        doc_code = is_read_vint(stde->frq_in);
-        stde->doc_num += (doc_code >> 1);            /* shift off low bit */
-        if (0 != (doc_code & 1)) {                   /* if low bit is set */
-            stde->freq = 1;                            /* freq is one */
-        }
-        else {
-            stde->freq = is_read_vint(stde->frq_in);  /* else read freq */
-        }
+    os_write_vint(os, start);
+    os_write_vint(os, len - start);
+    os_write_bytes(os, (uchar *)(value + start), len - start);
+    memcpy(dvw->last_value, value, len + 1);
+    return ++dvw->value_cnt;
+}
 
-        stde->count++;
+static void dvw_finish_field(DocValuesWriter *dvw)
+{
+    int i, j;
+    OutStream *os = dvw->os;
+    DocValuesFieldEntry *entry = &dvw->entries[dvw->entry_cnt - 1];
+    const int width = tix_int_width(dvw->value_cnt);
+    const int doc_cnt = dvw->doc_cnt;
 
-        if (NULL == stde->deleted_docs
-            || 0 == bv_get(stde->deleted_docs, stde->doc_num)) {
-            docs[i] = stde->doc_num;
-            freqs[i] = stde->freq;
-            i++;
+    entry->value_cnt = dvw->value_cnt;
+    entry->ords_ptr = os_pos(os);
+    os_write_byte(os, (uchar)width);
+    for (i = 0; i < doc_cnt; i++) {
+        int ord = dvw->ords[i];
+        for (j = 0; j < width; j++) {
+            os_write_byte(os, (uchar)ord);
+            ord >>= 8;
         }
     }
-    return i;
 }
 
-static bool stde_skip_to(TermDocEnum *tde, int target_doc_num)
+static void dvw_close(DocValuesWriter *dvw)
 {
-    SegmentTermDocEnum *stde = STDE(tde);
+    OutStream *os = dvw->os;
+    off_t dir_ptr = os_pos(os);
 
-    if (stde->doc_freq >= stde->skip_interval
-        && target_doc_num > stde->doc_num) {       /* optimized case */
-        int last_skip_doc;
-        off_t last_frq_ptr;
-        off_t last_prx_ptr;
-        int num_skipped;
+    dvs_write_directory(os, dvw->entries, dvw->entry_cnt, NULL);
+    os_seek(os, 0);
+    os_write_u64(os, (u64)dir_ptr);
+    os_close(os);
+    free(dvw->entries);
+    free(dvw->ords);
+    free(dvw);
+}
 
-        if (NULL == stde->skip_in) {
-            stde->skip_in = is_clone(stde->frq_in);/* lazily clone */
+/****************************************************************************
+ *
+ * Postings Blocks
+ *
+ ****************************************************************************/
+
+/* A block of POSTINGS_BLOCK_SIZE non-negative ints is stored as a byte
+ * holding the number of bits needed for the largest value followed by every
+ * value packed into that many bits, least significant bit first. Since the
+ * block size is a multiple of 8 the packed values always fill whole bytes. */
+
+#define POSTINGS_BLOCK_MAX_BYTES (POSTINGS_BLOCK_SIZE * 4)
+
+static void postings_block_write(OutStream *os, const int *values)
+{
+    uchar buf[POSTINGS_BLOCK_MAX_BYTES];
+    uchar *p = buf;
+    u32 all = 0;
+    u64 acc = 0;
+    int acc_bits = 0, bits = 0, i;
+
+    for (i = 0; i < POSTINGS_BLOCK_SIZE; i++) {
+        all |= (u32)values[i];
+    }
+    while (all) {
+        bits++;
+        all >>= 1;
+    }
+
+    os_write_byte(os, (uchar)bits);
+    if (0 == bits) {
+        return;
+    }
+    for (i = 0; i < POSTINGS_BLOCK_SIZE; i++) {
+        acc |= (u64)(u32)values[i] << acc_bits;
+        acc_bits += bits;
+        while (acc_bits >= 8) {
+            *p++ = (uchar)acc;
+            acc >>= 8;
+            acc_bits -= 8;
         }
+    }
+    os_write_bytes(os, buf, (int)(p - buf));
+}
 
-        //printf("skip_ptr = %lld\n", stde->skip_ptr);
-        if (!stde->have_skipped) {                 /* lazily seek skip stream */
-            is_seek(stde->skip_in, stde->skip_ptr);
-            stde->have_skipped = true;
+static INLINE void postings_block_unpack(const uchar *src, const int bits,
+                                         int *values, const int cnt)
+{
+    const u64 mask = ((u64)1 << bits) - 1;
+    u64 acc = 0;
+    int acc_bits = 0, i;
+
+    for (i = 0; i < cnt; i++) {
+        while (acc_bits < bits) {
+            acc |= (u64)*src++ << acc_bits;
+            acc_bits += 8;
         }
+        values[i] = (int)(acc & mask);
+        acc >>= bits;
+        acc_bits -= bits;
+    }
+}
 
-        /* scan skip data */
-        last_skip_doc = stde->skip_doc;
-        last_frq_ptr = is_pos(stde->frq_in);
-        last_prx_ptr = -1;
-        num_skipped = -1 - (stde->count % stde->skip_interval);
-        //printf("%d, %d, %d, %d\n", last_skip_doc, last_frq_ptr, last_prx_ptr, num_skipped);
+/* Specializing the unpacker on the bit width turns the inner loop into a
+ * fixed sequence of shifts and masks which the compiler can unroll and
+ * vectorize. */
+#define PB_UNPACK_CASE(n) case n:\
+    postings_block_unpack(src, n, values, POSTINGS_BLOCK_SIZE); break
 
-        while (target_doc_num > stde->skip_doc) {
-            last_skip_doc = stde->skip_doc;
-            last_frq_ptr = stde->frq_ptr;
-            last_prx_ptr = stde->prx_ptr;
+static void postings_block_unpack_any(const uchar *src, const int bits,
+                                      const int len, int *values)
+{
+    (void)len;
+    switch (bits) {
+        PB_UNPACK_CASE(1);  PB_UNPACK_CASE(2);  PB_UNPACK_CASE(3);
+        PB_UNPACK_CASE(4);  PB_UNPACK_CASE(5);  PB_UNPACK_CASE(6);
+        PB_UNPACK_CASE(7);  PB_UNPACK_CASE(8);  PB_UNPACK_CASE(9);
+        PB_UNPACK_CASE(10); PB_UNPACK_CASE(11); PB_UNPACK_CASE(12);
+        PB_UNPACK_CASE(13); PB_UNPACK_CASE(14); PB_UNPACK_CASE(15);
+        PB_UNPACK_CASE(16);
+        default:
+            postings_block_unpack(src, bits, values, POSTINGS_BLOCK_SIZE);
+            break;
+    }
+}
 
-            if (0 != stde->skip_doc && stde->skip_doc >= stde->doc_num) {
-                num_skipped += stde->skip_interval;
-            }
+#ifdef PB_X86_DISPATCH
+/* Every group of 8 values starts on a byte boundary, so each lane gathers
+ * the 4 bytes its value starts in and shifts it into place. A value of up to
+ * 25 bits always fits in those 4 bytes. The gather reads up to 3 bytes past
+ * a group so the groups at the end of the block are left to the scalar
+ * unpacker rather than read past +len+. */
+static __attribute__((target("avx2")))
+void postings_block_unpack_avx2(const uchar *src, const int bits,
+                                const int len, int *values)
+{
+    const __m256i bit_pos = _mm256_mullo_epi32(
+        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(bits));
+    const __m256i offsets = _mm256_srli_epi32(bit_pos, 3);
+    const __m256i shifts = _mm256_and_si256(bit_pos, _mm256_set1_epi32(7));
+    const __m256i mask = _mm256_set1_epi32((1 << bits) - 1);
+    const int group_end = ((7 * bits) >> 3) + 4;
+    int i = 0, start = 0;
 
-            if (stde->skip_count >= stde->num_skips) {
-                break;
+    if (bits > 25) {
+        postings_block_unpack_any(src, bits, len, values);
+        return;
+    }
+    for (; i < POSTINGS_BLOCK_SIZE && start + group_end <= len;
+         i += 8, start += bits) {
+        __m256i v = _mm256_i32gather_epi32((const int *)(src + start),
+                                           offsets, 1);
+        v = _mm256_and_si256(_mm256_srlv_epi32(v, shifts), mask);
+        _mm256_storeu_si256((__m256i *)(values + i), v);
+    }
+    postings_block_unpack(src + start, bits, values + i,
+                          POSTINGS_BLOCK_SIZE - i);
+}
+#endif
+
+/* The unpacker is picked at runtime so that the AVX2 version is only used on
+ * CPUs which support it. It is resolved when a block TermDocEnum is opened
+ * (see stde_new) so postings_block_read can call it directly. */
+static void (*pb_unpack)(const uchar *src, const int bits, const int len,
+                         int *values);
+static thread_once_t pb_unpack_once = THREAD_ONCE_INIT;
+
+static void pb_unpack_init()
+{
+    pb_unpack = &postings_block_unpack_any;
+#ifdef PB_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        pb_unpack = &postings_block_unpack_avx2;
+    }
+#endif
+}
+
+static void postings_block_read(InStream *is, int *values)
+{
+    uchar buf[POSTINGS_BLOCK_MAX_BYTES];
+    const uchar *src = buf;
+    const int bits = is_read_byte(is);
+    const int len = bits * (POSTINGS_BLOCK_SIZE / 8);
+
+    if (0 == bits) {
+        memset(values, 0, POSTINGS_BLOCK_SIZE * sizeof(int));
+        return;
+    }
+    if (bits > 32) {
+        RAISE(IO_ERROR, "corrupt postings block with %d bit values", bits);
+    }
+    if (is_mapped(is) && is->buf.pos + len <= is->buf.len) {
+        src = is->data + is->buf.pos;           /* read straight from the map */
+        is->buf.pos += len;
+    }
+    else {
+        is_read_bytes(is, buf, len);
+    }
+
+    pb_unpack(src, bits, len, values);
+}
+
+/****************************************************************************
+ *
+ * TermDocEnum
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * SegmentTermDocEnum
+ ****************************************************************************/
+
+#define STDE(tde) ((SegmentTermDocEnum *)(tde))
+#define TDE(stde) ((TermDocEnum *)(stde))
+
+#define CHECK_STATE(method) do {\
+    if (0 == STDE(tde)->count) {\
+        RAISE(STATE_ERROR, "Illegal state of TermDocEnum. You must call #next "\
+              "before you call #"method);\
+    }\
+} while (0)
+
+/* The number of skip levels a term with +doc_freq+ documents has. Both the
+ * SegmentTermDocEnum and the SkipBuffer use this so it must never change for
+ * a given file format. */
+static INLINE int skip_level_cnt(int doc_freq, int skip_interval,
+                                 int skip_multiplier, int max_skip_levels)
+{
+    int level_cnt = 1;
+    int skip_cnt = doc_freq / skip_interval;
+    while (level_cnt < max_skip_levels && (skip_cnt /= skip_multiplier) > 0) {
+        level_cnt++;
+    }
+    return level_cnt;
+}
+
+static void stde_seek_ti(SegmentTermDocEnum *stde, TermInfo *ti)
+{
+    if (NULL == ti) {
+        stde->doc_freq = 0;
+    }
+    else {
+        stde->count = 0;
+        stde->doc_freq = ti->doc_freq;
+        stde->doc_num = 0;
+        stde->frq_ptr = ti->frq_ptr;
+        stde->prx_ptr = ti->prx_ptr;
+        stde->skip_ptr = ti->frq_ptr + ti->skip_offset;
+        is_seek(stde->frq_in, ti->frq_ptr);
+        stde->have_skipped = false;
+        stde->block_pos = stde->block_len = 0;
+    }
+}
+
+static void stde_seek(TermDocEnum *tde, int field_num, const char *term)
+{
+    TermInfo *ti = tir_get_ti_field(STDE(tde)->tir, field_num, term);
+    stde_seek_ti(STDE(tde), ti);
+}
+
+static void stde_seek_te(TermDocEnum *tde, TermEnum *te)
+{
+#ifdef DEBUG
+    if (te->set_field != &ste_set_field) {
+        RAISE(ARG_ERROR, "Passed an incorrect TermEnum type");
+    }
+#endif
+    stde_seek_ti(STDE(tde), &(te->curr_ti));
+}
+
+static int stde_doc_num(TermDocEnum *tde)
+{
+    CHECK_STATE("doc_num");
+    return STDE(tde)->doc_num;
+}
+
+static int stde_freq(TermDocEnum *tde)
+{
+    CHECK_STATE("freq");
+    return STDE(tde)->freq;
+}
+
+static bool stde_next(TermDocEnum *tde)
+{
+    int doc_code;
+    SegmentTermDocEnum *stde = STDE(tde);
+
+    while (true) {
+        if (stde->count >= stde->doc_freq) {
+            return false;
+        }
+
+        doc_code = is_read_vint(stde->frq_in);
+        stde->doc_num += doc_code >> 1;    /* shift off low bit */
+        if (0 != (doc_code & 1)) {         /* if low bit is set */
+            stde->freq = 1;                /* freq is one */
+        }
+        else {
+            stde->freq = (int)is_read_vint(stde->frq_in); /* read freq */
+        }
+
+        stde->count++;
+
+        if (NULL == stde->deleted_docs
+            || 0 == bv_get(stde->deleted_docs, stde->doc_num)) {
+            break; /* We found an undeleted doc so return */
+        }
+
+        stde->skip_prox(stde);
+    }
+    return true;
+}
+
+static int stde_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
+{
+    SegmentTermDocEnum *stde = STDE(tde);
+    int i = 0;
+    int doc_code;
+
+    while (i < req_num && stde->count < stde->doc_freq) {
+        /* manually inlined call to next() for speed */
+        doc_code = is_read_vint(stde->frq_in);
+        stde->doc_num += (doc_code >> 1);            /* shift off low bit */
+        if (0 != (doc_code & 1)) {                   /* if low bit is set */
+            stde->freq = 1;                            /* freq is one */
+        }
+        else {
+            stde->freq = is_read_vint(stde->frq_in);  /* else read freq */
+        }
+
+        stde->count++;
+
+        if (NULL == stde->deleted_docs
+            || 0 == bv_get(stde->deleted_docs, stde->doc_num)) {
+            docs[i] = stde->doc_num;
+            freqs[i] = stde->freq;
+            i++;
+        }
+    }
+    return i;
+}
+
+/* Read the header of the current term's skip list, cloning a stream for each
+ * level. Levels are stored highest first, each preceded by its length except
+ * for level 0 which runs to the end of the skip data. The impacts of the
+ * term's tail come first. */
+static void stde_load_skip_levels(SegmentTermDocEnum *stde)
+{
+    int i;
+    InStream *is;
+    SkipLevel *sl = stde->skip_levels;
+
+    stde->num_skip_levels = skip_level_cnt(stde->doc_freq, stde->skip_interval,
+                                           stde->skip_multiplier,
+                                           stde->max_skip_levels);
+
+    for (i = 0; i < stde->num_skip_levels; i++) {
+        if (NULL == sl[i].in) {
+            sl[i].in = is_clone(stde->frq_in);  /* lazily clone */
+        }
+        sl[i].interval = i ? sl[i - 1].interval * stde->skip_multiplier
+                           : stde->skip_interval;
+        sl[i].doc = 0;
+        sl[i].skipped = 0;
+        sl[i].frq_ptr = stde->frq_ptr;
+        sl[i].prx_ptr = stde->prx_ptr;
+        sl[i].child_ptr = 0;
+    }
+
+    is = sl[0].in;
+    is_seek(is, stde->skip_ptr);
+    if (stde->has_impacts) {
+        stde->tail_max_freq = is_read_vint(is);
+        stde->tail_max_norm = is_read_byte(is);
+    }
+    for (i = stde->num_skip_levels - 1; i > 0; i--) {
+        off_t length = is_read_voff_t(is);
+        sl[i].ptr = is_pos(is);
+        is_seek(sl[i].in, sl[i].ptr);
+        is_seek(is, sl[i].ptr + length);
+    }
+    sl[0].ptr = is_pos(is);
+
+    stde->last_skip_doc = 0;
+    stde->last_frq_ptr = stde->frq_ptr;
+    stde->last_prx_ptr = stde->prx_ptr;
+    stde->last_child_ptr = 0;
+    stde->have_skipped = true;
+}
+
+static bool stde_load_next_skip(SegmentTermDocEnum *stde, int level)
+{
+    SkipLevel *sl = stde->skip_levels + level;
+
+    /* the entry we are about to pass is the one we may seek to */
+    stde->last_skip_doc = sl->doc;
+    stde->last_frq_ptr = sl->frq_ptr;
+    stde->last_prx_ptr = sl->prx_ptr;
+    stde->last_child_ptr = sl->child_ptr;
+
+    sl->skipped += sl->interval;
+    if (sl->skipped > stde->doc_freq) {
+        /* this level is exhausted */
+        sl->doc = INT_MAX;
+        if (stde->num_skip_levels > level) {
+            stde->num_skip_levels = level;
+        }
+        return false;
+    }
+
+    sl->doc     += is_read_vint(sl->in);
+    sl->frq_ptr += is_read_voff_t(sl->in);
+    sl->prx_ptr += is_read_voff_t(sl->in);
+    if (level > 0) {
+        sl->child_ptr = is_read_voff_t(sl->in) + (sl - 1)->ptr;
+    }
+    else if (stde->has_impacts) {
+        sl->max_freq = is_read_vint(sl->in);
+        sl->max_norm = is_read_byte(sl->in);
+    }
+    return true;
+}
+
+static void stde_seek_skip_child(SegmentTermDocEnum *stde, int level)
+{
+    SkipLevel *sl = stde->skip_levels + level;
+
+    is_seek(sl->in, stde->last_child_ptr);
+    sl->skipped = (sl + 1)->skipped - (sl + 1)->interval;
+    sl->doc = stde->last_skip_doc;
+    sl->frq_ptr = stde->last_frq_ptr;
+    sl->prx_ptr = stde->last_prx_ptr;
+    if (level > 0) {
+        sl->child_ptr = is_read_voff_t(sl->in) + (sl - 1)->ptr;
+    }
+}
+
+/* Walk the skip list to the last entry before +target_doc_num+, starting on
+ * the highest level which still has entries before the target and dropping
+ * down a level each time we overshoot. Returns the number of skip intervals
+ * covered by the entry found, in docs, and leaves its pointers in
+ * stde->last_*. */
+static int stde_skip_levels_to(SegmentTermDocEnum *stde, int target_doc_num)
+{
+    SkipLevel *sl = stde->skip_levels;
+    int level = 0;
+
+    while (level < stde->num_skip_levels - 1
+           && target_doc_num > sl[level + 1].doc) {
+        level++;
+    }
+
+    while (level >= 0) {
+        if (target_doc_num > sl[level].doc) {
+            if (!stde_load_next_skip(stde, level)) {
+                continue;
             }
+        }
+        else {
+            if (level > 0 && stde->last_child_ptr > is_pos(sl[level - 1].in)) {
+                stde_seek_skip_child(stde, level - 1);
+            }
+            level--;
+        }
+    }
 
-            stde->skip_doc += is_read_vint(stde->skip_in);
-            stde->frq_ptr  += is_read_vint(stde->skip_in);
-            stde->prx_ptr  += is_read_vint(stde->skip_in);
-            //printf("inner-> skip_doc:%d, frq_ptr:%d, prx_ptr:%d\n", stde->skip_doc, stde->frq_ptr, stde->prx_ptr);
+    return sl[0].skipped - sl[0].interval;
+}
 
-            stde->skip_count++;
+static bool stde_skip_to(TermDocEnum *tde, int target_doc_num)
+{
+    SegmentTermDocEnum *stde = STDE(tde);
+
+    if (stde->doc_freq >= stde->skip_interval
+        && target_doc_num > stde->doc_num) {       /* optimized case */
+        int num_skipped;
+
+        if (!stde->have_skipped) {                 /* lazily read skip levels */
+            stde_load_skip_levels(stde);
         }
 
+        /* VInt skip entries are added before the doc which completes each
+         * interval so they cover one less doc than the interval */
+        num_skipped = stde_skip_levels_to(stde, target_doc_num) - 1;
+
         /* if we found something to skip, skip it */
-        if (last_frq_ptr > is_pos(stde->frq_in)) {
-            is_seek(stde->frq_in, last_frq_ptr);
-            stde->seek_prox(stde, last_prx_ptr);
+        if (num_skipped > stde->count) {
+            is_seek(stde->frq_in, stde->last_frq_ptr);
+            stde->seek_prox(stde, stde->last_prx_ptr);
 
-            stde->doc_num = last_skip_doc;
-            stde->count += num_skipped;
+            stde->doc_num = stde->last_skip_doc;
+            stde->count = num_skipped;
         }
     }
 
@@ -3064,17 +3986,193 @@ static bool stde_skip_to(TermDocEnum *tde, int target_doc_num)
     return true;
 }
 
+static int stde_block_max(TermDocEnum *tde, int target_doc_num,
+                          int *max_freq, uchar *max_norm)
+{
+    SegmentTermDocEnum *stde = STDE(tde);
+    SkipLevel *sl = stde->skip_levels;
+    int last_doc;
+
+    if (stde->count >= stde->doc_freq) {
+        *max_freq = 0;                             /* no docs left */
+        *max_norm = 0;
+        return INT_MAX;
+    }
+    if (!stde->has_impacts || stde->doc_freq < stde->skip_interval) {
+        return -1;
+    }
+    if (!stde->have_skipped) {
+        stde_load_skip_levels(stde);
+    }
+
+    /* move the skip list, but not the postings, up to the target. The
+     * level 0 entry we stop on covers the target. Doc 0 is covered by the
+     * first entry which hasn't been read until we skip past doc 0 */
+    stde_skip_levels_to(stde, MAX(target_doc_num, 1));
+    if (INT_MAX == sl->doc) {
+        *max_freq = stde->tail_max_freq;
+        *max_norm = stde->tail_max_norm;
+        last_doc = INT_MAX;
+    }
+    else {
+        *max_freq = sl->max_freq;
+        *max_norm = sl->max_norm;
+        last_doc = sl->doc;
+    }
+    if (NULL != stde->norms_modified && *stde->norms_modified) {
+        *max_norm = 0xFF;  /* stored norms may be stale */
+    }
+    return last_doc;
+}
+
 static void stde_close(TermDocEnum *tde)
 {
+    int i;
     is_close(STDE(tde)->frq_in);
+    free(STDE(tde)->block_docs);
 
-    if (NULL != STDE(tde)->skip_in) {
-        is_close(STDE(tde)->skip_in);
+    for (i = 0; i < MAX_SKIP_LEVELS; i++) {
+        if (NULL != STDE(tde)->skip_levels[i].in) {
+            is_close(STDE(tde)->skip_levels[i].in);
+        }
     }
 
     free(tde);
 }
 
+/* FRT_POSTINGS_BLOCK reading. Docs are decoded a block at a time into
+ * block_docs and block_freqs. The last partial block of a term is stored as
+ * VInts like FRT_POSTINGS_VINT. */
+static void stbe_refill(SegmentTermDocEnum *stde)
+{
+    InStream *frq_in = stde->frq_in;
+    int *docs = stde->block_docs;
+    int *freqs = stde->block_freqs;
+    int doc_num = stde->doc_num;
+    int len = stde->doc_freq - stde->count;
+    int i;
+
+    if (len >= POSTINGS_BLOCK_SIZE) {
+        len = POSTINGS_BLOCK_SIZE;
+        postings_block_read(frq_in, docs);
+        postings_block_read(frq_in, freqs);
+        for (i = 0; i < POSTINGS_BLOCK_SIZE; i++) {
+            docs[i] = (doc_num += docs[i]);
+            freqs[i]++;
+        }
+    }
+    else {
+        for (i = 0; i < len; i++) {
+            int doc_code = is_read_vint(frq_in);
+            docs[i] = (doc_num += doc_code >> 1);
+            freqs[i] = (0 != (doc_code & 1)) ? 1 : (int)is_read_vint(frq_in);
+        }
+    }
+    stde->block_pos = 0;
+    stde->block_len = len;
+}
+
+static bool stbe_next(TermDocEnum *tde)
+{
+    SegmentTermDocEnum *stde = STDE(tde);
+
+    while (true) {
+        if (stde->block_pos >= stde->block_len) {
+            if (stde->count >= stde->doc_freq) {
+                return false;
+            }
+            stbe_refill(stde);
+        }
+
+        stde->doc_num = stde->block_docs[stde->block_pos];
+        stde->freq = stde->block_freqs[stde->block_pos];
+        stde->block_pos++;
+        stde->count++;
+
+        if (NULL == stde->deleted_docs
+            || 0 == bv_get(stde->deleted_docs, stde->doc_num)) {
+            break; /* We found an undeleted doc so return */
+        }
+
+        stde->skip_prox(stde);
+    }
+    return true;
+}
+
+static int stbe_read(TermDocEnum *tde, int *docs, int *freqs, int req_num)
+{
+    SegmentTermDocEnum *stde = STDE(tde);
+    int i = 0;
+
+    while (i < req_num) {
+        int pos, len;
+        if (stde->block_pos >= stde->block_len) {
+            if (stde->count >= stde->doc_freq) {
+                break;
+            }
+            stbe_refill(stde);
+        }
+
+        pos = stde->block_pos;
+        len = MIN(stde->block_len - pos, req_num - i);
+        if (NULL == stde->deleted_docs) {
+            /* copy as much of the block as we can in one go */
+            memcpy(docs + i, stde->block_docs + pos, len * sizeof(int));
+            memcpy(freqs + i, stde->block_freqs + pos, len * sizeof(int));
+            i += len;
+        }
+        else {
+            const int end = pos + len;
+            for (; pos < end; pos++) {
+                if (0 == bv_get(stde->deleted_docs, stde->block_docs[pos])) {
+                    docs[i] = stde->block_docs[pos];
+                    freqs[i] = stde->block_freqs[pos];
+                    i++;
+                }
+            }
+        }
+        stde->block_pos += len;
+        stde->count += len;
+        stde->doc_num = stde->block_docs[stde->block_pos - 1];
+        stde->freq = stde->block_freqs[stde->block_pos - 1];
+    }
+    return i;
+}
+
+static bool stbe_skip_to(TermDocEnum *tde, int target_doc_num)
+{
+    SegmentTermDocEnum *stde = STDE(tde);
+
+    if (stde->doc_freq >= stde->skip_interval
+        && target_doc_num > stde->doc_num) {       /* optimized case */
+        int num_skipped;
+
+        if (!stde->have_skipped) {                 /* lazily read skip levels */
+            stde_load_skip_levels(stde);
+        }
+
+        /* skip entries sit on block boundaries */
+        num_skipped = stde_skip_levels_to(stde, target_doc_num);
+
+        if (num_skipped > stde->count) {
+            is_seek(stde->frq_in, stde->last_frq_ptr);
+            stde->seek_prox(stde, stde->last_prx_ptr);
+
+            stde->doc_num = stde->last_skip_doc;
+            stde->count = num_skipped;
+            stde->block_pos = stde->block_len = 0;
+        }
+    }
+
+    /* done skipping, now just scan */
+    do {
+        if (!tde->next(tde)) {
+            return false;
+        }
+    } while (target_doc_num > stde->doc_num);
+    return true;
+}
+
 static void stde_skip_prox(SegmentTermDocEnum *stde)
 {
     (void)stde;
@@ -3090,7 +4188,7 @@ static void stde_seek_prox(SegmentTermDocEnum *stde, off_t prx_ptr)
 TermDocEnum *stde_new(TermInfosReader *tir,
                       InStream *frq_in,
                       BitVector *deleted_docs,
-                      int skip_interval)
+                      SegmentFieldIndex *sfi)
 {
     SegmentTermDocEnum *stde = ALLOC_AND_ZERO(SegmentTermDocEnum);
     TermDocEnum *tde         = (TermDocEnum *)stde;
@@ -3105,16 +4203,31 @@ TermDocEnum *stde_new(TermInfosReader *tir,
     tde->skip_to             = &stde_skip_to;
     tde->next_position       = NULL;
     tde->close               = &stde_close;
+    tde->block_max           = &stde_block_max;
 
     /* SegmentTermDocEnum methods */
     stde->skip_prox          = &stde_skip_prox;
     stde->seek_prox          = &stde_seek_prox;
+    stde->next_doc           = &stde_next;
+
+    if (POSTINGS_BLOCK == sfi->postings_format) {
+        tde->next            = &stbe_next;
+        tde->read            = &stbe_read;
+        tde->skip_to         = &stbe_skip_to;
+        stde->next_doc       = &stbe_next;
+        stde->block_docs     = ALLOC_N(int, 2 * POSTINGS_BLOCK_SIZE);
+        stde->block_freqs    = stde->block_docs + POSTINGS_BLOCK_SIZE;
+        thread_once(&pb_unpack_once, &pb_unpack_init);
+    }
 
     /* Attributes */
     stde->tir                = tir;
     stde->frq_in             = is_clone(frq_in);
     stde->deleted_docs       = deleted_docs;
-    stde->skip_interval      = skip_interval;
+    stde->skip_interval      = sfi->skip_interval;
+    stde->skip_multiplier    = sfi->skip_multiplier;
+    stde->max_skip_levels    = sfi->max_skip_levels;
+    stde->has_impacts        = sfi->has_impacts;
 
     return tde;
 }
@@ -3148,7 +4261,7 @@ static bool stpe_next(TermDocEnum *tde)
     is_skip_vints(stde->prx_in, stde->prx_cnt);
 
     /* if super */
-    if (stde_next(tde)) {
+    if (stde->next_doc(tde)) {
         stde->prx_cnt = stde->freq;
         stde->position = 0;
         return true;
@@ -3196,9 +4309,9 @@ TermDocEnum *stpe_new(TermInfosReader *tir,
                       InStream *frq_in,
                       InStream *prx_in,
                       BitVector *del_docs,
-                      int skip_interval)
+                      SegmentFieldIndex *sfi)
 {
-    TermDocEnum *tde         = stde_new(tir, frq_in, del_docs, skip_interval);
+    TermDocEnum *tde         = stde_new(tir, frq_in, del_docs, sfi);
     SegmentTermDocEnum *stde = STDE(tde);
 
     /* TermDocEnum methods */
@@ -3368,6 +4481,47 @@ static bool mtde_skip_to(TermDocEnum *tde, int target_doc_num)
     return false;
 }
 
+static int mtde_block_max(TermDocEnum *tde, int target_doc_num,
+                          int *max_freq, uchar *max_norm)
+{
+    MultiTermDocEnum *mtde = MTDE(tde);
+    TermDocEnum *sub_tde;
+    int ptr = mtde->ptr, base, last_doc;
+
+    if (NULL == mtde->curr_tde) {
+        *max_freq = 0;                             /* no docs left */
+        *max_norm = 0;
+        return INT_MAX;
+    }
+    while (target_doc_num >= mtde->starts[ptr + 1]) {
+        if (++ptr >= mtde->ir_cnt) {
+            *max_freq = 0;
+            *max_norm = 0;
+            return INT_MAX;
+        }
+    }
+    base = mtde->starts[ptr];
+    if (!mtde->state[ptr]) {
+        /* the term doesn't occur in this reader */
+        *max_freq = 0;
+        *max_norm = 0;
+        return mtde->starts[ptr + 1] - 1;
+    }
+    sub_tde = mtde->irs_tde[ptr];
+    if (NULL == sub_tde->block_max) {
+        return -1;
+    }
+    last_doc = sub_tde->block_max(sub_tde, target_doc_num - base,
+                                  max_freq, max_norm);
+    if (last_doc < 0) {
+        return -1;
+    }
+    else if (last_doc >= mtde->starts[ptr + 1] - base) {
+        return mtde->starts[ptr + 1] - 1;
+    }
+    return last_doc + base;
+}
+
 static void mtde_close(TermDocEnum *tde)
 {
     MultiTermDocEnum *mtde = MTDE(tde);
@@ -3396,6 +4550,7 @@ static TermDocEnum *mtxe_new(MultiReader *mr)
     tde->read               = &mtde_read;
     tde->skip_to            = &mtde_skip_to;
     tde->close              = &mtde_close;
+    tde->block_max          = &mtde_block_max;
 
     mtde->state             = ALLOC_AND_ZERO_N(char, mr->r_cnt);
     mtde->te                = ((IndexReader *)mr)->terms((IndexReader *)mr, 0);
@@ -3878,6 +5033,14 @@ static void ir_acquire_not_necessary(IndexReader *ir)
     (void)ir;
 }
 
+static void ir_acquire_read_only(IndexReader *ir)
+{
+    (void)ir;
+    RAISE(STATE_ERROR, "IndexReaders opened by an IndexWriter can't be used "
+                       "for delete, undelete, or set_norm operations. Use the "
+                       "IndexWriter to delete documents instead");
+}
+
 #define I64_PFX POSH_I64_PRINTF_PREFIX
 static void ir_acquire_write_lock(IndexReader *ir)
 {
@@ -4019,6 +5182,15 @@ uchar *ir_get_norms_into(IndexReader *ir, Symbol field, uchar *buf)
     return buf;
 }
 
+DocValues *ir_get_doc_values(IndexReader *ir, Symbol field)
+{
+    int field_num = fis_get_field_num(ir->fis, field);
+    if (field_num < 0) {
+        return NULL;
+    }
+    return ir->get_doc_values(ir, field_num);
+}
+
 void ir_undelete_all(IndexReader *ir)
 {
     mutex_lock(&ir->mutex);
@@ -4187,6 +5359,39 @@ bool ir_is_latest(IndexReader *ir)
     return ir->is_latest_i(ir);
 }
 
+/*
+ * The end of the segment holding doc +doc_num+. +sorted+ is set if the
+ * segment's docs are in the order of the integer values of +field+. Readers
+ * without segments of their own, like those opened with mr_open, are one
+ * unsorted segment.
+ */
+int ir_segment_end(IndexReader *ir, int doc_num, Symbol field, bool reverse,
+                   bool *sorted)
+{
+    SegmentInfos *sis = ir->sis;
+    const int max_doc = ir->max_doc(ir);
+    int i, start = 0, end = -1;
+
+    *sorted = false;
+    if (NULL == sis) {
+        return max_doc;
+    }
+    for (i = 0; i < sis->size; i++) {
+        SegmentInfo *si = sis->segs[i];
+        if (end < 0 && doc_num < start + si->doc_cnt) {
+            end = start + si->doc_cnt;
+            *sorted = si->sort_field == field && si->sort_reverse == reverse;
+        }
+        start += si->doc_cnt;
+    }
+    if (start != max_doc || end < 0) {
+        /* a segment's reader has the SegmentInfos of the whole index */
+        *sorted = false;
+        return max_doc;
+    }
+    return end;
+}
+
 /****************************************************************************
  * Norm
  ****************************************************************************/
@@ -4241,20 +5446,32 @@ static void norm_rewrite(Norm *norm, Store *store, Deleter *dlr,
  * SegmentReader
  ****************************************************************************/
 
+/* The files of a segment which never change once it has been written. They
+ * are shared by the SegmentReaders ir_reopen opens on the same segment so
+ * only the deletions and norms need to be read again. */
+typedef struct SegmentCore {
+    Store *cfs_store;
+    InStream *frq_in;
+    InStream *prx_in;
+    SegmentFieldIndex *sfi;
+    TermInfosReader *tir;
+    InStream *dvs_in;
+    DocValuesFieldEntry *dv_entries;
+    int dv_entry_cnt;
+    int ref_cnt;
+} SegmentCore;
+
 typedef struct SegmentReader {
     IndexReader ir;
     SegmentInfo *si;
     char *segment;
     FieldsReader *fr;
     BitVector *deleted_docs;
-    InStream *frq_in;
-    InStream *prx_in;
-    SegmentFieldIndex *sfi;
-    TermInfosReader *tir;
+    SegmentCore *core;
     thread_key_t thread_fr;
     void **fr_bucket;
     Hash *norms;
-    Store *cfs_store;
+    bool norms_modified;     /* norms changed since the postings were written */
     bool deleted_docs_dirty : 1;
     bool undelete_all : 1;
     bool norms_dirty : 1;
@@ -4323,12 +5540,14 @@ static void sr_set_norm_i(IndexReader *ir, int doc_num, int field_num, uchar b)
         ir->has_changes = true;
         norm->is_dirty = true; /* mark it dirty */
         SR(ir)->norms_dirty = true;
+        SR(ir)->norms_modified = true;
         sr_get_norms_i(SR(ir), field_num)[doc_num] = b;
     }
 }
 
 static void sr_delete_doc_i(IndexReader *ir, int doc_num)
 {
+    ir->deletion_gen++;
     if (NULL == SR(ir)->deleted_docs) {
         SR(ir)->deleted_docs = bv_new();
     }
@@ -4341,6 +5560,7 @@ static void sr_delete_doc_i(IndexReader *ir, int doc_num)
 
 static void sr_undelete_all_i(IndexReader *ir)
 {
+    ir->deletion_gen++;
     SR(ir)->undelete_all = true;
     SR(ir)->deleted_docs_dirty = false;
     ir->has_changes = true;
@@ -4359,28 +5579,52 @@ static void bv_write(BitVector *bv, Store *store, char *name)
 {
     int i;
     OutStream *os = store->new_output(store, name);
-    os_write_vint(os, bv->size);
-    for (i = ((bv->size-1) >> 5); i >= 0; i--) {
-        os_write_u32(os, bv->bits[i]);
+    Roaring *docs = roar_from_bv(bv, bv->size);
+    /* sparse deletions are compressed and marked by a leading 0 */
+    if (roar_memory(docs) <= TO_WORD(bv->size) * (int)sizeof(u32)) {
+        os_write_vint(os, 0);
+        os_write_vint(os, bv->size);
+        roar_write(docs, os);
     }
+    else {
+        os_write_vint(os, bv->size);
+        /* the file holds 32-bit words, highest first */
+        for (i = ((bv->size-1) >> 5); i >= 0; i--) {
+            os_write_u32(os, (u32)(bv->bits[i >> 1] >> ((i & 1) << 5)));
+        }
+    }
+    roar_destroy(docs);
     os_close(os);
 }
 
 static BitVector *bv_read(Store *store, char *name)
 {
-    int i;
+    int i, size;
     volatile bool success = false;
     InStream *volatile is = store->open_input(store, name);
-    BitVector *volatile bv = ALLOC_AND_ZERO(BitVector);
-    bv->size = (int)is_read_vint(is);
-    bv->capa = (bv->size >> 5) + 1;
-    bv->bits = ALLOC_AND_ZERO_N(u32, bv->capa);
-    bv->ref_cnt = 1;
+    BitVector *volatile bv = NULL;
     TRY
-        for (i = ((bv->size-1) >> 5); i >= 0; i--) {
-            bv->bits[i] = is_read_u32(is);
+        if (0 == (size = (int)is_read_vint(is))) {
+            Roaring *docs;
+            size = (int)is_read_vint(is);
+            docs = roar_read(is);
+            bv = roar_to_bv(docs);
+            roar_destroy(docs);
+            if (size > bv->size) {
+                bv_grow(bv, size);
+            }
+        }
+        else {
+            bv = ALLOC_AND_ZERO(BitVector);
+            bv->size = size;
+            bv->capa = (bv->size >> 6) + 1;
+            bv->bits = ALLOC_AND_ZERO_N(u64, bv->capa);
+            bv->ref_cnt = 1;
+            for (i = ((bv->size-1) >> 5); i >= 0; i--) {
+                bv->bits[i >> 1] |= (u64)is_read_u32(is) << ((i & 1) << 5);
+            }
+            bv_recount(bv);
         }
-        bv_recount(bv);
         success = true;
     XFINALLY
         is_close(is);
@@ -4435,18 +5679,30 @@ static void sr_commit_i(IndexReader *ir)
     }
 }
 
+static void sc_deref(SegmentCore *sc)
+{
+    if (0 == --(sc->ref_cnt)) {
+        if (sc->tir)          tir_close(sc->tir);
+        if (sc->sfi)          sfi_close(sc->sfi);
+        if (sc->frq_in)       is_close(sc->frq_in);
+        if (sc->prx_in)       is_close(sc->prx_in);
+        if (sc->dvs_in)       is_close(sc->dvs_in);
+        free(sc->dv_entries);
+        if (sc->cfs_store)    store_deref(sc->cfs_store);
+        free(sc);
+    }
+}
+
 static void sr_close_i(IndexReader *ir)
 {
     SegmentReader *sr = SR(ir);
 
     if (sr->fr)           fr_close(sr->fr);
-    if (sr->tir)          tir_close(sr->tir);
-    if (sr->sfi)          sfi_close(sr->sfi);
-    if (sr->frq_in)       is_close(sr->frq_in);
-    if (sr->prx_in)       is_close(sr->prx_in);
+    if (sr->core)         sc_deref(sr->core);
     if (sr->norms)        h_destroy(sr->norms);
     if (sr->deleted_docs) bv_destroy(sr->deleted_docs);
-    if (sr->cfs_store)    store_deref(sr->cfs_store);
+    si_deref(sr->si);
+    fis_deref(ir->fis);
     if (sr->fr_bucket) {
         thread_setspecific(sr->thread_fr, NULL);
         thread_key_delete(sr->thread_fr);
@@ -4516,16 +5772,44 @@ static uchar *sr_get_norms_into(IndexReader *ir, int field_num,
     return buf;
 }
 
+static DocValues *sr_get_doc_values(IndexReader *ir, int field_num)
+{
+    SegmentReader *sr = SR(ir);
+    SegmentTermIndex *sti;
+    int i;
+
+    for (i = 0; i < sr->core->dv_entry_cnt; i++) {
+        if (sr->core->dv_entries[i].field_num == field_num) {
+            InStream *volatile is = is_clone(sr->core->dvs_in);
+            DocValues *dv = NULL;
+            TRY
+                dv = dv_read(is, &sr->core->dv_entries[i], SR_SIZE(ir));
+            XFINALLY
+                is_close(is);
+            XENDTRY
+            return dv;
+        }
+    }
+
+    /* a field without terms in this segment has no values. Otherwise it
+     * gained doc values after the segment was written */
+    sti = (SegmentTermIndex *)h_get_int(sr->core->sfi->field_dict, field_num);
+    if (NULL == sti || 0 == sti->size) {
+        return dv_new_empty(SR_SIZE(ir));
+    }
+    return NULL;
+}
+
 static TermEnum *sr_terms(IndexReader *ir, int field_num)
 {
-    TermEnum *te = SR(ir)->tir->orig_te;
+    TermEnum *te = SR(ir)->core->tir->orig_te;
     te = ste_clone(te);
     return ste_set_field(te, field_num);
 }
 
 static TermEnum *sr_terms_from(IndexReader *ir, int field_num, const char *term)
 {
-    TermEnum *te = SR(ir)->tir->orig_te;
+    TermEnum *te = SR(ir)->core->tir->orig_te;
     te = ste_clone(te);
     ste_set_field(te, field_num);
     ste_scan_to(te, term);
@@ -4534,21 +5818,25 @@ static TermEnum *sr_terms_from(IndexReader *ir, int field_num, const char *term)
 
 static int sr_doc_freq(IndexReader *ir, int field_num, const char *term)
 {
-    TermInfo *ti = tir_get_ti(tir_set_field(SR(ir)->tir, field_num), term);
+    TermInfo *ti = tir_get_ti(tir_set_field(SR(ir)->core->tir, field_num), term);
     return ti ? ti->doc_freq : 0;
 }
 
 static TermDocEnum *sr_term_docs(IndexReader *ir)
 {
-    return stde_new(SR(ir)->tir, SR(ir)->frq_in, SR(ir)->deleted_docs,
-                    STE(SR(ir)->tir->orig_te)->skip_interval);
+    TermDocEnum *tde = stde_new(SR(ir)->core->tir, SR(ir)->core->frq_in,
+                                SR(ir)->deleted_docs, SR(ir)->core->sfi);
+    STDE(tde)->norms_modified = &SR(ir)->norms_modified;
+    return tde;
 }
 
 static TermDocEnum *sr_term_positions(IndexReader *ir)
 {
     SegmentReader *sr = SR(ir);
-    return stpe_new(sr->tir, sr->frq_in, sr->prx_in, sr->deleted_docs,
-                    STE(sr->tir->orig_te)->skip_interval);
+    TermDocEnum *tde = stpe_new(sr->core->tir, sr->core->frq_in, sr->core->prx_in,
+                                sr->deleted_docs, sr->core->sfi);
+    STDE(tde)->norms_modified = &sr->norms_modified;
+    return tde;
 }
 
 static TermVector *sr_term_vector(IndexReader *ir, int doc_num,
@@ -4604,13 +5892,56 @@ static void sr_open_norms(IndexReader *ir, Store *cfs_store)
             h_set_int(SR(ir)->norms, i,
                       norm_create(store->open_input(store, file_name), i));
         }
+        if (si->norm_gens[i] > 0) {
+            SR(ir)->norms_modified = true;
+        }
     }
     SR(ir)->norms_dirty = false;
 }
 
-static IndexReader *sr_setup_i(SegmentReader *sr)
+static SegmentCore *sc_open(SegmentInfo *si)
+{
+    Store *volatile store = si->store;
+    SegmentCore *volatile sc = ALLOC_AND_ZERO(SegmentCore);
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    char *segment = si->name;
+
+    sc->ref_cnt = 1;
+    TRY
+        if (si->use_compound_file) {
+            sprintf(file_name, "%s.cfs", segment);
+            sc->cfs_store = open_cmpd_store(store, file_name);
+            store = sc->cfs_store;
+        }
+
+        sc->sfi = sfi_open(store, segment);
+        sc->tir = tir_open(store, sc->sfi, segment);
+
+        sprintf(file_name, "%s.dvs", segment);
+        if (store->exists(store, file_name)) {
+            sc->dvs_in = store->open_input(store, file_name);
+            sc->dv_entries = dvs_read_directory(sc->dvs_in, &sc->dv_entry_cnt);
+        }
+
+        sprintf(file_name, "%s.frq", segment);
+        sc->frq_in = store->open_input(store, file_name);
+        sprintf(file_name, "%s.prx", segment);
+        sc->prx_in = store->open_input(store, file_name);
+    XCATCHALL
+        sc_deref(sc);
+    XENDTRY
+
+    return sc;
+}
+
+/*
+ * +prev+ is a reader on the same segment opened before the segment's
+ * deletions or norms were changed. Its SegmentCore is shared and its
+ * deletions are copied if they haven't changed.
+ */
+static IndexReader *sr_setup_i(SegmentReader *sr, SegmentReader *prev)
 {
-    Store *volatile store = sr->si->store;
+    Store *store;
     IndexReader *ir = IR(sr);
     char file_name[SEGMENT_NAME_MAX_LENGTH];
     char *sr_segment = sr->si->name;
@@ -4621,6 +5952,7 @@ static IndexReader *sr_setup_i(SegmentReader *sr)
     ir->get_lazy_doc        = &sr_get_lazy_doc;
     ir->get_norms           = &sr_get_norms;
     ir->get_norms_into      = &sr_get_norms_into;
+    ir->get_doc_values      = &sr_get_doc_values;
     ir->terms               = &sr_terms;
     ir->terms_from          = &sr_terms_from;
     ir->doc_freq            = &sr_doc_freq;
@@ -4639,31 +5971,35 @@ static IndexReader *sr_setup_i(SegmentReader *sr)
     ir->commit_i            = &sr_commit_i;
     ir->close_i             = &sr_close_i;
 
-    sr->cfs_store   = NULL;
-
     TRY
-        if (sr->si->use_compound_file) {
-            sprintf(file_name, "%s.cfs", sr_segment);
-            sr->cfs_store = open_cmpd_store(store, file_name);
-            store = sr->cfs_store;
+        if (prev) {
+            sr->core = prev->core;
+            sr->core->ref_cnt++;
         }
+        else {
+            sr->core = sc_open(sr->si);
+        }
+        store = sr->core->cfs_store ? sr->core->cfs_store : sr->si->store;
 
         sr->fr = fr_open(store, sr_segment, ir->fis);
-        sr->sfi = sfi_open(store, sr_segment);
-        sr->tir = tir_open(store, sr->sfi, sr_segment);
 
         sr->deleted_docs = NULL;
         sr->deleted_docs_dirty = false;
         sr->undelete_all = false;
-        if (si_has_deletions(sr->si)) {
+        if (prev && prev->si->del_gen == sr->si->del_gen) {
+            mutex_lock(&IR(prev)->mutex);
+            if (prev->deleted_docs) {
+                /* ORing the deletions with themselves copies them */
+                sr->deleted_docs = bv_or(prev->deleted_docs,
+                                         prev->deleted_docs);
+            }
+            mutex_unlock(&IR(prev)->mutex);
+        }
+        else if (si_has_deletions(sr->si)) {
             fn_for_generation(file_name, sr_segment, "del", sr->si->del_gen);
             sr->deleted_docs = bv_read(sr->si->store, file_name);
         }
 
-        sprintf(file_name, "%s.frq", sr_segment);
-        sr->frq_in = store->open_input(store, file_name);
-        sprintf(file_name, "%s.prx", sr_segment);
-        sr->prx_in = store->open_input(store, file_name);
         sr->norms = h_new_int((free_ft)&norm_destroy);
         sr_open_norms(ir, store);
         if (fis_has_vectors(ir->fis)) {
@@ -4679,12 +6015,14 @@ static IndexReader *sr_setup_i(SegmentReader *sr)
 }
 
 static IndexReader *sr_open(SegmentInfos *sis, FieldInfos *fis, int si_num,
-                            bool is_owner)
+                            bool is_owner, SegmentReader *prev)
 {
     SegmentReader *sr = ALLOC_AND_ZERO(SegmentReader);
     sr->si = sis->segs[si_num];
+    REF(sr->si);
+    REF(fis);
     ir_setup(IR(sr), sr->si->store, sis, fis, is_owner);
-    return sr_setup_i(sr);
+    return sr_setup_i(sr, prev);
 }
 
 /****************************************************************************
@@ -4814,8 +6152,96 @@ static uchar *mr_get_norms_into(IndexReader *ir, int field_num, uchar *buf)
             }
         }
     }
-    mutex_unlock(&ir->mutex);
-    return buf;
+    mutex_unlock(&ir->mutex);
+    return buf;
+}
+
+/* merge the sorted values of the sub-readers, mapping each sub-reader's
+ * ordinals to those of the merged values */
+static DocValues *mr_get_doc_values(IndexReader *ir, int field_num)
+{
+    MultiReader *mr = MR(ir);
+    const int r_cnt = mr->r_cnt;
+    DocValues **sub_dvs = ALLOC_AND_ZERO_N(DocValues *, r_cnt);
+    int **ord_maps = ALLOC_AND_ZERO_N(int *, r_cnt);
+    int *positions = ALLOC_AND_ZERO_N(int, r_cnt);
+    DocValues *dv = NULL;
+    int i, j, value_cnt = 0;
+    bool has_all_values = true;
+
+    for (i = 0; i < r_cnt && has_all_values; i++) {
+        int fnum = mr_get_field_num(mr, i, field_num);
+        if (fnum >= 0) {
+            IndexReader *reader = mr->sub_readers[i];
+            sub_dvs[i] = reader->get_doc_values(reader, fnum);
+            if (NULL == sub_dvs[i]) {
+                has_all_values = false;
+            }
+            else {
+                value_cnt += sub_dvs[i]->value_cnt;
+                ord_maps[i] = ALLOC_AND_ZERO_N(int, sub_dvs[i]->value_cnt + 1);
+                positions[i] = 1;
+            }
+        }
+    }
+
+    if (has_all_values) {
+        dv = dv_new(mr->max_doc);
+        dv->values = ALLOC_N(char *, value_cnt + 1);
+        dv->values[0] = NULL;
+        while (true) {
+            const char *min = NULL;
+            for (i = 0; i < r_cnt; i++) {
+                if (sub_dvs[i] && positions[i] <= sub_dvs[i]->value_cnt) {
+                    const char *value = sub_dvs[i]->values[positions[i]];
+                    if (NULL == min || strcmp(value, min) < 0) {
+                        min = value;
+                    }
+                }
+            }
+            if (NULL == min) {
+                break;
+            }
+            dv->values[++dv->value_cnt] = mp_strdup(dv->mp, min);
+            for (i = 0; i < r_cnt; i++) {
+                if (sub_dvs[i] && positions[i] <= sub_dvs[i]->value_cnt
+                    && 0 == strcmp(sub_dvs[i]->values[positions[i]],
+                                   dv->values[dv->value_cnt])) {
+                    ord_maps[i][positions[i]++] = dv->value_cnt;
+                }
+            }
+        }
+
+        dv->ord_width = tix_int_width(dv->value_cnt);
+        dv->ords = dv->ords_buf =
+            ALLOC_AND_ZERO_N(uchar, mr->max_doc * dv->ord_width + 1);
+        for (i = 0; i < r_cnt; i++) {
+            DocValues *sub_dv = sub_dvs[i];
+            if (NULL != sub_dv) {
+                const int sub_size = sub_dv->size;
+                uchar *p = dv->ords_buf + mr->starts[i] * dv->ord_width;
+                for (j = 0; j < sub_size; j++) {
+                    int ord = ord_maps[i][dv_get_ord(sub_dv, j)];
+                    int width = dv->ord_width;
+                    for (; width > 0; width--) {
+                        *p++ = (uchar)ord;
+                        ord >>= 8;
+                    }
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < r_cnt; i++) {
+        if (sub_dvs[i]) {
+            dv_destroy(sub_dvs[i]);
+        }
+        free(ord_maps[i]);
+    }
+    free(sub_dvs);
+    free(ord_maps);
+    free(positions);
+    return dv;
 }
 
 static TermEnum *mr_terms(IndexReader *ir, int field_num)
@@ -4926,6 +6352,10 @@ static void mr_set_deleter_i(IndexReader *ir, Deleter *deleter)
 static bool mr_is_latest_i(IndexReader *ir)
 {
     int i;
+    if (ir->sis) {
+        /* the sub readers may have been shared with a reopened reader */
+        return (sis_read_current_version(ir->store) == ir->sis->version);
+    }
     const int mr_reader_cnt = MR(ir)->r_cnt;
     for (i = 0; i < mr_reader_cnt; i++) {
         if (!ir_is_latest(MR(ir)->sub_readers[i])) {
@@ -4990,6 +6420,7 @@ static IndexReader *mr_new(IndexReader **sub_readers, const int r_cnt)
     ir->get_lazy_doc        = &mr_get_lazy_doc;
     ir->get_norms           = &mr_get_norms;
     ir->get_norms_into      = &mr_get_norms_into;
+    ir->get_doc_values      = &mr_get_doc_values;
     ir->terms               = &mr_terms;
     ir->terms_from          = &mr_terms_from;
     ir->doc_freq            = &mr_doc_freq;
@@ -5035,6 +6466,11 @@ static void mr_close_ext_i(IndexReader *ir)
     mr_close_i(ir);
 }
 
+MultiReader *ir_as_multi(IndexReader *ir)
+{
+    return ir->max_doc == &mr_max_doc ? MR(ir) : NULL;
+}
+
 IndexReader *mr_open(IndexReader **sub_readers, const int r_cnt)
 {
     IndexReader *ir = mr_new(sub_readers, r_cnt);
@@ -5099,6 +6535,79 @@ IndexReader *mr_open(IndexReader **sub_readers, const int r_cnt)
  ****************************************************************************/
 
 
+/*
+ * Find the SegmentReader for +segment+ in a reader opened by ir_open.
+ */
+static SegmentReader *ir_segment_reader(IndexReader *ir, const char *segment)
+{
+    MultiReader *mr;
+    if (NULL == ir) {
+        return NULL;
+    }
+    if (NULL != (mr = ir_as_multi(ir))) {
+        int i;
+        for (i = 0; i < mr->r_cnt; i++) {
+            SegmentReader *sr = SR(mr->sub_readers[i]);
+            if (0 == strcmp(sr->si->name, segment)) {
+                return sr;
+            }
+        }
+    }
+    else if (0 == strcmp(SR(ir)->si->name, segment)) {
+        return SR(ir);
+    }
+    return NULL;
+}
+
+/*
+ * Open a SegmentReader on segment +si_num+ of +sis+. If +prev+ is a sub
+ * reader on the same segment its SegmentCore is shared. The new reader gets
+ * its own copy of the deletions so neither reader sees the other's changes.
+ */
+static IndexReader *sr_reopen(SegmentInfos *sis, FieldInfos *fis, int si_num,
+                              bool is_owner, SegmentReader *prev)
+{
+    SegmentInfo *si = sis->segs[si_num];
+
+    if (prev && prev->si->use_compound_file != si->use_compound_file) {
+        /* the segment's files have since been moved into a compound file */
+        prev = NULL;
+    }
+    return sr_open(sis, fis, si_num, is_owner, prev);
+}
+
+/*
+ * Open a reader owning +sis+ on its segments, sharing the readers of
+ * +prev_ir+ where possible.
+ */
+static IndexReader *ir_open_segments(Store *store, SegmentInfos *sis,
+                                     IndexReader *prev_ir)
+{
+    FieldInfos *fis = sis->fis;
+
+    if (sis->size == 1) {
+        return sr_reopen(sis, fis, 0, true,
+                         ir_segment_reader(prev_ir, sis->segs[0]->name));
+    }
+    else {
+        volatile int i;
+        IndexReader **readers = ALLOC_N(IndexReader *, sis->size);
+        int num_segments = sis->size;
+        for (i = num_segments - 1; i >= 0; i--) {
+            TRY
+                readers[i] = sr_reopen(sis, fis, i, false,
+                    ir_segment_reader(prev_ir, sis->segs[i]->name));
+            XCATCHALL
+                for (i++; i < num_segments; i++) {
+                    ir_close(readers[i]);
+                }
+                free(readers);
+            XENDTRY
+        }
+        return mr_open_i(store, sis, fis, readers, sis->size);
+    }
+}
+
 static void ir_open_i(Store *store, FindSegmentsFile *fsf)
 {
     volatile bool success = false;
@@ -5106,32 +6615,10 @@ static void ir_open_i(Store *store, FindSegmentsFile *fsf)
     SegmentInfos *volatile sis = NULL;
     TRY
     do {
-        FieldInfos *fis;
-
         mutex_lock(&store->mutex);
         sis_read_i(store, fsf);
         sis = fsf->ret.sis;
-        fis = sis->fis;
-
-        if (sis->size == 1) {
-            ir = sr_open(sis, fis, 0, true);
-        }
-        else {
-            volatile int i;
-            IndexReader **readers = ALLOC_N(IndexReader *, sis->size);
-            int num_segments = sis->size;
-            for (i = num_segments - 1; i >= 0; i--) {
-                TRY
-                    readers[i] = sr_open(sis, fis, i, false);
-                XCATCHALL
-                    for (i++; i < num_segments; i++) {
-                        ir_close(readers[i]);
-                    }
-                    free(readers);
-                XENDTRY
-            }
-            ir = mr_open_i(store, sis, fis, readers, sis->size);
-        }
+        ir = ir_open_segments(store, sis, fsf->prev_ir);
         fsf->ret.ir = ir;
         success = true;
     } while (0);
@@ -5155,10 +6642,31 @@ static void ir_open_i(Store *store, FindSegmentsFile *fsf)
 IndexReader *ir_open(Store *store)
 {
     FindSegmentsFile fsf;
+    fsf.prev_ir = NULL;
     sis_find_segments_file(store, &fsf, &ir_open_i);
     return fsf.ret.ir;
 }
 
+IndexReader *ir_reopen(IndexReader *ir)
+{
+    FindSegmentsFile fsf;
+
+    if (NULL == ir->store || NULL == ir->sis) {
+        RAISE(STATE_ERROR, "Only an IndexReader opened on a Store with "
+              "ir_open can be reopened");
+    }
+    ir_commit(ir);
+    if (ir_is_latest(ir)) {
+        mutex_lock(&ir->mutex);
+        ir->ref_cnt++;
+        mutex_unlock(&ir->mutex);
+        return ir;
+    }
+    fsf.prev_ir = ir;
+    sis_find_segments_file(ir->store, &fsf, &ir_open_i);
+    return fsf.ret.ir;
+}
+
 /****************************************************************************
  *
  * Offset
@@ -5175,32 +6683,228 @@ Offset *offset_new(off_t start, off_t end)
 
 /****************************************************************************
  *
- * Occurence
+ * ByteBlockPool
  *
  ****************************************************************************/
 
-static Occurence *occ_new(MemoryPool *mp, int pos)
+/* A stream's first slice holds 5 bytes and each slice it outgrows links to a
+ * slice of the next level's size. The last byte of an unwritten slice is
+ * 16|level, so a writer knows it has reached the end of a slice when it finds
+ * a non-zero byte. The last four bytes of a full slice are overwritten by the
+ * address of the next one. */
+#define BBP_LEVEL_CNT 10
+static const int bbp_level_sizes[BBP_LEVEL_CNT] = {
+    5, 14, 20, 30, 40, 40, 80, 80, 120, 200
+};
+static const int bbp_next_levels[BBP_LEVEL_CNT] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 9
+};
+
+ByteBlockPool *bbp_new()
 {
-    Occurence *occ = MP_ALLOC(mp, Occurence);
-    occ->pos = pos;
-    occ->next = NULL;
-    return occ;
+    ByteBlockPool *bbp = ALLOC_AND_ZERO(ByteBlockPool);
+    bbp->block_capa = 16;
+    bbp->blocks = ALLOC_N(uchar *, bbp->block_capa);
+    bbp->upto = BYTE_BLOCK_SIZE;
+    return bbp;
+}
+
+static void bbp_next_block(ByteBlockPool *bbp)
+{
+    if (bbp->block_cnt == bbp->block_alloc) {
+        if (bbp->block_alloc == bbp->block_capa) {
+            bbp->block_capa <<= 1;
+            REALLOC_N(bbp->blocks, uchar *, bbp->block_capa);
+        }
+        bbp->blocks[bbp->block_alloc++] =
+            ALLOC_AND_ZERO_N(uchar, BYTE_BLOCK_SIZE);
+    }
+    bbp->block_cnt++;
+    bbp->upto = 0;
+}
+
+/* Recycles the blocks. They must be zeroed again for the slice ends to be
+ * found */
+void bbp_reset(ByteBlockPool *bbp)
+{
+    int i;
+    for (i = 0; i < bbp->block_cnt - 1; i++) {
+        ZEROSET_N(bbp->blocks[i], uchar, BYTE_BLOCK_SIZE);
+    }
+    if (bbp->block_cnt > 0) {
+        ZEROSET_N(bbp->blocks[i], uchar, bbp->upto);
+    }
+    bbp->block_cnt = 0;
+    bbp->upto = BYTE_BLOCK_SIZE;
+}
+
+void bbp_destroy(ByteBlockPool *bbp)
+{
+    int i;
+    for (i = 0; i < bbp->block_alloc; i++) {
+        free(bbp->blocks[i]);
+    }
+    free(bbp->blocks);
+    free(bbp);
+}
+
+int bbp_used(ByteBlockPool *bbp)
+{
+    return bbp->block_cnt * BYTE_BLOCK_SIZE;
+}
+
+/* Returns the address of a new slice of +level+ */
+static int bbp_alloc(ByteBlockPool *bbp, int level)
+{
+    const int size = bbp_level_sizes[level];
+    int addr;
+    if (bbp->upto > BYTE_BLOCK_SIZE - size) {
+        bbp_next_block(bbp);
+    }
+    addr = ((bbp->block_cnt - 1) << BYTE_BLOCK_SHIFT) + bbp->upto;
+    bbp->upto += size;
+    bbp->blocks[bbp->block_cnt - 1][bbp->upto - 1] = 16 | level;
+    return addr;
+}
+
+int bbp_new_slice(ByteBlockPool *bbp)
+{
+    return bbp_alloc(bbp, 0);
+}
+
+/* Links the full slice ending at +upto+ to a new slice, moving the slice's
+ * last three bytes to make room for the link. Returns the address to write
+ * the next byte to. */
+static int bbp_next_slice(ByteBlockPool *bbp, int upto)
+{
+    uchar *buf = bbp->blocks[upto >> BYTE_BLOCK_SHIFT];
+    int off = upto & BYTE_BLOCK_MASK;
+    int level = bbp_next_levels[buf[off] & 15];
+    int addr = bbp_alloc(bbp, level);
+    uchar *new_buf = bbp->blocks[addr >> BYTE_BLOCK_SHIFT];
+    int new_off = addr & BYTE_BLOCK_MASK;
+
+    memcpy(new_buf + new_off, buf + off - 3, 3);
+    buf[off - 3] = (uchar)(addr >> 24);
+    buf[off - 2] = (uchar)(addr >> 16);
+    buf[off - 1] = (uchar)(addr >> 8);
+    buf[off] = (uchar)addr;
+    return addr + 3;
+}
+
+void bbp_write_byte(ByteBlockPool *bbp, int *upto, uchar b)
+{
+    uchar *buf = bbp->blocks[*upto >> BYTE_BLOCK_SHIFT];
+    if (0 != buf[*upto & BYTE_BLOCK_MASK]) {
+        *upto = bbp_next_slice(bbp, *upto);
+        buf = bbp->blocks[*upto >> BYTE_BLOCK_SHIFT];
+    }
+    buf[*upto & BYTE_BLOCK_MASK] = b;
+    (*upto)++;
+}
+
+void bbp_write_vint(ByteBlockPool *bbp, int *upto, unsigned int i)
+{
+    while (i > 127) {
+        bbp_write_byte(bbp, upto, (uchar)((i & 0x7f) | 0x80));
+        i >>= 7;
+    }
+    bbp_write_byte(bbp, upto, (uchar)i);
+}
+
+/****************************************************************************
+ *
+ * ByteSliceReader
+ *
+ ****************************************************************************/
+
+static void bsr_set_limit(ByteSliceReader *bsr, int addr)
+{
+    const int size = bbp_level_sizes[bsr->level];
+    bsr->buf = bsr->bbp->blocks[addr >> BYTE_BLOCK_SHIFT];
+    bsr->buf_start = addr & ~BYTE_BLOCK_MASK;
+    bsr->upto = addr & BYTE_BLOCK_MASK;
+    if (addr + size >= bsr->end) {
+        /* the stream ends in this slice */
+        bsr->limit = bsr->end - bsr->buf_start;
+    }
+    else {
+        bsr->limit = bsr->upto + size - 4;
+    }
+}
+
+void bsr_init(ByteSliceReader *bsr, ByteBlockPool *bbp, int start, int end)
+{
+    bsr->bbp = bbp;
+    bsr->end = end;
+    bsr->level = 0;
+    bsr_set_limit(bsr, start);
+}
+
+static void bsr_next_slice(ByteSliceReader *bsr)
+{
+    const uchar *b = bsr->buf + bsr->limit;
+    int addr = (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+    bsr->level = bbp_next_levels[bsr->level];
+    bsr_set_limit(bsr, addr);
+}
+
+bool bsr_eof(ByteSliceReader *bsr)
+{
+    return bsr->buf_start + bsr->upto == bsr->end;
+}
+
+uchar bsr_read_byte(ByteSliceReader *bsr)
+{
+    if (bsr->upto == bsr->limit) {
+        bsr_next_slice(bsr);
+    }
+    return bsr->buf[bsr->upto++];
+}
+
+unsigned int bsr_read_vint(ByteSliceReader *bsr)
+{
+    register unsigned int res, b;
+    register int shift = 7;
+
+    res = (b = bsr_read_byte(bsr)) & 0x7F;
+    while ((b & 0x80) != 0) {
+        res |= ((b = bsr_read_byte(bsr)) & 0x7F) << shift;
+        shift += 7;
+    }
+    return res;
+}
+
+/* Copies the next +cnt+ vints to +os+ a slice at a time */
+void bsr_copy_vints(ByteSliceReader *bsr, OutStream *os, int cnt)
+{
+    while (cnt > 0) {
+        int i;
+        if (bsr->upto == bsr->limit) {
+            bsr_next_slice(bsr);
+        }
+        for (i = bsr->upto; i < bsr->limit && cnt > 0; i++) {
+            if (0 == (bsr->buf[i] & 0x80)) {
+                cnt--;
+            }
+        }
+        os_write_bytes(os, bsr->buf + bsr->upto, i - bsr->upto);
+        bsr->upto = i;
+    }
 }
 
 /****************************************************************************
  *
- * Posting
+ * Occurence
  *
  ****************************************************************************/
 
-Posting *p_new(MemoryPool *mp, int doc_num, int pos)
+static Occurence *occ_new(MemoryPool *mp, int pos)
 {
-    Posting *p = MP_ALLOC(mp, Posting);
-    p->doc_num = doc_num;
-    p->first_occ = occ_new(mp, pos);
-    p->freq = 1;
-    p->next = NULL;
-    return p;
+    Occurence *occ = MP_ALLOC(mp, Occurence);
+    occ->pos = pos;
+    occ->next = NULL;
+    return occ;
 }
 
 /****************************************************************************
@@ -5209,32 +6913,162 @@ Posting *p_new(MemoryPool *mp, int doc_num, int pos)
  *
  ****************************************************************************/
 
-PostingList *pl_new(MemoryPool *mp, const char *term,
-                           int term_len, Posting *p)
+PostingList *pl_new(MemoryPool *mp, const char *term, int term_len)
 {
-    PostingList *pl = MP_ALLOC(mp, PostingList);
+    PostingList *pl = MP_ALLOC_AND_ZERO(mp, PostingList);
     pl->term = (char *)mp_memdup(mp, term, term_len + 1);
     pl->term_len = term_len;
-    pl->first = pl->last = p;
-    pl->last_occ = p->first_occ;
     return pl;
 }
 
 void pl_add_occ(MemoryPool *mp, PostingList *pl, int pos)
 {
-    pl->last_occ = pl->last_occ->next = occ_new(mp, pos);
-    pl->last->freq++;
+    Occurence *occ = occ_new(mp, pos);
+    if (pl->last_occ) {
+        pl->last_occ = pl->last_occ->next = occ;
+    }
+    else {
+        pl->first_occ = pl->last_occ = occ;
+    }
+    pl->freq++;
 }
 
-static void pl_add_posting(PostingList *pl, Posting *p)
+int pl_cmp(const PostingList **pl1, const PostingList **pl2)
 {
-    pl->last = pl->last->next = p;
-    pl->last_occ = p->first_occ;
+    return strcmp((*pl1)->term, (*pl2)->term);
 }
 
-int pl_cmp(const PostingList **pl1, const PostingList **pl2)
+#define PL_INSERTION_SORT_CNT 12
+#define PL_CHAR(pl, depth) ((uchar)(pl)->term[depth])
+#define PL_SWAP(pls, i, j) do {\
+    PostingList *tmp = pls[i]; pls[i] = pls[j]; pls[j] = tmp;\
+} while (0)
+
+/* sort postings whose terms share their first +depth+ bytes */
+static void pl_insertion_sort(PostingList **pls, int cnt, int depth)
 {
-    return strcmp((*pl1)->term, (*pl2)->term);
+    int i, j;
+    for (i = 1; i < cnt; i++) {
+        for (j = i; j > 0 && strcmp(pls[j - 1]->term + depth,
+                                    pls[j]->term + depth) > 0; j--) {
+            PL_SWAP(pls, j - 1, j);
+        }
+    }
+}
+
+static INLINE int median3(int a, int b, int c)
+{
+    return a < b ? (b < c ? b : (a < c ? c : a))
+                 : (a < c ? a : (b < c ? c : b));
+}
+
+/* Multi-key quicksort. The postings are split three ways on the byte at
+ * +depth+ so the shared prefixes of terms are only compared once */
+static void pl_mkqsort(PostingList **pls, int cnt, int depth)
+{
+    while (cnt > PL_INSERTION_SORT_CNT) {
+        const int pivot = median3(PL_CHAR(pls[0], depth),
+                                  PL_CHAR(pls[cnt >> 1], depth),
+                                  PL_CHAR(pls[cnt - 1], depth));
+        int lt = 0, i = 0, gt = cnt - 1;
+        int lt_cnt, gt_cnt;
+
+        while (i <= gt) {
+            const int c = PL_CHAR(pls[i], depth);
+            if (c < pivot) {
+                PL_SWAP(pls, lt, i);
+                lt++;
+                i++;
+            }
+            else if (c > pivot) {
+                PL_SWAP(pls, i, gt);
+                gt--;
+            }
+            else {
+                i++;
+            }
+        }
+        /* terms are unique so only one can end at this byte */
+        if (0 != pivot) {
+            pl_mkqsort(pls + lt, gt + 1 - lt, depth + 1);
+        }
+
+        /* recurse into the smaller side to bound the stack */
+        lt_cnt = lt;
+        gt_cnt = cnt - gt - 1;
+        if (lt_cnt < gt_cnt) {
+            pl_mkqsort(pls, lt_cnt, depth);
+            pls += gt + 1;
+            cnt = gt_cnt;
+        }
+        else {
+            pl_mkqsort(pls + gt + 1, gt_cnt, depth);
+            cnt = lt_cnt;
+        }
+    }
+    pl_insertion_sort(pls, cnt, depth);
+}
+
+#define PL_RADIX_SORT_MIN 256
+
+/* MSD radix sort. Buckets the postings on the byte at +depth+, which is read
+ * once per posting into +keys+, and sorts each bucket on the next byte. Small
+ * buckets are left to pl_mkqsort */
+static void pl_radix_sort(PostingList **pls, PostingList **tmp, uchar *keys,
+                          int cnt, int depth)
+{
+    int counts[256];
+    int i, c, start;
+
+    while (cnt > PL_RADIX_SORT_MIN) {
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < cnt; i++) {
+            counts[keys[i] = PL_CHAR(pls[i], depth)]++;
+        }
+        depth++;
+        for (c = 1; c < 256 && counts[c] != cnt; c++) {
+        }
+        if (c < 256) {
+            /* all the terms share this byte so move on to the next */
+            continue;
+        }
+
+        for (c = 0, start = 0; c < 256; c++) {
+            const int count = counts[c];
+            counts[c] = start;
+            start += count;
+        }
+        for (i = 0; i < cnt; i++) {
+            tmp[counts[keys[i]]++] = pls[i];
+        }
+        memcpy(pls, tmp, cnt * sizeof(PostingList *));
+
+        /* counts[c] is now the end of bucket c. Only one term can end at
+         * the 0 byte */
+        for (c = 1; c < 256; c++) {
+            if (counts[c] > counts[c - 1]) {
+                pl_radix_sort(pls + counts[c - 1], tmp, keys,
+                              counts[c] - counts[c - 1], depth);
+            }
+        }
+        return;
+    }
+    pl_mkqsort(pls, cnt, depth);
+}
+
+/* Sorts +plists+ into the same order as pl_cmp */
+void pl_sort(PostingList **plists, int cnt)
+{
+    if (cnt > PL_RADIX_SORT_MIN) {
+        PostingList **tmp = ALLOC_N(PostingList *, cnt);
+        uchar *keys = ALLOC_N(uchar, cnt);
+        pl_radix_sort(plists, tmp, keys, cnt, 0);
+        free(keys);
+        free(tmp);
+    }
+    else {
+        pl_mkqsort(plists, cnt, 0);
+    }
 }
 
 /****************************************************************************
@@ -5253,77 +7087,282 @@ static FieldInverter *fld_inv_new(DocWriter *dw, FieldInfo *fi)
         fld_inv->norms = MP_ALLOC_AND_ZERO_N(dw->mp, uchar,
                                              dw->max_buffered_docs);
     }
-    fld_inv->fi = fi;
+    fld_inv->fi = fi;
+
+    /* this will alloc it's own memory so must be destroyed */
+    fld_inv->plists = h_new_str(NULL, NULL);
+
+    return fld_inv;
+}
+
+static void fld_inv_destroy(FieldInverter *fld_inv)
+{
+    h_destroy(fld_inv->plists);
+}
+
+/****************************************************************************
+ *
+ * SkipBuffer
+ *
+ ****************************************************************************/
+
+/* The skip list for a term is written after its postings in the .frq file.
+ * Level 0 has an entry every skip_interval docs and each level above it has
+ * an entry every SKIP_MULTIPLIER entries of the level below. Every level but
+ * the lowest is preceded by its length and each of its entries points to the
+ * matching entry in the level below. The highest level is written first.
+ *
+ * Each level 0 entry also holds the impacts, that is the maximum freq and
+ * norm, of the docs since the previous entry. The impacts of the docs after
+ * the last entry lead the skip data. */
+typedef struct SkipBuffer
+{
+    OutStream *bufs[MAX_SKIP_LEVELS];
+    OutStream *frq_out;
+    OutStream *prx_out;
+    int skip_interval;
+    int level_cnt;           /* levels written to since the last reset */
+    int last_docs[MAX_SKIP_LEVELS];
+    off_t last_frq_ptrs[MAX_SKIP_LEVELS];
+    off_t last_prx_ptrs[MAX_SKIP_LEVELS];
+} SkipBuffer;
+
+static void skip_buf_reset(SkipBuffer *skip_buf)
+{
+    int i;
+    off_t frq_ptr = os_pos(skip_buf->frq_out);
+    off_t prx_ptr = os_pos(skip_buf->prx_out);
+    for (i = 0; i < skip_buf->level_cnt; i++) {
+        ramo_reset(skip_buf->bufs[i]);
+    }
+    skip_buf->level_cnt = 0;
+    for (i = 0; i < MAX_SKIP_LEVELS; i++) {
+        skip_buf->last_docs[i] = 0;
+        skip_buf->last_frq_ptrs[i] = frq_ptr;
+        skip_buf->last_prx_ptrs[i] = prx_ptr;
+    }
+}
+
+static SkipBuffer *skip_buf_new(OutStream *frq_out, OutStream *prx_out,
+                                int skip_interval)
+{
+    int i;
+    SkipBuffer *skip_buf = ALLOC(SkipBuffer);
+    for (i = 0; i < MAX_SKIP_LEVELS; i++) {
+        skip_buf->bufs[i] = ram_new_buffer();
+    }
+    skip_buf->frq_out = frq_out;
+    skip_buf->prx_out = prx_out;
+    skip_buf->skip_interval = skip_interval;
+    skip_buf->level_cnt = 0;
+    return skip_buf;
+}
+
+/* Add a skip entry pointing at the doc following +doc+. +doc_freq+ is the
+ * number of docs added so far, including the next one, and must be a
+ * multiple of skip_interval. +max_freq+ and +max_norm+ are the impacts of the
+ * docs added since the last entry. */
+static void skip_buf_add(SkipBuffer *skip_buf, int doc, int doc_freq,
+                         int max_freq, uchar max_norm)
+{
+    off_t frq_ptr = os_pos(skip_buf->frq_out);
+    off_t prx_ptr = os_pos(skip_buf->prx_out);
+    off_t child_ptr = 0;
+    int skip_cnt = doc_freq / skip_buf->skip_interval;
+    int level;
+
+    for (level = 0; level < MAX_SKIP_LEVELS; level++) {
+        OutStream *buf = skip_buf->bufs[level];
+        off_t next_child_ptr;
+
+        os_write_vint(buf, doc - skip_buf->last_docs[level]);
+        os_write_voff_t(buf, frq_ptr - skip_buf->last_frq_ptrs[level]);
+        os_write_voff_t(buf, prx_ptr - skip_buf->last_prx_ptrs[level]);
+        if (0 == level) {
+            os_write_vint(buf, max_freq);
+            os_write_byte(buf, max_norm);
+        }
+        next_child_ptr = os_pos(buf);
+        if (level > 0) {
+            os_write_voff_t(buf, child_ptr);
+        }
+        child_ptr = next_child_ptr;
+
+        skip_buf->last_docs[level] = doc;
+        skip_buf->last_frq_ptrs[level] = frq_ptr;
+        skip_buf->last_prx_ptrs[level] = prx_ptr;
+        if (level >= skip_buf->level_cnt) {
+            skip_buf->level_cnt = level + 1;
+        }
+
+        /* every SKIP_MULTIPLIER-th entry is also added to the next level */
+        if (0 != (skip_cnt % SKIP_MULTIPLIER)) {
+            break;
+        }
+        skip_cnt /= SKIP_MULTIPLIER;
+    }
+}
 
-    /* this will alloc it's own memory so must be destroyed */
-    fld_inv->plists = h_new_str(NULL, NULL);
+static off_t skip_buf_write(SkipBuffer *skip_buf, int doc_freq,
+                            int tail_max_freq, uchar tail_max_norm)
+{
+    off_t skip_ptr = os_pos(skip_buf->frq_out);
+    int level = skip_level_cnt(doc_freq, skip_buf->skip_interval,
+                               SKIP_MULTIPLIER, MAX_SKIP_LEVELS);
 
-    return fld_inv;
+    if (doc_freq < skip_buf->skip_interval) {
+        return skip_ptr; /* no skip data */
+    }
+    os_write_vint(skip_buf->frq_out, tail_max_freq);
+    os_write_byte(skip_buf->frq_out, tail_max_norm);
+
+    while (--level > 0) {
+        os_write_voff_t(skip_buf->frq_out, os_pos(skip_buf->bufs[level]));
+        ramo_write_to(skip_buf->bufs[level], skip_buf->frq_out);
+    }
+    ramo_write_to(skip_buf->bufs[0], skip_buf->frq_out);
+    return skip_ptr;
 }
 
-static void fld_inv_destroy(FieldInverter *fld_inv)
+static void skip_buf_destroy(SkipBuffer *skip_buf)
 {
-    h_destroy(fld_inv->plists);
+    int i;
+    for (i = 0; i < MAX_SKIP_LEVELS; i++) {
+        ram_destroy_buffer(skip_buf->bufs[i]);
+    }
+    free(skip_buf);
 }
 
 /****************************************************************************
  *
- * SkipBuffer
+ * PostingsWriter
  *
  ****************************************************************************/
 
-typedef struct SkipBuffer
+/* Writes the doc numbers and frequencies of each term to the .frq file in
+ * the index's PostingsFormat along with the term's skip data. Positions are
+ * written straight to the .prx file by the caller after each pw_add. Each doc
+ * is added with its norm for the field so the skip data can record the
+ * impacts of each block. */
+typedef struct PostingsWriter
 {
-    OutStream *buf;
     OutStream *frq_out;
     OutStream *prx_out;
+    SkipBuffer *skip_buf;
+    PostingsFormat format;
+    int skip_interval;
+    int doc_freq;
     int last_doc;
-    off_t last_frq_ptr;
-    off_t last_prx_ptr;
-} SkipBuffer;
+    int block_size;
+    int max_freq;            /* impacts since the last skip entry */
+    uchar max_norm;
+    int deltas[POSTINGS_BLOCK_SIZE];
+    int freqs[POSTINGS_BLOCK_SIZE];
+} PostingsWriter;
 
-static void skip_buf_reset(SkipBuffer *skip_buf)
+static PostingsWriter *pw_new(OutStream *frq_out, OutStream *prx_out,
+                              int skip_interval, PostingsFormat format)
 {
-    ramo_reset(skip_buf->buf);
-    skip_buf->last_doc = 0;
-    skip_buf->last_frq_ptr = os_pos(skip_buf->frq_out);
-    skip_buf->last_prx_ptr = os_pos(skip_buf->prx_out);
+    PostingsWriter *pw = ALLOC(PostingsWriter);
+    pw->frq_out = frq_out;
+    pw->prx_out = prx_out;
+    pw->format = format;
+    /* skip entries must land on block boundaries */
+    pw->skip_interval = (POSTINGS_BLOCK == format) ? POSTINGS_BLOCK_SIZE
+                                                   : skip_interval;
+    pw->skip_buf = skip_buf_new(frq_out, prx_out, pw->skip_interval);
+    return pw;
 }
 
-static SkipBuffer *skip_buf_new(OutStream *frq_out, OutStream *prx_out)
+static void pw_start_term(PostingsWriter *pw)
 {
-    SkipBuffer *skip_buf = ALLOC(SkipBuffer);
-    skip_buf->buf = ram_new_buffer();
-    skip_buf->frq_out = frq_out;
-    skip_buf->prx_out = prx_out;
-    return skip_buf;
+    pw->doc_freq = 0;
+    pw->last_doc = 0;
+    pw->block_size = 0;
+    pw->max_freq = 0;
+    pw->max_norm = 0;
+    skip_buf_reset(pw->skip_buf);
 }
 
-static void skip_buf_add(SkipBuffer *skip_buf, int doc)
+static INLINE void pw_add_skip(PostingsWriter *pw, int doc_freq)
 {
-    off_t frq_ptr = os_pos(skip_buf->frq_out);
-    off_t prx_ptr = os_pos(skip_buf->prx_out);
+    skip_buf_add(pw->skip_buf, pw->last_doc, doc_freq, pw->max_freq,
+                 pw->max_norm);
+    pw->max_freq = 0;
+    pw->max_norm = 0;
+}
 
-    os_write_vint(skip_buf->buf, doc - skip_buf->last_doc);
-    os_write_vint(skip_buf->buf, frq_ptr - skip_buf->last_frq_ptr);
-    os_write_vint(skip_buf->buf, prx_ptr - skip_buf->last_prx_ptr);
+static void pw_flush_block(PostingsWriter *pw)
+{
+    postings_block_write(pw->frq_out, pw->deltas);
+    postings_block_write(pw->frq_out, pw->freqs);
+    pw->block_size = 0;
+    /* the positions of the last doc in the block have now been written */
+    pw_add_skip(pw, pw->doc_freq);
+}
+
+static void pw_add(PostingsWriter *pw, int doc_num, int freq, uchar norm)
+{
+    int doc_code = (doc_num - pw->last_doc) << 1;
 
-    skip_buf->last_doc = doc;
-    skip_buf->last_frq_ptr = frq_ptr;
-    skip_buf->last_prx_ptr = prx_ptr;
+    if (POSTINGS_BLOCK == pw->format) {
+        if (POSTINGS_BLOCK_SIZE == pw->block_size) {
+            pw_flush_block(pw);
+        }
+        pw->deltas[pw->block_size] = doc_num - pw->last_doc;
+        pw->freqs[pw->block_size] = freq - 1;
+        pw->block_size++;
+    }
+    else {
+        if (0 == ((pw->doc_freq + 1) % pw->skip_interval)) {
+            pw_add_skip(pw, pw->doc_freq + 1);
+        }
+        if (freq == 1) {
+            os_write_vint(pw->frq_out, doc_code | 1); /* doc & freq=1 */
+        }
+        else {
+            os_write_vint(pw->frq_out, doc_code);     /* write doc */
+            os_write_vint(pw->frq_out, freq);         /* write freqency */
+        }
+    }
+    if (freq > pw->max_freq) {
+        pw->max_freq = freq;
+    }
+    if (norm > pw->max_norm) {
+        pw->max_norm = norm;
+    }
+    pw->last_doc = doc_num;
+    pw->doc_freq++;
 }
 
-static off_t skip_buf_write(SkipBuffer *skip_buf)
+/* Returns the position of the term's skip data in the .frq file */
+static off_t pw_finish_term(PostingsWriter *pw)
 {
-  off_t skip_ptr = os_pos(skip_buf->frq_out);
-  ramo_write_to(skip_buf->buf, skip_buf->frq_out);
-  return skip_ptr;
+    if (POSTINGS_BLOCK == pw->format) {
+        int i;
+        if (POSTINGS_BLOCK_SIZE == pw->block_size) {
+            pw_flush_block(pw);
+        }
+        /* write the last partial block as vints */
+        for (i = 0; i < pw->block_size; i++) {
+            if (0 == pw->freqs[i]) {
+                os_write_vint(pw->frq_out, (pw->deltas[i] << 1) | 1);
+            }
+            else {
+                os_write_vint(pw->frq_out, pw->deltas[i] << 1);
+                os_write_vint(pw->frq_out, pw->freqs[i] + 1);
+            }
+        }
+        pw->block_size = 0;
+    }
+    return skip_buf_write(pw->skip_buf, pw->doc_freq, pw->max_freq,
+                          pw->max_norm);
 }
 
-static void skip_buf_destroy(SkipBuffer *skip_buf)
+static void pw_destroy(PostingsWriter *pw)
 {
-    ram_destroy_buffer(skip_buf->buf);
-    free(skip_buf);
+    skip_buf_destroy(pw->skip_buf);
+    free(pw);
 }
 
 /****************************************************************************
@@ -5332,6 +7371,51 @@ static void skip_buf_destroy(SkipBuffer *skip_buf)
  *
  ****************************************************************************/
 
+/* a live doc of a merge or a flush and the key it is sorted by */
+typedef struct SortedDoc {
+    long key;
+    int seg;
+    int doc;
+} SortedDoc;
+
+/* a posting buffered until all of a term's postings can be written in the
+ * order of the sorted docs */
+typedef struct SortedPosting {
+    int doc;
+    int freq;
+    uchar norm;
+    int prx_start;          /* where its position deltas start in prx_buf */
+    int prx_len;
+} SortedPosting;
+
+static int sorted_doc_cmp(const void *p1, const void *p2)
+{
+    const SortedDoc *sd1 = (const SortedDoc *)p1;
+    const SortedDoc *sd2 = (const SortedDoc *)p2;
+    if (sd1->key != sd2->key) {
+        return sd1->key < sd2->key ? -1 : 1;
+    }
+    if (sd1->seg != sd2->seg) {
+        return sd1->seg - sd2->seg;
+    }
+    return sd1->doc - sd2->doc;
+}
+
+/* equal keys keep their order when reversed as searches break ties by doc
+ * number whichever way they sort */
+static int sorted_doc_cmp_reverse(const void *p1, const void *p2)
+{
+    const SortedDoc *sd1 = (const SortedDoc *)p1;
+    const SortedDoc *sd2 = (const SortedDoc *)p2;
+    if (sd1->key != sd2->key) {
+        return sd1->key > sd2->key ? -1 : 1;
+    }
+    if (sd1->seg != sd2->seg) {
+        return sd1->seg - sd2->seg;
+    }
+    return sd1->doc - sd2->doc;
+}
+
 static void dw_write_norms(DocWriter *dw, FieldInverter *fld_inv)
 {
     char file_name[SEGMENT_NAME_MAX_LENGTH];
@@ -5343,6 +7427,232 @@ static void dw_write_norms(DocWriter *dw, FieldInverter *fld_inv)
     os_close(norms_out);
 }
 
+/*
+ * Work out the order of the buffered docs when the index is sorted, reading
+ * the keys from the sort field's postings +pls+ as smi_load_sort_keys reads
+ * them from a segment. Returns the new number of each doc or NULL if none of
+ * them move.
+ */
+static int *dw_sort_docs(DocWriter *dw, FieldInverter *fld_inv,
+                         PostingList **pls)
+{
+    const int doc_cnt = dw->doc_num;
+    SortedDoc *docs = ALLOC_AND_ZERO_N(SortedDoc, doc_cnt + 1);
+    char term[MAX_WORD_SIZE + 1];
+    ByteSliceReader frq_bsr;
+    int *doc_map = NULL;
+    int i, doc_num;
+
+    for (i = 0; i < doc_cnt; i++) {
+        docs[i].doc = i;
+    }
+    for (i = 0; i < fld_inv->plists->size; i++) {
+        PostingList *pl = pls[i];
+        long val = 0;
+        memcpy(term, pl->term, pl->term_len);
+        term[pl->term_len] = '\0';
+        sscanf(term, "%ld", &val);
+        bsr_init(&frq_bsr, dw->bbp, pl->frq_start, pl->frq_upto);
+        doc_num = 0;
+        while (!bsr_eof(&frq_bsr)) {
+            const int doc_code = bsr_read_vint(&frq_bsr);
+            doc_num += doc_code >> 1;
+            if (0 == (doc_code & 1)) {
+                bsr_read_vint(&frq_bsr);
+            }
+            docs[doc_num].key = val;
+        }
+        docs[pl->doc_num].key = val;
+    }
+
+    qsort(docs, doc_cnt, sizeof(SortedDoc),
+          dw->sort_reverse ? &sorted_doc_cmp_reverse : &sorted_doc_cmp);
+    for (i = 1; i < doc_cnt; i++) {
+        if (docs[i].doc < docs[i - 1].doc) {
+            break;
+        }
+    }
+    if (i < doc_cnt) {
+        doc_map = ALLOC_N(int, doc_cnt);
+        for (i = 0; i < doc_cnt; i++) {
+            doc_map[docs[i].doc] = i;
+        }
+    }
+    free(docs);
+    return doc_map;
+}
+
+/* move each doc's norm to the doc's new number */
+static void dw_remap_norms(DocWriter *dw, uchar *norms, const int *doc_map)
+{
+    uchar *old_norms = MP_ALLOC_N(dw->mp, uchar, dw->doc_num);
+    int i;
+    memcpy(old_norms, norms, dw->doc_num);
+    for (i = 0; i < dw->doc_num; i++) {
+        norms[doc_map[i]] = old_norms[i];
+    }
+}
+
+/* write the postings of +pl+ with the docs keeping their numbers */
+static void dw_copy_postings(DocWriter *dw, PostingList *pl, PostingsWriter *pw,
+                             const uchar *norms, int *dv_ords, int ord)
+{
+    ByteSliceReader frq_bsr, prx_bsr;
+    int doc_num, freq;
+
+        bsr_init(&frq_bsr, dw->bbp, pl->frq_start, pl->frq_upto);
+        bsr_init(&prx_bsr, dw->bbp, pl->prx_start, pl->prx_upto);
+        doc_num = 0;
+        /* the docs in the frq stream and then the term's last doc */
+        while (true) {
+            if (!bsr_eof(&frq_bsr)) {
+                int doc_code = bsr_read_vint(&frq_bsr);
+                doc_num += doc_code >> 1;
+                freq = (doc_code & 1) ? 1 : bsr_read_vint(&frq_bsr);
+            }
+            else {
+                doc_num = pl->doc_num;
+                freq = pl->freq;
+            }
+            pw_add(pw, doc_num, freq, norms ? norms[doc_num] : 0);
+            if (dv_ords) {
+                dv_ords[doc_num] = ord;
+            }
+            /* the deltas are already encoded as they are in the .prx */
+            bsr_copy_vints(&prx_bsr, pw->prx_out, freq);
+            if (doc_num == pl->doc_num) {
+                break;
+            }
+        }
+}
+
+/* a term's postings buffered so they can be written in the sorted order */
+typedef struct PostingsBuffer {
+    SortedPosting *postings;
+    int postings_capa;
+    uchar *prx_buf;
+    int prx_buf_capa;
+} PostingsBuffer;
+
+/*
+ * Write the postings of +pl+ with the docs renumbered by +doc_map+. As in
+ * sm_append_sorted_postings they are buffered with their position deltas and
+ * sorted by their new doc numbers first. The norms have already been moved.
+ */
+static void dw_write_sorted_postings(DocWriter *dw, PostingsBuffer *buf,
+                                     PostingList *pl, PostingsWriter *pw,
+                                     const int *doc_map, const uchar *norms,
+                                     int *dv_ords, int ord)
+{
+    ByteSliceReader frq_bsr, prx_bsr;
+    int i, k, cnt = 0, prx_len = 0, doc_num = 0, freq;
+
+    bsr_init(&frq_bsr, dw->bbp, pl->frq_start, pl->frq_upto);
+    bsr_init(&prx_bsr, dw->bbp, pl->prx_start, pl->prx_upto);
+    while (true) {
+        SortedPosting *sp;
+        if (!bsr_eof(&frq_bsr)) {
+            int doc_code = bsr_read_vint(&frq_bsr);
+            doc_num += doc_code >> 1;
+            freq = (doc_code & 1) ? 1 : bsr_read_vint(&frq_bsr);
+        }
+        else {
+            doc_num = pl->doc_num;
+            freq = pl->freq;
+        }
+        if (cnt >= buf->postings_capa) {
+            buf->postings_capa = max2(buf->postings_capa * 2, 64);
+            REALLOC_N(buf->postings, SortedPosting, buf->postings_capa);
+        }
+        sp = &buf->postings[cnt++];
+        sp->doc = doc_map[doc_num];
+        sp->freq = freq;
+        sp->norm = norms ? norms[sp->doc] : 0;
+        sp->prx_start = prx_len;
+        for (k = 0; k < freq; k++) {
+            uchar b;
+            do {
+                if (prx_len >= buf->prx_buf_capa) {
+                    buf->prx_buf_capa = max2(buf->prx_buf_capa * 2, 1024);
+                    REALLOC_N(buf->prx_buf, uchar, buf->prx_buf_capa);
+                }
+                b = buf->prx_buf[prx_len++] = bsr_read_byte(&prx_bsr);
+            } while (b & 0x80);
+        }
+        sp->prx_len = prx_len - sp->prx_start;
+        if (doc_num == pl->doc_num) {
+            break;
+        }
+    }
+    qsort(buf->postings, cnt, sizeof(SortedPosting), &icmp_risky);
+
+    for (i = 0; i < cnt; i++) {
+        SortedPosting *sp = &buf->postings[i];
+        if (dv_ords) {
+            dv_ords[sp->doc] = ord;
+        }
+        pw_add(pw, sp->doc, sp->freq, sp->norm);
+        os_write_bytes(pw->prx_out, buf->prx_buf + sp->prx_start,
+                       sp->prx_len);
+    }
+}
+
+/*
+ * Rewrite the stored fields of +segment+ with the docs in their sorted
+ * order. Each doc's record in the .fdt file, term vectors included, is
+ * self-contained so the records are copied into new files which then
+ * replace the old ones.
+ */
+static void dw_sort_stored_fields(Store *store, const char *segment,
+                                  const int *doc_map, const int doc_cnt)
+{
+    char fdt_name[SEGMENT_NAME_MAX_LENGTH], fdx_name[SEGMENT_NAME_MAX_LENGTH];
+    char tmp_fdt_name[SEGMENT_NAME_MAX_LENGTH];
+    char tmp_fdx_name[SEGMENT_NAME_MAX_LENGTH];
+    off_t *starts = ALLOC_N(off_t, doc_cnt + 1);
+    u32 *tv_idx_offsets = ALLOC_N(u32, doc_cnt);
+    int *old_docs = ALLOC_N(int, doc_cnt);
+    InStream *volatile fdt_in = NULL, *volatile fdx_in = NULL;
+    OutStream *volatile fdt_out = NULL, *volatile fdx_out = NULL;
+    int i;
+
+    sprintf(fdt_name, "%s.fdt", segment);
+    sprintf(fdx_name, "%s.fdx", segment);
+    sprintf(tmp_fdt_name, "%s.fdt.tmp", segment);
+    sprintf(tmp_fdx_name, "%s.fdx.tmp", segment);
+    for (i = 0; i < doc_cnt; i++) {
+        old_docs[doc_map[i]] = i;
+    }
+    TRY
+        fdx_in = store->open_input(store, fdx_name);
+        for (i = 0; i < doc_cnt; i++) {
+            starts[i] = (off_t)is_read_u64(fdx_in);
+            tv_idx_offsets[i] = is_read_u32(fdx_in);
+        }
+        fdt_in = store->open_input(store, fdt_name);
+        starts[doc_cnt] = is_length(fdt_in);
+        fdt_out = store->new_output(store, tmp_fdt_name);
+        fdx_out = store->new_output(store, tmp_fdx_name);
+        for (i = 0; i < doc_cnt; i++) {
+            const int doc = old_docs[i];
+            os_write_u64(fdx_out, os_pos(fdt_out));
+            os_write_u32(fdx_out, tv_idx_offsets[doc]);
+            is_seek(fdt_in, starts[doc]);
+            is2os_copy_bytes(fdt_in, fdt_out, starts[doc + 1] - starts[doc]);
+        }
+    XFINALLY
+        if (fdx_in) is_close(fdx_in);
+        if (fdt_in) is_close(fdt_in);
+        if (fdt_out) os_close(fdt_out);
+        if (fdx_out) os_close(fdx_out);
+        free(starts);
+        free(tv_idx_offsets);
+        free(old_docs);
+    XENDTRY
+    store->rename(store, tmp_fdt_name, fdt_name);
+    store->rename(store, tmp_fdx_name, fdx_name);
+}
+
 /* we'll use the postings Hash's table area to sort the postings as it is
  * going to be zeroset soon anyway */
 static PostingList **dw_sort_postings(Hash *plists_ht)
@@ -5358,15 +7668,69 @@ static PostingList **dw_sort_postings(Hash *plists_ht)
         }
     }
 
-    qsort(plists, plists_ht->size, sizeof(PostingList *),
-          (int (*)(const void *, const void *))&pl_cmp);
+    pl_sort(plists, plists_ht->size);
 
     return plists;
 }
 
+/* The fields are sorted by up to flush_workers threads, each taking the next
+ * field yet to be sorted */
+typedef struct DocWriterSorter
+{
+    FieldInverter **fld_invs;
+    PostingList ***plists;
+    int cnt;
+    int next;
+    mutex_t mutex;
+} DocWriterSorter;
+
+static void *dws_run(void *arg)
+{
+    DocWriterSorter *dws = (DocWriterSorter *)arg;
+    while (true) {
+        int i;
+        mutex_lock(&dws->mutex);
+        i = dws->next++;
+        mutex_unlock(&dws->mutex);
+        if (i >= dws->cnt) {
+            break;
+        }
+        if (dws->fld_invs[i]) {
+            dws->plists[i] = dw_sort_postings(dws->fld_invs[i]->plists);
+        }
+    }
+    return NULL;
+}
+
+/* Sorts the postings of each field in +fld_invs+ into +plists+ */
+static void dw_sort_fields(DocWriter *dw, FieldInverter **fld_invs,
+                           PostingList ***plists, int cnt)
+{
+    DocWriterSorter dws;
+    const int thread_cnt = min2(dw->flush_workers, cnt) - 1;
+    thread_t *threads;
+    int i;
+
+    dws.fld_invs = fld_invs;
+    dws.plists = plists;
+    dws.cnt = cnt;
+    dws.next = 0;
+    mutex_init(&dws.mutex, NULL);
+    threads = thread_cnt > 0 ? MP_ALLOC_N(dw->mp, thread_t, thread_cnt) : NULL;
+    for (i = 0; i < thread_cnt; i++) {
+        thread_create(&threads[i], &dws_run, &dws);
+    }
+    dws_run(&dws);
+    for (i = 0; i < thread_cnt; i++) {
+        thread_join(threads[i]);
+    }
+    mutex_destroy(&dws.mutex);
+}
+
 static void dw_flush_streams(DocWriter *dw)
 {
     mp_reset(dw->mp);
+    bbp_reset(dw->bbp);
     fw_close(dw->fw);
     dw->fw = NULL;
     h_clear(dw->fields);
@@ -5375,82 +7739,114 @@ static void dw_flush_streams(DocWriter *dw)
 
 static void dw_flush(DocWriter *dw)
 {
-    int i, j, last_doc, doc_code, doc_freq, last_pos, posting_count;
-    int skip_interval = dw->skip_interval;
+    int i, j, posting_count;
     FieldInfos *fis = dw->fis;
     const int fields_count = fis->size;
-    FieldInverter *fld_inv;
+    FieldInverter *fld_inv, **fld_invs;
     FieldInfo *fi;
-    PostingList **pls, *pl;
-    Posting *p;
-    Occurence *occ;
+    PostingList **pls, ***field_pls, *pl;
+    uchar *norms;
     Store *store = dw->store;
-    TermInfosWriter *tiw = tiw_open(store, dw->si->name,
-                                    dw->index_interval, skip_interval);
+    TermInfosWriter *tiw;
     TermInfo ti;
     char file_name[SEGMENT_NAME_MAX_LENGTH];
     OutStream *frq_out, *prx_out;
-    SkipBuffer *skip_buf;
+    PostingsWriter *pw;
+    DocValuesWriter *dvw = NULL;
+    int *dv_ords, ord;
+    int *doc_map = NULL;
+    const int doc_cnt = dw->doc_num;
+    PostingsBuffer postings_buf = {NULL, 0, NULL, 0};
 
     sprintf(file_name, "%s.frq", dw->si->name);
     frq_out = store->new_output(store, file_name);
     sprintf(file_name, "%s.prx", dw->si->name);
     prx_out = store->new_output(store, file_name);
-    skip_buf = skip_buf_new(frq_out, prx_out);
+    pw = pw_new(frq_out, prx_out, dw->skip_interval, dw->postings_format);
+    tiw = tiw_open(store, dw->si->name, dw->index_interval, pw->skip_interval,
+                   dw->postings_format);
+    if (fis_has_doc_values(fis)) {
+        dvw = dvw_open(store, dw->si->name, dw->doc_num);
+    }
+
+    fld_invs = MP_ALLOC_N(dw->mp, FieldInverter *, fields_count);
+    field_pls = MP_ALLOC_N(dw->mp, PostingList **, fields_count);
+    for (i = 0; i < fields_count; i++) {
+        fi = fis->fields[i];
+        fld_invs[i] = fi_is_indexed(fi)
+            ? (FieldInverter*)h_get_int(dw->fields, fi->number) : NULL;
+    }
+    dw_sort_fields(dw, fld_invs, field_pls, fields_count);
+
+    /* when the index is sorted the docs are renumbered in sorted order as
+     * they are written rather than rewriting the segment afterwards */
+    if (dw->sort_field) {
+        const int sort_fnum = fis_get_field_num(fis, dw->sort_field);
+        if (sort_fnum >= 0 && fld_invs[sort_fnum]) {
+            doc_map = dw_sort_docs(dw, fld_invs[sort_fnum],
+                                   field_pls[sort_fnum]);
+        }
+        dw->si->sort_field = dw->sort_field;
+        dw->si->sort_reverse = dw->sort_reverse;
+    }
 
     for (i = 0; i < fields_count; i++) {
         fi = fis->fields[i];
-        if (!fi_is_indexed(fi) || NULL ==
-            (fld_inv = (FieldInverter*)h_get_int(dw->fields, fi->number))) {
+        if (NULL == (fld_inv = fld_invs[i])) {
             continue;
         }
+        if (doc_map) {
+            dw_remap_norms(dw, fld_inv->norms, doc_map);
+        }
         if (!fi_omit_norms(fi)) {
             dw_write_norms(dw, fld_inv);
         }
+        /* fields without norms read back as zeroed norms */
+        norms = fld_inv->has_norms ? fld_inv->norms : NULL;
 
-        pls = dw_sort_postings(fld_inv->plists);
-        tiw_start_field(tiw, fi->number);
+        pls = field_pls[i];
+        tiw_start_field(tiw, fi->number, fi_is_key(fi));
+        dv_ords = NULL;
+        if (fi_store_doc_values(fi)) {
+            dvw_start_field(dvw, fi->number);
+            dv_ords = dvw->ords;
+        }
         posting_count = fld_inv->plists->size;
         for (j = 0; j < posting_count; j++) {
             pl = pls[j];
             ti.frq_ptr = os_pos(frq_out);
             ti.prx_ptr = os_pos(prx_out);
-            last_doc = 0;
-            doc_freq = 0;
-            skip_buf_reset(skip_buf);
-            for (p = pl->first; NULL != p; p = p->next) {
-                doc_freq++;
-                if (0 == (doc_freq % dw->skip_interval)) {
-                    skip_buf_add(skip_buf, last_doc);
-                }
-
-                doc_code = (p->doc_num - last_doc) << 1;
-                last_doc = p->doc_num;
-
-                if (p->freq == 1) {
-                    os_write_vint(frq_out, 1|doc_code);
-                }
-                else {
-                    os_write_vint(frq_out, doc_code);
-                    os_write_vint(frq_out, p->freq);
-                }
-
-                last_pos = 0;
-                for (occ = p->first_occ; NULL != occ; occ = occ->next) {
-                    os_write_vint(prx_out, occ->pos - last_pos);
-                    last_pos = occ->pos;
-                }
+            ord = dv_ords ? dvw_add_value(dvw, pl->term, pl->term_len) : 0;
+            pw_start_term(pw);
+            if (doc_map) {
+                dw_write_sorted_postings(dw, &postings_buf, pl, pw, doc_map,
+                                         norms, dv_ords, ord);
+            }
+            else {
+                dw_copy_postings(dw, pl, pw, norms, dv_ords, ord);
             }
-            ti.skip_offset = skip_buf_write(skip_buf) - ti.frq_ptr;
-            ti.doc_freq = doc_freq;
+            ti.skip_offset = pw_finish_term(pw) - ti.frq_ptr;
+            ti.doc_freq = pw->doc_freq;
             tiw_add(tiw, pl->term, pl->term_len, &ti);
         }
+        if (dv_ords) {
+            dvw_finish_field(dvw);
+        }
+    }
+    if (dvw) {
+        dvw_close(dvw);
     }
     os_close(prx_out);
     os_close(frq_out);
     tiw_close(tiw);
-    skip_buf_destroy(skip_buf);
+    pw_destroy(pw);
+    free(postings_buf.postings);
+    free(postings_buf.prx_buf);
     dw_flush_streams(dw);
+    if (doc_map) {
+        dw_sort_stored_fields(store, dw->si->name, doc_map, doc_cnt);
+        free(doc_map);
+    }
 }
 
 DocWriter *dw_open(IndexWriter *iw, SegmentInfo *si)
@@ -5461,7 +7857,10 @@ DocWriter *dw_open(IndexWriter *iw, SegmentInfo *si)
 
     DocWriter *dw = ALLOC(DocWriter);
 
+    dw->counted_memory = 0;
     dw->mp          = mp;
+    dw->bbp         = bbp_new();
+    dw->tv_mp       = mp_new();
     dw->analyzer    = iw->analyzer;
     dw->fis         = iw->fis;
     dw->store       = store;
@@ -5476,12 +7875,17 @@ DocWriter *dw_open(IndexWriter *iw, SegmentInfo *si)
     dw->skip_interval       = iw->config.skip_interval;
     dw->max_field_length    = iw->config.max_field_length;
     dw->max_buffered_docs   = iw->config.max_buffered_docs;
+    dw->postings_format     = iw->config.postings_format;
+    dw->flush_workers       = iw->config.flush_workers;
+    dw->sort_field          = iw->config.sort_field;
+    dw->sort_reverse        = iw->config.sort_reverse;
 
     dw->offsets             = ALLOC_AND_ZERO_N(Offset, DW_OFFSET_INIT_CAPA);
     dw->offsets_size        = 0;
     dw->offsets_capa        = DW_OFFSET_INIT_CAPA;
 
     dw->similarity          = iw->similarity;
+    dw->in_use              = false;
     return dw;
 }
 
@@ -5491,6 +7895,12 @@ void dw_new_segment(DocWriter *dw, SegmentInfo *si)
     dw->si = si;
 }
 
+/* Returns the memory taken by the buffered docs */
+int dw_used(DocWriter *dw)
+{
+    return mp_used(dw->mp) + bbp_used(dw->bbp);
+}
+
 void dw_close(DocWriter *dw)
 {
     if (dw->doc_num) {
@@ -5502,6 +7912,8 @@ void dw_close(DocWriter *dw)
     h_destroy(dw->curr_plists);
     h_destroy(dw->fields);
     mp_destroy(dw->mp);
+    mp_destroy(dw->tv_mp);
+    bbp_destroy(dw->bbp);
     free(dw->offsets);
     free(dw);
 }
@@ -5517,34 +7929,59 @@ FieldInverter *dw_get_fld_inv(DocWriter *dw, FieldInfo *fi)
     return fld_inv;
 }
 
-static void dw_add_posting(MemoryPool *mp,
-                           Hash *curr_plists,
-                           Hash *fld_plists,
+/* Adds +pos+ to the term's postings. A term's postings for a doc are moved to
+ * its frq stream when the term is first seen in the next doc so the freq is
+ * known. */
+static void dw_add_posting(DocWriter *dw,
+                           FieldInverter *fld_inv,
                            int doc_num,
                            const char *text,
                            int len,
                            int pos)
 {
     HashEntry *pl_he;
-    if (h_set_ext(curr_plists, text, &pl_he)) {
-        Posting *p =  p_new(mp, doc_num, pos);
+    PostingList *pl;
+    if (h_set_ext(dw->curr_plists, text, &pl_he)) {
         HashEntry *fld_pl_he;
-        PostingList *pl;
 
-        if (h_set_ext(fld_plists, text, &fld_pl_he)) {
-            fld_pl_he->value = pl = pl_new(mp, text, len, p);
-            pl_he->key = fld_pl_he->key = (char *)pl->term;
+        if (h_set_ext(fld_inv->plists, text, &fld_pl_he)) {
+            fld_pl_he->value = pl = pl_new(dw->mp, text, len);
+            fld_pl_he->key = (char *)pl->term;
+            pl->frq_start = pl->frq_upto = bbp_new_slice(dw->bbp);
+            pl->prx_start = pl->prx_upto = bbp_new_slice(dw->bbp);
         }
         else {
+            int doc_code;
             pl = (PostingList *)fld_pl_he->value;
-            pl_add_posting(pl, p);
-            pl_he->key = (char *)pl->term;
+            doc_code = (pl->doc_num - pl->last_doc) << 1;
+            if (1 == pl->freq) {
+                bbp_write_vint(dw->bbp, &pl->frq_upto, doc_code | 1);
+            }
+            else {
+                bbp_write_vint(dw->bbp, &pl->frq_upto, doc_code);
+                bbp_write_vint(dw->bbp, &pl->frq_upto, pl->freq);
+            }
+            pl->last_doc = pl->doc_num;
         }
+        pl->doc_num = doc_num;
+        pl->freq = 0;
+        pl->last_pos = 0;
+        pl->first_occ = pl->last_occ = NULL;
+        pl_he->key = (char *)pl->term;
         pl_he->value = pl;
     }
     else {
-        pl_add_occ(mp, (PostingList *)pl_he->value, pos);
+        pl = (PostingList *)pl_he->value;
+    }
+
+    if (fld_inv->store_term_vector) {
+        pl_add_occ(dw->tv_mp, pl, pos);
+    }
+    else {
+        pl->freq++;
     }
+    bbp_write_vint(dw->bbp, &pl->prx_upto, pos - pl->last_pos);
+    pl->last_pos = pos;
 }
 
 static INLINE void dw_add_offsets(DocWriter *dw, int pos, off_t start, off_t end)
@@ -5566,10 +8003,8 @@ Hash *dw_invert_field(DocWriter *dw,
                            FieldInverter *fld_inv,
                            DocField *df)
 {
-    MemoryPool *mp = dw->mp;
     Analyzer *a = dw->analyzer;
     Hash *curr_plists = dw->curr_plists;
-    Hash *fld_plists = fld_inv->plists;
     const bool store_offsets = fld_inv->store_offsets;
     int doc_num = dw->doc_num;
     int i;
@@ -5591,8 +8026,8 @@ Hash *dw_invert_field(DocWriter *dw,
                     if (pos < 0) {
                         pos = 0;
                     }
-                    dw_add_posting(mp, curr_plists, fld_plists, doc_num,
-                                   tk->text, tk->len, pos);
+                    dw_add_posting(dw, fld_inv, doc_num, tk->text, tk->len,
+                                   pos);
                     dw_add_offsets(dw, pos,
                                    start_offset + tk->start,
                                    start_offset + tk->end);
@@ -5604,8 +8039,8 @@ Hash *dw_invert_field(DocWriter *dw,
             else {
                 while (NULL != (tk = ts->next(ts))) {
                     pos += tk->pos_inc;
-                    dw_add_posting(mp, curr_plists, fld_plists, doc_num,
-                                   tk->text, tk->len, pos);
+                    dw_add_posting(dw, fld_inv, doc_num, tk->text, tk->len,
+                                   pos);
                     if (num_terms++ >= dw->max_field_length) {
                         break;
                     }
@@ -5626,8 +8061,7 @@ Hash *dw_invert_field(DocWriter *dw,
                 len = MAX_WORD_SIZE - 1;
                 data_ptr = (char *)memcpy(buf, df->data[i], len);
             }
-            dw_add_posting(mp, curr_plists, fld_plists, doc_num, data_ptr,
-                           len, i);
+            dw_add_posting(dw, fld_inv, doc_num, data_ptr, len, i);
             if (store_offsets) {
                 dw_add_offsets(dw, i, start_offset,
                                start_offset + df->lengths[i]);
@@ -5671,6 +8105,7 @@ void dw_add_doc(DocWriter *dw, Document *doc)
             fw_add_postings(dw->fw, fld_inv->fi->number,
                             dw_sort_postings(postings), postings->size,
                             dw->offsets, dw->offsets_size);
+            mp_reset(dw->tv_mp);
         }
 
         if (fld_inv->has_norms) {
@@ -5713,6 +8148,7 @@ typedef struct SegmentMergeInfo {
     int *doc_map;
     InStream *frq_in;
     InStream *prx_in;
+    uchar *norms;            /* norms of the field being merged */
 } SegmentMergeInfo;
 
 static bool smi_lt(const SegmentMergeInfo *smi1, const SegmentMergeInfo *smi2)
@@ -5783,11 +8219,49 @@ static void smi_load_term_input(SegmentMergeInfo *smi)
     sprintf(file_name, "%s.prx", segment);
     smi->prx_in = store->open_input(store, file_name);
     smi->tde = stpe_new(NULL, smi->frq_in, smi->prx_in, smi->deleted_docs,
-                        STE(smi->te)->skip_interval);
+                        smi->sfi);
+}
+
+/* Returns NULL if the segment has no norms for field +field_num+ */
+static InStream *smi_open_norms(SegmentMergeInfo *smi, int field_num)
+{
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    SegmentInfo *si = smi->si;
+    if (si_norm_file_name(si, file_name, field_num)) {
+        Store *store = (si->use_compound_file && si->norm_gens[field_num])
+                        ? smi->orig_store : smi->store;
+        return store->open_input(store, file_name);
+    }
+    return NULL;
+}
+
+/* Load the norms of field +fi+ so the merged postings can record their
+ * impacts. smi->norms is left NULL for fields without norms. */
+static void smi_load_norms(SegmentMergeInfo *smi, FieldInfo *fi)
+{
+    InStream *is;
+    if (!fi_has_norms(fi)) {
+        free(smi->norms);
+        smi->norms = NULL;
+        return;
+    }
+    is = smi_open_norms(smi, fi->number);
+    if (NULL == smi->norms) {
+        smi->norms = ALLOC_N(uchar, smi->max_doc);
+    }
+    if (is) {
+        is_read_bytes(is, smi->norms, smi->max_doc);
+        is_close(is);
+    }
+    else {
+        memset(smi->norms, 0, smi->max_doc);
+    }
 }
 
 static void smi_close_term_input(SegmentMergeInfo *smi)
 {
+    free(smi->norms);
+    smi->norms = NULL;
     ste_close(smi->te);
     sfi_close(smi->sfi);
     stpe_close(smi->tde);
@@ -5802,11 +8276,55 @@ static void smi_destroy(SegmentMergeInfo *smi)
     }
     if (smi->deleted_docs) {
         bv_destroy(smi->deleted_docs);
-        free(smi->doc_map);
     }
+    free(smi->doc_map);
     free(smi);
 }
 
+/*
+ * Load the sort key of each of the segment's docs into +keys+. The key is the
+ * integer value of the field, parsed the way an integer FieldIndex parses it
+ * so the index is sorted the way searches sort. Docs without the field get 0.
+ */
+static void smi_load_sort_keys(SegmentMergeInfo *smi, int field_num,
+                               long *keys)
+{
+    Store *store = smi->store;
+    char *segment = smi->si->name;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    SegmentFieldIndex *volatile sfi = NULL;
+    TermEnum *volatile te = NULL;
+    InStream *volatile frq_in = NULL;
+    TermDocEnum *volatile tde = NULL;
+
+    memset(keys, 0, smi->max_doc * sizeof(long));
+    if (field_num < 0) {
+        return;
+    }
+    TRY
+        sfi = sfi_open(store, segment);
+        sprintf(file_name, "%s.tis", segment);
+        te = TE(ste_new(store->open_input(store, file_name), sfi));
+        sprintf(file_name, "%s.frq", segment);
+        frq_in = store->open_input(store, file_name);
+        tde = stde_new(NULL, frq_in, NULL, sfi);
+        ste_set_field(te, field_num);
+        while (NULL != ste_next(te)) {
+            long val = 0;
+            sscanf(te->curr_term, "%ld", &val);
+            stde_seek_ti(STDE(tde), &te->curr_ti);
+            while (STDE(tde)->next_doc(tde)) {
+                keys[stde_doc_num(tde)] = val;
+            }
+        }
+    XFINALLY
+        if (tde) tde->close(tde);
+        if (frq_in) is_close(frq_in);
+        if (te) ste_close(te);
+        if (sfi) sfi_close(sfi);
+    XENDTRY
+}
+
 static char *smi_next(SegmentMergeInfo *smi)
 {
     return (smi->term = ste_next(smi->te));
@@ -5830,18 +8348,28 @@ typedef struct SegmentMerger {
     int term_buf_ptr;
     int term_buf_size;
     PriorityQueue *queue;
-    SkipBuffer *skip_buf;
+    PostingsWriter *pw;
     OutStream *frq_out;
     OutStream *prx_out;
+    DocValuesWriter *dvw;
+    int *dv_ords;       /* NULL unless the field being merged has doc values */
+    bool sorted;        /* the order of the merged docs has been worked out */
+    SortedDoc *sorted_docs; /* the merged docs in order. NULL unless sorting
+                             * moves any of them */
+    SortedPosting *postings;
+    int postings_capa;
+    uchar *prx_buf;
+    int prx_buf_capa;
 } SegmentMerger;
 
-static SegmentMerger *sm_create(IndexWriter *iw, SegmentInfo *si,
-                                SegmentInfo **seg_infos, const int seg_cnt)
+static SegmentMerger *sm_create(IndexWriter *iw, FieldInfos *fis,
+                                SegmentInfo *si, SegmentInfo **seg_infos,
+                                const int seg_cnt)
 {
     int i;
     SegmentMerger *sm = ALLOC_AND_ZERO_N(SegmentMerger, seg_cnt);
     sm->store = iw->store;
-    sm->fis = iw->fis;
+    sm->fis = fis;
     sm->si = si;
     sm->doc_cnt = 0;
     sm->smis = ALLOC_N(SegmentMergeInfo *, seg_cnt);
@@ -5863,13 +8391,136 @@ static void sm_destroy(SegmentMerger *sm)
         smi_destroy(sm->smis[i]);
     }
     free(sm->smis);
+    free(sm->sorted_docs);
     free(sm);
 }
 
+/*
+ * Work out the order of the merged docs when the index is sorted. Each doc's
+ * new number goes in its segment's doc_map and, as the new numbers aren't
+ * relative to the segment's base any more, every base is set to 0. If no doc
+ * moves the segments are appended as usual.
+ */
+static void sm_sort_docs(SegmentMerger *sm)
+{
+    Symbol field = sm->config->sort_field;
+    const bool reverse = sm->config->sort_reverse;
+    SortedDoc *docs;
+    long *keys;
+    int max_doc = 1, i, j, k;
+
+    if (sm->sorted || NULL == field) {
+        return;
+    }
+    sm->sorted = true;
+    sm->si->sort_field = field;
+    sm->si->sort_reverse = reverse;
+
+    for (i = 0; i < sm->seg_cnt; i++) {
+        max_doc = max2(max_doc, sm->smis[i]->max_doc);
+    }
+    keys = ALLOC_N(long, max_doc);
+    docs = ALLOC_N(SortedDoc, sm->doc_cnt + 1);
+    TRY
+        for (i = k = 0; i < sm->seg_cnt; i++) {
+            SegmentMergeInfo *smi = sm->smis[i];
+            smi_load_sort_keys(smi, fis_get_field_num(sm->fis, field), keys);
+            for (j = 0; j < smi->max_doc; j++) {
+                if (NULL == smi->deleted_docs
+                    || !bv_get(smi->deleted_docs, j)) {
+                    docs[k].key = keys[j];
+                    docs[k].seg = i;
+                    docs[k].doc = j;
+                    k++;
+                }
+            }
+        }
+    XCATCHALL
+        free(keys);
+        free(docs);
+    XENDTRY
+    free(keys);
+
+    qsort(docs, sm->doc_cnt, sizeof(SortedDoc),
+          reverse ? &sorted_doc_cmp_reverse : &sorted_doc_cmp);
+    for (k = 1; k < sm->doc_cnt; k++) {
+        if (docs[k].seg < docs[k - 1].seg
+            || (docs[k].seg == docs[k - 1].seg
+                && docs[k].doc < docs[k - 1].doc)) {
+            break;
+        }
+    }
+    if (k >= sm->doc_cnt) {
+        free(docs);
+        return;
+    }
+
+    for (i = 0; i < sm->seg_cnt; i++) {
+        SegmentMergeInfo *smi = sm->smis[i];
+        if (NULL == smi->doc_map) {
+            smi->doc_map = ALLOC_N(int, smi->max_doc);
+        }
+        for (j = 0; j < smi->max_doc; j++) {
+            smi->doc_map[j] = -1;
+        }
+        smi->base = 0;
+    }
+    for (k = 0; k < sm->doc_cnt; k++) {
+        sm->smis[docs[k].seg]->doc_map[docs[k].doc] = k;
+    }
+    sm->sorted_docs = docs;
+}
+
+/* copy each doc's record from its segment in the sorted order */
+static void sm_merge_sorted_fields(SegmentMerger *sm, OutStream *fdt_out,
+                                   OutStream *fdx_out)
+{
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    InStream **fdt_ins = ALLOC_AND_ZERO_N(InStream *, sm->seg_cnt);
+    InStream **fdx_ins = ALLOC_AND_ZERO_N(InStream *, sm->seg_cnt);
+    int i;
+
+    TRY
+        for (i = 0; i < sm->seg_cnt; i++) {
+            Store *store = sm->smis[i]->store;
+            sprintf(file_name, "%s.fdt", sm->smis[i]->si->name);
+            fdt_ins[i] = store->open_input(store, file_name);
+            sprintf(file_name, "%s.fdx", sm->smis[i]->si->name);
+            fdx_ins[i] = store->open_input(store, file_name);
+        }
+        for (i = 0; i < sm->doc_cnt; i++) {
+            const SortedDoc *sd = &sm->sorted_docs[i];
+            InStream *fdt_in = fdt_ins[sd->seg], *fdx_in = fdx_ins[sd->seg];
+            off_t start, end;
+            u32 tv_idx_offset;
+            is_seek(fdx_in, (off_t)sd->doc * FIELDS_IDX_PTR_SIZE);
+            start = (off_t)is_read_u64(fdx_in);
+            tv_idx_offset = is_read_u32(fdx_in);
+            end = (sd->doc + 1 < sm->smis[sd->seg]->max_doc)
+                ? (off_t)is_read_u64(fdx_in) : is_length(fdt_in);
+            os_write_u64(fdx_out, os_pos(fdt_out));
+            os_write_u32(fdx_out, tv_idx_offset);
+            is_seek(fdt_in, start);
+            is2os_copy_bytes(fdt_in, fdt_out, end - start);
+        }
+    XFINALLY
+        for (i = 0; i < sm->seg_cnt; i++) {
+            if (fdt_ins[i]) is_close(fdt_ins[i]);
+            if (fdx_ins[i]) is_close(fdx_ins[i]);
+        }
+        free(fdt_ins);
+        free(fdx_ins);
+    XENDTRY
+}
+
+/*
+ * Each document's stored fields and term vectors are a self-contained record
+ * in the .fdt file so runs of live docs are copied in one go. Only their
+ * pointers in the .fdx file need to be moved.
+ */
 static void sm_merge_fields(SegmentMerger *sm)
 {
     int i, j;
-    off_t start, end = 0;
     char file_name[SEGMENT_NAME_MAX_LENGTH];
     OutStream *fdt_out, *fdx_out;
     Store *store = sm->store;
@@ -5881,36 +8532,49 @@ static void sm_merge_fields(SegmentMerger *sm)
     sprintf(file_name, "%s.fdx", sm->si->name);
     fdx_out = store->new_output(store, file_name);
 
+    if (sm->sorted_docs) {
+        sm_merge_sorted_fields(sm, fdt_out, fdx_out);
+        os_close(fdt_out);
+        os_close(fdx_out);
+        return;
+    }
+
     for (i = 0; i < seg_cnt; i++) {
         SegmentMergeInfo *smi = sm->smis[i];
         const int max_doc = smi->max_doc;
+        BitVector *deleted_docs = smi->deleted_docs;
         InStream *fdt_in, *fdx_in;
         char *segment = smi->si->name;
+        /* the run of live docs not copied yet starts at run_start in the
+         * input and will start at run_out in the output */
+        off_t run_start = -1, run_out = 0;
         store = smi->store;
         sprintf(file_name, "%s.fdt", segment);
         fdt_in = store->open_input(store, file_name);
         sprintf(file_name, "%s.fdx", segment);
         fdx_in = store->open_input(store, file_name);
 
-        if (max_doc > 0) {
-            end = (off_t)is_read_u64(fdx_in);
-        }
         for (j = 0; j < max_doc; j++) {
+            off_t start = (off_t)is_read_u64(fdx_in);
             u32 tv_idx_offset = is_read_u32(fdx_in);
-            start = end;
-            if (j == max_doc - 1) {
-                end = is_length(fdt_in);
-            }
-            else {
-                end = (off_t)is_read_u64(fdx_in);
+            if (deleted_docs && bv_get(deleted_docs, j)) {
+                if (run_start >= 0) {
+                    is_seek(fdt_in, run_start);
+                    is2os_copy_bytes(fdt_in, fdt_out, start - run_start);
+                    run_start = -1;
+                }
+                continue;
             }
-            /* skip deleted docs */
-            if (!smi->deleted_docs || !bv_get(smi->deleted_docs, j)) {
-                os_write_u64(fdx_out, os_pos(fdt_out));
-                os_write_u32(fdx_out, tv_idx_offset);
-                is_seek(fdt_in, start);
-                is2os_copy_bytes(fdt_in, fdt_out, end - start);
+            if (run_start < 0) {
+                run_start = start;
+                run_out = os_pos(fdt_out);
             }
+            os_write_u64(fdx_out, run_out + (start - run_start));
+            os_write_u32(fdx_out, tv_idx_offset);
+        }
+        if (run_start >= 0) {
+            is_seek(fdt_in, run_start);
+            is2os_copy_bytes(fdt_in, fdt_out, is_length(fdt_in) - run_start);
         }
         is_close(fdt_in);
         is_close(fdx_in);
@@ -5923,14 +8587,12 @@ static int sm_append_postings(SegmentMerger *sm, SegmentMergeInfo **matches,
                               const int match_size)
 {
     int i;
-    int last_doc = 0, base, doc, doc_code, freq;
-    int skip_interval = sm->config->skip_interval;
+    int last_doc = 0, base, doc, freq;
     int *doc_map = NULL;
-    int df = 0;            /* number of docs w/ term */
     TermDocEnum *tde;
     SegmentMergeInfo *smi;
-    SkipBuffer *skip_buf = sm->skip_buf;
-    skip_buf_reset(skip_buf);
+    PostingsWriter *pw = sm->pw;
+    pw_start_term(pw);
 
     for (i = 0; i < match_size; i++) {
         smi = matches[i];
@@ -5940,37 +8602,85 @@ static int sm_append_postings(SegmentMerger *sm, SegmentMergeInfo **matches,
         stpe_seek_ti(STDE(tde), &smi->te->curr_ti);
 
         /* since we are using copy_bytes below to copy the proximities we use
-         * stde_next rather than stpe_next here */
-        while (stde_next(tde)) {
+         * next_doc rather than stpe_next here */
+        while (STDE(tde)->next_doc(tde)) {
             doc = stde_doc_num(tde);
             if (NULL != doc_map) {
                 doc = doc_map[doc]; /* work around deletions */
             }
             doc += base;          /* convert to merged space */
             assert(doc == 0 || doc > last_doc);
-
-            df++;
-            if (0 == (df % skip_interval)) {
-                skip_buf_add(skip_buf, last_doc);
-            }
-
-            doc_code = (doc - last_doc) << 1;    /* use low bit to flag freq=1 */
             last_doc = doc;
+            if (sm->dv_ords) {
+                /* the term's value is only added if it has any docs */
+                sm->dv_ords[doc] = sm->dvw->value_cnt + 1;
+            }
 
             freq = stde_freq(tde);
-            if (freq == 1) {
-                os_write_vint(sm->frq_out, doc_code | 1); /* doc & freq=1 */
-            }
-            else {
-                os_write_vint(sm->frq_out, doc_code); /* write doc */
-                os_write_vint(sm->frq_out, freq);     /* write freqency in doc */
-            }
+            pw_add(pw, doc, freq,
+                   smi->norms ? smi->norms[stde_doc_num(tde)] : 0);
 
             /* copy position deltas */
             is2os_copy_vints(STDE(tde)->prx_in, sm->prx_out, freq);
         }
     }
-    return df;
+    return pw->doc_freq;
+}
+
+/*
+ * The postings of a term are buffered with their position deltas and sorted
+ * by their new doc numbers before they are written as a sorted merge can
+ * move any doc ahead of any other.
+ */
+static int sm_append_sorted_postings(SegmentMerger *sm,
+                                     SegmentMergeInfo **matches,
+                                     const int match_size)
+{
+    int i, k, cnt = 0, prx_len = 0;
+    PostingsWriter *pw = sm->pw;
+
+    for (i = 0; i < match_size; i++) {
+        SegmentMergeInfo *smi = matches[i];
+        TermDocEnum *tde = smi->tde;
+        stpe_seek_ti(STDE(tde), &smi->te->curr_ti);
+        while (STDE(tde)->next_doc(tde)) {
+            InStream *prx_in = STDE(tde)->prx_in;
+            const int doc = stde_doc_num(tde);
+            SortedPosting *sp;
+            if (cnt >= sm->postings_capa) {
+                sm->postings_capa = max2(sm->postings_capa * 2, 64);
+                REALLOC_N(sm->postings, SortedPosting, sm->postings_capa);
+            }
+            sp = &sm->postings[cnt++];
+            sp->doc = smi->doc_map[doc];
+            sp->freq = stde_freq(tde);
+            sp->norm = smi->norms ? smi->norms[doc] : 0;
+            sp->prx_start = prx_len;
+            for (k = 0; k < sp->freq; k++) {
+                uchar b;
+                do {
+                    if (prx_len >= sm->prx_buf_capa) {
+                        sm->prx_buf_capa = max2(sm->prx_buf_capa * 2, 1024);
+                        REALLOC_N(sm->prx_buf, uchar, sm->prx_buf_capa);
+                    }
+                    b = sm->prx_buf[prx_len++] = is_read_byte(prx_in);
+                } while (b & 0x80);
+            }
+            sp->prx_len = prx_len - sp->prx_start;
+        }
+    }
+    qsort(sm->postings, cnt, sizeof(SortedPosting), &icmp_risky);
+
+    pw_start_term(pw);
+    for (i = 0; i < cnt; i++) {
+        SortedPosting *sp = &sm->postings[i];
+        if (sm->dv_ords) {
+            sm->dv_ords[sp->doc] = sm->dvw->value_cnt + 1;
+        }
+        pw_add(pw, sp->doc, sp->freq, sp->norm);
+        os_write_bytes(sm->prx_out, sm->prx_buf + sp->prx_start, sp->prx_len);
+    }
+    return pw->doc_freq;
 }
 
 static char *sm_cache_term(SegmentMerger *sm, char *term, int term_len)
@@ -5989,15 +8699,21 @@ static void sm_merge_term_info(SegmentMerger *sm, SegmentMergeInfo **matches,
     off_t frq_ptr = os_pos(sm->frq_out);
     off_t prx_ptr = os_pos(sm->prx_out);
 
-    int df = sm_append_postings(sm, matches, match_size); /* append posting data */
+    int df = sm->sorted_docs                              /* append posting data */
+        ? sm_append_sorted_postings(sm, matches, match_size)
+        : sm_append_postings(sm, matches, match_size);
 
-    off_t skip_ptr = skip_buf_write(sm->skip_buf);
+    off_t skip_ptr = pw_finish_term(sm->pw);
 
     if (df > 0) {
         /* add an entry to the dictionary with ptrs to prox and freq files */
         SegmentMergeInfo *first_match = matches[0];
         int term_len = first_match->te->curr_term_len;
 
+        if (sm->dv_ords) {
+            dvw_add_value(sm->dvw, first_match->term, term_len);
+        }
+
         ti_set(sm->ti, df, frq_ptr, prx_ptr,
                (skip_ptr - frq_ptr));
         tiw_add(sm->tiw, sm_cache_term(sm, first_match->term, term_len),
@@ -6020,9 +8736,15 @@ static void sm_merge_term_infos(SegmentMerger *sm)
     }
 
     for (i = 0; i < fis_size; i++) {
-        tiw_start_field(sm->tiw, i);
+        tiw_start_field(sm->tiw, i, fi_is_key(sm->fis->fields[i]));
+        sm->dv_ords = NULL;
+        if (fi_store_doc_values(sm->fis->fields[i])) {
+            dvw_start_field(sm->dvw, i);
+            sm->dv_ords = sm->dvw->ords;
+        }
         for (j = 0; j < seg_cnt; j++) {
             smi = sm->smis[j];
+            smi_load_norms(smi, sm->fis->fields[i]);
             ste_set_field(smi->te, i);
             if (NULL != smi_next(smi)) {
                 pq_push(sm->queue, smi); /* initialize @queue */
@@ -6057,6 +8779,9 @@ static void sm_merge_term_infos(SegmentMerger *sm)
                 }
             }
         }
+        if (sm->dv_ords) {
+            dvw_finish_field(sm->dvw);
+        }
     }
     free(matches);
     for (j = 0; j < seg_cnt; j++) {
@@ -6073,9 +8798,13 @@ static void sm_merge_terms(SegmentMerger *sm)
     sprintf(file_name, "%s.prx", sm->si->name);
     sm->prx_out = sm->store->new_output(sm->store, file_name);
 
+    sm->pw = pw_new(sm->frq_out, sm->prx_out, sm->config->skip_interval,
+                    sm->config->postings_format);
     sm->tiw = tiw_open(sm->store, sm->si->name, sm->config->index_interval,
-                       sm->config->skip_interval);
-    sm->skip_buf = skip_buf_new(sm->frq_out, sm->prx_out);
+                       sm->pw->skip_interval, sm->config->postings_format);
+    if (fis_has_doc_values(sm->fis)) {
+        sm->dvw = dvw_open(sm->store, sm->si->name, sm->doc_cnt);
+    }
 
     /* terms_buf_ptr holds a buffer of terms since the TermInfosWriter needs
      * to keep the last index_interval terms so that it can compare the last
@@ -6092,16 +8821,43 @@ static void sm_merge_terms(SegmentMerger *sm)
     os_close(sm->frq_out);
     os_close(sm->prx_out);
     tiw_close(sm->tiw);
+    if (sm->dvw) {
+        dvw_close(sm->dvw);
+    }
     pq_destroy(sm->queue);
-    skip_buf_destroy(sm->skip_buf);
+    pw_destroy(sm->pw);
     free(sm->term_buf);
+    free(sm->postings);
+    free(sm->prx_buf);
+}
+
+static void sm_merge_sorted_norms(SegmentMerger *sm, OutStream *os,
+                                  int field_num)
+{
+    uchar **norms = ALLOC_N(uchar *, sm->seg_cnt);
+    InStream *is;
+    int i;
+    for (i = 0; i < sm->seg_cnt; i++) {
+        SegmentMergeInfo *smi = sm->smis[i];
+        norms[i] = ALLOC_AND_ZERO_N(uchar, smi->max_doc);
+        if (NULL != (is = smi_open_norms(smi, field_num))) {
+            is_read_bytes(is, norms[i], smi->max_doc);
+            is_close(is);
+        }
+    }
+    for (i = 0; i < sm->doc_cnt; i++) {
+        os_write_byte(os, norms[sm->sorted_docs[i].seg][sm->sorted_docs[i].doc]);
+    }
+    for (i = 0; i < sm->seg_cnt; i++) {
+        free(norms[i]);
+    }
+    free(norms);
 }
 
 static void sm_merge_norms(SegmentMerger *sm)
 {
     SegmentInfo *si;
     int i, j, k;
-    Store *store;
     uchar byte;
     FieldInfo *fi;
     OutStream *os;
@@ -6116,15 +8872,16 @@ static void sm_merge_norms(SegmentMerger *sm)
             si_advance_norm_gen(si, i);
             si_norm_file_name(si, file_name, i);
             os = sm->store->new_output(sm->store, file_name);
+            if (sm->sorted_docs) {
+                sm_merge_sorted_norms(sm, os, i);
+                os_close(os);
+                continue;
+            }
             for (j = 0; j < seg_cnt; j++) {
                 smi = sm->smis[j];
-                si = smi->si;
-                if (si_norm_file_name(si, file_name, i)) {
+                if (NULL != (is = smi_open_norms(smi, i))) {
                     const int max_doc = smi->max_doc;
                     BitVector *deleted_docs =  smi->deleted_docs;
-                    store = (si->use_compound_file && si->norm_gens[i])
-                             ? smi->orig_store : smi->store;
-                    is = store->open_input(store, file_name);
                     if (deleted_docs) {
                         for (k = 0; k < max_doc; k++) {
                             byte = is_read_byte(is);
@@ -6150,15 +8907,413 @@ static void sm_merge_norms(SegmentMerger *sm)
     }
 }
 
+/*
+ * The postings, stored fields and norms of a merge read and write separate
+ * files so they can be merged on separate threads. The postings are the
+ * bulk of the work so they get a thread to themselves when there are enough
+ * workers. The other workers merge a copy of the SegmentMerger with their
+ * own compound stores as the InStreams of a compound store all share the
+ * compound file's InStream.
+ */
+#define SM_PART_CNT 3
+
+typedef struct SegmentMergeWorker {
+    SegmentMerger *sm;
+    void (*parts[SM_PART_CNT])(SegmentMerger *sm);
+    int part_cnt;
+    RateLimiter *rate_limiter;  /* the limiter of the thread merging */
+    thread_t thread;
+    int excode;                 /* 0 unless merging raised an error */
+    char msg[XMSG_BUFFER_SIZE];
+} SegmentMergeWorker;
+
+/* the deleted docs and doc maps belong to the SegmentMerger cloned */
+static void sm_clone_destroy(SegmentMerger *clone)
+{
+    int i;
+    for (i = 0; i < clone->seg_cnt; i++) {
+        SegmentMergeInfo *smi = clone->smis[i];
+        if (NULL == smi) {
+            break;
+        }
+        if (smi->store != smi->orig_store) {
+            store_deref(smi->store);
+        }
+        free(smi);
+    }
+    free(clone->smis);
+    free(clone);
+}
+
+static SegmentMerger *sm_clone(SegmentMerger *sm)
+{
+    int i;
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    SegmentMerger *clone = ALLOC(SegmentMerger);
+    memcpy(clone, sm, sizeof(SegmentMerger));
+    clone->smis = ALLOC_AND_ZERO_N(SegmentMergeInfo *, sm->seg_cnt);
+    TRY
+        for (i = 0; i < sm->seg_cnt; i++) {
+            SegmentMergeInfo *smi = ALLOC(SegmentMergeInfo);
+            memcpy(smi, sm->smis[i], sizeof(SegmentMergeInfo));
+            clone->smis[i] = smi;
+            if (smi->store != smi->orig_store) {
+                smi->store = smi->orig_store;
+                sprintf(file_name, "%s.cfs", smi->si->name);
+                smi->store = open_cmpd_store(smi->orig_store, file_name);
+            }
+        }
+    XCATCHALL
+        sm_clone_destroy(clone);
+    XENDTRY
+    return clone;
+}
+
+static void smw_merge(SegmentMergeWorker *smw)
+{
+    int i;
+    TRY
+        for (i = 0; i < smw->part_cnt; i++) {
+            smw->parts[i](smw->sm);
+        }
+    XCATCHALL
+        smw->excode = xcontext.excode;
+        snprintf(smw->msg, XMSG_BUFFER_SIZE, "%s", xcontext.msg);
+        HANDLED();
+    XENDTRY
+}
+
+static void *smw_run(void *arg)
+{
+    SegmentMergeWorker *smw = (SegmentMergeWorker *)arg;
+    thread_set_rate_limiter(smw->rate_limiter);
+    smw_merge(smw);
+    thread_set_rate_limiter(NULL);
+    return NULL;
+}
+
+static void sm_merge_parallel(SegmentMerger *sm, const int worker_cnt)
+{
+    static void (*const parts[SM_PART_CNT])(SegmentMerger *sm) = {
+        &sm_merge_terms, &sm_merge_fields, &sm_merge_norms
+    };
+    SegmentMergeWorker workers[SM_PART_CNT];
+    RateLimiter *rate_limiter = thread_get_rate_limiter();
+    volatile int clone_cnt = 1;
+    int i;
+
+    memset(workers, 0, sizeof(workers));
+    for (i = 0; i < SM_PART_CNT; i++) {
+        SegmentMergeWorker *smw
+            = &workers[i == 0 ? 0 : 1 + (i - 1) % (worker_cnt - 1)];
+        smw->parts[smw->part_cnt++] = parts[i];
+    }
+
+    workers[0].sm = sm;
+    TRY
+        for (; clone_cnt < worker_cnt; clone_cnt++) {
+            workers[clone_cnt].sm = sm_clone(sm);
+        }
+    XCATCHALL
+        for (i = 1; i < clone_cnt; i++) {
+            sm_clone_destroy(workers[i].sm);
+        }
+    XENDTRY
+
+    for (i = 1; i < worker_cnt; i++) {
+        workers[i].rate_limiter = rate_limiter;
+        thread_create(&workers[i].thread, &smw_run, &workers[i]);
+    }
+    smw_merge(&workers[0]);
+    for (i = 1; i < worker_cnt; i++) {
+        thread_join(workers[i].thread);
+        sm_clone_destroy(workers[i].sm);
+    }
+
+    for (i = 0; i < worker_cnt; i++) {
+        if (workers[i].excode) {
+            RAISE(workers[i].excode, "%s", workers[i].msg);
+        }
+    }
+}
+
 static int sm_merge(SegmentMerger *sm)
 {
-    sm_merge_fields(sm);
-    sm_merge_terms(sm);
-    sm_merge_norms(sm);
+    const int worker_cnt = min2(sm->config->merge_workers, SM_PART_CNT);
+    sm_sort_docs(sm);
+    if (worker_cnt > 1) {
+        sm_merge_parallel(sm, worker_cnt);
+    }
+    else {
+        sm_merge_fields(sm);
+        sm_merge_terms(sm);
+        sm_merge_norms(sm);
+    }
     return sm->doc_cnt;
 }
 
 
+/****************************************************************************
+ * MergePolicy
+ ****************************************************************************/
+
+/* Find the first segment not being merged from the end of iw->sis going
+ * back while they are all smaller than the merge level's target size. Once
+ * the segments found add up to the target they are merged. */
+static int lmp_find_merge(MergePolicy *mp, IndexWriter *iw, SegmentInfo **segs)
+{
+    SegmentInfos *sis = iw->sis;
+    int target_merge_docs = iw->config.merge_factor;
+    int min_segment, merge_docs;
+    SegmentInfo *si;
+    (void)mp;
+
+    while (target_merge_docs > 0
+           && target_merge_docs <= iw->config.max_merge_docs) {
+        /* find segments smaller than current target size */
+        min_segment = sis->size - 1;
+        merge_docs = 0;
+        while (min_segment >= 0) {
+            si = sis->segs[min_segment];
+            if (si->doc_cnt >= target_merge_docs || si->merging) {
+                break;
+            }
+            merge_docs += si->doc_cnt;
+            min_segment--;
+        }
+
+        if (merge_docs >= target_merge_docs) { /* found a merge to do */
+            const int seg_cnt = sis->size - (min_segment + 1);
+            memcpy(segs, &sis->segs[min_segment + 1],
+                   seg_cnt * sizeof(SegmentInfo *));
+            return seg_cnt;
+        }
+        else if (min_segment <= 0) {
+            break;
+        }
+
+        target_merge_docs *= iw->config.merge_factor;
+    }
+    return 0;
+}
+
+/* Merge runs of up to merge_factor segments with deletions */
+static int lmp_find_expunge_merge(MergePolicy *mp, IndexWriter *iw,
+                                  SegmentInfo **segs)
+{
+    SegmentInfos *sis = iw->sis;
+    int i, seg_cnt = 0;
+    (void)mp;
+
+    for (i = 0; i < sis->size && seg_cnt < iw->config.merge_factor; i++) {
+        SegmentInfo *si = sis->segs[i];
+        if (!si->merging && si_has_deletions(si)) {
+            segs[seg_cnt++] = si;
+        }
+        else if (seg_cnt > 0) {
+            break;
+        }
+    }
+    return seg_cnt;
+}
+
+static void lmp_destroy(MergePolicy *mp)
+{
+    free(mp);
+}
+
+MergePolicy *log_merge_policy_new()
+{
+    MergePolicy *mp = ALLOC(MergePolicy);
+    mp->find_merge = &lmp_find_merge;
+    mp->find_expunge_merge = &lmp_find_expunge_merge;
+    mp->destroy = &lmp_destroy;
+    return mp;
+}
+
+#define TMP(mp) ((TieredMergePolicy *)(mp))
+
+typedef struct SegmentSize {
+    SegmentInfo *si;
+    double bytes;           /* bytes on disk */
+    double live_bytes;      /* bytes less the share of the deleted docs */
+} SegmentSize;
+
+static int ss_cmp(const void *p1, const void *p2)
+{
+    double b1 = ((SegmentSize *)p1)->live_bytes;
+    double b2 = ((SegmentSize *)p2)->live_bytes;
+    return b1 < b2 ? 1 : (b1 > b2 ? -1 : 0);
+}
+
+/* Get the sizes of the segments not being merged, biggest first */
+static int tmp_segment_sizes(IndexWriter *iw, SegmentSize *sizes)
+{
+    SegmentInfos *sis = iw->sis;
+    int i, cnt = 0;
+    for (i = 0; i < sis->size; i++) {
+        SegmentInfo *si = sis->segs[i];
+        if (!si->merging) {
+            SegmentSize *ss = &sizes[cnt++];
+            ss->si = si;
+            ss->bytes = (double)si_size(si);
+            ss->live_bytes = si->doc_cnt > 0
+                ? ss->bytes * (si->doc_cnt - si_del_cnt(si)) / si->doc_cnt
+                : 0.0;
+        }
+    }
+    qsort(sizes, cnt, sizeof(SegmentSize), &ss_cmp);
+    return cnt;
+}
+
+/* Sizes are floored at one byte at least, even when floor_segment_bytes is
+ * set to 0, so that the tiers and the skew of a merge of empty segments never
+ * divide by zero. */
+static double tmp_floor(TieredMergePolicy *tmp, double bytes)
+{
+    const double floor_bytes = tmp->floor_segment_bytes > 1
+        ? (double)tmp->floor_segment_bytes : 1.0;
+    return bytes < floor_bytes ? floor_bytes : bytes;
+}
+
+/* The number of segments the index's tiers have room for */
+static int tmp_allowed_seg_cnt(TieredMergePolicy *tmp, SegmentSize *sizes,
+                               int cnt)
+{
+    double level_bytes, bytes_left = 0.0;
+    int i, allowed = 0;
+    for (i = 0; i < cnt; i++) {
+        bytes_left += sizes[i].live_bytes;
+    }
+    level_bytes = tmp_floor(tmp, cnt > 0 ? sizes[cnt - 1].live_bytes : 0.0);
+    while (true) {
+        double level_seg_cnt = bytes_left / level_bytes;
+        if (level_seg_cnt < tmp->segs_per_tier) {
+            allowed += (int)ceil(level_seg_cnt);
+            break;
+        }
+        allowed += tmp->segs_per_tier;
+        bytes_left -= tmp->segs_per_tier * level_bytes;
+        level_bytes *= tmp->max_merge_at_once;
+    }
+    return allowed;
+}
+
+static int tmp_find_merge(MergePolicy *mp, IndexWriter *iw, SegmentInfo **segs)
+{
+    TieredMergePolicy *tmp = TMP(mp);
+    const double max_bytes = (double)tmp->max_merged_segment_bytes;
+    SegmentSize *sizes = ALLOC_N(SegmentSize, iw->sis->size);
+    SegmentSize *eligible;
+    double best_score = 0.0;
+    int i, start, cnt, best_cnt = 0;
+
+    cnt = tmp_segment_sizes(iw, sizes);
+    /* segments more than half the maximum size can't be merged with
+     * anything so they don't count towards any tier */
+    for (eligible = sizes; cnt > 0 && eligible->live_bytes > max_bytes / 2;
+         eligible++) {
+        cnt--;
+    }
+
+    if (cnt > tmp_allowed_seg_cnt(tmp, eligible, cnt)) {
+        SegmentInfo **candidate = ALLOC_N(SegmentInfo *, tmp->max_merge_at_once);
+        for (start = 0; start < cnt - 1; start++) {
+            double bytes = 0.0, live_bytes = 0.0;
+            double floored_bytes = 0.0, max_floored_bytes = 0.0;
+            double skew, score;
+            bool too_large = false;
+            int candidate_cnt = 0;
+
+            for (i = start; i < cnt && candidate_cnt < tmp->max_merge_at_once;
+                 i++) {
+                SegmentSize *ss = &eligible[i];
+                double floored = tmp_floor(tmp, ss->live_bytes);
+                if (live_bytes + ss->live_bytes > max_bytes) {
+                    /* try fitting smaller segments in instead */
+                    too_large = true;
+                    continue;
+                }
+                candidate[candidate_cnt++] = ss->si;
+                bytes += ss->bytes;
+                live_bytes += ss->live_bytes;
+                floored_bytes += floored;
+                if (floored > max_floored_bytes) {
+                    max_floored_bytes = floored;
+                }
+            }
+            if (candidate_cnt < 2) {
+                continue;
+            }
+
+            /* lower scores are better. Merges of evenly sized segments
+             * have a low skew. A merge which fills up a maximum sized
+             * segment is as good as it gets. */
+            skew = too_large ? 1.0 / tmp->max_merge_at_once
+                             : max_floored_bytes / floored_bytes;
+            score = skew * pow(live_bytes, 0.05);
+            if (bytes > 0.0) {
+                score *= pow(live_bytes / bytes, tmp->reclaim_deletes_weight);
+            }
+            if (0 == best_cnt || score < best_score) {
+                best_score = score;
+                best_cnt = candidate_cnt;
+                memcpy(segs, candidate, candidate_cnt * sizeof(SegmentInfo *));
+            }
+        }
+        free(candidate);
+    }
+    free(sizes);
+    return best_cnt;
+}
+
+/* Merge the biggest segments with too many deletions which fit together */
+static int tmp_find_expunge_merge(MergePolicy *mp, IndexWriter *iw,
+                                  SegmentInfo **segs)
+{
+    TieredMergePolicy *tmp = TMP(mp);
+    SegmentSize *sizes = ALLOC_N(SegmentSize, iw->sis->size);
+    double live_bytes = 0.0;
+    int i, cnt = tmp_segment_sizes(iw, sizes), seg_cnt = 0;
+
+    for (i = 0; i < cnt && seg_cnt < tmp->max_merge_at_once; i++) {
+        SegmentInfo *si = sizes[i].si;
+        if (si->doc_cnt > 0 && 100.0 * si_del_cnt(si) / si->doc_cnt
+                               > tmp->expunge_deletes_pct_allowed) {
+            /* the first segment is always rewritten even if it is too big
+             * to merge with anything else */
+            if (seg_cnt > 0 && live_bytes + sizes[i].live_bytes
+                               > tmp->max_merged_segment_bytes) {
+                continue;
+            }
+            segs[seg_cnt++] = si;
+            live_bytes += sizes[i].live_bytes;
+        }
+    }
+    free(sizes);
+    return seg_cnt;
+}
+
+static void tmp_destroy(MergePolicy *mp)
+{
+    free(TMP(mp));
+}
+
+MergePolicy *tiered_merge_policy_new()
+{
+    TieredMergePolicy *tmp = ALLOC(TieredMergePolicy);
+    tmp->super.find_merge = &tmp_find_merge;
+    tmp->super.find_expunge_merge = &tmp_find_expunge_merge;
+    tmp->super.destroy = &tmp_destroy;
+    tmp->max_merge_at_once = 10;
+    tmp->segs_per_tier = 10;
+    tmp->max_merged_segment_bytes = (off_t)5 << 30;     /* 5Gb */
+    tmp->floor_segment_bytes = (off_t)2 << 20;          /* 2Mb */
+    tmp->expunge_deletes_pct_allowed = 10.0;
+    tmp->reclaim_deletes_weight = 2.0;
+    return (MergePolicy *)tmp;
+}
+
 /****************************************************************************
  * IndexWriter
  ****************************************************************************/
@@ -6187,8 +9342,8 @@ int iw_doc_count(IndexWriter *iw)
     for (i = iw->sis->size - 1; i >= 0; i--) {
         doc_cnt += iw->sis->segs[i]->doc_cnt;
     }
-    if (iw->dw) {
-        doc_cnt += iw->dw->doc_num;
+    for (i = ary_size(iw->dws) - 1; i >= 0; i--) {
+        doc_cnt += iw->dws[i]->doc_num;
     }
     mutex_unlock(&iw->mutex);
     return doc_cnt;
@@ -6218,6 +9373,12 @@ static void iw_create_compound_file(Store *store, FieldInfos *fis,
         MOVE_TO_COMPOUND_DIR(file_name);
     }
 
+    /* segments without doc values fields have no .dvs file */
+    memcpy(ext, "dvs", 4);
+    if (store->exists(store, file_name)) {
+        MOVE_TO_COMPOUND_DIR(file_name);
+    }
+
     /* Field norm file_names */
     for (i = fis->size - 1; i >= 0; i--) {
         if (fi_has_norms(fis->fields[i])
@@ -6225,104 +9386,343 @@ static void iw_create_compound_file(Store *store, FieldInfos *fis,
             MOVE_TO_COMPOUND_DIR(file_name);
         }
     }
-
-    /* Perform the merge */
-    cw_close(cw);
+
+    /* Perform the merge */
+    cw_close(cw);
+}
+
+static void iw_commit_compound_file(IndexWriter *iw, SegmentInfo *si)
+{
+    char cfs_name[SEGMENT_NAME_MAX_LENGTH];
+    sprintf(cfs_name, "%s.cfs", si->name);
+
+    iw_create_compound_file(iw->store, iw->fis, si, cfs_name, iw->deleter);
+}
+
+/*
+ * A merge of a run of segments into the new segment +si+. The merged
+ * segments stay in the IndexWriter until the merge is committed so they are
+ * marked as merging to stop them being picked for another merge.
+ */
+struct FrtMergeTask
+{
+    SegmentInfo *si;
+    SegmentInfo **segs;
+    int *del_gens;          /* the del_gen of each segment at the start */
+    int seg_cnt;
+    FieldInfos *fis;        /* the fields when the merge started */
+    SegmentMerger *sm;
+    Deleter *dlr;           /* files moved into the compound file */
+    MergeTask *next;
+};
+
+/*
+ * Start a merge of the +seg_cnt+ segments in +segs+. They needn't be next to
+ * each other but they are merged in the order they are in iw->sis.
+ * iw->mutex must be locked.
+ */
+static MergeTask *mt_new(IndexWriter *iw, SegmentInfo **segs,
+                         const int seg_cnt)
+{
+    int i, j, k = 0;
+    MergeTask *mt = ALLOC_AND_ZERO(MergeTask);
+    mt->seg_cnt = seg_cnt;
+    mt->segs = ALLOC_N(SegmentInfo *, seg_cnt);
+    for (i = 0; i < iw->sis->size; i++) {
+        for (j = 0; j < seg_cnt; j++) {
+            if (iw->sis->segs[i] == segs[j]) {
+                mt->segs[k++] = segs[j];
+                break;
+            }
+        }
+    }
+    mt->si = si_new(new_segment(iw->sis->counter++), 0, iw->store);
+    mt->fis = fis_clone(iw->fis);
+    TRY
+        /* the deletions are read now so deletions made while the merge is
+         * running can be told apart */
+        mt->sm = sm_create(iw, mt->fis, mt->si, mt->segs, seg_cnt);
+    XCATCHALL
+        si_deref(mt->si);
+        fis_deref(mt->fis);
+        free(mt->segs);
+        free(mt);
+    XENDTRY
+    mt->dlr = deleter_new(NULL, iw->store);
+    mt->del_gens = ALLOC_N(int, seg_cnt);
+    for (i = 0; i < seg_cnt; i++) {
+        SegmentInfo *si = mt->segs[i];
+        REF(si);
+        si->merging = true;
+        mt->del_gens[i] = si->del_gen;
+    }
+    return mt;
+}
+
+/* iw->mutex must be locked */
+static void mt_destroy(MergeTask *mt)
+{
+    int i;
+    sm_destroy(mt->sm);
+    for (i = 0; i < mt->seg_cnt; i++) {
+        mt->segs[i]->merging = false;
+        si_deref(mt->segs[i]);
+    }
+    if (mt->si) {
+        si_deref(mt->si);
+    }
+    deleter_destroy(mt->dlr);
+    fis_deref(mt->fis);
+    free(mt->segs);
+    free(mt->del_gens);
+    free(mt);
+}
+
+/*
+ * Write the merged segment. Only the merge's own files are touched so this
+ * is safe to run in a merge thread without iw->mutex locked.
+ */
+static void mt_merge(IndexWriter *iw, MergeTask *mt)
+{
+    /* all of the merge's I/O on this thread goes through the rate limiter */
+    thread_set_rate_limiter(iw->merge_rate_limiter);
+    TRY
+        mt->si->doc_cnt = sm_merge(mt->sm);
+        if (iw->config.use_compound_file) {
+            char cfs_name[SEGMENT_NAME_MAX_LENGTH];
+            sprintf(cfs_name, "%s.cfs", mt->si->name);
+            iw_create_compound_file(iw->store, mt->fis, mt->si, cfs_name,
+                                    mt->dlr);
+            deleter_commit_pending_deletions(mt->dlr);
+            mt->si->use_compound_file = true;
+        }
+    XFINALLY
+        thread_set_rate_limiter(NULL);
+    XENDTRY
+}
+
+/*
+ * Docs may have been deleted from the merged segments while the merge was
+ * running. Delete them from the merged segment too.
+ */
+static void mt_carry_deletions(MergeTask *mt)
+{
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    BitVector *deleted_docs = NULL;
+    int i, doc;
+
+    for (i = 0; i < mt->seg_cnt; i++) {
+        SegmentInfo *si = mt->segs[i];
+        SegmentMergeInfo *smi = mt->sm->smis[i];
+        BitVector *bv;
+        if (si->del_gen < 0 || si->del_gen == mt->del_gens[i]) {
+            continue;
+        }
+        fn_for_generation(file_name, si->name, "del", si->del_gen);
+        bv = bv_read(si->store, file_name);
+        for (doc = bv_scan_next_from(bv, 0); doc >= 0;
+             doc = bv_scan_next_from(bv, doc + 1)) {
+            if (smi->deleted_docs && bv_get(smi->deleted_docs, doc)) {
+                continue;
+            }
+            if (NULL == deleted_docs) {
+                deleted_docs = bv_new_capa(mt->si->doc_cnt);
+            }
+            bv_set(deleted_docs, smi->base
+                   + (smi->doc_map ? smi->doc_map[doc] : doc));
+        }
+        bv_destroy(bv);
+    }
+    if (deleted_docs) {
+        mt->si->del_gen = 0;
+        fn_for_generation(file_name, mt->si->name, "del", mt->si->del_gen);
+        bv_write(deleted_docs, mt->si->store, file_name);
+        bv_destroy(deleted_docs);
+    }
 }
 
-static void iw_commit_compound_file(IndexWriter *iw, SegmentInfo *si)
+/* the position of +si+ in +sis+ */
+static int sis_index_of(SegmentInfos *sis, SegmentInfo *si)
 {
-    char cfs_name[SEGMENT_NAME_MAX_LENGTH];
-    sprintf(cfs_name, "%s.cfs", si->name);
-
-    iw_create_compound_file(iw->store, iw->fis, si, cfs_name, iw->deleter);
+    int i = 0;
+    while (sis->segs[i] != si) {
+        i++;
+    }
+    return i;
 }
 
-static void iw_merge_segments(IndexWriter *iw, const int min_seg,
-                              const int max_seg)
+/*
+ * Replace the merged segments with the merged segment, which takes the
+ * place of the first of them. Segments before them may have been merged in
+ * the meantime so they are searched for rather than remembered by position.
+ * iw->mutex must be locked.
+ */
+static void iw_install_merge_i(IndexWriter *iw, MergeTask *mt)
 {
-    int i;
     SegmentInfos *sis = iw->sis;
-    SegmentInfo *si = sis_new_segment(sis, 0, iw->store);
-
-    SegmentMerger *merger = sm_create(iw, si, &sis->segs[min_seg],
-                                      max_seg - min_seg);
+    HashSetEntry *hse;
+    int i;
 
-    /* This is where all the action happens. */
-    si->doc_cnt = sm_merge(merger);
+    mt_carry_deletions(mt);
 
     mutex_lock(&iw->store->mutex);
     /* delete merged segments */
-    for (i = min_seg; i < max_seg; i++) {
-        si_delete_files(sis->segs[i], iw->fis, iw->deleter);
+    for (i = 0; i < mt->seg_cnt; i++) {
+        si_delete_files(mt->segs[i], iw->fis, iw->deleter);
+    }
+    /* and any files the merge couldn't delete itself */
+    for (hse = mt->dlr->pending->first; hse; hse = hse->next) {
+        deleter_queue_file(iw->deleter, (char *)hse->elem);
     }
 
-    sis_del_from_to(sis, min_seg, max_seg);
-
-    if (iw->config.use_compound_file) {
-        iw_commit_compound_file(iw, si);
-        si->use_compound_file = true;
+    /* the segments are in order so removing the later ones doesn't move
+     * the first */
+    for (i = mt->seg_cnt - 1; i > 0; i--) {
+        sis_del_at(sis, sis_index_of(sis, mt->segs[i]));
     }
+    i = sis_index_of(sis, mt->segs[0]);
+    si_deref(sis->segs[i]);
+    sis->segs[i] = mt->si;
+    mt->si = NULL;
+    mutex_unlock(&iw->store->mutex);
+}
 
-    sis_write(sis, iw->store, iw->deleter);
-    deleter_commit_pending_deletions(iw->deleter);
+static void iw_merge_segments(IndexWriter *iw, SegmentInfo **segs,
+                              const int seg_cnt)
+{
+    MergeTask *mt = mt_new(iw, segs, seg_cnt);
 
-    mutex_unlock(&iw->store->mutex);
+    TRY
+        /* This is where all the action happens. */
+        mt_merge(iw, mt);
+        iw_install_merge_i(iw, mt);
+
+        mutex_lock(&iw->store->mutex);
+        sis_write(iw->sis, iw->store, iw->deleter);
+        deleter_commit_pending_deletions(iw->deleter);
+        iw->merges_uncommitted = false;
+        mutex_unlock(&iw->store->mutex);
+    XCATCHALL
+        mt_destroy(mt);
+    XENDTRY
+
+    mt_destroy(mt);
+}
 
-    sm_destroy(merger);
+/*
+ * Hand the merge of +segs+ to the merge threads. iw->mutex must be locked.
+ */
+static void iw_queue_merge_i(IndexWriter *iw, SegmentInfo **segs,
+                             const int seg_cnt)
+{
+    MergeTask *mt = mt_new(iw, segs, seg_cnt);
+    MergeTask **tail = &iw->merge_queue;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = mt;
+    cond_broadcast(&iw->merge_cond);
 }
 
-static void iw_merge_segments_from(IndexWriter *iw, int min_segment)
+/* Wait for all queued and running merges to be committed. iw->mutex must be
+ * locked. */
+static void iw_wait_for_merges_i(IndexWriter *iw)
 {
-    iw_merge_segments(iw, min_segment, iw->sis->size);
+    while (iw->merge_queue || iw->running_merges > 0) {
+        cond_wait(&iw->merge_cond, &iw->mutex);
+    }
 }
 
+/*
+ * Start the merges the merge policy picks. Without merge threads each merge
+ * is done before the policy is asked for the next one.
+ */
 static void iw_maybe_merge_segments(IndexWriter *iw)
 {
-    int target_merge_docs = iw->config.merge_factor;
-    int min_segment, merge_docs;
-    SegmentInfo *si;
+    SegmentInfo **segs = ALLOC_N(SegmentInfo *, iw->sis->size);
+    MergePolicy *mp = iw->merge_policy;
+    int seg_cnt;
 
-    while (target_merge_docs > 0
-           && target_merge_docs <= iw->config.max_merge_docs) {
-        /* find segments smaller than current target size */
-        min_segment = iw->sis->size - 1;
-        merge_docs = 0;
-        while (min_segment >= 0) {
-            si = iw->sis->segs[min_segment];
-            if (si->doc_cnt >= target_merge_docs) {
-                break;
+    TRY
+        while ((seg_cnt = mp->find_merge(mp, iw, segs)) > 0) {
+            if (iw->merge_thread_cnt > 0) {
+                iw_queue_merge_i(iw, segs, seg_cnt);
+            }
+            else {
+                iw_merge_segments(iw, segs, seg_cnt);
             }
-            merge_docs += si->doc_cnt;
-            min_segment--;
         }
+    XFINALLY
+        free(segs);
+    XENDTRY
+}
 
-        if (merge_docs >= target_merge_docs) { /* found a merge to do */
-            iw_merge_segments_from(iw, min_segment + 1);
-        }
-        else if (min_segment <= 0) {
-            break;
-        }
+/*
+ * Write the docs buffered by +dw+ to its segment. Each DocWriter writes its
+ * own segment so this doesn't need iw->mutex to be locked.
+ */
+static SegmentInfo *dw_flush_segment(DocWriter *dw)
+{
+    SegmentInfo *si = dw->si;
+    si->doc_cnt = dw->doc_num;
+    dw_flush(dw);
+    return si;
+}
 
-        target_merge_docs *= iw->config.merge_factor;
+/*
+ * Add a flushed segment to the IndexWriter without committing it. The
+ * segment can be read by the readers iw_get_reader opens but isn't in the
+ * segments file until iw_commit_segments is called.
+ */
+static void iw_add_flushed_segment(IndexWriter *iw, SegmentInfo *si)
+{
+    sis_add_si(iw->sis, si);
+    iw->uncommitted_cnt++;
+}
+
+/*
+ * Bring the memory +dw+ is counted as using in iw->buffered_memory up to
+ * date. iw->mutex must be locked and +dw+ mustn't be in use by another
+ * thread.
+ */
+static void iw_count_dw_memory_i(IndexWriter *iw, DocWriter *dw)
+{
+    const int used = dw_used(dw);
+    iw->buffered_memory += used - dw->counted_memory;
+    dw->counted_memory = used;
+}
+
+/*
+ * Flush the docs buffered by the DocWriters which aren't being used by
+ * other threads.
+ */
+static void iw_flush_ram_segments(IndexWriter *iw)
+{
+    int i;
+    for (i = 0; i < ary_size(iw->dws); i++) {
+        DocWriter *dw = iw->dws[i];
+        if (!dw->in_use && dw->doc_num > 0) {
+            iw_add_flushed_segment(iw, dw_flush_segment(dw));
+            iw_count_dw_memory_i(iw, dw);
+        }
     }
 }
 
-static void iw_flush_ram_segment(IndexWriter *iw)
+static void iw_commit_segments(IndexWriter *iw)
 {
     SegmentInfos *sis = iw->sis;
-    SegmentInfo *si;
-
-    si = sis->segs[sis->size - 1];
-    si->doc_cnt = iw->dw->doc_num;
-    dw_flush(iw->dw);
+    int i;
 
     mutex_lock(&iw->store->mutex);
 
     if (iw->config.use_compound_file) {
-        iw_commit_compound_file(iw, si);
-        si->use_compound_file = true;
+        for (i = sis->size - iw->uncommitted_cnt; i < sis->size; i++) {
+            iw_commit_compound_file(iw, sis->segs[i]);
+            sis->segs[i]->use_compound_file = true;
+        }
     }
+    iw->uncommitted_cnt = 0;
+    iw->merges_uncommitted = false;
     /* commit the segments file and the fields file */
     sis_write(iw->sis, iw->store, iw->deleter);
     deleter_commit_pending_deletions(iw->deleter);
@@ -6332,27 +9732,239 @@ static void iw_flush_ram_segment(IndexWriter *iw)
     iw_maybe_merge_segments(iw);
 }
 
-void iw_add_doc(IndexWriter *iw, Document *doc)
+static void iw_commit_i(IndexWriter *iw)
+{
+    iw_flush_ram_segments(iw);
+    if (iw->uncommitted_cnt > 0 || iw->merges_uncommitted) {
+        iw_commit_segments(iw);
+    }
+}
+
+/*
+ * Merge threads take merges off the queue, write the merged segment without
+ * iw->mutex locked so documents can still be added, then swap it in for the
+ * merged segments. The segments file isn't written as that would commit the
+ * segments iw_get_reader flushed, so the merge is committed by the next
+ * commit. Further merges are looked for unless flushed segments are waiting
+ * to be committed, in which case the commit will look for them.
+ */
+static void *iw_merge_thread(void *arg)
+{
+    IndexWriter *iw = (IndexWriter *)arg;
+    mutex_lock(&iw->mutex);
+    while (true) {
+        MergeTask *mt = iw->merge_queue;
+        char *volatile error = NULL;
+        volatile int excode = 0;
+        if (NULL == mt) {
+            if (iw->closing) {
+                break;
+            }
+            cond_wait(&iw->merge_cond, &iw->mutex);
+            continue;
+        }
+        iw->merge_queue = mt->next;
+        iw->running_merges++;
+        mutex_unlock(&iw->mutex);
+
+        TRY
+            mt_merge(iw, mt);
+        XCATCHALL
+            excode = xcontext.excode;
+            error = estrdup(xcontext.msg);
+            HANDLED();
+        XENDTRY
+
+        mutex_lock(&iw->mutex);
+        if (NULL == error) {
+            TRY
+                iw_install_merge_i(iw, mt);
+                iw->merges_uncommitted = true;
+                if (0 == iw->uncommitted_cnt) {
+                    iw_maybe_merge_segments(iw);
+                }
+            XCATCHALL
+                excode = xcontext.excode;
+                error = estrdup(xcontext.msg);
+                HANDLED();
+            XENDTRY
+        }
+        if (error) {
+            /* the segments are left as they were */
+            if (mt->si) {
+                si_delete_files(mt->si, mt->fis, iw->deleter);
+            }
+            free(iw->merge_error);
+            iw->merge_error = error;
+            iw->merge_excode = excode;
+        }
+        mt_destroy(mt);
+        iw->running_merges--;
+        cond_broadcast(&iw->merge_cond);
+    }
+    mutex_unlock(&iw->mutex);
+    return NULL;
+}
+
+/*
+ * Raise the error of the last merge which failed in a merge thread. The
+ * merged segments are left in the index so no docs are lost.
+ */
+static void iw_raise_merge_error(IndexWriter *iw)
 {
+    char msg[XMSG_BUFFER_SIZE];
+    int excode;
     mutex_lock(&iw->mutex);
-    if (NULL == iw->dw) {
-        iw->dw = dw_open(iw, sis_new_segment(iw->sis, 0, iw->store));
+    if (NULL == iw->merge_error) {
+        mutex_unlock(&iw->mutex);
+        return;
     }
-    else if (NULL == iw->dw->fw) {
-        dw_new_segment(iw->dw, sis_new_segment(iw->sis, 0, iw->store));
+    excode = iw->merge_excode;
+    snprintf(msg, XMSG_BUFFER_SIZE, "%s", iw->merge_error);
+    free(iw->merge_error);
+    iw->merge_error = NULL;
+    mutex_unlock(&iw->mutex);
+    RAISE(excode, "%s", msg);
+}
+
+/*
+ * Add the fields of +doc+ which the IndexWriter hasn't seen yet. The
+ * FieldInfos are only changed with iw->mutex locked so they can be read
+ * here without the fis_lock.
+ */
+static void iw_add_fields_i(IndexWriter *iw, Document *doc)
+{
+    int i;
+    for (i = 0; i < doc->size; i++) {
+        if (NULL == fis_get_field(iw->fis, doc->fields[i]->name)) {
+            rwlock_wrlock(&iw->fis_lock);
+            for (; i < doc->size; i++) {
+                fis_get_or_add_field(iw->fis, doc->fields[i]->name);
+            }
+            rwlock_unlock(&iw->fis_lock);
+        }
+    }
+}
+
+/*
+ * Get a DocWriter which no other thread is using, opening a new one if they
+ * all are. Segment names are handed out here but the segment isn't added
+ * to the IndexWriter until the DocWriter is flushed.
+ */
+static DocWriter *iw_checkout_dw_i(IndexWriter *iw)
+{
+    DocWriter *dw = NULL;
+    int i;
+    for (i = ary_size(iw->dws) - 1; i >= 0; i--) {
+        if (!iw->dws[i]->in_use) {
+            dw = iw->dws[i];
+            break;
+        }
+    }
+    if (NULL == dw) {
+        dw = dw_open(iw, si_new(new_segment(iw->sis->counter++), 0,
+                                iw->store));
+        ary_push(iw->dws, dw);
+    }
+    else if (NULL == dw->fw) {
+        dw_new_segment(dw, si_new(new_segment(iw->sis->counter++), 0,
+                                  iw->store));
+    }
+    dw->in_use = true;
+    return dw;
+}
+
+/*
+ * max_buffer_memory limits the memory used by all of the DocWriters together
+ * so once it is passed the idle DocWriter using the most is flushed. Returns
+ * that DocWriter checked out or NULL if the limit isn't passed or all the
+ * other DocWriters are in use. iw->mutex must be locked.
+ */
+static DocWriter *iw_checkout_largest_dw_i(IndexWriter *iw)
+{
+    DocWriter *largest = NULL;
+    int i;
+    if (iw->buffered_memory <= iw->config.max_buffer_memory) {
+        return NULL;
+    }
+    for (i = ary_size(iw->dws) - 1; i >= 0; i--) {
+        DocWriter *dw = iw->dws[i];
+        if (!dw->in_use && dw->doc_num > 0
+            && (NULL == largest
+                || dw->counted_memory > largest->counted_memory)) {
+            largest = dw;
+        }
     }
-    dw_add_doc(iw->dw, doc);
-    if (mp_used(iw->dw->mp) > iw->config.max_buffer_memory
-        || iw->dw->doc_num >= iw->config.max_buffered_docs) {
-        iw_flush_ram_segment(iw);
+    if (largest) {
+        largest->in_use = true;
     }
+    return largest;
+}
+
+/*
+ * Flush the checked out DocWriter +dw+ and check it back in. Returns the
+ * next DocWriter to flush if the DocWriters are still over the memory limit.
+ */
+static DocWriter *iw_flush_dw(IndexWriter *iw, DocWriter *dw)
+{
+    SegmentInfo *volatile flushed = NULL;
+    DocWriter *next;
+
+    rwlock_rdlock(&iw->fis_lock);
+    TRY
+        flushed = dw_flush_segment(dw);
+    XCATCHALL
+        rwlock_unlock(&iw->fis_lock);
+        mutex_lock(&iw->mutex);
+        dw->in_use = false;
+        mutex_unlock(&iw->mutex);
+    XENDTRY
+    rwlock_unlock(&iw->fis_lock);
+
+    mutex_lock(&iw->mutex);
+    iw_count_dw_memory_i(iw, dw);
+    dw->in_use = false;
+    iw_add_flushed_segment(iw, flushed);
+    iw_commit_i(iw);
+    next = iw_checkout_largest_dw_i(iw);
     mutex_unlock(&iw->mutex);
+    return next;
 }
 
-static void iw_commit_i(IndexWriter *iw)
+void iw_add_doc(IndexWriter *iw, Document *doc)
 {
-    if (iw->dw && iw->dw->doc_num > 0) {
-        iw_flush_ram_segment(iw);
+    DocWriter *dw;
+
+    mutex_lock(&iw->mutex);
+    iw_add_fields_i(iw, doc);
+    dw = iw_checkout_dw_i(iw);
+    mutex_unlock(&iw->mutex);
+
+    /* analysis, inversion and flushing happen in parallel in each thread's
+     * own DocWriter. The FieldInfos are read locked so no fields are added
+     * while the DocWriter is using them */
+    rwlock_rdlock(&iw->fis_lock);
+    TRY
+        dw_add_doc(dw, doc);
+    XCATCHALL
+        rwlock_unlock(&iw->fis_lock);
+        mutex_lock(&iw->mutex);
+        iw_count_dw_memory_i(iw, dw);
+        dw->in_use = false;
+        mutex_unlock(&iw->mutex);
+    XENDTRY
+    rwlock_unlock(&iw->fis_lock);
+
+    mutex_lock(&iw->mutex);
+    iw_count_dw_memory_i(iw, dw);
+    if (dw->doc_num < iw->config.max_buffered_docs) {
+        dw->in_use = false;
+        dw = iw_checkout_largest_dw_i(iw);
+    }
+    mutex_unlock(&iw->mutex);
+
+    while (dw) {
+        dw = iw_flush_dw(iw, dw);
     }
 }
 
@@ -6361,6 +9973,7 @@ void iw_commit(IndexWriter *iw)
     mutex_lock(&iw->mutex);
     iw_commit_i(iw);
     mutex_unlock(&iw->mutex);
+    iw_raise_merge_error(iw);
 }
 
 void iw_delete_term(IndexWriter *iw, Symbol field, const char *term)
@@ -6375,7 +9988,7 @@ void iw_delete_term(IndexWriter *iw, Symbol field, const char *term)
             const int seg_cnt = sis->size;
             bool did_delete = false;
             for (i = 0; i < seg_cnt; i++) {
-                IndexReader *ir = sr_open(sis, iw->fis, i, false);
+                IndexReader *ir = sr_open(sis, iw->fis, i, false, NULL);
                 TermDocEnum *tde = ir->term_docs(ir);
                 ir->deleter = iw->deleter;
                 stde_seek(tde, field_num, term);
@@ -6410,7 +10023,7 @@ void iw_delete_terms(IndexWriter *iw, Symbol field,
             const int seg_cnt = sis->size;
             bool did_delete = false;
             for (i = 0; i < seg_cnt; i++) {
-                IndexReader *ir = sr_open(sis, iw->fis, i, false);
+                IndexReader *ir = sr_open(sis, iw->fis, i, false, NULL);
                 TermDocEnum *tde = ir->term_docs(ir);
                 int j;
                 for (j = 0 ; j < term_cnt; j++) {
@@ -6440,6 +10053,7 @@ static void iw_optimize_i(IndexWriter *iw)
 {
     int min_segment;
     iw_commit_i(iw);
+    iw_wait_for_merges_i(iw);
     while (iw->sis->size > 1
            || (iw->sis->size == 1
                && (si_has_deletions(iw->sis->segs[0])
@@ -6448,8 +10062,14 @@ static void iw_optimize_i(IndexWriter *iw)
                        && (!iw->sis->segs[0]->use_compound_file
                            || si_has_separate_norms(iw->sis->segs[0])))))) {
         min_segment = iw->sis->size - iw->config.merge_factor;
-        iw_merge_segments_from(iw, min_segment < 0 ? 0 : min_segment);
+        if (min_segment < 0) {
+            min_segment = 0;
+        }
+        iw_merge_segments(iw, &iw->sis->segs[min_segment],
+                          iw->sis->size - min_segment);
     }
+    /* commit the merge threads' merges if no merge was needed after them */
+    iw_commit_i(iw);
 }
 
 void iw_optimize(IndexWriter *iw)
@@ -6457,15 +10077,112 @@ void iw_optimize(IndexWriter *iw)
     mutex_lock(&iw->mutex);
     iw_optimize_i(iw);
     mutex_unlock(&iw->mutex);
+    iw_raise_merge_error(iw);
+}
+
+void iw_expunge_deletes(IndexWriter *iw)
+{
+    SegmentInfo **volatile segs = NULL;
+    int seg_cnt;
+    mutex_lock(&iw->mutex);
+    TRY
+        iw_commit_i(iw);
+        iw_wait_for_merges_i(iw);
+        segs = ALLOC_N(SegmentInfo *, iw->sis->size);
+        while ((seg_cnt = iw->merge_policy->find_expunge_merge(
+                    iw->merge_policy, iw, segs)) > 0) {
+            iw_merge_segments(iw, segs, seg_cnt);
+        }
+        iw_commit_i(iw);
+    XFINALLY
+        free(segs);
+        mutex_unlock(&iw->mutex);
+    XENDTRY
+    iw_raise_merge_error(iw);
+}
+
+void iw_set_merge_policy(IndexWriter *iw, MergePolicy *mp)
+{
+    mutex_lock(&iw->mutex);
+    iw->merge_policy->destroy(iw->merge_policy);
+    iw->merge_policy = mp;
+    mutex_unlock(&iw->mutex);
+}
+
+void iw_set_max_merge_mb_per_sec(IndexWriter *iw, double mb_per_sec)
+{
+    mutex_lock(&iw->mutex);
+    iw->config.max_merge_mb_per_sec = mb_per_sec;
+    rate_limiter_set_mb_per_sec(iw->merge_rate_limiter, mb_per_sec);
+    mutex_unlock(&iw->mutex);
+}
+
+IndexReader *iw_get_reader(IndexWriter *iw)
+{
+    IndexReader *volatile ir = NULL;
+    SegmentInfos *volatile sis = NULL;
+
+    mutex_lock(&iw->mutex);
+    TRY
+        iw_flush_ram_segments(iw);
+        sis = sis_clone(iw->sis);
+        ir = ir_open_segments(iw->store, sis, iw->reader);
+        ir->acquire_write_lock = &ir_acquire_read_only;
+        if (iw->reader) {
+            ir_close(iw->reader);
+        }
+        /* keep the reader so the next one can share its segment cores */
+        iw->reader = ir;
+        ir->ref_cnt++;
+    XCATCHALL
+        if (NULL == ir && NULL != sis) {
+            sis_destroy(sis);
+        }
+        mutex_unlock(&iw->mutex);
+    XENDTRY
+    mutex_unlock(&iw->mutex);
+
+    return ir;
 }
 
 void iw_close(IndexWriter *iw)
 {
+    int i;
     mutex_lock(&iw->mutex);
     iw_commit_i(iw);
-    if (iw->dw) {
-        dw_close(iw->dw);
+    if (iw->merge_thread_cnt > 0) {
+        /* the merges are only committed here and committing them may start
+         * more */
+        iw_wait_for_merges_i(iw);
+        while (iw->merges_uncommitted) {
+            iw_commit_i(iw);
+            iw_wait_for_merges_i(iw);
+        }
+        iw->closing = true;
+        cond_broadcast(&iw->merge_cond);
+        mutex_unlock(&iw->mutex);
+        for (i = 0; i < iw->merge_thread_cnt; i++) {
+            thread_join(iw->merge_threads[i]);
+        }
+        mutex_lock(&iw->mutex);
+        free(iw->merge_threads);
+    }
+    free(iw->merge_error);
+    iw->merge_policy->destroy(iw->merge_policy);
+    rate_limiter_destroy(iw->merge_rate_limiter);
+    if (iw->reader) {
+        ir_close(iw->reader);
+    }
+    for (i = ary_size(iw->dws) - 1; i >= 0; i--) {
+        DocWriter *dw = iw->dws[i];
+        /* a segment was started but adding the doc to it failed */
+        SegmentInfo *si = dw->fw ? dw->si : NULL;
+        dw_close(dw);
+        if (si) {
+            si_deref(si);
+        }
     }
+    ary_free(iw->dws);
     a_deref(iw->analyzer);
     sis_destroy(iw->sis);
     fis_deref(iw->fis);
@@ -6477,6 +10194,8 @@ void iw_close(IndexWriter *iw)
     store_deref(iw->store);
     deleter_destroy(iw->deleter);
 
+    rwlock_destroy(&iw->fis_lock);
+    cond_destroy(&iw->merge_cond);
     mutex_destroy(&iw->mutex);
     free(iw);
 }
@@ -6486,6 +10205,8 @@ IndexWriter *iw_open(Store *store, Analyzer *volatile analyzer,
 {
     IndexWriter *iw = ALLOC_AND_ZERO(IndexWriter);
     mutex_init(&iw->mutex, NULL);
+    rwlock_init(&iw->fis_lock);
+    cond_init(&iw->merge_cond);
     iw->store = store;
     if (!config) {
         config = &default_config;
@@ -6514,12 +10235,25 @@ IndexWriter *iw_open(Store *store, Analyzer *volatile analyzer,
     XENDTRY
 
     iw->similarity = sim_create_default();
+    iw->merge_policy = log_merge_policy_new();
+    iw->merge_rate_limiter =
+        rate_limiter_new(iw->config.max_merge_mb_per_sec, store);
+    iw->dws = (DocWriter **)ary_new();
     iw->analyzer = analyzer ? (Analyzer *)analyzer
                             : mb_standard_analyzer_new(true);
 
     iw->deleter = deleter_new(iw->sis, store);
     deleter_delete_deletable_files(iw->deleter);
 
+    if (iw->config.merge_threads > 0) {
+        int i;
+        iw->merge_thread_cnt = iw->config.merge_threads;
+        iw->merge_threads = ALLOC_N(thread_t, iw->merge_thread_cnt);
+        for (i = 0; i < iw->merge_thread_cnt; i++) {
+            thread_create(&iw->merge_threads[i], &iw_merge_thread, iw);
+        }
+    }
+
     REF(store);
     return iw;
 }
@@ -6533,7 +10267,7 @@ static void iw_cp_fields(IndexWriter *iw, SegmentReader *sr,
     char file_name[SEGMENT_NAME_MAX_LENGTH];
     OutStream *fdt_out, *fdx_out;
     InStream *fdt_in, *fdx_in;
-    Store *store_in = sr->cfs_store ? sr->cfs_store : sr->ir.store;
+    Store *store_in = sr->core->cfs_store ? sr->core->cfs_store : sr->ir.store;
     Store *store_out = iw->store;
     char *sr_segment = sr->si->name;
 
@@ -6621,7 +10355,7 @@ static void iw_cp_terms(IndexWriter *iw, SegmentReader *sr,
     OutStream *tix_out, *tis_out, *tfx_out, *frq_out, *prx_out;
     InStream *tix_in, *tis_in, *tfx_in, *frq_in, *prx_in;
     Store *store_out = iw->store;
-    Store *store_in = sr->cfs_store ? sr->cfs_store : sr->ir.store;
+    Store *store_in = sr->core->cfs_store ? sr->core->cfs_store : sr->ir.store;
     char *sr_segment = sr->si->name;
 
     sprintf(file_name, "%s.tix", segment);
@@ -6650,8 +10384,21 @@ static void iw_cp_terms(IndexWriter *iw, SegmentReader *sr,
     prx_in = store_in->open_input(store_in, file_name);
 
     if (map) {
-        int field_cnt = is_read_u32(tfx_in);
-        os_write_u32(tfx_out, field_cnt);
+        int field_cnt = is_read_i32(tfx_in);
+        if (field_cnt < 0) {
+            int format = field_cnt;
+            os_write_i32(tfx_out, format);
+            field_cnt = is_read_u32(tfx_in);
+            os_write_u32(tfx_out, field_cnt);
+            os_write_vint(tfx_out, is_read_vint(tfx_in)); /* skip_multiplier */
+            os_write_vint(tfx_out, is_read_vint(tfx_in)); /* max_skip_levels */
+            if (format <= TFX_FORMAT_POSTINGS_FORMAT) {
+                os_write_vint(tfx_out, is_read_vint(tfx_in)); /* postings */
+            }
+        }
+        else {
+            os_write_u32(tfx_out, field_cnt);
+        }
         os_write_vint(tfx_out, is_read_vint(tfx_in)); /* index_interval */
         os_write_vint(tfx_out, is_read_vint(tfx_in)); /* skip_interval */
 
@@ -6699,7 +10446,7 @@ static void iw_cp_norms(IndexWriter *iw, SegmentReader *sr,
         if (fi_has_norms(fis->fields[i])
             && si_norm_file_name(sr->si, file_name_in, i)) {
             Store *store = (sr->si->use_compound_file
-                            && sr->si->norm_gens[i] == 0) ? sr->cfs_store
+                            && sr->si->norm_gens[i] == 0) ? sr->core->cfs_store
                                                           : IR(sr)->store;
             int field_num = map ? map[i] : i;
 
@@ -6714,6 +10461,32 @@ static void iw_cp_norms(IndexWriter *iw, SegmentReader *sr,
     }
 }
 
+static void iw_cp_doc_values(IndexWriter *iw, SegmentReader *sr,
+                             const char *segment, int *field_map)
+{
+    char file_name[SEGMENT_NAME_MAX_LENGTH];
+    OutStream *os;
+    InStream *is;
+    off_t dir_ptr;
+
+    if (NULL == sr->core->dvs_in) {
+        return;
+    }
+    is = is_clone(sr->core->dvs_in);
+    sprintf(file_name, "%s.dvs", segment);
+    os = iw->store->new_output(iw->store, file_name);
+
+    /* only the field numbers in the directory need to be mapped */
+    is_seek(is, 0);
+    dir_ptr = (off_t)is_read_u64(is);
+    is_seek(is, 0);
+    is2os_copy_bytes(is, os, dir_ptr);
+    dvs_write_directory(os, sr->core->dv_entries, sr->core->dv_entry_cnt, field_map);
+
+    os_close(os);
+    is_close(is);
+}
+
 static void iw_cp_map_files(IndexWriter *iw, SegmentReader *sr,
                             SegmentInfo *si)
 {
@@ -6730,6 +10503,7 @@ static void iw_cp_map_files(IndexWriter *iw, SegmentReader *sr,
     iw_cp_fields(iw, sr, si->name, field_map);
     iw_cp_terms( iw, sr, si->name, field_map);
     iw_cp_norms( iw, sr, si,       field_map);
+    iw_cp_doc_values(iw, sr, si->name, field_map);
 
     free(field_map);
 }
@@ -6740,6 +10514,7 @@ static void iw_cp_files(IndexWriter *iw, SegmentReader *sr,
     iw_cp_fields(iw, sr, si->name, NULL);
     iw_cp_terms( iw, sr, si->name, NULL);
     iw_cp_norms( iw, sr, si,       NULL);
+    iw_cp_doc_values(iw, sr, si->name, NULL);
 }
 
 static void iw_add_segment(IndexWriter *iw, SegmentReader *sr)
@@ -6753,6 +10528,7 @@ static void iw_add_segment(IndexWriter *iw, SegmentReader *sr)
 
     si->doc_cnt = IR(sr)->max_doc(IR(sr));
     /* Merge FieldInfos */
+    rwlock_wrlock(&iw->fis_lock);
     for (j = 0; j < fis_size; j++) {
         FieldInfo *fi = sub_fis->fields[j];
         FieldInfo *new_fi = fis_get_field(fis, fi->name);
@@ -6766,6 +10542,7 @@ static void iw_add_segment(IndexWriter *iw, SegmentReader *sr)
             must_map_fields = true;
         }
     }
+    rwlock_unlock(&iw->fis_lock);
 
     if (must_map_fields) {
         iw_cp_map_files(iw, sr, si);
@@ -1,4 +1,6 @@
 #include <string.h>
+#include <limits.h>
+#include <math.h>
 #include "search.h"
 #include "array.h"
 #include "internal.h"
@@ -260,6 +262,286 @@ static Scorer *counting_disjunction_sum_scorer_new(
     return self;
 }
 
+/***************************************************************************
+ * BlockMaxWandScorer
+ ***************************************************************************/
+
+/* A disjunction which skips docs that can't score higher than min_score.
+ * Docs are visited in windows within which every sub-scorer's score is
+ * bounded by its max_score. The sub-scorers with the lowest bounds which
+ * together can't beat min_score are non-essential. Only docs matched by an
+ * essential sub-scorer are candidates and the non-essential sub-scorers are
+ * only advanced while the candidate could still compete. */
+
+#define BMWSc(scorer) ((BlockMaxWandScorer *)(scorer))
+
+/* min_score is lowered by this fraction so that a bound rounding differently
+ * to the sum it bounds can't lose a hit */
+#define BMW_SCORE_SLACK 1e-5f
+
+typedef struct BlockMaxWandScorer
+{
+    Scorer          super;
+    float           cum_score;
+    int             num_matches;
+    Scorer        **sub_scorers;
+    int             ss_cnt;
+    Scorer        **scorers;        /* live sub-scorers sorted by bound */
+    float          *max_scores;     /* their bounds in the current window */
+    int             s_cnt;
+    int             ne_cnt;         /* number of non-essential sub-scorers */
+    float           ne_max_score;   /* sum of their bounds */
+    int             up_to;          /* last doc in the current window */
+    float           min_score;
+    float          *max_coords;     /* highest coord factor up to n matches */
+    Coordinator    *coordinator;
+} BlockMaxWandScorer;
+
+static float bmwsc_score(Scorer *self)
+{
+    BMWSc(self)->coordinator->num_matches += BMWSc(self)->num_matches;
+    return BMWSc(self)->cum_score;
+}
+
+static void bmwsc_init(BlockMaxWandScorer *bmwsc)
+{
+    int i;
+    Scorer *sub_scorer;
+    bmwsc->scorers = ALLOC_N(Scorer *, bmwsc->ss_cnt);
+    bmwsc->max_scores = ALLOC_AND_ZERO_N(float, bmwsc->ss_cnt);
+    bmwsc->s_cnt = 0;
+    for (i = 0; i < bmwsc->ss_cnt; i++) {
+        sub_scorer = bmwsc->sub_scorers[i];
+        if (sub_scorer->next(sub_scorer)) {
+            bmwsc->scorers[bmwsc->s_cnt++] = sub_scorer;
+        }
+    }
+}
+
+/* Find the non-essential sub-scorers. A doc matching only those scores no
+ * more than the sum of their bounds times the best coord factor for that many
+ * matches. */
+static void bmwsc_partition(BlockMaxWandScorer *bmwsc)
+{
+    float sum = 0.0f, next_sum;
+    int i;
+    for (i = 0; i < bmwsc->s_cnt; i++) {
+        next_sum = sum + bmwsc->max_scores[i];
+        if (next_sum * bmwsc->max_coords[i + 1] > bmwsc->min_score) {
+            break;
+        }
+        sum = next_sum;
+    }
+    bmwsc->ne_cnt = i;
+    bmwsc->ne_max_score = sum;
+}
+
+static void bmwsc_update_window(BlockMaxWandScorer *bmwsc, int target)
+{
+    int i, j, sub_up_to, up_to = INT_MAX;
+    Scorer *sub_scorer;
+    float max_score;
+
+    for (i = 0; i < bmwsc->s_cnt; i++) {
+        sub_scorer = bmwsc->scorers[i];
+        max_score = sub_scorer->max_score(sub_scorer, target, &sub_up_to);
+        if (sub_up_to < up_to) {
+            up_to = sub_up_to;
+        }
+        /* insertion sort by bound, there are only a few sub-scorers */
+        for (j = i; j > 0 && bmwsc->max_scores[j - 1] > max_score; j--) {
+            bmwsc->max_scores[j] = bmwsc->max_scores[j - 1];
+            bmwsc->scorers[j] = bmwsc->scorers[j - 1];
+        }
+        bmwsc->max_scores[j] = max_score;
+        bmwsc->scorers[j] = sub_scorer;
+    }
+    bmwsc->up_to = up_to;
+    bmwsc_partition(bmwsc);
+}
+
+/* drop an exhausted sub-scorer. It is destroyed with the others later */
+static void bmwsc_remove(BlockMaxWandScorer *bmwsc, int i)
+{
+    bmwsc->s_cnt--;
+    memmove(bmwsc->scorers + i, bmwsc->scorers + i + 1,
+            (bmwsc->s_cnt - i) * sizeof(Scorer *));
+    memmove(bmwsc->max_scores + i, bmwsc->max_scores + i + 1,
+            (bmwsc->s_cnt - i) * sizeof(float));
+    bmwsc->up_to = -1; /* the window needs to be recalculated */
+}
+
+static bool bmwsc_advance(Scorer *self, int target)
+{
+    BlockMaxWandScorer *bmwsc = BMWSc(self);
+    Scorer *sub_scorer;
+    float *coord_factors = bmwsc->coordinator->coord_factors;
+
+    while (true) {
+        int i, doc = INT_MAX, num_matches = 0;
+        float score = 0.0f, max_score;
+
+        if (target > bmwsc->up_to) {
+            if (0 == bmwsc->s_cnt) {
+                return false;
+            }
+            bmwsc_update_window(bmwsc, target);
+            if (bmwsc->ne_cnt == bmwsc->s_cnt) {
+                /* nothing in this window can compete */
+                if (INT_MAX == bmwsc->up_to) {
+                    return false;
+                }
+                target = bmwsc->up_to + 1;
+                continue;
+            }
+        }
+
+        /* the candidate is the first doc of the essential sub-scorers */
+        for (i = bmwsc->s_cnt - 1; i >= bmwsc->ne_cnt; i--) {
+            sub_scorer = bmwsc->scorers[i];
+            if (sub_scorer->doc < target
+                && !sub_scorer->skip_to(sub_scorer, target)) {
+                bmwsc_remove(bmwsc, i);
+            }
+            else if (sub_scorer->doc < doc) {
+                doc = sub_scorer->doc;
+            }
+        }
+        if (bmwsc->up_to < 0) {
+            continue;           /* a sub-scorer was removed so start again */
+        }
+        else if (doc > bmwsc->up_to) {
+            /* the non-essential sub-scorers may match docs before the
+             * candidate in the windows that follow */
+            target = bmwsc->up_to + 1;
+            continue;
+        }
+
+        for (i = bmwsc->s_cnt - 1; i >= bmwsc->ne_cnt; i--) {
+            sub_scorer = bmwsc->scorers[i];
+            if (sub_scorer->doc == doc) {
+                score += sub_scorer->score(sub_scorer);
+                num_matches++;
+            }
+        }
+
+        /* add the non-essential sub-scorers, highest bound first, until the
+         * candidate can no longer compete */
+        max_score = bmwsc->ne_max_score;
+        for (i = bmwsc->ne_cnt - 1; i >= 0; i--) {
+            if ((score + max_score) * bmwsc->max_coords[num_matches + i + 1]
+                <= bmwsc->min_score) {
+                break;
+            }
+            sub_scorer = bmwsc->scorers[i];
+            max_score -= bmwsc->max_scores[i];
+            if (sub_scorer->doc < doc && !sub_scorer->skip_to(sub_scorer, doc)) {
+                bmwsc_remove(bmwsc, i);
+            }
+            else if (sub_scorer->doc == doc) {
+                score += sub_scorer->score(sub_scorer);
+                num_matches++;
+            }
+        }
+
+        if (i < 0 && score * coord_factors[num_matches] > bmwsc->min_score) {
+            self->doc = doc;
+            bmwsc->cum_score = score;
+            bmwsc->num_matches = num_matches;
+            return true;
+        }
+        target = doc + 1;
+    }
+}
+
+static bool bmwsc_next(Scorer *self)
+{
+    if (NULL == BMWSc(self)->scorers) {
+        bmwsc_init(BMWSc(self));
+    }
+    return bmwsc_advance(self, self->doc + 1);
+}
+
+static bool bmwsc_skip_to(Scorer *self, int doc_num)
+{
+    if (NULL == BMWSc(self)->scorers) {
+        bmwsc_init(BMWSc(self));
+    }
+    if (doc_num <= self->doc) {
+        doc_num = self->doc + 1;
+    }
+    return bmwsc_advance(self, doc_num);
+}
+
+static void bmwsc_set_min_score(Scorer *self, float min_score)
+{
+    BlockMaxWandScorer *bmwsc = BMWSc(self);
+    bmwsc->min_score = min_score - fabsf(min_score) * BMW_SCORE_SLACK;
+    if (bmwsc->up_to >= 0) {
+        bmwsc_partition(bmwsc);
+    }
+}
+
+static Explanation *bmwsc_explain(Scorer *self, int doc_num)
+{
+    int i;
+    BlockMaxWandScorer *bmwsc = BMWSc(self);
+    Scorer *sub_scorer;
+    Explanation *e = expl_new(0.0, "At least 1 of:");
+    for (i = 0; i < bmwsc->ss_cnt; i++) {
+        sub_scorer = bmwsc->sub_scorers[i];
+        expl_add_detail(e, sub_scorer->explain(sub_scorer, doc_num));
+    }
+    return e;
+}
+
+static void bmwsc_destroy(Scorer *self)
+{
+    BlockMaxWandScorer *bmwsc = BMWSc(self);
+    int i;
+    for (i = 0; i < bmwsc->ss_cnt; i++) {
+        bmwsc->sub_scorers[i]->destroy(bmwsc->sub_scorers[i]);
+    }
+    free(bmwsc->scorers);
+    free(bmwsc->max_scores);
+    free(bmwsc->max_coords);
+    scorer_destroy_i(self);
+}
+
+/* All of +sub_scorers+ must implement max_score. The coordinator must already
+ * be initialized. */
+static Scorer *block_max_wand_scorer_new(Coordinator *coordinator,
+                                         Scorer **sub_scorers, int ss_cnt,
+                                         float min_score)
+{
+    int i;
+    Scorer *self = scorer_new(BlockMaxWandScorer, NULL);
+    BlockMaxWandScorer *bmwsc = BMWSc(self);
+
+    self->doc = -1;
+    bmwsc->sub_scorers = sub_scorers;
+    bmwsc->ss_cnt = ss_cnt;
+    bmwsc->scorers = NULL;
+    bmwsc->up_to = -1;
+    bmwsc->coordinator = coordinator;
+    bmwsc->max_coords = ALLOC_N(float, coordinator->max_coord + 1);
+    bmwsc->max_coords[0] = coordinator->coord_factors[0];
+    for (i = 1; i <= coordinator->max_coord; i++) {
+        bmwsc->max_coords[i] = MAX(bmwsc->max_coords[i - 1],
+                                   coordinator->coord_factors[i]);
+    }
+
+    self->score         = &bmwsc_score;
+    self->next          = &bmwsc_next;
+    self->skip_to       = &bmwsc_skip_to;
+    self->explain       = &bmwsc_explain;
+    self->destroy       = &bmwsc_destroy;
+    self->set_min_score = &bmwsc_set_min_score;
+    bmwsc_set_min_score(self, min_score);
+
+    return self;
+}
+
 /***************************************************************************
  * ConjunctionScorer
  ***************************************************************************/
@@ -851,8 +1133,27 @@ typedef struct BooleanScorer
     int             ps_capa;
     Scorer         *counting_sum_scorer;
     Coordinator    *coordinator;
+    Scorer         *bmw_scorer;     /* gets min_score when pruning */
+    float           min_score;
+    bool            prune : 1;
 } BooleanScorer;
 
+/* Only pure disjunctions of sub-scorers which can bound their scores are
+ * pruned */
+static bool bsc_can_prune(BooleanScorer *bsc)
+{
+    int i;
+    if (!bsc->prune || bsc->rs_cnt > 0 || bsc->os_cnt < 2) {
+        return false;
+    }
+    for (i = 0; i < bsc->os_cnt; i++) {
+        if (NULL == bsc->optional_scorers[i]->max_score) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static Scorer *counting_sum_scorer_create3(BooleanScorer *bsc,
                                            Scorer *req_scorer,
                                            Scorer *opt_scorer)
@@ -935,6 +1236,13 @@ static Scorer *counting_sum_scorer_create(BooleanScorer *bsc)
                                            bsc->optional_scorers[0]),
                 NULL, 0); /* no optional scorers left */
         }
+        else if (bsc_can_prune(bsc)) {
+            bsc->bmw_scorer = block_max_wand_scorer_new(bsc->coordinator,
+                                                        bsc->optional_scorers,
+                                                        bsc->os_cnt,
+                                                        bsc->min_score);
+            return counting_sum_scorer_create2(bsc, bsc->bmw_scorer, NULL, 0);
+        }
         else {
             /* more than 1 optional_scorers, no required scorers */
             return counting_sum_scorer_create2(
@@ -1037,6 +1345,19 @@ static bool bsc_skip_to(Scorer *self, int doc_num)
     }
 }
 
+static void bsc_set_min_score(Scorer *self, float min_score)
+{
+    BooleanScorer *bsc = BSc(self);
+    if (bsc->bmw_scorer) {
+        bsc->bmw_scorer->set_min_score(bsc->bmw_scorer, min_score);
+    }
+    else if (NULL == bsc->counting_sum_scorer) {
+        /* it's not too late to choose a scorer which can prune */
+        bsc->prune = true;
+        bsc->min_score = min_score;
+    }
+}
+
 static void bsc_destroy(Scorer *self)
 {
     BooleanScorer *bsc = BSc(self);
@@ -1085,6 +1406,7 @@ static Scorer *bsc_new(Similarity *similarity)
     self->skip_to   = &bsc_skip_to;
     self->explain   = &bsc_explain;
     self->destroy   = &bsc_destroy;
+    self->set_min_score = &bsc_set_min_score;
     return self;
 }
 
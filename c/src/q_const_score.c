@@ -13,9 +13,9 @@
 
 typedef struct ConstantScoreScorer
 {
-    Scorer      super;
-    BitVector  *bv;
-    float       score;
+    Scorer            super;
+    DocIdSetIterator *docs;
+    float             score;
 } ConstantScoreScorer;
 
 static float cssc_score(Scorer *self)
@@ -25,12 +25,22 @@ static float cssc_score(Scorer *self)
 
 static bool cssc_next(Scorer *self)
 {
-    return ((self->doc = bv_scan_next(CScSc(self)->bv)) >= 0);
+    DocIdSetIterator *docs = CScSc(self)->docs;
+    if (docs->next(docs)) {
+        self->doc = docs->doc;
+        return true;
+    }
+    return false;
 }
 
 static bool cssc_skip_to(Scorer *self, int doc_num)
 {
-    return ((self->doc = bv_scan_next_from(CScSc(self)->bv, doc_num)) >= 0);
+    DocIdSetIterator *docs = CScSc(self)->docs;
+    if (docs->skip_to(docs, doc_num)) {
+        self->doc = docs->doc;
+        return true;
+    }
+    return false;
 }
 
 static Explanation *cssc_explain(Scorer *self, int doc_num)
@@ -39,19 +49,26 @@ static Explanation *cssc_explain(Scorer *self, int doc_num)
     return expl_new(1.0, "ConstantScoreScorer");
 }
 
+static void cssc_destroy(Scorer *self)
+{
+    DocIdSetIterator *docs = CScSc(self)->docs;
+    docs->close(docs);
+    scorer_destroy_i(self);
+}
+
 static Scorer *cssc_new(Weight *weight, IndexReader *ir)
 {
     Scorer *self    = scorer_new(ConstantScoreScorer, weight->similarity);
     Filter *filter  = CScQ(weight->query)->filter;
 
     CScSc(self)->score  = weight->value;
-    CScSc(self)->bv     = filt_get_bv(filter, ir);
+    CScSc(self)->docs   = filt_get_iterator(filter, ir);
 
     self->score     = &cssc_score;
     self->next      = &cssc_next;
     self->skip_to   = &cssc_skip_to;
     self->explain   = &cssc_explain;
-    self->destroy   = &scorer_destroy_i;
+    self->destroy   = &cssc_destroy;
     return self;
 }
 
@@ -71,9 +88,9 @@ static Explanation *csw_explain(Weight *self, IndexReader *ir, int doc_num)
     Filter *filter = CScQ(self->query)->filter;
     Explanation *expl;
     char *filter_str = filter->to_s(filter);
-    BitVector *bv = filt_get_bv(filter, ir);
+    Roaring *docs = filt_get_roaring(filter, ir);
 
-    if (bv_get(bv, doc_num)) {
+    if (roar_get(docs, doc_num)) {
         expl = expl_new(self->value,
                         "ConstantScoreQuery(%s), product of:", filter_str);
         expl_add_detail(expl, expl_new(self->query->boost, "boost"));
@@ -13,9 +13,10 @@
 
 typedef struct FilteredQueryScorer
 {
-    Scorer      super;
-    Scorer     *sub_scorer;
-    BitVector  *bv;
+    Scorer            super;
+    Scorer           *sub_scorer;
+    Roaring          *docs;
+    DocIdSetIterator *it;     /* only set when the filter is sparse */
 } FilteredQueryScorer;
 
 static float fqsc_score(Scorer *self)
@@ -24,30 +25,36 @@ static float fqsc_score(Scorer *self)
     return sub_sc->score(sub_sc);
 }
 
+/* find the first doc from the one +sub_sc+ is on which the filter matches */
+static bool fqsc_filter(Scorer *self, Scorer *sub_sc)
+{
+    FilteredQueryScorer *fqsc = FQSc(self);
+    if (fqsc->it) {
+        if (!scorer_leapfrog(sub_sc, fqsc->it)) {
+            return false;
+        }
+    }
+    else {
+        while (!roar_get(fqsc->docs, sub_sc->doc)) {
+            if (!sub_sc->next(sub_sc)) {
+                return false;
+            }
+        }
+    }
+    self->doc = sub_sc->doc;
+    return true;
+}
+
 static bool fqsc_next(Scorer *self)
 {
     Scorer *sub_sc = FQSc(self)->sub_scorer;
-    BitVector *bv = FQSc(self)->bv;
-    while (sub_sc->next(sub_sc)) {
-        self->doc = sub_sc->doc;
-        if (bv_get(bv, self->doc)) return true;
-    }
-    return false;
+    return sub_sc->next(sub_sc) && fqsc_filter(self, sub_sc);
 }
 
 static bool fqsc_skip_to(Scorer *self, int doc_num)
 {
     Scorer *sub_sc = FQSc(self)->sub_scorer;
-    BitVector *bv = FQSc(self)->bv;
-    if (sub_sc->skip_to(sub_sc, doc_num)) {
-        do {
-            self->doc = sub_sc->doc;
-            if (bv_get(bv, self->doc)) {
-                return true;
-            }
-        } while (sub_sc->next(sub_sc));
-    }
-    return false;
+    return sub_sc->skip_to(sub_sc, doc_num) && fqsc_filter(self, sub_sc);
 }
 
 static Explanation *fqsc_explain(Scorer *self, int doc_num)
@@ -60,15 +67,22 @@ static void fqsc_destroy(Scorer *self)
 {
     FilteredQueryScorer *fqsc = FQSc(self);
     fqsc->sub_scorer->destroy(fqsc->sub_scorer);
+    if (fqsc->it) {
+        fqsc->it->close(fqsc->it);
+    }
     scorer_destroy_i(self);
 }
 
-static Scorer *fqsc_new(Scorer *scorer, BitVector *bv, Similarity *sim)
+static Scorer *fqsc_new(Scorer *scorer, Filter *filter, IndexReader *ir,
+                        Similarity *sim)
 {
     Scorer *self            = scorer_new(FilteredQueryScorer, sim);
 
     FQSc(self)->sub_scorer  = scorer;
-    FQSc(self)->bv          = bv;
+    FQSc(self)->docs        = filt_get_roaring(filter, ir);
+    FQSc(self)->it          = (filt_is_sparse(filter, ir)
+                               ? filt_get_iterator(filter, ir)
+                               : NULL);
 
     self->score   = &fqsc_score;
     self->next    = &fqsc_next;
@@ -127,7 +141,7 @@ static Scorer *fqw_scorer(Weight *self, IndexReader *ir)
     Scorer *scorer = sub_weight->scorer(sub_weight, ir);
     Filter *filter = FQQ(self->query)->filter;
 
-    return fqsc_new(scorer, filt_get_bv(filter, ir), self->similarity);
+    return fqsc_new(scorer, filter, ir, self->similarity);
 }
 
 static void fqw_destroy(Weight *self)
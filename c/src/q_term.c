@@ -1,5 +1,7 @@
 #include "symbol.h"
 #include <string.h>
+#include <limits.h>
+#include <float.h>
 #include "search.h"
 #include "internal.h"
 
@@ -13,7 +15,7 @@
  ***************************************************************************/
 
 #define SCORE_CACHE_SIZE 32
-#define TDE_READ_SIZE 32
+#define TDE_READ_SIZE POSTINGS_BLOCK_SIZE /* read a whole block at a time */
 
 typedef struct TermScorer
 {
@@ -27,6 +29,8 @@ typedef struct TermScorer
     TermDocEnum    *tde;
     uchar          *norms;
     float           weight_value;
+    float           buf_max_score;  /* bound of the docs left in the buffer */
+    bool            buf_max_stale : 1;
 } TermScorer;
 
 static float tsc_score(Scorer *self)
@@ -58,6 +62,7 @@ static bool tsc_next(Scorer *self)
                                         TDE_READ_SIZE);
         if (ts->pointer_max != 0) {
             ts->pointer = 0;
+            ts->buf_max_stale = true;
         }
         else {
             return false;
@@ -86,6 +91,7 @@ static bool tsc_skip_to(Scorer *self, int doc_num)
         ts->pointer = 0;
         ts->docs[0] = self->doc = tde->doc_num(tde);
         ts->freqs[0] = tde->freq(tde);
+        ts->buf_max_stale = true;
         return true;
     }
     else {
@@ -93,6 +99,54 @@ static bool tsc_skip_to(Scorer *self, int doc_num)
     }
 }
 
+static INLINE float tsc_impact_score(Scorer *self, int freq, uchar norm)
+{
+    TermScorer *ts = TSc(self);
+    float score = (freq < SCORE_CACHE_SIZE)
+        ? ts->score_cache[freq]
+        : sim_tf(self->similarity, (float)freq) * ts->weight_value;
+    return score * sim_decode_norm(self->similarity, norm);
+}
+
+/* The docs left in the buffer are bounded exactly. Past them we use the
+ * impacts the TermDocEnum keeps for each block of postings. This relies on
+ * the similarity's tf and norm decoding never decreasing as their input
+ * grows. */
+static float tsc_max_score(Scorer *self, int doc_num, int *up_to)
+{
+    TermScorer *ts = TSc(self);
+    TermDocEnum *tde = ts->tde;
+    float max_score = 0.0f;
+    int last_doc = ts->docs[ts->pointer_max - 1];
+    int max_freq;
+    uchar max_norm;
+
+    if (doc_num <= last_doc) {
+        if (ts->buf_max_stale) {
+            int i;
+            ts->buf_max_score = 0.0f;
+            for (i = ts->pointer; i < ts->pointer_max; i++) {
+                float score = tsc_impact_score(self, ts->freqs[i],
+                                               ts->norms[ts->docs[i]]);
+                if (score > ts->buf_max_score) {
+                    ts->buf_max_score = score;
+                }
+            }
+            ts->buf_max_stale = false;
+        }
+        max_score = ts->buf_max_score;
+        doc_num = last_doc + 1;
+    }
+
+    /* the TermDocEnum has read up to the end of the buffer */
+    if (NULL == tde->block_max
+        || 0 > (*up_to = tde->block_max(tde, doc_num, &max_freq, &max_norm))) {
+        *up_to = INT_MAX;
+        return FLT_MAX;
+    }
+    return MAX(max_score, tsc_impact_score(self, max_freq, max_norm));
+}
+
 static Explanation *tsc_explain(Scorer *self, int doc_num)
 {
     TermScorer *ts = TSc(self);
@@ -133,6 +187,10 @@ static Scorer *tsc_new(Weight *weight, TermDocEnum *tde, uchar *norms)
     self->skip_to           = &tsc_skip_to;
     self->explain           = &tsc_explain;
     self->destroy           = &tsc_destroy;
+    if (TSc(self)->weight_value >= 0.0f) {
+        /* a negative weight would turn the maximum impact into a minimum */
+        self->max_score     = &tsc_max_score;
+    }
     return self;
 }
 
@@ -2,7 +2,13 @@
 #include <string.h>
 #include "internal.h"
 
-static RAMFile *rf_new(const char *name)
+/*
+ * store->mutex_i guards the store's file table and the reference counts of
+ * its RAMFiles so that several threads can write segments to the same store.
+ * store->mutex can't be used as it is held around whole commits.
+ */
+
+static RAMFile *rf_new(Store *store, const char *name)
 {
     RAMFile *rf = ALLOC(RAMFile);
     rf->buffers = ALLOC(uchar *);
@@ -11,6 +17,7 @@ static RAMFile *rf_new(const char *name)
     rf->len = 0;
     rf->bufcnt = 1;
     rf->ref_cnt = 1;
+    rf->store = store;
     return rf;
 }
 
@@ -37,42 +44,59 @@ static void rf_close(void *p)
     free(rf);
 }
 
+static void rf_deref(RAMFile *rf)
+{
+    Store *store = rf->store;
+    if (store) {
+        mutex_lock(&store->mutex_i);
+    }
+    DEREF(rf);
+    rf_close(rf);
+    if (store) {
+        mutex_unlock(&store->mutex_i);
+    }
+}
+
 static void ram_touch(Store *store, const char *filename)
 {
+    mutex_lock(&store->mutex_i);
     if (h_get(store->dir.ht, filename) == NULL) {
-        h_set(store->dir.ht, filename, rf_new(filename));
+        h_set(store->dir.ht, filename, rf_new(store, filename));
     }
+    mutex_unlock(&store->mutex_i);
 }
 
 static int ram_exists(Store *store, const char *filename)
 {
-    if (h_get(store->dir.ht, filename) != NULL) {
-        return true;
-    }
-    else {
-        return false;
-    }
+    bool exists;
+    mutex_lock(&store->mutex_i);
+    exists = h_get(store->dir.ht, filename) != NULL;
+    mutex_unlock(&store->mutex_i);
+    return exists;
 }
 
 static int ram_remove(Store *store, const char *filename)
 {
-    RAMFile *rf = (RAMFile *)h_rem(store->dir.ht, filename, false);
+    RAMFile *rf;
+    mutex_lock(&store->mutex_i);
+    rf = (RAMFile *)h_rem(store->dir.ht, filename, false);
     if (rf != NULL) {
         DEREF(rf);
         rf_close(rf);
-        return true;
-    }
-    else {
-        return false;
     }
+    mutex_unlock(&store->mutex_i);
+    return rf != NULL;
 }
 
 static void ram_rename(Store *store, const char *from, const char *to)
 {
-    RAMFile *rf = (RAMFile *)h_rem(store->dir.ht, from, false);
+    RAMFile *rf;
     RAMFile *tmp;
 
+    mutex_lock(&store->mutex_i);
+    rf = (RAMFile *)h_rem(store->dir.ht, from, false);
     if (rf == NULL) {
+        mutex_unlock(&store->mutex_i);
         RAISE(IO_ERROR, "couldn't rename \"%s\" to \"%s\". \"%s\""
               " doesn't exist", from, to, from);
     }
@@ -88,27 +112,52 @@ static void ram_rename(Store *store, const char *from, const char *to)
     }
 
     h_set(store->dir.ht, rf->name, rf);
+    mutex_unlock(&store->mutex_i);
 }
 
 static int ram_count(Store *store)
 {
-    return store->dir.ht->size;
+    int cnt;
+    mutex_lock(&store->mutex_i);
+    cnt = store->dir.ht->size;
+    mutex_unlock(&store->mutex_i);
+    return cnt;
 }
 
+/*
+ * The names are copied with the store locked and +func+ is called after it
+ * is unlocked as +func+ may well use the store itself.
+ */
 static void ram_each(Store *store,
                      void (*func)(const char *fname, void *arg), void *arg)
 {
     Hash *ht = store->dir.ht;
-    int i;
+    char **names;
+    int i, cnt = 0;
+
+    mutex_lock(&store->mutex_i);
+    names = ALLOC_N(char *, ht->size + 1);
     for (i = 0; i <= ht->mask; i++) {
         RAMFile *rf = (RAMFile *)ht->table[i].value;
         if (rf) {
             if (strncmp(rf->name, LOCK_PREFIX, strlen(LOCK_PREFIX)) == 0) {
                 continue;
             }
-            func(rf->name, arg);
+            names[cnt++] = estrdup(rf->name);
         }
     }
+    mutex_unlock(&store->mutex_i);
+
+    TRY
+        for (i = 0; i < cnt; i++) {
+            func(names[i], arg);
+        }
+    XFINALLY
+        for (i = 0; i < cnt; i++) {
+            free(names[i]);
+        }
+        free(names);
+    XENDTRY
 }
 
 static void ram_close_i(Store *store)
@@ -118,6 +167,8 @@ static void ram_close_i(Store *store)
     for (i = 0; i <= ht->mask; i++) {
         RAMFile *rf = (RAMFile *)ht->table[i].value;
         if (rf) {
+            /* streams still open on the file mustn't lock the closed store */
+            rf->store = NULL;
             DEREF(rf);
         }
     }
@@ -132,6 +183,7 @@ static void ram_clear(Store *store)
 {
     int i;
     Hash *ht = store->dir.ht;
+    mutex_lock(&store->mutex_i);
     for (i = 0; i <= ht->mask; i++) {
         RAMFile *rf = (RAMFile *)ht->table[i].value;
         if (rf && !file_is_lock(rf->name)) {
@@ -139,12 +191,14 @@ static void ram_clear(Store *store)
             h_del(ht, rf->name);
         }
     }
+    mutex_unlock(&store->mutex_i);
 }
 
 static void ram_clear_locks(Store *store)
 {
     int i;
     Hash *ht = store->dir.ht;
+    mutex_lock(&store->mutex_i);
     for (i = 0; i <= ht->mask; i++) {
         RAMFile *rf = (RAMFile *)ht->table[i].value;
         if (rf && file_is_lock(rf->name)) {
@@ -152,12 +206,14 @@ static void ram_clear_locks(Store *store)
             h_del(ht, rf->name);
         }
     }
+    mutex_unlock(&store->mutex_i);
 }
 
 static void ram_clear_all(Store *store)
 {
     int i;
     Hash *ht = store->dir.ht;
+    mutex_lock(&store->mutex_i);
     for (i = 0; i <= ht->mask; i++) {
         RAMFile *rf = (RAMFile *)ht->table[i].value;
         if (rf) {
@@ -165,17 +221,19 @@ static void ram_clear_all(Store *store)
             h_del(ht, rf->name);
         }
     }
+    mutex_unlock(&store->mutex_i);
 }
 
 static off_t ram_length(Store *store, const char *filename)
 {
-    RAMFile *rf = (RAMFile *)h_get(store->dir.ht, filename);
-    if (rf != NULL) {
-        return rf->len;
-    }
-    else {
-        return 0;
+    RAMFile *rf;
+    off_t len = 0;
+    mutex_lock(&store->mutex_i);
+    if (NULL != (rf = (RAMFile *)h_get(store->dir.ht, filename))) {
+        len = rf->len;
     }
+    mutex_unlock(&store->mutex_i);
+    return len;
 }
 
 off_t ramo_length(OutStream *os)
@@ -230,9 +288,7 @@ void ramo_reset(OutStream *os)
 
 static void ramo_close_i(OutStream *os)
 {
-    RAMFile *rf = os->file.rf;
-    DEREF(rf);
-    rf_close(rf);
+    rf_deref(os->file.rf);
 }
 
 void ramo_write_to(OutStream *os, OutStream *other_o)
@@ -259,7 +315,7 @@ static const struct OutStreamMethods RAM_OUT_STREAM_METHODS = {
 
 OutStream *ram_new_buffer()
 {
-    RAMFile *rf = rf_new("");
+    RAMFile *rf = rf_new(NULL, "");
     OutStream *os = os_new();
 
     DEREF(rf);
@@ -277,14 +333,16 @@ void ram_destroy_buffer(OutStream *os)
 
 static OutStream *ram_new_output(Store *store, const char *filename)
 {
-    RAMFile *rf = (RAMFile *)h_get(store->dir.ht, filename);
+    RAMFile *rf;
     OutStream *os = os_new();
 
-    if (rf == NULL) {
-        rf = rf_new(filename);
+    mutex_lock(&store->mutex_i);
+    if (NULL == (rf = (RAMFile *)h_get(store->dir.ht, filename))) {
+        rf = rf_new(store, filename);
         h_set(store->dir.ht, rf->name, rf);
     }
     REF(rf);
+    mutex_unlock(&store->mutex_i);
     os->pointer = 0;
     os->file.rf = rf;
     os->m = &RAM_OUT_STREAM_METHODS;
@@ -334,9 +392,7 @@ static void rami_seek_i(InStream *is, off_t pos)
 
 static void rami_close_i(InStream *is)
 {
-    RAMFile *rf = is->file.rf;
-    DEREF(rf);
-    rf_close(rf);
+    rf_deref(is->file.rf);
 }
 
 static const struct InStreamMethods RAM_IN_STREAM_METHODS = {
@@ -348,9 +404,14 @@ static const struct InStreamMethods RAM_IN_STREAM_METHODS = {
 
 static InStream *ram_open_input(Store *store, const char *filename)
 {
-    RAMFile *rf = (RAMFile *)h_get(store->dir.ht, filename);
+    RAMFile *rf;
     InStream *is = NULL;
 
+    mutex_lock(&store->mutex_i);
+    if (NULL != (rf = (RAMFile *)h_get(store->dir.ht, filename))) {
+        REF(rf);
+    }
+    mutex_unlock(&store->mutex_i);
     if (rf == NULL) {
         /*
         Hash *ht = store->dir.ht;
@@ -365,7 +426,6 @@ static InStream *ram_open_input(Store *store, const char *filename)
         RAISE(FILE_NOT_FOUND_ERROR,
               "tried to open \"%s\" but it doesn't exist", filename);
     }
-    REF(rf);
     is = is_new();
     is->file.rf = rf;
     is->d.pointer = 0;
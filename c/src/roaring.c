@@ -0,0 +1,717 @@
+#include <string.h>
+#include "roaring.h"
+#include "internal.h"
+
+#define RC_KEY(doc) ((doc) >> 16)
+#define RC_LOW(doc) ((doc) & 0xffff)
+#define RC_DOC(key, low) (((int)(key) << 16) | (low))
+#define RC_SIZE 65536
+
+/* the number of bytes each type of container needs */
+#define RC_ARRAY_BYTES(card) ((card) * (int)sizeof(u16))
+#define RC_BITMAP_BYTES (RC_BITMAP_WORDS * (int)sizeof(u64))
+#define RC_RUN_BYTES(runs) ((runs) * 2 * (int)sizeof(u16))
+
+/* below this ratio of sizes arrays are intersected by merging them */
+#define RC_GALLOP_RATIO 16
+
+/****************************************************************************
+ *
+ * RoaringContainer
+ *
+ ****************************************************************************/
+
+static void rc_destroy(RoaringContainer *c)
+{
+    free(c->shorts);
+    free(c->words);
+}
+
+static void rc_reserve(RoaringContainer *c, int len)
+{
+    if (c->capa < len) {
+        int capa = c->capa ? c->capa : 4;
+        while (capa < len) {
+            capa <<= 1;
+        }
+        REALLOC_N(c->shorts, u16, capa);
+        c->capa = capa;
+    }
+}
+
+/* the index of the first value in shorts[lo..hi) which is >= +val+ */
+static int rc_lower_bound(const u16 *shorts, int lo, int hi, int val)
+{
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (shorts[mid] < val) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* the index of the last run starting at or before +val+ or -1 */
+static int rc_run_floor(const RoaringContainer *c, int val)
+{
+    int lo = 0, hi = c->len >> 1;
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (c->shorts[mid << 1] <= val) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+static void words_set_range(u64 *words, int from, int to)
+{
+    int word = from >> 6;
+    const int last_word = (to - 1) >> 6;
+    u64 mask = ~(u64)0 << (from & 63);
+    for (; word < last_word; word++, mask = ~(u64)0) {
+        words[word] |= mask;
+    }
+    words[word] |= mask & (~(u64)0 >> (63 - ((to - 1) & 63)));
+}
+
+/* the first bit at or after +pos+ which is +set+ or RC_SIZE if none are */
+static int words_next(const u64 *words, int pos, bool set)
+{
+    int i = pos >> 6;
+    u64 word;
+    if (pos >= RC_SIZE) {
+        return RC_SIZE;
+    }
+    word = (set ? words[i] : ~words[i]) & (~(u64)0 << (pos & 63));
+    while (!word) {
+        if (++i >= RC_BITMAP_WORDS) {
+            return RC_SIZE;
+        }
+        word = set ? words[i] : ~words[i];
+    }
+    return (i << 6) + count_trailing_zeros64(word);
+}
+
+static void rc_fill_words(const RoaringContainer *c, u64 *words)
+{
+    int i;
+    if (c->type == RC_BITMAP) {
+        memcpy(words, c->words, RC_BITMAP_BYTES);
+        return;
+    }
+    memset(words, 0, RC_BITMAP_BYTES);
+    if (c->type == RC_ARRAY) {
+        for (i = 0; i < c->card; i++) {
+            words[c->shorts[i] >> 6] |= (u64)1 << (c->shorts[i] & 63);
+        }
+    }
+    else {
+        for (i = 0; i < c->len; i += 2) {
+            words_set_range(words, c->shorts[i],
+                            c->shorts[i] + c->shorts[i + 1] + 1);
+        }
+    }
+}
+
+/*
+ * Store the docs set in +words+ in the container using whichever type of
+ * container takes the least space. +words+ may be the container's own
+ * bitmap. Returns the number of docs in the container.
+ */
+static int rc_set_words(RoaringContainer *c, const u64 *words)
+{
+    int i, card = 0, runs = 0;
+    u64 carry = 0;
+    for (i = 0; i < RC_BITMAP_WORDS; i++) {
+        const u64 word = words[i];
+        card += count_ones64(word);
+        /* count the bits which start a run */
+        runs += count_ones64(word & ~((word << 1) | carry));
+        carry = word >> 63;
+    }
+
+    c->card = card;
+    if (RC_RUN_BYTES(runs) < min2(RC_ARRAY_BYTES(card), RC_BITMAP_BYTES)) {
+        int start = words_next(words, 0, true);
+        rc_reserve(c, runs * 2);
+        for (i = 0; start < RC_SIZE; i += 2) {
+            const int end = words_next(words, start, false);
+            c->shorts[i] = (u16)start;
+            c->shorts[i + 1] = (u16)(end - start - 1);
+            start = words_next(words, end, true);
+        }
+        c->len = i;
+        c->type = RC_RUN;
+    }
+    else if (card <= RC_ARRAY_MAX) {
+        int len = 0;
+        rc_reserve(c, card);
+        for (i = 0; i < RC_BITMAP_WORDS; i++) {
+            u64 word = words[i];
+            while (word) {
+                c->shorts[len++] = (u16)((i << 6) + count_trailing_zeros64(word));
+                word &= word - 1;
+            }
+        }
+        c->len = len;
+        c->type = RC_ARRAY;
+    }
+    else {
+        if (!c->words) {
+            c->words = ALLOC_N(u64, RC_BITMAP_WORDS);
+        }
+        if (c->words != words) {
+            memcpy(c->words, words, RC_BITMAP_BYTES);
+        }
+        free(c->shorts);
+        c->shorts = NULL;
+        c->len = c->capa = 0;
+        c->type = RC_BITMAP;
+        return card;
+    }
+    free(c->words);
+    c->words = NULL;
+    return card;
+}
+
+static void rc_to_bitmap(RoaringContainer *c)
+{
+    u64 *words = ALLOC_N(u64, RC_BITMAP_WORDS);
+    rc_fill_words(c, words);
+    free(c->shorts);
+    c->shorts = NULL;
+    c->len = c->capa = 0;
+    c->words = words;
+    c->type = RC_BITMAP;
+}
+
+static int rc_get(const RoaringContainer *c, int low)
+{
+    int i;
+    switch (c->type) {
+        case RC_ARRAY:
+            i = rc_lower_bound(c->shorts, 0, c->card, low);
+            return i < c->card && c->shorts[i] == low;
+        case RC_BITMAP:
+            return (int)((c->words[low >> 6] >> (low & 63)) & 1);
+        default:
+            i = rc_run_floor(c, low);
+            return i >= 0
+                && low <= c->shorts[i << 1] + c->shorts[(i << 1) + 1];
+    }
+}
+
+/* returns true if +low+ wasn't already in the container */
+static bool rc_add(RoaringContainer *c, int low)
+{
+    int i;
+    if (c->type == RC_RUN) {
+        if (rc_get(c, low)) {
+            return false;
+        }
+        rc_to_bitmap(c);
+    }
+    else if (c->type == RC_ARRAY) {
+        i = rc_lower_bound(c->shorts, 0, c->card, low);
+        if (i < c->card && c->shorts[i] == low) {
+            return false;
+        }
+        if (c->card < RC_ARRAY_MAX) {
+            rc_reserve(c, c->card + 1);
+            memmove(c->shorts + i + 1, c->shorts + i,
+                    sizeof(u16) * (c->card - i));
+            c->shorts[i] = (u16)low;
+            c->len = ++c->card;
+            return true;
+        }
+        rc_to_bitmap(c);
+    }
+    if ((c->words[low >> 6] >> (low & 63)) & 1) {
+        return false;
+    }
+    c->words[low >> 6] |= (u64)1 << (low & 63);
+    c->card++;
+    return true;
+}
+
+/* the first doc in the container >= +low+ or -1 */
+static int rc_next_from(const RoaringContainer *c, int low)
+{
+    int i;
+    switch (c->type) {
+        case RC_ARRAY:
+            i = rc_lower_bound(c->shorts, 0, c->card, low);
+            return i < c->card ? c->shorts[i] : -1;
+        case RC_BITMAP:
+            i = words_next(c->words, low, true);
+            return i < RC_SIZE ? i : -1;
+        default:
+            i = rc_run_floor(c, low);
+            if (i >= 0 && low <= c->shorts[i << 1] + c->shorts[(i << 1) + 1]) {
+                return low;
+            }
+            i = (i + 1) << 1;
+            return i < c->len ? c->shorts[i] : -1;
+    }
+}
+
+/* the last doc in a non-empty container */
+static int rc_last(const RoaringContainer *c)
+{
+    int i;
+    switch (c->type) {
+        case RC_ARRAY:
+            return c->shorts[c->card - 1];
+        case RC_BITMAP:
+            for (i = RC_BITMAP_WORDS - 1; !c->words[i]; i--) {
+            }
+            return (i << 6) + 63 - count_leading_zeros64(c->words[i]);
+        default:
+            return c->shorts[c->len - 2] + c->shorts[c->len - 1];
+    }
+}
+
+/* store up to +cnt+ docs >= +low+ in +buf+ returning the number stored */
+static int rc_next_n(const RoaringContainer *c, int low, int *buf, int cnt)
+{
+    const int base = RC_DOC(c->key, 0);
+    int i, n = 0;
+    switch (c->type) {
+        case RC_ARRAY:
+            for (i = rc_lower_bound(c->shorts, 0, c->card, low);
+                 i < c->card && n < cnt; i++) {
+                buf[n++] = base + c->shorts[i];
+            }
+            break;
+        case RC_BITMAP:
+            i = low >> 6;
+            if (i < RC_BITMAP_WORDS) {
+                u64 word = c->words[i] & (~(u64)0 << (low & 63));
+                while (true) {
+                    while (word) {
+                        buf[n++] = base + (i << 6) + count_trailing_zeros64(word);
+                        if (n == cnt) {
+                            return n;
+                        }
+                        word &= word - 1;
+                    }
+                    if (++i >= RC_BITMAP_WORDS) {
+                        break;
+                    }
+                    word = c->words[i];
+                }
+            }
+            break;
+        default:
+            i = rc_run_floor(c, low);
+            if (i < 0) {
+                i = 0;
+            }
+            for (i <<= 1; i < c->len && n < cnt; i += 2) {
+                int doc = max2(low, c->shorts[i]);
+                const int end = c->shorts[i] + c->shorts[i + 1];
+                for (; doc <= end && n < cnt; doc++) {
+                    buf[n++] = base + doc;
+                }
+            }
+            break;
+    }
+    return n;
+}
+
+/* intersect two arrays into +out+ returning the number of docs in both */
+static int rc_and_arrays(const RoaringContainer *c1,
+                         const RoaringContainer *c2, RoaringContainer *out)
+{
+    int i = 0, j = 0, card = 0;
+    const RoaringContainer *tmp;
+    if (c1->card > c2->card) {
+        tmp = c1; c1 = c2; c2 = tmp;
+    }
+    rc_reserve(out, c1->card);
+    if (c1->card * RC_GALLOP_RATIO < c2->card) {
+        /* binary search the larger array for each doc in the smaller */
+        for (; i < c1->card && j < c2->card; i++) {
+            j = rc_lower_bound(c2->shorts, j, c2->card, c1->shorts[i]);
+            if (j < c2->card && c2->shorts[j] == c1->shorts[i]) {
+                out->shorts[card++] = c1->shorts[i];
+            }
+        }
+    }
+    else {
+        while (i < c1->card && j < c2->card) {
+            if (c1->shorts[i] < c2->shorts[j]) {
+                i++;
+            }
+            else if (c1->shorts[i] > c2->shorts[j]) {
+                j++;
+            }
+            else {
+                out->shorts[card++] = c1->shorts[i];
+                i++, j++;
+            }
+        }
+    }
+    out->type = RC_ARRAY;
+    out->len = out->card = card;
+    return card;
+}
+
+static int rc_and(const RoaringContainer *c1, const RoaringContainer *c2,
+                  RoaringContainer *out)
+{
+    int i;
+    if (c1->type == RC_ARRAY && c2->type == RC_ARRAY) {
+        return rc_and_arrays(c1, c2, out);
+    }
+    else if (c1->type == RC_ARRAY || c2->type == RC_ARRAY) {
+        const RoaringContainer *array = c1->type == RC_ARRAY ? c1 : c2;
+        const RoaringContainer *other = c1->type == RC_ARRAY ? c2 : c1;
+        int card = 0;
+        rc_reserve(out, array->card);
+        for (i = 0; i < array->card; i++) {
+            if (rc_get(other, array->shorts[i])) {
+                out->shorts[card++] = array->shorts[i];
+            }
+        }
+        out->type = RC_ARRAY;
+        out->len = out->card = card;
+        return card;
+    }
+    else {
+        u64 words1[RC_BITMAP_WORDS], words2[RC_BITMAP_WORDS];
+        const u64 *w1 = c1->words, *w2 = c2->words;
+        if (c1->type == RC_RUN) {
+            rc_fill_words(c1, words1);
+            w1 = words1;
+        }
+        if (c2->type == RC_RUN) {
+            rc_fill_words(c2, words2);
+            w2 = words2;
+        }
+        for (i = 0; i < RC_BITMAP_WORDS; i++) {
+            words1[i] = w1[i] & w2[i];
+        }
+        return rc_set_words(out, words1);
+    }
+}
+
+static int rc_memory(const RoaringContainer *c)
+{
+    switch (c->type) {
+        case RC_ARRAY:  return RC_ARRAY_BYTES(c->card);
+        case RC_BITMAP: return RC_BITMAP_BYTES;
+        default:        return RC_RUN_BYTES(c->len >> 1);
+    }
+}
+
+/****************************************************************************
+ *
+ * Roaring
+ *
+ ****************************************************************************/
+
+Roaring *roar_new()
+{
+    Roaring *r = ALLOC_AND_ZERO(Roaring);
+    r->ref_cnt = 1;
+    return r;
+}
+
+void roar_destroy(Roaring *r)
+{
+    if (--(r->ref_cnt) == 0) {
+        int i;
+        for (i = 0; i < r->size; i++) {
+            rc_destroy(&r->containers[i]);
+        }
+        free(r->containers);
+        free(r);
+    }
+}
+
+/* the index of the first container with a key >= +key+ */
+static int roar_find(const Roaring *r, int key)
+{
+    int lo = 0, hi = r->size;
+    if (hi == 0 || r->containers[hi - 1].key < key) {
+        return hi;
+    }
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (r->containers[mid].key < key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* insert an empty array container with key +key+ at index +i+ */
+static RoaringContainer *roar_insert(Roaring *r, int i, int key)
+{
+    RoaringContainer *c;
+    if (r->size >= r->capa) {
+        r->capa = r->capa ? r->capa << 1 : 4;
+        REALLOC_N(r->containers, RoaringContainer, r->capa);
+    }
+    memmove(r->containers + i + 1, r->containers + i,
+            sizeof(RoaringContainer) * (r->size - i));
+    r->size++;
+    c = &r->containers[i];
+    ZEROSET(c, RoaringContainer);
+    c->key = (u16)key;
+    return c;
+}
+
+void roar_add(Roaring *r, int doc)
+{
+    const int key = RC_KEY(doc);
+    const int i = roar_find(r, key);
+    RoaringContainer *c = (i < r->size && r->containers[i].key == key)
+        ? &r->containers[i]
+        : roar_insert(r, i, key);
+    if (rc_add(c, RC_LOW(doc))) {
+        r->count++;
+    }
+}
+
+int roar_get(Roaring *r, int doc)
+{
+    const int key = RC_KEY(doc);
+    const int i = roar_find(r, key);
+    return i < r->size && r->containers[i].key == key
+        && rc_get(&r->containers[i], RC_LOW(doc));
+}
+
+int roar_next_from(Roaring *r, int doc)
+{
+    int i, key;
+    if (doc < 0) {
+        doc = 0;
+    }
+    key = RC_KEY(doc);
+    for (i = roar_find(r, key); i < r->size; i++) {
+        const RoaringContainer *c = &r->containers[i];
+        const int low = rc_next_from(c, c->key == key ? RC_LOW(doc) : 0);
+        if (low >= 0) {
+            return RC_DOC(c->key, low);
+        }
+    }
+    return -1;
+}
+
+int roar_next_n(Roaring *r, int doc, int *buf, int cnt)
+{
+    int i, key, n = 0;
+    if (doc < 0) {
+        doc = 0;
+    }
+    key = RC_KEY(doc);
+    for (i = roar_find(r, key); i < r->size && n < cnt; i++) {
+        const RoaringContainer *c = &r->containers[i];
+        n += rc_next_n(c, c->key == key ? RC_LOW(doc) : 0, buf + n, cnt - n);
+    }
+    return n;
+}
+
+void roar_optimize(Roaring *r)
+{
+    u64 words[RC_BITMAP_WORDS];
+    int i;
+    for (i = 0; i < r->size; i++) {
+        rc_fill_words(&r->containers[i], words);
+        rc_set_words(&r->containers[i], words);
+    }
+}
+
+Roaring *roar_from_bv(BitVector *bv, int size)
+{
+    Roaring *r = roar_new();
+    u64 words[RC_BITMAP_WORDS];
+    const int bv_words = BV_WORDS(bv->size);
+    const u64 ext = bv->extends_as_ones ? ~(u64)0 : 0;
+    int key;
+
+    for (key = 0; RC_DOC(key, 0) < size; key++) {
+        RoaringContainer *c;
+        const int first_word = key * RC_BITMAP_WORDS;
+        int i;
+        for (i = 0; i < RC_BITMAP_WORDS; i++) {
+            const int w = first_word + i;
+            u64 word = w < bv_words ? bv->bits[w] : ext;
+            /* bits past the bv's size are its extension */
+            if (w == bv_words - 1 && (bv->size & 63)) {
+                const u64 mask = ~(u64)0 << (bv->size & 63);
+                word = (word & ~mask) | (ext & mask);
+            }
+            /* and bits past +size+ aren't docs */
+            if ((w << 6) >= size) {
+                word = 0;
+            }
+            else if (((w + 1) << 6) > size) {
+                word &= ~(~(u64)0 << (size & 63));
+            }
+            words[i] = word;
+        }
+        c = roar_insert(r, r->size, key);
+        if (rc_set_words(c, words) == 0) {
+            rc_destroy(c);
+            r->size--;
+        }
+        r->count += c->card;
+    }
+    return r;
+}
+
+BitVector *roar_to_bv(Roaring *r)
+{
+    BitVector *bv;
+    u64 words[RC_BITMAP_WORDS];
+    int i, size;
+    if (r->size == 0) {
+        return bv_new();
+    }
+    size = RC_DOC(r->containers[r->size - 1].key,
+                  rc_last(&r->containers[r->size - 1])) + 1;
+    bv = bv_new_capa(size);
+    bv_grow(bv, size);
+    for (i = 0; i < r->size; i++) {
+        const RoaringContainer *c = &r->containers[i];
+        const int first_word = c->key * RC_BITMAP_WORDS;
+        const int word_cnt = min2(RC_BITMAP_WORDS,
+                                  BV_WORDS(size) - first_word);
+        rc_fill_words(c, words);
+        memcpy(bv->bits + first_word, words, sizeof(u64) * word_cnt);
+    }
+    bv->count = r->count;
+    return bv;
+}
+
+Roaring *roar_and(Roaring *r1, Roaring *r2)
+{
+    Roaring *r = roar_new();
+    int i = 0, j = 0;
+    while (i < r1->size && j < r2->size) {
+        const RoaringContainer *c1 = &r1->containers[i];
+        const RoaringContainer *c2 = &r2->containers[j];
+        if (c1->key < c2->key) {
+            i++;
+        }
+        else if (c1->key > c2->key) {
+            j++;
+        }
+        else {
+            RoaringContainer *c = roar_insert(r, r->size, c1->key);
+            const int card = rc_and(c1, c2, c);
+            if (card == 0) {
+                rc_destroy(c);
+                r->size--;
+            }
+            r->count += card;
+            i++, j++;
+        }
+    }
+    return r;
+}
+
+int roar_memory(Roaring *r)
+{
+    int i, memory = 0;
+    for (i = 0; i < r->size; i++) {
+        memory += (int)sizeof(RoaringContainer) + rc_memory(&r->containers[i]);
+    }
+    return memory;
+}
+
+void roar_write(Roaring *r, OutStream *os)
+{
+    int i, j;
+    os_write_vint(os, r->size);
+    for (i = 0; i < r->size; i++) {
+        const RoaringContainer *c = &r->containers[i];
+        int last = 0;
+        os_write_vint(os, c->key);
+        os_write_byte(os, c->type);
+        os_write_vint(os, c->card);
+        switch (c->type) {
+            case RC_ARRAY:
+                for (j = 0; j < c->card; j++) {
+                    os_write_vint(os, c->shorts[j] - last);
+                    last = c->shorts[j];
+                }
+                break;
+            case RC_BITMAP:
+                for (j = 0; j < RC_BITMAP_WORDS; j++) {
+                    os_write_u64(os, c->words[j]);
+                }
+                break;
+            default:
+                os_write_vint(os, c->len >> 1);
+                for (j = 0; j < c->len; j += 2) {
+                    os_write_vint(os, c->shorts[j] - last);
+                    os_write_vint(os, c->shorts[j + 1]);
+                    last = c->shorts[j] + c->shorts[j + 1];
+                }
+                break;
+        }
+    }
+}
+
+Roaring *roar_read(InStream *is)
+{
+    Roaring *volatile r = roar_new();
+    int i, j, size;
+    TRY
+        size = (int)is_read_vint(is);
+        for (i = 0; i < size; i++) {
+            RoaringContainer *c = roar_insert(r, r->size,
+                                              (int)is_read_vint(is));
+            int last = 0;
+            c->type = is_read_byte(is);
+            c->card = (int)is_read_vint(is);
+            r->count += c->card;
+            switch (c->type) {
+                case RC_ARRAY:
+                    rc_reserve(c, c->card);
+                    for (j = 0; j < c->card; j++) {
+                        last += (int)is_read_vint(is);
+                        c->shorts[j] = (u16)last;
+                    }
+                    c->len = c->card;
+                    break;
+                case RC_BITMAP:
+                    c->words = ALLOC_N(u64, RC_BITMAP_WORDS);
+                    for (j = 0; j < RC_BITMAP_WORDS; j++) {
+                        c->words[j] = is_read_u64(is);
+                    }
+                    break;
+                case RC_RUN:
+                    c->len = (int)is_read_vint(is) << 1;
+                    rc_reserve(c, c->len);
+                    for (j = 0; j < c->len; j += 2) {
+                        last += (int)is_read_vint(is);
+                        c->shorts[j] = (u16)last;
+                        c->shorts[j + 1] = (u16)is_read_vint(is);
+                        last += c->shorts[j + 1];
+                    }
+                    break;
+                default:
+                    RAISE(IO_ERROR, "unknown roaring container type %d",
+                          c->type);
+            }
+        }
+    XCATCHALL
+        roar_destroy(r);
+    XENDTRY
+    return r;
+}
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <limits.h>
+#include <float.h>
 #include "search.h"
 #include "array.h"
 #include "internal.h"
@@ -500,6 +501,21 @@ int scorer_doc_cmp(const void *p1, const void *p2)
     return (*(Scorer **)p1)->doc - (*(Scorer **)p2)->doc;
 }
 
+bool scorer_leapfrog(Scorer *scorer, DocIdSetIterator *it)
+{
+    while (true) {
+        if (it->doc < scorer->doc && !it->skip_to(it, scorer->doc)) {
+            return false;
+        }
+        if (it->doc == scorer->doc) {
+            return true;
+        }
+        if (!scorer->skip_to(scorer, it->doc)) {
+            return false;
+        }
+    }
+}
+
 /***************************************************************************
  *
  * Highlighter
@@ -1017,21 +1033,69 @@ static int isea_max_doc(Searcher *self)
     return ir->max_doc(ir);
 }
 
-#define IS_FILTERED(bits, post_filter, scorer, searcher) \
-((bits && !bv_get(bits, scorer->doc))\
- || (post_filter \
-     && !(filter_factor = \
-          post_filter->filter_func(scorer->doc, scorer->score(scorer),\
-                                   searcher, post_filter->arg))))
+/*
+ * Get the docs matched by +filter+ in +ir+. A sparse filter is returned as
+ * an iterator for the scorer to leapfrog with while a dense one is returned
+ * as a set to check each scored doc against.
+ */
+static Roaring *sea_get_filter(Filter *filter, IndexReader *ir,
+                               DocIdSetIterator **it)
+{
+    *it = NULL;
+    if (!filter) {
+        return NULL;
+    }
+    if (filt_is_sparse(filter, ir)) {
+        *it = filt_get_iterator(filter, ir);
+        return NULL;
+    }
+    return filt_get_roaring(filter, ir);
+}
 
-static TopDocs *isea_search_w(Searcher *self,
-                              Weight *weight,
-                              int first_doc,
-                              int num_docs,
-                              Filter *filter,
-                              Sort *sort,
-                              PostFilter *post_filter,
-                              bool load_fields)
+static INLINE bool sea_next(Scorer *scorer, DocIdSetIterator *filter_it)
+{
+    return scorer->next(scorer)
+        && (!filter_it || scorer_leapfrog(scorer, filter_it));
+}
+
+static INLINE bool sea_skip_to(Scorer *scorer, int doc_num,
+                               DocIdSetIterator *filter_it)
+{
+    return scorer->skip_to(scorer, doc_num)
+        && (!filter_it || scorer_leapfrog(scorer, filter_it));
+}
+
+/*
+ * Searches sorted by an integer field, with ties broken by doc number, can
+ * stop looking in a segment sorted by the same field once they have enough
+ * hits. See Config#sort_field.
+ */
+static bool sea_sorted_like_index(Sort *sort, Symbol *field, bool *reverse)
+{
+    SortField *sf;
+    if (sort->size < 1 || sort->size > 2) {
+        return false;
+    }
+    if (sort->size == 2) {
+        sf = sort->sort_fields[1];
+        if (sf->type != SORT_TYPE_DOC || sf->reverse) {
+            return false;
+        }
+    }
+    sf = sort->sort_fields[0];
+    *field = sf->field;
+    *reverse = sf->reverse;
+    return sf->type == SORT_TYPE_INTEGER;
+}
+
+static TopDocs *isea_search_w_i(Searcher *self,
+                                Weight *weight,
+                                int first_doc,
+                                int num_docs,
+                                Filter *filter,
+                                Sort *sort,
+                                PostFilter *post_filter,
+                                bool load_fields)
 {
     int max_size = num_docs + (num_docs == INT_MAX ? 0 : first_doc);
     int i;
@@ -1041,13 +1105,17 @@ static TopDocs *isea_search_w(Searcher *self,
     int total_hits = 0;
     float score, max_score = 0.0;
     float filter_factor = 1.0;
-    BitVector *bits = (filter
-                       ? filt_get_bv(filter, ISEA(self)->ir)
-                       : NULL);
+    DocIdSetIterator *filter_it;
+    Roaring *bits;
     Hit *(*hq_pop)(PriorityQueue *pq);
     void (*hq_insert)(PriorityQueue *pq, Hit *hit);
     void (*hq_destroy)(PriorityQueue *self);
     PriorityQueue *hq;
+    bool prune;
+    bool early_stop, seg_sorted = false;
+    Symbol sort_field = NULL;
+    bool sort_reverse = false;
+    int seg_end = -1, skip_to = -1, lowest_doc = -1;
 
     sea_check_args(num_docs, first_doc);
 
@@ -1056,6 +1124,23 @@ static TopDocs *isea_search_w(Searcher *self,
         if (scorer) scorer->destroy(scorer);
         return td_new(0, 0, NULL, 0.0);
     }
+    bits = sea_get_filter(filter, ISEA(self)->ir, &filter_it);
+
+    /* hits are collected in doc order and ties go to the lower doc so once
+     * the queue is full only docs scoring higher than its lowest hit can get
+     * in. The scorer may use that to skip docs. */
+    prune = !sort && !post_filter && !ISEA(self)->count_total_hits
+        && NULL != scorer->set_min_score;
+    if (prune) {
+        scorer->set_min_score(scorer, -FLT_MAX);
+    }
+
+    /* in a segment sorted the way the search is sorted no doc after one
+     * which can't get ahead of the lowest hit in a full queue can either so
+     * the rest of the segment is skipped. total_hits and max_score only count
+     * the docs looked at. */
+    early_stop = sort && !ISEA(self)->count_total_hits
+        && sea_sorted_like_index(sort, &sort_field, &sort_reverse);
 
     if (sort) {
         hq = fshq_pq_new(max_size, sort, ISEA(self)->ir);
@@ -1075,8 +1160,14 @@ static TopDocs *isea_search_w(Searcher *self,
         hq_destroy = &pq_destroy;
     }
 
-    while (scorer->next(scorer)) {
-        if (bits && !bv_get(bits, scorer->doc)) continue;
+    while (skip_to >= 0 ? sea_skip_to(scorer, skip_to, filter_it)
+                        : sea_next(scorer, filter_it)) {
+        skip_to = -1;
+        if (early_stop && scorer->doc >= seg_end) {
+            seg_end = ir_segment_end(ISEA(self)->ir, scorer->doc, sort_field,
+                                     sort_reverse, &seg_sorted);
+        }
+        if (bits && !roar_get(bits, scorer->doc)) continue;
         score = scorer->score(scorer);
         if (post_filter &&
             !(filter_factor = post_filter->filter_func(scorer->doc,
@@ -1089,9 +1180,25 @@ static TopDocs *isea_search_w(Searcher *self,
         if (filter_factor < 1.0) score *= filter_factor;
         if (score > max_score) max_score = score;
         hit.doc = scorer->doc; hit.score = score;
+        if (seg_sorted) {
+            lowest_doc = hq->size == max_size ? ((Hit *)pq_top(hq))->doc : -1;
+        }
         hq_insert(hq, &hit);
+        if (prune && hq->size == max_size) {
+            scorer->set_min_score(scorer, ((Hit *)pq_top(hq))->score);
+        }
+        /* the doc went in as the lowest hit or didn't get in at all */
+        if (seg_sorted && hq->size == max_size
+            && (((Hit *)pq_top(hq))->doc == hit.doc
+                || ((Hit *)pq_top(hq))->doc == lowest_doc)) {
+            if (seg_end >= ISEA(self)->ir->max_doc(ISEA(self)->ir)) {
+                break;
+            }
+            skip_to = seg_end;
+        }
     }
     scorer->destroy(scorer);
+    if (filter_it) filter_it->close(filter_it);
 
     if (hq->size > first_doc) {
         if ((hq->size - first_doc) < num_docs) {
@@ -1115,6 +1222,45 @@ static TopDocs *isea_search_w(Searcher *self,
     return td_new(total_hits, num_docs, score_docs, max_score);
 }
 
+/* The search methods let the store know when they are running so that merges
+ * can throttle their I/O, see Config#max_merge_mb_per_sec. MultiReaders opened
+ * with mr_open have no store. */
+static void isea_search_start(Searcher *self)
+{
+    Store *store = ISEA(self)->ir->store;
+    if (store) {
+        store_search_start(store);
+    }
+}
+
+static void isea_search_finish(Searcher *self)
+{
+    Store *store = ISEA(self)->ir->store;
+    if (store) {
+        store_search_finish(store);
+    }
+}
+
+static TopDocs *isea_search_w(Searcher *self,
+                              Weight *weight,
+                              int first_doc,
+                              int num_docs,
+                              Filter *filter,
+                              Sort *sort,
+                              PostFilter *post_filter,
+                              bool load_fields)
+{
+    TopDocs *volatile td = NULL;
+    isea_search_start(self);
+    TRY
+        td = isea_search_w_i(self, weight, first_doc, num_docs, filter, sort,
+                             post_filter, load_fields);
+    XFINALLY
+        isea_search_finish(self);
+    XENDTRY
+    return td;
+}
+
 static TopDocs *isea_search(Searcher *self,
                             Query *query,
                             int first_doc,
@@ -1132,25 +1278,25 @@ static TopDocs *isea_search(Searcher *self,
     return td;
 }
 
-static void isea_search_each_w(Searcher *self, Weight *weight, Filter *filter,
-                               PostFilter *post_filter,
-                               void (*fn)(Searcher *, int, float, void *),
-                               void *arg)
+static void isea_search_each_w_i(Searcher *self, Weight *weight,
+                                 Filter *filter, PostFilter *post_filter,
+                                 void (*fn)(Searcher *, int, float, void *),
+                                 void *arg)
 {
     Scorer *scorer;
     float filter_factor = 1.0;
-    BitVector *bits = (filter
-                       ? filt_get_bv(filter, ISEA(self)->ir)
-                       : NULL);
+    DocIdSetIterator *filter_it;
+    Roaring *bits;
 
     scorer = weight->scorer(weight, ISEA(self)->ir);
     if (!scorer) {
         return;
     }
+    bits = sea_get_filter(filter, ISEA(self)->ir, &filter_it);
 
-    while (scorer->next(scorer)) {
+    while (sea_next(scorer, filter_it)) {
         float score;
-        if (bits && !bv_get(bits, scorer->doc)) continue;
+        if (bits && !roar_get(bits, scorer->doc)) continue;
         score = scorer->score(scorer);
         if (post_filter &&
             !(filter_factor = post_filter->filter_func(scorer->doc,
@@ -1162,6 +1308,20 @@ static void isea_search_each_w(Searcher *self, Weight *weight, Filter *filter,
         fn(self, scorer->doc, filter_factor * score, arg);
     }
     scorer->destroy(scorer);
+    if (filter_it) filter_it->close(filter_it);
+}
+
+static void isea_search_each_w(Searcher *self, Weight *weight, Filter *filter,
+                               PostFilter *post_filter,
+                               void (*fn)(Searcher *, int, float, void *),
+                               void *arg)
+{
+    isea_search_start(self);
+    TRY
+        isea_search_each_w_i(self, weight, filter, post_filter, fn, arg);
+    XFINALLY
+        isea_search_finish(self);
+    XENDTRY
 }
 
 static void isea_search_each(Searcher *self, Query *query, Filter *filter,
@@ -1182,11 +1342,11 @@ static void isea_search_each(Searcher *self, Query *query, Filter *filter,
  * Note: Unlike the offset_docnum in other search methods, this offset_docnum
  * refers to document number and not hit.
  */
-static int isea_search_unscored_w(Searcher *self,
-                                  Weight *weight,
-                                  int *buf,
-                                  int limit,
-                                  int offset_docnum)
+static int isea_search_unscored_w_i(Searcher *self,
+                                    Weight *weight,
+                                    int *buf,
+                                    int limit,
+                                    int offset_docnum)
 {
     int count = 0;
     Scorer *scorer = weight->scorer(weight, ISEA(self)->ir);
@@ -1201,6 +1361,23 @@ static int isea_search_unscored_w(Searcher *self,
     return count;
 }
 
+static int isea_search_unscored_w(Searcher *self,
+                                  Weight *weight,
+                                  int *buf,
+                                  int limit,
+                                  int offset_docnum)
+{
+    volatile int count = 0;
+    isea_search_start(self);
+    TRY
+        count = isea_search_unscored_w_i(self, weight, buf, limit,
+                                         offset_docnum);
+    XFINALLY
+        isea_search_finish(self);
+    XENDTRY
+    return count;
+}
+
 static int isea_search_unscored(Searcher *self,
                                 Query *query,
                                 int *buf,
@@ -1265,6 +1442,7 @@ Searcher *isea_new(IndexReader *ir)
 
     ISEA(self)->ir          = ir;
     ISEA(self)->close_ir    = true;
+    ISEA(self)->count_total_hits = true;
 
     self->similarity        = sim_create_default();
     self->doc_freq          = &isea_doc_freq;
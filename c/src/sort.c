@@ -199,13 +199,13 @@ const SortField SORT_FIELD_DOC_REV = {
 
 static void sf_byte_get_val(void *index, Hit *hit, Comparable *comparable)
 {
-    comparable->val.l = ((long *)index)[hit->doc];
+    comparable->val.l = (long)pi_get((PackedInts *)index, hit->doc);
 }
 
 static int sf_byte_compare(void *index, Hit *hit1, Hit *hit2)
 {
-    long val1 = ((long *)index)[hit1->doc];
-    long val2 = ((long *)index)[hit2->doc];
+    i64 val1 = pi_get((PackedInts *)index, hit1->doc);
+    i64 val2 = pi_get((PackedInts *)index, hit2->doc);
     if (val1 > val2) return 1;
     else if (val1 < val2) return -1;
     else return 0;
@@ -224,13 +224,13 @@ SortField *sort_field_byte_new(Symbol field, bool reverse)
 
 static void sf_int_get_val(void *index, Hit *hit, Comparable *comparable)
 {
-    comparable->val.l = ((long *)index)[hit->doc];
+    comparable->val.l = (long)pi_get((PackedInts *)index, hit->doc);
 }
 
 static int sf_int_compare(void *index, Hit *hit1, Hit *hit2)
 {
-    long val1 = ((long *)index)[hit1->doc];
-    long val2 = ((long *)index)[hit2->doc];
+    i64 val1 = pi_get((PackedInts *)index, hit1->doc);
+    i64 val2 = pi_get((PackedInts *)index, hit2->doc);
     if (val1 > val2) return 1;
     else if (val1 < val2) return -1;
     else return 0;
@@ -249,13 +249,13 @@ SortField *sort_field_int_new(Symbol field, bool reverse)
 
 static void sf_float_get_val(void *index, Hit *hit, Comparable *comparable)
 {
-    comparable->val.f = ((float *)index)[hit->doc];
+    comparable->val.f = pi_get_float((PackedInts *)index, hit->doc);
 }
 
 static int sf_float_compare(void *index, Hit *hit1, Hit *hit2)
 {
-    float val1 = ((float *)index)[hit1->doc];
-    float val2 = ((float *)index)[hit2->doc];
+    float val1 = pi_get_float((PackedInts *)index, hit1->doc);
+    float val2 = pi_get_float((PackedInts *)index, hit2->doc);
     if (val1 > val2) return 1;
     else if (val1 < val2) return -1;
     else return 0;
@@ -274,17 +274,15 @@ SortField *sort_field_float_new(Symbol field, bool reverse)
 
 static void sf_string_get_val(void *index, Hit *hit, Comparable *comparable)
 {
-    comparable->val.s
-        = ((StringIndex *)index)->values[
-        ((StringIndex *)index)->index[hit->doc]];
+    StringIndex *si = (StringIndex *)index;
+    comparable->val.s = STRING_INDEX_VALUE(si, pi_get(si->index, hit->doc));
 }
 
 static int sf_string_compare(void *index, Hit *hit1, Hit *hit2)
 {
-    char *s1 = ((StringIndex *)index)->values[
-        ((StringIndex *)index)->index[hit1->doc]];
-    char *s2 = ((StringIndex *)index)->values[
-        ((StringIndex *)index)->index[hit2->doc]];
+    StringIndex *si = (StringIndex *)index;
+    char *s1 = STRING_INDEX_VALUE(si, pi_get(si->index, hit1->doc));
+    char *s2 = STRING_INDEX_VALUE(si, pi_get(si->index, hit2->doc));
 
     if (s1 == NULL) return s2 ? 1 : 0;
     if (s2 == NULL) return -1;
@@ -298,8 +296,8 @@ static int sf_string_compare(void *index, Hit *hit1, Hit *hit2)
     /*
      * TODO: investigate whether it would be a good idea to presort strings.
      *
-    int val1 = index->index[hit1->doc];
-    int val2 = index->index[hit2->doc];
+    i64 val1 = pi_get(index->index, hit1->doc);
+    i64 val2 = pi_get(index->index, hit2->doc);
     if (val1 > val2) return 1;
     else if (val1 < val2) return -1;
     else return 0;
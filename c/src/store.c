@@ -1,5 +1,6 @@
 #include "store.h"
 #include <string.h>
+#include <sys/time.h>
 #include "internal.h"
 
 #define VINT_MAX_LEN 10
@@ -43,6 +44,184 @@ void store_deref(Store *store)
     }
 }
 
+/* The FS and mmap stores of a directory are separate Stores so they share
+ * their count of running searches. All counts are guarded by one mutex as
+ * they can't use the mutex of any one store. */
+struct FrtSearchCount
+{
+    int cnt;
+    int ref_cnt;
+};
+
+#ifndef UNTHREADED
+static mutex_t search_count_mutex = MUTEX_INITIALIZER;
+#endif
+
+static void search_count_deref(struct FrtSearchCount *searches)
+{
+    if (--searches->ref_cnt <= 0) {
+        free(searches);
+    }
+}
+
+void store_share_searches(Store *store, Store *other)
+{
+    mutex_lock(&search_count_mutex);
+    search_count_deref(store->searches);
+    store->searches = other->searches;
+    store->searches->ref_cnt++;
+    mutex_unlock(&search_count_mutex);
+}
+
+void store_search_start(Store *store)
+{
+    mutex_lock(&search_count_mutex);
+    store->searches->cnt++;
+    mutex_unlock(&search_count_mutex);
+}
+
+void store_search_finish(Store *store)
+{
+    mutex_lock(&search_count_mutex);
+    store->searches->cnt--;
+    mutex_unlock(&search_count_mutex);
+}
+
+bool store_searching(Store *store)
+{
+    bool searching;
+    mutex_lock(&search_count_mutex);
+    searching = store->searches->cnt > 0;
+    mutex_unlock(&search_count_mutex);
+    return searching;
+}
+
+/****************************************************************************
+ *
+ * RateLimiter
+ *
+ ****************************************************************************/
+
+/* don't bother sleeping for less than a millisecond. The time is still owed
+ * so it is made up on a later pause */
+#define RL_MIN_PAUSE 0.001
+/* sleep in slices so that rate changes are noticed during long pauses */
+#define RL_MAX_PAUSE 0.1
+
+static thread_key_t rate_limiter_key;
+static thread_once_t rate_limiter_key_once = THREAD_ONCE_INIT;
+
+static void rate_limiter_key_alloc(void)
+{
+    thread_key_create(&rate_limiter_key, NULL);
+}
+
+static double rl_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+static void rl_sleep(double secs)
+{
+    micro_sleep((int)(secs * 1000000.0));
+}
+
+RateLimiter *rate_limiter_new(double mb_per_sec, Store *store)
+{
+    RateLimiter *rl = ALLOC(RateLimiter);
+    rl->mb_per_sec = mb_per_sec;
+    rl->next_time = 0.0;
+    rl->paused = 0.0;
+    rl->store = store;
+    rl->now = &rl_now;
+    rl->sleep = &rl_sleep;
+    mutex_init(&rl->mutex, NULL);
+    return rl;
+}
+
+void rate_limiter_destroy(RateLimiter *rl)
+{
+    mutex_destroy(&rl->mutex);
+    free(rl);
+}
+
+void rate_limiter_set_mb_per_sec(RateLimiter *rl, double mb_per_sec)
+{
+    mutex_lock(&rl->mutex);
+    rl->mb_per_sec = mb_per_sec;
+    mutex_unlock(&rl->mutex);
+}
+
+/* must be called with rl->mutex locked */
+static bool rl_limiting(RateLimiter *rl)
+{
+    return rl->mb_per_sec > 0.0 && (!rl->store || store_searching(rl->store));
+}
+
+void rate_limiter_pause(RateLimiter *rl, int bytes)
+{
+    double now, target;
+
+    mutex_lock(&rl->mutex);
+    now = rl->now();
+    if (!rl_limiting(rl)) {
+        /* no time is owed for bytes transferred while we aren't limiting */
+        rl->next_time = now;
+        mutex_unlock(&rl->mutex);
+        return;
+    }
+    if (rl->next_time < now) {
+        rl->next_time = now;
+    }
+    rl->next_time += bytes / (rl->mb_per_sec * 1048576.0);
+    target = rl->next_time;
+    mutex_unlock(&rl->mutex);
+
+    while (target - now >= RL_MIN_PAUSE) {
+        double pause = target - now;
+        bool limiting;
+        if (pause > RL_MAX_PAUSE) {
+            pause = RL_MAX_PAUSE;
+        }
+        rl->sleep(pause);
+
+        mutex_lock(&rl->mutex);
+        rl->paused += pause;
+        now = rl->now();
+        if (!(limiting = rl_limiting(rl))) {
+            rl->next_time = now;
+        }
+        mutex_unlock(&rl->mutex);
+        if (!limiting) {
+            break;
+        }
+    }
+}
+
+void thread_set_rate_limiter(RateLimiter *rl)
+{
+    thread_once(&rate_limiter_key_once, &rate_limiter_key_alloc);
+    thread_setspecific(rate_limiter_key, rl);
+}
+
+RateLimiter *thread_get_rate_limiter()
+{
+    thread_once(&rate_limiter_key_once, &rate_limiter_key_alloc);
+    return (RateLimiter *)thread_getspecific(rate_limiter_key);
+}
+
+/* pause on the calling thread's RateLimiter, if it has one, after
+ * transferring +bytes+ bytes */
+static INLINE void io_pause(int bytes)
+{
+    RateLimiter *rl = thread_get_rate_limiter();
+    if (rl) {
+        rate_limiter_pause(rl, bytes);
+    }
+}
+
 Lock *open_lock(Store *store, const char *lockname)
 {
     Lock *lock = store->open_lock_i(store, lockname);
@@ -67,6 +246,8 @@ Store *store_new()
 {
     Store *store = ALLOC(Store);
     store->ref_cnt = 1;
+    store->searches = ALLOC_AND_ZERO(struct FrtSearchCount);
+    store->searches->ref_cnt = 1;
     mutex_init(&store->mutex_i, NULL);
     mutex_init(&store->mutex, NULL);
     store->locks = hs_new_ptr((free_ft)&close_lock_i);
@@ -80,6 +261,9 @@ Store *store_new()
  */
 void store_destroy(Store *store)
 {
+    mutex_lock(&search_count_mutex);
+    search_count_deref(store->searches);
+    mutex_unlock(&search_count_mutex);
     mutex_destroy(&store->mutex_i);
     mutex_destroy(&store->mutex);
     hs_destroy(store->locks);
@@ -108,6 +292,7 @@ OutStream *os_new()
 INLINE void os_flush(OutStream *os)
 {
     os->m->flush_i(os, os->buf.buf, os->buf.pos);
+    io_pause((int)os->buf.pos);
     os->buf.start += os->buf.pos;
     os->buf.pos = 0;
 }
@@ -160,6 +345,7 @@ void os_write_bytes(OutStream *os, const uchar *buf, int len)
 
     if (len < BUFFER_SIZE) {
         os->m->flush_i(os, buf, len);
+        io_pause(len);
         os->buf.start += len;
     }
     else {
@@ -173,6 +359,7 @@ void os_write_bytes(OutStream *os, const uchar *buf, int len)
                 size = BUFFER_SIZE;
             }
             os->m->flush_i(os, buf + pos, size);
+            io_pause(size);
             pos += size;
             os->buf.start += size;
         }
@@ -190,6 +377,7 @@ InStream *is_new()
     is->buf.start = 0;
     is->buf.pos = 0;
     is->buf.len = 0;
+    is->data = is->buf.buf;
     is->ref_cnt_ptr = ALLOC_AND_ZERO(int);
     return is;
 }
@@ -205,7 +393,14 @@ static void is_refill(InStream *is)
 {
     off_t start = is->buf.start + is->buf.pos;
     off_t last = start + BUFFER_SIZE;
-    off_t flen = is->m->length_i(is);
+    off_t flen;
+
+    if (is_mapped(is)) {
+        RAISE(EOF_ERROR, "current pos = %"OFF_T_PFX"d, "
+              "file length = %"OFF_T_PFX"d", start, is->buf.len);
+    }
+
+    flen = is->m->length_i(is);
 
     if (last > flen) {          /* don't read past EOF */
         last = flen;
@@ -218,6 +413,7 @@ static void is_refill(InStream *is)
     }
 
     is->m->read_i(is, is->buf.buf, is->buf.len);
+    io_pause((int)is->buf.len);
 
     is->buf.start = start;
     is->buf.pos = 0;
@@ -228,7 +424,7 @@ static void is_refill(InStream *is)
  * there is no chance that you will read past the end of the InStream's
  * buffer.
  */
-#define read_byte(is) is->buf.buf[is->buf.pos++]
+#define read_byte(is) is->data[is->buf.pos++]
 
 /**
  * Read a singly byte (unsigned char) from the InStream +is+.
@@ -262,10 +458,20 @@ uchar *is_read_bytes(InStream *is, uchar *buf, int len)
             buf[i] = read_byte(is);
         }
     }
+    else if (is_mapped(is)) {
+        if ((is->buf.pos + len) > is->buf.len) {
+            RAISE(EOF_ERROR, "Tried to read past end of file. File length is "
+                  "<%"OFF_T_PFX"d> and tried to read to <%"OFF_T_PFX"d>",
+                  is->buf.len, is->buf.pos + len);
+        }
+        memcpy(buf, is->data + is->buf.pos, len);
+        is->buf.pos += len;
+    }
     else {                              /* read all-at-once */
         start = is_pos(is);
         is->m->seek_i(is, start);
         is->m->read_i(is, buf, len);
+        io_pause(len);
 
         is->buf.start = start + len;    /* adjust stream variables */
         is->buf.pos = 0;
@@ -276,7 +482,10 @@ uchar *is_read_bytes(InStream *is, uchar *buf, int len)
 
 void is_seek(InStream *is, off_t pos)
 {
-    if (pos >= is->buf.start && pos < (is->buf.start + is->buf.len)) {
+    if (is_mapped(is)) {
+        is->buf.pos = pos;                  /* the whole file is buffered */
+    }
+    else if (pos >= is->buf.start && pos < (is->buf.start + is->buf.len)) {
         is->buf.pos = pos - is->buf.start;  /* seek within buffer */
     }
     else {
@@ -300,6 +509,9 @@ InStream *is_clone(InStream *is)
 {
     InStream *new_index_i = ALLOC(InStream);
     memcpy(new_index_i, is, sizeof(InStream));
+    if (!is_mapped(is)) {
+        new_index_i->data = new_index_i->buf.buf;
+    }
     (*(new_index_i->ref_cnt_ptr))++;
     return new_index_i;
 }
@@ -470,7 +682,7 @@ char *is_read_string(InStream *is)
         }
     }
     else {                      /* unchecked optimization */
-        memcpy(str, is->buf.buf + is->buf.pos, length);
+        memcpy(str, is->data + is->buf.pos, length);
         is->buf.pos += length;
     }
 
@@ -491,7 +703,7 @@ char *is_read_string_safe(InStream *is)
             }
         }
         else {                      /* unchecked optimization */
-            memcpy(str, is->buf.buf + is->buf.pos, length);
+            memcpy(str, is->data + is->buf.pos, length);
             is->buf.pos += length;
         }
     XCATCHALL
@@ -621,11 +833,29 @@ int file_is_lock(const char *filename)
     return ((start > 0) && (strcmp(LOCK_EXT, &filename[start]) == 0));
 }
 
-void is2os_copy_bytes(InStream *is, OutStream *os, int cnt)
+/* the most bytes handed to os_write_bytes at a time when copying out of a
+ * memory-mapped InStream */
+#define MAPPED_COPY_SIZE 0x100000
+
+void is2os_copy_bytes(InStream *is, OutStream *os, off_t cnt)
 {
     int len;
     uchar buf[BUFFER_SIZE];
 
+    if (is_mapped(is)) {
+        if ((is->buf.pos + cnt) > is->buf.len) {
+            RAISE(EOF_ERROR, "Tried to read past end of file. File length is "
+                  "<%"OFF_T_PFX"d> and tried to read to <%"OFF_T_PFX"d>",
+                  is->buf.len, is->buf.pos + cnt);
+        }
+        for (; cnt > 0; cnt -= len) {
+            len = (int)((cnt > MAPPED_COPY_SIZE) ? MAPPED_COPY_SIZE : cnt);
+            os_write_bytes(os, is->data + is->buf.pos, len);
+            is->buf.pos += len;
+        }
+        return;
+    }
+
     for (; cnt > 0; cnt -= BUFFER_SIZE) {
         len = ((cnt > BUFFER_SIZE) ? BUFFER_SIZE : cnt);
         is_read_bytes(is, buf, len);
@@ -15,6 +15,7 @@ TestSuite *ts_fields(TestSuite *suite);
 TestSuite *ts_file_deleter(TestSuite *suite);
 TestSuite *ts_filter(TestSuite *suite);
 TestSuite *ts_fs_store(TestSuite *suite);
+TestSuite *ts_fst(TestSuite *suite);
 TestSuite *ts_global(TestSuite *suite);
 TestSuite *ts_hash(TestSuite *suite);
 TestSuite *ts_hashset(TestSuite *suite);
@@ -23,6 +24,7 @@ TestSuite *ts_highlighter(TestSuite *suite);
 TestSuite *ts_index(TestSuite *suite);
 TestSuite *ts_lang(TestSuite *suite);
 TestSuite *ts_mem_pool(TestSuite *suite);
+TestSuite *ts_mmap_store(TestSuite *suite);
 TestSuite *ts_multimapper(TestSuite *suite);
 TestSuite *ts_priorityqueue(TestSuite *suite);
 TestSuite *ts_q_const_score(TestSuite *suite);
@@ -31,6 +33,7 @@ TestSuite *ts_q_fuzzy(TestSuite *suite);
 TestSuite *ts_q_parser(TestSuite *suite);
 TestSuite *ts_q_span(TestSuite *suite);
 TestSuite *ts_ram_store(TestSuite *suite);
+TestSuite *ts_roaring(TestSuite *suite);
 TestSuite *ts_search(TestSuite *suite);
 TestSuite *ts_multi_search(TestSuite *suite);
 TestSuite *ts_segments(TestSuite *suite);
@@ -57,6 +60,7 @@ const struct test_list
     {ts_file_deleter},
     {ts_filter},
     {ts_fs_store},
+    {ts_fst},
     {ts_global},
     {ts_hash},
     {ts_hashset},
@@ -65,6 +69,7 @@ const struct test_list
     {ts_index},
     {ts_lang},
     {ts_mem_pool},
+    {ts_mmap_store},
     {ts_multimapper},
     {ts_priorityqueue},
     {ts_q_const_score},
@@ -73,6 +78,7 @@ const struct test_list
     {ts_q_parser},
     {ts_q_span},
     {ts_ram_store},
+    {ts_roaring},
     {ts_search},
     {ts_multi_search},
     {ts_segments},
@@ -1149,6 +1149,57 @@ static void test_per_field_analyzer(TestCase *tc, void *data)
     a_deref(pfa);
 }
 
+static void *get_ts_thread(void *arg)
+{
+    Analyzer *a = (Analyzer *)arg;
+    char text[] = "other thread";
+    TokenStream *ts = a_get_ts(a, I("random"), text);
+    ts_deref(ts);
+    return ts;
+}
+
+static void test_reused_token_streams(TestCase *tc, void *data)
+{
+    char text[] = "Pay by e-mail now";
+    char text2[] = "second";
+    Analyzer *pfa = per_field_analyzer_new(standard_analyzer_new(true));
+    Analyzer *a = standard_analyzer_new(true);
+    TokenStream *ts, *ts2;
+    thread_t thread;
+    void *thread_ts;
+    (void)data;
+
+    pfa_add_field(pfa, I("std"), a);
+    ts = a_get_ts(a, I("random"), text);
+    test_token_pi(ts_next(ts), "pay", 0, 3, 1);
+    test_token_pi(ts_next(ts), "email", 7, 13, 2);
+    test_token_pi(ts_next(ts), "e", 7, 8, 0);
+    ts_deref(ts);
+
+    /* the stream is reset, dropping the rest of the hyphenated word */
+    ts2 = a_get_ts(pfa, I("std"), text2);
+    Apequal(ts, ts2);
+    test_token_pi(ts_next(ts2), "second", 0, 6, 1);
+    Apnull(ts_next(ts2));
+
+    /* a new stream is handed out while the thread's stream is in use */
+    ts = a_get_ts(a, I("random"), text);
+    Assert(ts != ts2, "stream in use shouldn't be reused");
+    test_token_pi(ts_next(ts), "pay", 0, 3, 1);
+    ts_deref(ts);
+    ts_deref(ts2);
+
+    /* each thread has its own stream */
+    thread_create(&thread, &get_ts_thread, a);
+    pthread_join(thread, &thread_ts);
+    Assert(thread_ts != ts2, "threads shouldn't share a stream");
+    ts = a_get_ts(a, I("random"), text2);
+    Apequal(ts2, ts);
+    ts_deref(ts);
+
+    a_deref(pfa);
+}
+
 TestSuite *ts_analysis(TestSuite *suite)
 {
     bool u = false;
@@ -1209,6 +1260,7 @@ TestSuite *ts_analysis(TestSuite *suite)
 
     /* PerField */
     tst_run_test(suite, test_per_field_analyzer, NULL);
+    tst_run_test(suite, test_reused_token_streams, NULL);
 
     /* Filters */
     tst_run_test(suite, test_lowercase_filter, NULL);
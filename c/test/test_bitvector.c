@@ -581,6 +581,78 @@ static void test_bv_scan_stress(TestCase *tc, void *data)
     bv_destroy(not_bv);
 }
 
+/**
+ * Test setting ranges of bits against setting each bit
+ */
+static void test_bv_set_range(TestCase *tc, void *data)
+{
+    static const int ranges[][2] = {
+        {0, 1}, {3, 3}, {5, 64}, {64, 128}, {60, 70}, {100, 300},
+        {250, 260}, {511, 513}, {0, 1000}
+    };
+    int i, j;
+    BitVector *bv = bv_new_capa(10);
+    BitVector *expected = bv_new();
+    (void)data; /* suppress unused argument warning */
+
+    for (i = 0; i < NELEMS(ranges); i++) {
+        bv_set_range(bv, ranges[i][0], ranges[i][1]);
+        for (j = ranges[i][0]; j < ranges[i][1]; j++) {
+            bv_set(expected, j);
+        }
+        Assert(bv_eq(expected, bv), "range %d set", i);
+        Aiequal(expected->size, bv->size);
+        Aiequal(expected->count, bv->count);
+        Aiequal(bv->count, bv_recount(bv));
+    }
+    Aiequal(1000, bv->count);
+    Aiequal(0, bv_get(bv, 1000));
+
+    bv_destroy(bv);
+    bv_destroy(expected);
+}
+
+/**
+ * Test scanning for set bits into a buffer
+ */
+static void test_bv_scan_next_n(TestCase *tc, void *data)
+{
+    int buf[7];
+    int i, n, bit, total = 0;
+    BitVector *bv = bv_new();
+    (void)data; /* suppress unused argument warning */
+
+    for (i = 0; i < BV_SIZE; i++) {
+        if ((rand() % 3) == 0 || i == 63 || i == 64) {
+            bv_set(bv, i);
+        }
+    }
+    bv_scan_reset(bv);
+    bit = -1;
+    while ((n = bv_scan_next_n(bv, buf, NELEMS(buf))) > 0) {
+        for (i = 0; i < n; i++) {
+            bit = bv_scan_next_from(bv, bit + 1);
+            Aiequal(bit, buf[i]);
+        }
+        total += n;
+        if (n < NELEMS(buf)) {
+            Aiequal(-1, bv_scan_next_from(bv, bit + 1));
+            break;
+        }
+    }
+    Aiequal(bv->count, total);
+    Aiequal(0, bv_scan_next_n(bv, buf, NELEMS(buf)));
+
+    /* an unset bit at the end increases the size but sets nothing */
+    bv_clear(bv);
+    bv_set(bv, 70);
+    bv_unset(bv, 200);
+    bv_scan_reset(bv);
+    Aiequal(1, bv_scan_next_n(bv, buf, NELEMS(buf)));
+    Aiequal(70, buf[0]);
+    bv_destroy(bv);
+}
+
 
 TestSuite *ts_bitvector(TestSuite *suite)
 {
@@ -595,6 +667,8 @@ TestSuite *ts_bitvector(TestSuite *suite)
     tst_run_test(suite, test_bv_combined_boolean_ops, NULL);
     tst_run_test(suite, test_bv_scan, NULL);
     tst_run_test(suite, test_bv_scan_stress, NULL);
+    tst_run_test(suite, test_bv_set_range, NULL);
+    tst_run_test(suite, test_bv_scan_next_n, NULL);
 
     return suite;
 }
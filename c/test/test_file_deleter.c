@@ -14,7 +14,14 @@ const Config lucene_config = {
     10,             /* max_buffered_docs */
     INT_MAX,        /* max_merged_docs */
     10000,          /* maximum field length (number of terms) */
-    true            /* use compound file by default */
+    true,           /* use compound file by default */
+    POSTINGS_VINT,  /* postings format */
+    0,              /* merge in the committing thread */
+    0.0,            /* don't limit the I/O rate of merges */
+    1,              /* merge the parts of a segment one after the other */
+    NULL,           /* keep docs in the order they were added */
+    false,          /* sort ascending when a sort field is set */
+    1               /* sort the terms of each field one after the other */
 };
 
 
@@ -312,6 +312,215 @@ static void test_score_altering_filter_func(TestCase *tc, void *data)
     q_deref(q);
 }
 
+#define SPARSE_DOCS_SIZE 2000
+
+/* tenant "a" owns 1 doc in 100 and each doc is in 1 to 3 of groups x, y, z */
+static void prepare_sparse_filter_index(Store *store)
+{
+    int i;
+    IndexWriter *iw;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+
+    index_create(store, fis);
+    fis_deref(fis);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), NULL);
+    for (i = 0; i < SPARSE_DOCS_SIZE; i++) {
+        Document *doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(intern("tenant")),
+                                       i % 100 == 37 ? "a" : "b"));
+        doc_add_field(doc, df_add_data(df_new(intern("group")),
+                                       i % 3 == 0 ? "x y"
+                                       : (i % 3 == 1 ? "x" : "z x")));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_close(iw);
+}
+
+/* check the sparse +f+ gives the same hits as checking each doc of +q+ */
+static void check_sparse_filter(TestCase *tc, Searcher *searcher, Query *q,
+                                Filter *f, BitVector *matches)
+{
+    int i, cnt = 0;
+    TopDocs *td = searcher_search(searcher, q, 0, SPARSE_DOCS_SIZE, NULL,
+                                  NULL, NULL);
+    TopDocs *ftd = searcher_search(searcher, q, 0, SPARSE_DOCS_SIZE, f,
+                                   NULL, NULL);
+    for (i = 0; i < td->size; i++) {
+        if (bv_get(matches, td->hits[i]->doc)) {
+            if (cnt < ftd->size) {
+                Aiequal(td->hits[i]->doc, ftd->hits[cnt]->doc);
+                Afequal(td->hits[i]->score, ftd->hits[cnt]->score);
+            }
+            cnt++;
+        }
+    }
+    Aiequal(cnt, ftd->total_hits);
+    Aiequal(cnt, ftd->size);
+    td_destroy(td);
+    td_destroy(ftd);
+}
+
+static void test_sparse_filter(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    IndexReader *ir;
+    Searcher *searcher;
+    Filter *f, *rf;
+    BitVector *matches;
+    DocIdSetIterator *it;
+    Query *q, *bq;
+    int i;
+    (void)data;
+
+    prepare_sparse_filter_index(store);
+    ir = ir_open(store);
+    searcher = isea_new(ir);
+    f = qfilt_new_nr(tq_new(intern("tenant"), "a"));
+    rf = rfilt_new(intern("tenant"), "a", "b", true, true);
+    Atrue(filt_is_sparse(f, ir));
+    Atrue(!filt_is_sparse(rf, ir));
+
+    matches = filt_get_bv(f, ir);
+    it = filt_get_iterator(f, ir);
+    Aiequal(SPARSE_DOCS_SIZE / 100, it->cost);
+    for (i = 37; i < SPARSE_DOCS_SIZE; i += 100) {
+        Atrue(it->next(it));
+        Aiequal(i, it->doc);
+    }
+    Atrue(!it->next(it));
+    it->close(it);
+    it = filt_get_iterator(f, ir);
+    Atrue(it->skip_to(it, 500));
+    Aiequal(537, it->doc);
+    Atrue(it->skip_to(it, 538));
+    Aiequal(637, it->doc);
+    Atrue(it->next(it));
+    Aiequal(737, it->doc);
+    Atrue(!it->skip_to(it, SPARSE_DOCS_SIZE - 62));
+    it->close(it);
+
+    q = tq_new(intern("group"), "y");
+    check_sparse_filter(tc, searcher, q, f, matches);
+    q_deref(q);
+
+    bq = bq_new(false);
+    bq_add_query_nr(bq, tq_new(intern("group"), "y"), BC_SHOULD);
+    bq_add_query_nr(bq, tq_new(intern("group"), "z"), BC_SHOULD);
+    check_sparse_filter(tc, searcher, bq, f, matches);
+
+    q = fq_new(bq, f);
+    REF(f);
+    check_sparse_filter(tc, searcher, q, f, matches);
+    q_deref(q);
+
+    q = csq_new(f);
+    check_sparse_filter(tc, searcher, q, f, matches);
+    q_deref(q);
+
+    bv_destroy(matches);
+    filt_deref(f);
+    filt_deref(rf);
+    searcher->close(searcher);
+    store_deref(store);
+}
+
+typedef struct CountingFilter
+{
+    Filter super;
+    Filter *filter;
+    int cnt;
+} CountingFilter;
+
+static BitVector *cfilt_get_bv_i(Filter *filt, IndexReader *ir)
+{
+    Filter *filter = ((CountingFilter *)filt)->filter;
+    ((CountingFilter *)filt)->cnt++;
+    return filter->get_bv_i(filter, ir);
+}
+
+static void cfilt_destroy_i(Filter *filt)
+{
+    filt_deref(((CountingFilter *)filt)->filter);
+    filt_destroy_i(filt);
+}
+
+static void test_segment_filter_cache(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir, *ir2, **sub_readers;
+    MultiReader *mr;
+    Filter *filt = filt_new(CountingFilter);
+    FieldInfos *fis;
+    Roaring *docs;
+    int i;
+    (void)data;
+
+    ((CountingFilter *)filt)->filter =
+        qfilt_new_nr(tq_new(intern("tenant"), "a"));
+    ((CountingFilter *)filt)->cnt = 0;
+    filt->get_bv_i = &cfilt_get_bv_i;
+    filt->destroy_i = &cfilt_destroy_i;
+
+    config.max_buffered_docs = 500;
+    config.merge_factor = 100;
+    fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+    index_create(store, fis);
+    fis_deref(fis);
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < SPARSE_DOCS_SIZE; i++) {
+        Document *doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(intern("tenant")),
+                                       i % 10 == 3 ? "a" : "b"));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_close(iw);
+
+    ir = ir_open(store);
+    mr = ir_as_multi(ir);
+    if (!Apnotnull(mr)) {
+        ir_close(ir);
+        filt_deref(filt);
+        store_deref(store);
+        return;
+    }
+    Aiequal(SPARSE_DOCS_SIZE / 500, mr->r_cnt);
+    docs = filt_get_roaring(filt, ir);
+    Aiequal(SPARSE_DOCS_SIZE / 10, docs->count);
+    Aiequal(mr->r_cnt, ((CountingFilter *)filt)->cnt);
+    Atrue(roar_get(docs, 1503));
+    Atrue(!roar_get(docs, 1504));
+
+    /* a reader sharing the segments only has to join their docs */
+    sub_readers = ALLOC_N(IndexReader *, mr->r_cnt);
+    for (i = 0; i < mr->r_cnt; i++) {
+        sub_readers[i] = mr->sub_readers[i];
+        REF(sub_readers[i]);
+    }
+    ir2 = mr_open(sub_readers, mr->r_cnt);
+    docs = filt_get_roaring(filt, ir2);
+    Aiequal(SPARSE_DOCS_SIZE / 10, docs->count);
+    Aiequal(mr->r_cnt, ((CountingFilter *)filt)->cnt);
+
+    /* only the segment with deletions is filtered again */
+    ir_delete_doc(ir, 1503);
+    docs = filt_get_roaring(filt, ir2);
+    Aiequal(SPARSE_DOCS_SIZE / 10 - 1, docs->count);
+    Atrue(!roar_get(docs, 1503));
+    Aiequal(mr->r_cnt + 1, ((CountingFilter *)filt)->cnt);
+    Aiequal(SPARSE_DOCS_SIZE / 10 - 1, filt_get_roaring(filt, ir)->count);
+    Aiequal(mr->r_cnt + 1, ((CountingFilter *)filt)->cnt);
+    ir_close(ir2);
+
+    ir_close(ir);
+    filt_deref(filt);
+    store_deref(store);
+}
+
 TestSuite *ts_filter(TestSuite *suite)
 {
     Store *store;
@@ -331,6 +540,8 @@ TestSuite *ts_filter(TestSuite *suite)
     tst_run_test(suite, test_query_filter_hash, NULL);
     tst_run_test(suite, test_filter_func, searcher);
     tst_run_test(suite, test_score_altering_filter_func, searcher);
+    tst_run_test(suite, test_sparse_filter, NULL);
+    tst_run_test(suite, test_segment_filter_cache, NULL);
 
     store_deref(store);
     searcher->close(searcher);
@@ -1,7 +1,157 @@
 #include "store.h"
+#include "index.h"
 #include "test_store.h"
 #include "test.h"
 
+#define FH_TEST_FILE_CNT 6
+
+/**
+ * Test that FS InStreams keep working when there are more of them open than
+ * the open file limit allows, including streams whose files have been
+ * removed.
+ */
+static void test_max_open_files(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    InStream *iss[FH_TEST_FILE_CNT * 2];
+    int old_max_open_files = fs_max_open_files;
+    char fname[20];
+    OutStream *os;
+    int i, j;
+
+    fs_max_open_files = 2;
+    for (i = 0; i < FH_TEST_FILE_CNT; i++) {
+        sprintf(fname, "_fh%d.frq", i);
+        os = store->new_output(store, fname);
+        for (j = 0; j < 1000; j++) {
+            os_write_vint(os, i * 1000 + j);
+        }
+        os_close(os);
+    }
+
+    for (i = 0; i < FH_TEST_FILE_CNT; i++) {
+        sprintf(fname, "_fh%d.frq", i);
+        iss[i] = store->open_input(store, fname);
+        iss[i + FH_TEST_FILE_CNT] = store->open_input(store, fname);
+    }
+    store->remove(store, "_fh0.frq");
+    for (j = 0; j < 1000; j++) {
+        for (i = 0; i < FH_TEST_FILE_CNT * 2; i++) {
+            Aiequal((i % FH_TEST_FILE_CNT) * 1000 + j, is_read_vint(iss[i]));
+        }
+    }
+    for (i = 0; i < FH_TEST_FILE_CNT * 2; i++) {
+        is_close(iss[i]);
+    }
+    fs_max_open_files = old_max_open_files;
+}
+
+static void remove_fh2(Store *store)
+{
+    store->remove(store, "_fh2.frq");
+}
+
+/**
+ * Test that removed files which are still being read don't pin more
+ * descriptors than the open file limit allows. Removing a file is put off
+ * until there is room for its descriptor.
+ */
+static void test_max_pinned_files(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    InStream *iss[4];
+    int old_max_open_files = fs_max_open_files;
+    char fname[20];
+    OutStream *os;
+    int i, j;
+
+    fs_max_open_files = 3;
+    for (i = 0; i < 4; i++) {
+        sprintf(fname, "_fh%d.frq", i);
+        os = store->new_output(store, fname);
+        for (j = 0; j < 1000; j++) {
+            os_write_vint(os, i * 1000 + j);
+        }
+        os_close(os);
+        iss[i] = store->open_input(store, fname);
+    }
+
+    store->remove(store, "_fh0.frq");
+    store->remove(store, "_fh1.frq");
+    Atrue(!store->exists(store, "_fh1.frq"));
+    Araise(IO_ERROR, &remove_fh2, store);
+    Atrue(store->exists(store, "_fh2.frq"));
+    for (j = 0; j < 500; j++) {
+        for (i = 0; i < 4; i++) {
+            Aiequal(i * 1000 + j, is_read_vint(iss[i]));
+        }
+    }
+
+    is_close(iss[0]);
+    store->remove(store, "_fh2.frq");
+    Atrue(!store->exists(store, "_fh2.frq"));
+    for (j = 500; j < 1000; j++) {
+        for (i = 1; i < 4; i++) {
+            Aiequal(i * 1000 + j, is_read_vint(iss[i]));
+        }
+    }
+    for (i = 1; i < 4; i++) {
+        is_close(iss[i]);
+    }
+    store->remove(store, "_fh3.frq");
+    fs_max_open_files = old_max_open_files;
+}
+
+/**
+ * Test that a file rewritten in place isn't read with the length it had when
+ * a stream which is still open was opened on it.
+ */
+static void test_rewritten_file_length(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    OutStream *os;
+    InStream *is1, *is2;
+
+    os = store->new_output(store, "_rw.gen");
+    os_write_u64(os, 1);
+    os_close(os);
+    is1 = store->open_input(store, "_rw.gen");
+    Aiequal(8, is_length(is1));
+
+    os = store->new_output(store, "_rw.gen");
+    os_write_u64(os, 2);
+    os_write_u64(os, 3);
+    os_close(os);
+    is2 = store->open_input(store, "_rw.gen");
+    Aiequal(16, is_length(is2));
+    Aiequal(2, is_read_u64(is2));
+    Aiequal(3, is_read_u64(is2));
+    is_close(is2);
+    is_close(is1);
+    store->remove(store, "_rw.gen");
+}
+
+/**
+ * Test that searches through the mmap store of a directory are seen by
+ * merges through its FS store and vice versa.
+ */
+static void test_shared_searches(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Store *mmap_store = open_mmap_store(store->dir.path);
+
+    Atrue(!store_searching(store));
+    store_search_start(mmap_store);
+    Atrue(store_searching(store));
+    store_search_start(store);
+    store_search_finish(mmap_store);
+    Atrue(store_searching(mmap_store));
+    store_search_finish(store);
+    Atrue(!store_searching(mmap_store));
+    Atrue(!store_searching(store));
+    store_deref(mmap_store);
+}
+
 /**
  * Test a FileSystem store
  */
@@ -18,6 +168,112 @@ TestSuite *ts_fs_store(TestSuite *suite)
     suite = ADD_SUITE(suite);
 
     create_test_store_suite(suite, store);
+    tst_run_test(suite, test_max_open_files, store);
+    tst_run_test(suite, test_max_pinned_files, store);
+    tst_run_test(suite, test_rewritten_file_length, store);
+    tst_run_test(suite, test_shared_searches, store);
+    store->clear_all(store);
+
+    store_deref(store);
+
+    return suite;
+}
+
+static void read_past_eof(void *p)
+{
+    InStream *is = (InStream *)p;
+    uchar buf[4];
+    is_read_bytes(is, buf, 4);
+}
+
+/**
+ * Test that memory-mapped streams, including streams within a compound file,
+ * read straight from the mapping and still detect the end of the file.
+ */
+static void test_mmap_compound(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data, *c_reader;
+    CompoundWriter *cw;
+    OutStream *os;
+    InStream *is, *is_alt;
+    char *p;
+    int i;
+
+    os = store->new_output(store, "_mm.frq");
+    for (i = 0; i < 2000; i++) {
+        os_write_vint(os, i * 1000);
+    }
+    os_close(os);
+    os = store->new_output(store, "_mm.prx");
+    os_write_string(os, "this is file2");
+    os_write_u32(os, 1234);
+    os_close(os);
+
+    cw = open_cw(store, "_mm.cfs");
+    cw_add_file(cw, "_mm.frq");
+    cw_add_file(cw, "_mm.prx");
+    cw_close(cw);
+
+    c_reader = open_cmpd_store(store, "_mm.cfs");
+    is = c_reader->open_input(c_reader, "_mm.frq");
+#ifndef POSH_OS_WIN32
+    Atrue(is_mapped(is));
+#endif
+    for (i = 0; i < 1000; i++) {
+        Aiequal(i * 1000, is_read_vint(is));
+    }
+    is_alt = is_clone(is);
+    for (i = 1000; i < 2000; i++) {
+        Aiequal(i * 1000, is_read_vint(is_alt));
+    }
+    Aiequal(is_length(is_alt), is_pos(is_alt));
+    is_seek(is, 0);
+    Aiequal(0, is_read_vint(is));
+    is_close(is_alt);
+    is_close(is);
+
+    /* copies from a mapped stream are written straight out of the mapping */
+    is = c_reader->open_input(c_reader, "_mm.frq");
+    Aiequal(0, is_read_vint(is));
+    os = store->new_output(store, "_mm.cp");
+    is2os_copy_bytes(is, os, is_length(is) - is_pos(is));
+    os_close(os);
+    Aiequal(is_length(is), is_pos(is));
+    is_close(is);
+    is = store->open_input(store, "_mm.cp");
+    for (i = 1; i < 2000; i++) {
+        Aiequal(i * 1000, is_read_vint(is));
+    }
+    Aiequal(is_length(is), is_pos(is));
+    is_close(is);
+    store->remove(store, "_mm.cp");
+
+    is = c_reader->open_input(c_reader, "_mm.prx");
+    Asequal("this is file2", p = is_read_string(is)); free(p);
+    Aiequal(1234, is_read_u32(is));
+    Araise(EOF_ERROR, &read_past_eof, is);
+    is_close(is);
+    store_deref(c_reader);
+}
+
+/**
+ * Test a memory-mapped FileSystem store
+ */
+TestSuite *ts_mmap_store(TestSuite *suite)
+{
+
+#ifdef POSH_OS_WIN32
+    Store *store = open_mmap_store(".\\test\\testdir\\store");
+#else
+    Store *store = open_mmap_store("./test/testdir/store");
+#endif
+    store->clear(store);
+
+    suite = ADD_SUITE(suite);
+
+    create_test_store_suite(suite, store);
+    tst_run_test(suite, test_mmap_compound, store);
+    store->clear_all(store);
 
     store_deref(store);
 
@@ -0,0 +1,191 @@
+#include "fst.h"
+#include "testhelper.h"
+#include <string.h>
+#include "test.h"
+
+static const char *fst_keys[] = {
+    "", "a", "ab", "abc", "abd", "b", "bcd", "bcde", "x\377"
+};
+
+static Fst *fst_build(const char **keys, int cnt)
+{
+    int i;
+    Fst *fst;
+    FstBuilder *b = fstb_new();
+    for (i = 0; i < cnt; i++) {
+        fstb_add(b, keys[i], (int)strlen(keys[i]));
+    }
+    fst = fstb_finish(b);
+    fstb_destroy(b);
+    return fst;
+}
+
+#define Afloor(expected_ord, expected_key, fst, key) do {\
+    char buf[FST_MAX_KEY_LEN];\
+    int len = -1;\
+    int ord = fst_floor(fst, key, (int)strlen(key), buf, &len);\
+    Aiequal(expected_ord, ord);\
+    if (ord >= 0) {\
+        buf[len] = '\0';\
+        Asequal(expected_key, buf);\
+    }\
+} while (0)
+
+static void test_fst(TestCase *tc, void *data)
+{
+    char buf[FST_MAX_KEY_LEN];
+    int i, len;
+    Fst *fst = fst_build(fst_keys, NELEMS(fst_keys));
+    (void)data;
+
+    Aiequal(NELEMS(fst_keys), fst->size);
+    for (i = 0; i < NELEMS(fst_keys); i++) {
+        len = fst_get_key(fst, i, buf);
+        buf[len] = '\0';
+        Asequal(fst_keys[i], buf);
+        Afloor(i, fst_keys[i], fst, fst_keys[i]);
+    }
+    Afloor(0, "", fst, "\001");
+    Afloor(1, "a", fst, "aa");
+    Afloor(3, "abc", fst, "abca");
+    Afloor(4, "abd", fst, "abz");
+    Afloor(4, "abd", fst, "ac");
+    Afloor(5, "b", fst, "bc");
+    Afloor(5, "b", fst, "bb");
+    Afloor(7, "bcde", fst, "bcdf");
+    Afloor(7, "bcde", fst, "x");
+    Afloor(8, "x\377", fst, "x\377\377");
+    Afloor(8, "x\377", fst, "z");
+    fst_destroy(fst);
+
+    /* without the empty key some keys have no floor */
+    fst = fst_build(fst_keys + 5, 4);
+    Afloor(-1, "", fst, "");
+    Afloor(-1, "", fst, "a");
+    Afloor(0, "b", fst, "ba");
+    fst_destroy(fst);
+
+    fst = fst_build(fst_keys, 0);
+    Aiequal(0, fst->size);
+    Afloor(-1, "", fst, "a");
+    fst_destroy(fst);
+}
+
+static void test_fst_unsorted(TestCase *tc, void *data)
+{
+    bool arg_error = false;
+    FstBuilder *b = fstb_new();
+    (void)data;
+
+    fstb_add(b, "b", 1);
+    TRY
+        fstb_add(b, "a", 1);
+    case ARG_ERROR:
+        arg_error = true;
+        HANDLED();
+    XENDTRY
+    Assert(arg_error, "exception should have been thrown");
+
+    arg_error = false;
+    TRY
+        fstb_add(b, "b", 1);
+    case ARG_ERROR:
+        arg_error = true;
+        HANDLED();
+    XENDTRY
+    Assert(arg_error, "exception should have been thrown");
+    fstb_destroy(b);
+}
+
+static int str_cmp(const void *p1, const void *p2)
+{
+    return strcmp(*(const char **)p1, *(const char **)p2);
+}
+
+/* compare floor lookups with a binary search of the sorted keys */
+static void check_fst_floors(TestCase *tc, Fst *fst, const char **keys,
+                             int cnt)
+{
+    char buf[FST_MAX_KEY_LEN], key[FST_MAX_KEY_LEN];
+    int i, len;
+    for (i = 0; i < 2000; i++) {
+        int lo = 0, hi = cnt - 1, ord;
+        strcpy(key, test_word_list[rand() % TEST_WORD_LIST_SIZE]);
+        if (rand() % 2) {
+            key[rand() % strlen(key)] = 'a' + rand() % 26;
+        }
+        while (lo <= hi) {
+            int mid = (lo + hi) >> 1;
+            if (strcmp(keys[mid], key) <= 0) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid - 1;
+            }
+        }
+        ord = fst_floor(fst, key, (int)strlen(key), buf, &len);
+        Aiequal(hi, ord);
+        if (ord >= 0) {
+            buf[len] = '\0';
+            Asequal(keys[hi], buf);
+        }
+    }
+    for (i = 0; i < cnt; i++) {
+        len = fst_get_key(fst, i, buf);
+        buf[len] = '\0';
+        Asequal(keys[i], buf);
+    }
+}
+
+static void test_fst_word_list(TestCase *tc, void *data)
+{
+    int i, cnt = 0, total_len = 0;
+    const char **keys = ALLOC_N(const char *, TEST_WORD_LIST_SIZE);
+    Store *store = open_ram_store();
+    OutStream *os;
+    InStream *is;
+    Fst *fst, *fst2;
+    (void)data;
+
+    memcpy(keys, test_word_list, TEST_WORD_LIST_SIZE * sizeof(char *));
+    qsort(keys, TEST_WORD_LIST_SIZE, sizeof(char *), &str_cmp);
+    for (i = 0; i < TEST_WORD_LIST_SIZE; i++) {
+        if (0 == cnt || 0 != strcmp(keys[cnt - 1], keys[i])) {
+            keys[cnt++] = keys[i];
+            total_len += (int)strlen(keys[i]);
+        }
+    }
+
+    fst = fst_build(keys, cnt);
+    Aiequal(cnt, fst->size);
+    /* smaller than the null terminated keys and an array of pointers */
+    Atrue(fst->len < total_len + cnt * (int)(1 + sizeof(char *)));
+    check_fst_floors(tc, fst, keys, cnt);
+
+    os = store->new_output(store, "_0.fst");
+    fst_write(fst, os);
+    os_close(os);
+    is = store->open_input(store, "_0.fst");
+    fst2 = fst_read(is);
+    Aiequal(fst->size, fst2->size);
+    Aiequal(fst->len, fst2->len);
+    Atrue(0 == memcmp(fst->bytes, fst2->bytes, fst->len));
+    check_fst_floors(tc, fst2, keys, cnt);
+    fst_destroy(fst2);
+    is_close(is);
+
+    fst_destroy(fst);
+    free(keys);
+    store_deref(store);
+}
+
+TestSuite *ts_fst(TestSuite *suite)
+{
+    suite = ADD_SUITE(suite);
+
+    tst_run_test(suite, test_fst, NULL);
+    tst_run_test(suite, test_fst_unsorted, NULL);
+    tst_run_test(suite, test_fst_word_list, NULL);
+
+    return suite;
+}
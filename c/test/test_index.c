@@ -538,7 +538,6 @@ static void test_segment_term_doc_enum(TestCase *tc, void *data)
     FieldInfo *fi;
     SegmentFieldIndex *sfi;
     TermInfosReader *tir;
-    int skip_interval;
     InStream *frq_in, *prx_in;
     BitVector *bv = NULL;
     TermDocEnum *tde, *tde_reader, *tde_skip_to;
@@ -551,12 +550,11 @@ static void test_segment_term_doc_enum(TestCase *tc, void *data)
 
     sfi = sfi_open(store, "_0");
     tir = tir_open(store, sfi, "_0");
-    skip_interval = ((SegmentTermEnum *)tir->orig_te)->skip_interval;
     frq_in = store->open_input(store, "_0.frq");
     prx_in = store->open_input(store, "_0.prx");
-    tde = stde_new(tir, frq_in, bv, skip_interval);
-    tde_reader = stde_new(tir, frq_in, bv, skip_interval);
-    tde_skip_to = stde_new(tir, frq_in, bv, skip_interval);
+    tde = stde_new(tir, frq_in, bv, sfi);
+    tde_reader = stde_new(tir, frq_in, bv, sfi);
+    tde_skip_to = stde_new(tir, frq_in, bv, sfi);
 
     fi = fis_get_field(fis, I("tv"));
     for (i = 0; i < 300; i++) {
@@ -597,8 +595,8 @@ static void test_segment_term_doc_enum(TestCase *tc, void *data)
     tde_skip_to->close(tde_skip_to);
 
 
-    tde = stpe_new(tir, frq_in, prx_in, bv, skip_interval);
-    tde_skip_to = stpe_new(tir, frq_in, prx_in, bv, skip_interval);
+    tde = stpe_new(tir, frq_in, prx_in, bv, sfi);
+    tde_skip_to = stpe_new(tir, frq_in, prx_in, bv, sfi);
 
     fi = fis_get_field(fis, I("tv+offsets"));
     for (i = 0; i < 200; i++) {
@@ -647,7 +645,7 @@ const char *triple_word = "word word word";
 
 static void test_segment_tde_deleted_docs(TestCase *tc, void *data)
 {
-    int i, doc_num_expected, skip_interval;
+    int i, doc_num_expected;
     Store *store = (Store *)data;
     DocWriter *dw;
     Document *doc;
@@ -682,8 +680,7 @@ static void test_segment_tde_deleted_docs(TestCase *tc, void *data)
     tir = tir_open(store, sfi, "_0");
     frq_in = store->open_input(store, "_0.frq");
     prx_in = store->open_input(store, "_0.prx");
-    skip_interval = sfi->skip_interval;
-    tde = stpe_new(tir, frq_in, prx_in, bv, skip_interval);
+    tde = stpe_new(tir, frq_in, prx_in, bv, sfi);
 
     tde->seek(tde, 0, "word");
     doc_num_expected = 0;
@@ -709,6 +706,193 @@ static void test_segment_tde_deleted_docs(TestCase *tc, void *data)
     si_deref(si);
 }
 
+#define NUM_SKIP_TEST_DOCS 5000
+
+/* "word" is in all NUM_SKIP_TEST_DOCS docs which gives 5000 / SKIP_INTERVAL
+ * = 312 skips on the lowest level, 312 / SKIP_MULTIPLIER = 39 on the next and
+ * 4 on the third. A fourth level would have none so the skip list has three
+ * levels. */
+static void add_skip_test_docs(IndexWriter *iw, int start, int end)
+{
+    int i, j;
+    char buf[100];
+    Document *doc;
+
+    for (i = start; i < end; i++) {
+        buf[0] = '\0';
+        for (j = i % 3; j >= 0; j--) {
+            strcat(buf, "word ");
+        }
+        if (0 == (i % 2)) {
+            strcat(buf, "even");
+        }
+        doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(I("f")), buf));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+}
+
+static void check_skip_test_index(TestCase *tc, Store *store,
+                                  PostingsFormat postings_format)
+{
+    int i, j, cnt, target, expected;
+    int docs[50], freqs[50];
+    IndexReader *ir;
+    TermDocEnum *tde;
+    SegmentFieldIndex *sfi;
+
+    ir = ir_open(store);
+    Aiequal(1, ir->sis->size);
+    sfi = sfi_open(store, ir->sis->segs[0]->name);
+    Aiequal(MAX_SKIP_LEVELS, sfi->max_skip_levels);
+    Aiequal(SKIP_MULTIPLIER, sfi->skip_multiplier);
+    Aiequal(postings_format, sfi->postings_format);
+    sfi_close(sfi);
+
+    for (i = 0; i < NUM_SKIP_TEST_DOCS; i += 7) {
+        ir_delete_doc(ir, i);
+    }
+
+    tde = ir_term_positions_for(ir, I("f"), "word");
+    for (i = 0; i < 200; i++) {
+        tde->seek(tde, ir_get_field_num(ir, I("f")), "word");
+        target = 0;
+        while (true) {
+            target += rand() % (i * 10 + 1) + 1;
+            expected = (0 == (target % 7)) ? target + 1 : target;
+            if (expected >= NUM_SKIP_TEST_DOCS) {
+                Atrue(!tde->skip_to(tde, target));
+                break;
+            }
+            if (!Atrue(tde->skip_to(tde, target))) {
+                break;
+            }
+            Aiequal(expected, tde->doc_num(tde));
+            Aiequal(expected % 3 + 1, tde->freq(tde));
+            for (j = 0; j <= expected % 3; j++) {
+                Aiequal(j, tde->next_position(tde));
+            }
+            target = expected;
+        }
+    }
+    tde->close(tde);
+
+    tde = ir_term_docs_for(ir, I("f"), "even");
+    for (target = 1; target < NUM_SKIP_TEST_DOCS - 1; target += 97) {
+        expected = target + target % 2;
+        if (0 == (expected % 7)) {
+            expected += 2;
+        }
+        tde->seek(tde, ir_get_field_num(ir, I("f")), "even");
+        Atrue(tde->skip_to(tde, target));
+        Aiequal(expected, tde->doc_num(tde));
+    }
+
+    /* bulk reads must match the undeleted docs */
+    tde->seek(tde, ir_get_field_num(ir, I("f")), "word");
+    expected = 1;
+    while (0 < (cnt = tde->read(tde, docs, freqs, 50))) {
+        for (i = 0; i < cnt; i++, expected++) {
+            if (0 == (expected % 7)) {
+                expected++;
+            }
+            Aiequal(expected, docs[i]);
+            Aiequal(expected % 3 + 1, freqs[i]);
+        }
+    }
+    Aiequal(NUM_SKIP_TEST_DOCS, expected);
+    tde->close(tde);
+    ir_close(ir);
+}
+
+static void test_segment_tde_skip_levels(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Config config = default_config;
+    IndexWriter *iw;
+
+    config.max_buffered_docs = 1000;
+    config.use_compound_file = false;
+    config.postings_format = POSTINGS_VINT;
+    iw = create_book_iw_conf(store, &config);
+    add_skip_test_docs(iw, 0, NUM_SKIP_TEST_DOCS);
+    iw_optimize(iw);
+    iw_close(iw);
+
+    check_skip_test_index(tc, store, POSTINGS_VINT);
+}
+
+/* merge VInt segments and block segments into a block segment */
+static void test_segment_tde_block_postings(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Config config = default_config;
+    IndexWriter *iw;
+
+    config.max_buffered_docs = 1000;
+    config.use_compound_file = false;
+    config.postings_format = POSTINGS_VINT;
+    iw = create_book_iw_conf(store, &config);
+    add_skip_test_docs(iw, 0, 2000);
+    iw_close(iw);
+
+    config.postings_format = POSTINGS_BLOCK;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    add_skip_test_docs(iw, 2000, NUM_SKIP_TEST_DOCS);
+    iw_optimize(iw);
+    iw_close(iw);
+
+    check_skip_test_index(tc, store, POSTINGS_BLOCK);
+}
+
+/* each block of freqs is packed with a different bit width */
+#define BIT_WIDTH_BLOCKS 12
+#define bit_width_freq(i) \
+    (1 + (i) * 7919 % ((1 << ((i) / POSTINGS_BLOCK_SIZE + 1)) - 1))
+
+static void test_segment_tde_block_bit_widths(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Config config = default_config;
+    const int doc_cnt = BIT_WIDTH_BLOCKS * POSTINGS_BLOCK_SIZE;
+    char *buf = ALLOC_N(char, 2 << BIT_WIDTH_BLOCKS);
+    int i, j, cnt, expected = 0;
+    int docs[50], freqs[50];
+    IndexWriter *iw;
+    IndexReader *ir;
+    TermDocEnum *tde;
+
+    config.max_buffered_docs = doc_cnt;
+    config.postings_format = POSTINGS_BLOCK;
+    iw = create_book_iw_conf(store, &config);
+    for (i = 0; i < doc_cnt; i++) {
+        Document *doc = doc_new();
+        for (j = 0; j < bit_width_freq(i); j++) {
+            buf[j * 2] = 'w';
+            buf[j * 2 + 1] = ' ';
+        }
+        buf[j * 2] = '\0';
+        doc_add_field(doc, df_add_data(df_new(I("f")), buf));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_close(iw);
+    free(buf);
+
+    ir = ir_open(store);
+    tde = ir_term_docs_for(ir, I("f"), "w");
+    while (0 < (cnt = tde->read(tde, docs, freqs, 50))) {
+        for (i = 0; i < cnt; i++, expected++) {
+            Aiequal(expected, docs[i]);
+            Aiequal(bit_width_freq(expected), freqs[i]);
+        }
+    }
+    Aiequal(doc_cnt, expected);
+    tde->close(tde);
+    ir_close(ir);
+}
+
 /****************************************************************************
  *
  * Index
@@ -789,8 +973,8 @@ static void test_fld_inverter(TestCase *tc, void *data)
     Store *store = (Store *)data;
     Hash *plists;
     Hash *curr_plists;
-    Posting *p;
     PostingList *pl;
+    ByteSliceReader bsr;
     DocWriter *dw;
     IndexWriter *iw = create_book_iw(store);
     DocField *df;
@@ -819,11 +1003,16 @@ static void test_fld_inverter(TestCase *tc, void *data)
         Asequal("one", pl->term);
         Aiequal(3, pl->term_len);
 
-        p = pl->last;
-        Aiequal(1, p->freq);
-        Apequal(p->first_occ, pl->last_occ);
-        Apnull(p->first_occ->next);
-        Aiequal(0, p->first_occ->pos);
+        Aiequal(0, pl->doc_num);
+        Aiequal(1, pl->freq);
+        Aiequal(0, pl->last_pos);
+        /* the book's fields store term vectors so the occurences are kept */
+        Apequal(pl->first_occ, pl->last_occ);
+        Aiequal(0, pl->first_occ->pos);
+        bsr_init(&bsr, dw->bbp, pl->prx_start, pl->prx_upto);
+        Aiequal(0, bsr_read_vint(&bsr));
+        Atrue(bsr_eof(&bsr));
+        Aiequal(pl->frq_start, pl->frq_upto);
         Apequal(pl, ((PostingList *)h_get(plists, "one")));
     }
 
@@ -831,14 +1020,16 @@ static void test_fld_inverter(TestCase *tc, void *data)
     if (Apnotnull(pl)) {
         Asequal("five", pl->term);
         Aiequal(4, pl->term_len);
-        Apnull(pl->last_occ->next);
-        p = pl->last;
-        Aiequal(5, p->freq);
-        Aiequal(4, p->first_occ->pos);
-        Aiequal(8, p->first_occ->next->pos);
-        Aiequal(11, p->first_occ->next->next->pos);
-        Aiequal(13, p->first_occ->next->next->next->pos);
-        Aiequal(35, p->first_occ->next->next->next->next->pos);
+        Aiequal(5, pl->freq);
+        Aiequal(35, pl->last_pos);
+        /* positions 4, 8, 11, 13 and 35 */
+        bsr_init(&bsr, dw->bbp, pl->prx_start, pl->prx_upto);
+        Aiequal(4, bsr_read_vint(&bsr));
+        Aiequal(4, bsr_read_vint(&bsr));
+        Aiequal(3, bsr_read_vint(&bsr));
+        Aiequal(2, bsr_read_vint(&bsr));
+        Aiequal(22, bsr_read_vint(&bsr));
+        Atrue(bsr_eof(&bsr));
         Apequal(pl, ((PostingList *)h_get(plists, "five")));
     }
 
@@ -863,16 +1054,17 @@ static void test_fld_inverter(TestCase *tc, void *data)
         Asequal("one", pl->term);
         Aiequal(3, pl->term_len);
 
-        p = pl->first;
-        Aiequal(1, p->freq);
-        Apnull(p->first_occ->next);
-        Aiequal(0, p->first_occ->pos);
-
-        p = pl->last;
-        Aiequal(1, p->freq);
-        Apequal(p->first_occ, pl->last_occ);
-        Apnull(p->first_occ->next);
-        Aiequal(9, p->first_occ->pos);
+        /* the first doc has been moved to the frq stream */
+        bsr_init(&bsr, dw->bbp, pl->frq_start, pl->frq_upto);
+        Aiequal((0 << 1) | 1, bsr_read_vint(&bsr));
+        Atrue(bsr_eof(&bsr));
+
+        Aiequal(1, pl->doc_num);
+        Aiequal(1, pl->freq);
+        bsr_init(&bsr, dw->bbp, pl->prx_start, pl->prx_upto);
+        Aiequal(0, bsr_read_vint(&bsr));
+        Aiequal(9, bsr_read_vint(&bsr));
+        Atrue(bsr_eof(&bsr));
         Apequal(pl, ((PostingList *)h_get(plists, "one")));
     }
 
@@ -882,24 +1074,125 @@ static void test_fld_inverter(TestCase *tc, void *data)
     iw_close(iw);
 }
 
+/* write many interleaved streams of vints so their slices are chained
+ * across blocks and check they all read back */
+#define BBP_STREAM_CNT 200
+#define BBP_VINT_CNT 200
+static void test_byte_block_pool(TestCase *tc, void *data)
+{
+    ByteBlockPool *bbp = bbp_new();
+    ByteSliceReader bsr;
+    int starts[BBP_STREAM_CNT], uptos[BBP_STREAM_CNT];
+    unsigned int *vals = ALLOC_N(unsigned int, BBP_STREAM_CNT * BBP_VINT_CNT);
+    int i, j, round;
+    (void)data;
+
+    for (round = 0; round < 2; round++) {
+        for (i = 0; i < BBP_STREAM_CNT; i++) {
+            starts[i] = uptos[i] = bbp_new_slice(bbp);
+        }
+        for (j = 0; j < BBP_VINT_CNT; j++) {
+            for (i = 0; i < BBP_STREAM_CNT; i++) {
+                /* later streams are shorter */
+                if (j < BBP_VINT_CNT - i) {
+                    unsigned int val = rand() >> (rand() % 31);
+                    vals[i * BBP_VINT_CNT + j] = val;
+                    bbp_write_vint(bbp, &uptos[i], val);
+                }
+            }
+        }
+        Assert(bbp_used(bbp) > BYTE_BLOCK_SIZE, "should use many blocks");
+
+        for (i = 0; i < BBP_STREAM_CNT; i++) {
+            bsr_init(&bsr, bbp, starts[i], uptos[i]);
+            for (j = 0; j < BBP_VINT_CNT - i; j++) {
+                if (!Aiequal(vals[i * BBP_VINT_CNT + j], bsr_read_vint(&bsr))) {
+                    break;
+                }
+            }
+            Atrue(bsr_eof(&bsr));
+        }
+
+        /* a copied stream reads back as written */
+        {
+            Store *store = open_ram_store();
+            OutStream *os = store->new_output(store, "_0.bbp");
+            InStream *is;
+            i = BBP_STREAM_CNT / 2;
+            bsr_init(&bsr, bbp, starts[i], uptos[i]);
+            bsr_copy_vints(&bsr, os, 7);
+            bsr_copy_vints(&bsr, os, BBP_VINT_CNT - i - 7);
+            Atrue(bsr_eof(&bsr));
+            os_close(os);
+            is = store->open_input(store, "_0.bbp");
+            for (j = 0; j < BBP_VINT_CNT - i; j++) {
+                if (!Aiequal(vals[i * BBP_VINT_CNT + j], is_read_vint(is))) {
+                    break;
+                }
+            }
+            Aiequal(is_length(is), is_pos(is));
+            is_close(is);
+            store_deref(store);
+        }
+        /* the blocks are reused after a reset */
+        bbp_reset(bbp);
+        Aiequal(0, bbp_used(bbp));
+    }
+    free(vals);
+    bbp_destroy(bbp);
+}
+
 #define NUM_POSTINGS TEST_WORD_LIST_SIZE
+#define NUM_PREFIXED_POSTINGS 2000
 static void test_postings_sorter(TestCase *tc, void *data)
 {
-    int i;
+    int i, j;
     PostingList plists[NUM_POSTINGS], *p_ptr[NUM_POSTINGS];
+    PostingList *pls = ALLOC_N(PostingList, NUM_PREFIXED_POSTINGS);
+    PostingList **expected = ALLOC_N(PostingList *, NUM_PREFIXED_POSTINGS);
+    PostingList **sorted = ALLOC_N(PostingList *, NUM_PREFIXED_POSTINGS);
+    char *terms = ALLOC_N(char, NUM_PREFIXED_POSTINGS * 12);
+    Hash *seen = h_new_str(NULL, NULL);
     (void)data, (void)tc;
     for (i = 0; i < NUM_POSTINGS; i++) {
         plists[i].term = (char *)test_word_list[i];
         p_ptr[i] = &plists[i];
     }
 
-    qsort(p_ptr, NUM_POSTINGS, sizeof(PostingList *),
-          (int (*)(const void *, const void *))&pl_cmp);
+    pl_sort(p_ptr, NUM_POSTINGS);
 
     for (i = 1; i < NUM_POSTINGS; i++) {
         Assert(strcmp(p_ptr[i - 1]->term, p_ptr[i]->term) <= 0,
                "\"%s\" > \"%s\"", p_ptr[i - 1]->term, p_ptr[i]->term);
     }
+
+    /* unique terms with long shared prefixes and high bytes */
+    for (i = 0; i < NUM_PREFIXED_POSTINGS; i++) {
+        char *term = terms + i * 12;
+        do {
+            int len = 1 + rand() % 11;
+            for (j = 0; j < len; j++) {
+                term[j] = "aab\xe9\xff"[rand() % 5];
+            }
+            term[len] = '\0';
+        } while (!h_set_safe(seen, term, term));
+        pls[i].term = term;
+        expected[i] = sorted[i] = &pls[i];
+    }
+    qsort(expected, NUM_PREFIXED_POSTINGS, sizeof(PostingList *),
+          (int (*)(const void *, const void *))&pl_cmp);
+    pl_sort(sorted, NUM_PREFIXED_POSTINGS);
+    for (i = 0; i < NUM_PREFIXED_POSTINGS; i++) {
+        if (!Asequal(expected[i]->term, sorted[i]->term)) {
+            break;
+        }
+    }
+
+    h_destroy(seen);
+    free(terms);
+    free(sorted);
+    free(expected);
+    free(pls);
 }
 
 static void test_iw_add_doc(TestCase *tc, void *data)
@@ -1024,170 +1317,1055 @@ static void test_simulated_crashed_writer(TestCase *tc, void *data)
 
     iw = iw_open(store, whitespace_analyzer_new(false), &config);
 
-    /* add all books */
-    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
-        iw_add_doc(iw, docs[i]);
+    /* add all books */
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+    iw_close(iw);
+}
+
+/*
+ * Simulate a corrupt index by removing last byte of
+ * latest segments file and make sure we get an
+ * IOException trying to open the index:
+ */
+static void test_simulated_corrupt_index1(TestCase *tc, void *data)
+{
+    int i;
+    long gen;
+    off_t length;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    char file_name_in[SEGMENT_NAME_MAX_LENGTH];
+    char file_name_out[SEGMENT_NAME_MAX_LENGTH];
+    InStream *is;
+    OutStream *os;
+    Document **docs = prep_book_list();
+    Config config = default_config;
+    config.max_buffered_docs = 3;
+
+    iw = create_book_iw_conf(store, &config);
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+
+    /* close */
+    iw_close(iw);
+
+    gen = sis_current_segment_generation(store);
+    /* segment generation should be > 1 */
+    Atrue(gen > 1);
+
+    /* Make the next segments file, with last byte
+     * missing, to simulate a writer that crashed while
+     * writing segments file: */
+    sis_curr_seg_file_name(file_name_in, store);
+    fn_for_generation(file_name_out, SEGMENTS_FILE_NAME, "", 1 + gen);
+    is = store->open_input(store, file_name_in);
+    os = store->new_output(store, file_name_out);
+    length = is_length(is);
+    for(i = 0; i < length - 1; i++) {
+        os_write_byte(os, is_read_byte(is));
+    }
+    is_close(is);
+    os_close(os);
+    store->remove(store, file_name_in);
+
+    TRY
+        ir = ir_open(store);
+        ir_close(ir);
+        Afail("reader should have failed to open on a crashed index");
+        break;
+    case IO_ERROR:
+        HANDLED();
+        break;
+    default:
+        Afail("reader should have raised an IO_ERROR");
+        HANDLED();
+    XENDTRY
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+}
+
+/*
+ * Simulate a corrupt index by removing one of the cfs
+ * files and make sure we get an IOException trying to
+ * open the index:
+ */
+static void test_simulated_corrupt_index2(TestCase *tc, void *data)
+{
+    int i;
+    long gen;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    Document **docs = prep_book_list();
+    Config config = default_config;
+    config.max_buffered_docs = 10;
+
+    iw = create_book_iw_conf(store, &config);
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+
+    /* close */
+    iw_close(iw);
+
+    gen = sis_current_segment_generation(store);
+    /* segment generation should be > 1 */
+    Atrue(gen > 1);
+
+    Atrue(store->exists(store, "_0.cfs"));
+    store->remove(store, "_0.cfs");
+
+    TRY
+        ir = ir_open(store);
+        ir_close(ir);
+        Afail("reader should have failed to open on a crashed index");
+        break;
+    case IO_ERROR:
+        HANDLED();
+    XCATCHALL
+        Afail("reader should have raised an IO_ERROR");
+        HANDLED();
+    XENDTRY
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+}
+
+static void test_iw_add_docs(TestCase *tc, void *data)
+{
+    int i;
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    Document **docs = prep_book_list();
+    config.merge_factor = 4;
+    config.max_buffered_docs = 3;
+
+    iw = create_book_iw_conf(store, &config);
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    iw_optimize(iw);
+    Aiequal(BOOK_LIST_LENGTH, iw_doc_count(iw));
+    
+    iw_close(iw);
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+    if (!Aiequal(3, store->count(store))) {
+        char *buf = store_to_s(store);
+        Tmsg("To many files: %s\n", buf);
+        free(buf);
+    }
+}
+
+void test_iw_add_empty_tv(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    Document *doc;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_YES);
+    fis_add_field(fis, fi_new(I("no_tv"), STORE_YES, INDEX_YES, TERM_VECTOR_NO));
+    index_create(store, fis);
+    fis_deref(fis);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &default_config);
+    doc = doc_new();
+    doc_add_field(doc, df_add_data(df_new(I("tv1")), ""));
+    doc_add_field(doc, df_add_data(df_new(I("tv2")), ""));
+    doc_add_field(doc, df_add_data(df_new(I("no_tv")), "one two three"));
+
+    iw_add_doc(iw, doc);
+    iw_commit(iw);
+    Aiequal(1, iw_doc_count(iw));
+    iw_close(iw);
+    doc_destroy(doc);
+}
+
+/* deleting by a key field consults its Bloom filters in every segment */
+static void test_iw_del_key_terms(TestCase *tc, void *data)
+{
+    int i;
+    char id[20];
+    Config config = default_config;
+    Store *store = (Store *)data;
+    Symbol id_field = I("id");
+    IndexWriter *iw;
+    IndexReader *ir;
+    FieldInfo *fi;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_UNTOKENIZED, TERM_VECTOR_NO);
+    config.merge_factor = 4;
+    config.max_buffered_docs = 3;
+
+    fi = fi_new(id_field, STORE_YES, INDEX_UNTOKENIZED, TERM_VECTOR_NO);
+    fi->bits |= FI_IS_KEY_BM;
+    fis_add_field(fis, fi);
+    index_create(store, fis);
+    fis_deref(fis);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < 50; i++) {
+        Document *doc = doc_new();
+        sprintf(id, "id%d", i);
+        doc_add_field(doc, df_add_data(df_new(id_field), id));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_commit(iw);
+    Atrue(iw->sis->size > 1);
+    for (i = 0; i < 50; i += 3) {
+        sprintf(id, "id%d", i);
+        iw_delete_term(iw, id_field, id);
+    }
+    iw_delete_term(iw, id_field, "id50");
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Atrue(fi_is_key(fis_get_field(ir->fis, id_field)));
+    Aiequal(50 - 17, ir->num_docs(ir));
+    for (i = 0; i < 50; i++) {
+        sprintf(id, "id%d", i);
+        Aiequal(1, ir_doc_freq(ir, id_field, id));
+    }
+    ir_close(ir);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_optimize(iw);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(50 - 17, ir->num_docs(ir));
+    for (i = 0; i < 50; i++) {
+        sprintf(id, "id%d", i);
+        Aiequal(i % 3 ? 1 : 0, ir_doc_freq(ir, id_field, id));
+    }
+    Aiequal(0, ir_doc_freq(ir, id_field, "id50"));
+    ir_close(ir);
+}
+
+/*
+ * Untokenized values are indexed whole, so a term can be as long as
+ * MAX_WORD_SIZE and must still make it into the term index.
+ */
+static void test_iw_max_length_terms(TestCase *tc, void *data)
+{
+    int i;
+    char term[MAX_WORD_SIZE + 1];
+    Store *store = (Store *)data;
+    Symbol id_field = I("id");
+    IndexWriter *iw;
+    IndexReader *ir;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_UNTOKENIZED, TERM_VECTOR_NO);
+
+    index_create(store, fis);
+    fis_deref(fis);
+
+    memset(term, 'x', MAX_WORD_SIZE);
+    term[MAX_WORD_SIZE] = '\0';
+    iw = iw_open(store, whitespace_analyzer_new(false), &default_config);
+    for (i = 0; i < 300; i++) {
+        Document *doc = doc_new();
+        sprintf(term, "%03d", i);
+        term[3] = 'x';
+        doc_add_field(doc, df_add_data(df_new(id_field), term));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(300, ir->num_docs(ir));
+    for (i = 0; i < 300; i++) {
+        sprintf(term, "%03d", i);
+        term[3] = 'x';
+        Aiequal(1, ir_doc_freq(ir, id_field, term));
+    }
+    ir_close(ir);
+}
+
+/* every fifth document has no price */
+static void check_doc_values(TestCase *tc, IndexReader *ir, Symbol id_field,
+                             Symbol price_field)
+{
+    int i;
+    char expected[10];
+    const int max_doc = ir->max_doc(ir);
+    DocValues *dv = ir_get_doc_values(ir, price_field);
+    if (!Apnotnull(dv)) {
+        return;
+    }
+    Aiequal(max_doc, dv->size);
+    for (i = 1; i < dv->value_cnt; i++) {
+        Atrue(strcmp(dv->values[i], dv->values[i + 1]) < 0);
+    }
+    for (i = 0; i < max_doc; i++) {
+        if (!ir->is_deleted(ir, i)) {
+            Document *doc = ir->get_doc(ir, i);
+            int id = atoi(doc_get_field(doc, id_field)->data[0]);
+            const char *value = dv->values[dv_get_ord(dv, i)];
+            if (id % 5) {
+                sprintf(expected, "%03d", id * 7 % 50);
+                Asequal(expected, value);
+            }
+            else {
+                Apnull(value);
+            }
+            doc_destroy(doc);
+        }
+    }
+    dv_destroy(dv);
+}
+
+static void test_iw_doc_values(TestCase *tc, void *data)
+{
+    int i;
+    char buf[10];
+    Config config = default_config;
+    Store *store = (Store *)data;
+    Store *store2 = open_ram_store();
+    Symbol id_field = I("id"), price_field = I("price");
+    IndexWriter *iw;
+    IndexReader *ir;
+    FieldInfo *fi;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_UNTOKENIZED, TERM_VECTOR_NO);
+    config.merge_factor = 4;
+    config.max_buffered_docs = 3;
+
+    fis_add_field(fis, fi_new(id_field, STORE_YES, INDEX_UNTOKENIZED,
+                              TERM_VECTOR_NO));
+    fi = fi_new(price_field, STORE_NO, INDEX_UNTOKENIZED, TERM_VECTOR_NO);
+    fi->bits |= FI_STORE_DOC_VALUES_BM;
+    fis_add_field(fis, fi);
+    index_create(store, fis);
+    fis_deref(fis);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < 50; i++) {
+        Document *doc = doc_new();
+        sprintf(buf, "%d", i);
+        doc_add_field(doc, df_add_data(df_new(id_field),
+                estrdup(buf)))->destroy_data = true;
+        if (i % 5) {
+            sprintf(buf, "%03d", i * 7 % 50);
+            doc_add_field(doc, df_add_data(df_new(price_field),
+                    estrdup(buf)))->destroy_data = true;
+        }
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_commit(iw);
+    Atrue(iw->sis->size > 1);
+    for (i = 0; i < 50; i += 4) {
+        sprintf(buf, "%d", i);
+        iw_delete_term(iw, id_field, buf);
+    }
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Atrue(fi_store_doc_values(fis_get_field(ir->fis, price_field)));
+    Apnull(ir_get_doc_values(ir, id_field));
+    check_doc_values(tc, ir, id_field, price_field);
+    ir_close(ir);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_optimize(iw);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(50 - 13, ir->max_doc(ir));
+    check_doc_values(tc, ir, id_field, price_field);
+
+    /* copy the segment into an index which numbers the fields differently */
+    fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    fis_add_field(fis, fi_new(I("other"), STORE_YES, INDEX_YES,
+                              TERM_VECTOR_NO));
+    index_create(store2, fis);
+    fis_deref(fis);
+    iw = iw_open(store2, whitespace_analyzer_new(false), &config);
+    iw_add_readers(iw, &ir, 1);
+    iw_close(iw);
+    ir_close(ir);
+
+    ir = ir_open(store2);
+    Aiequal(50 - 13, ir->max_doc(ir));
+    Atrue(fis_get_field(ir->fis, price_field)->number != 1);
+    check_doc_values(tc, ir, id_field, price_field);
+    ir_close(ir);
+    store_deref(store2);
+}
+
+static void test_iw_max_length_doc_values(TestCase *tc, void *data)
+{
+    int i;
+    char value[MAX_WORD_SIZE + 1];
+    Config config = default_config;
+    Store *store = (Store *)data;
+    Symbol value_field = I("value");
+    IndexWriter *iw;
+    IndexReader *ir;
+    DocValues *dv;
+    FieldInfo *fi;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_UNTOKENIZED, TERM_VECTOR_NO);
+    config.max_buffered_docs = 3;
+
+    fi = fi_new(value_field, STORE_NO, INDEX_UNTOKENIZED, TERM_VECTOR_NO);
+    fi->bits |= FI_STORE_DOC_VALUES_BM;
+    fis_add_field(fis, fi);
+    index_create(store, fis);
+    fis_deref(fis);
+
+    memset(value, 'x', MAX_WORD_SIZE);
+    value[MAX_WORD_SIZE] = '\0';
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < 10; i++) {
+        Document *doc = doc_new();
+        value[MAX_WORD_SIZE - 1] = 'a' + i;
+        doc_add_field(doc, df_add_data(df_new(value_field),
+                estrdup(value)))->destroy_data = true;
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_optimize(iw);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    dv = ir_get_doc_values(ir, value_field);
+    if (Apnotnull(dv)) {
+        Aiequal(10, dv->value_cnt);
+        for (i = 0; i < 10; i++) {
+            value[MAX_WORD_SIZE - 1] = 'a' + i;
+            Asequal(value, dv->values[dv_get_ord(dv, i)]);
+        }
+        dv_destroy(dv);
+    }
+    ir_close(ir);
+}
+
+#define TMP_BOOK_COPIES 10
+
+static int segment_cnt(Store *store)
+{
+    SegmentInfos *sis = sis_read(store);
+    int seg_cnt = sis->size;
+    sis_destroy(sis);
+    return seg_cnt;
+}
+
+static IndexWriter *create_tiered_book_iw(Store *store, Config *config,
+                                          TieredMergePolicy **tmp)
+{
+    IndexWriter *iw = create_book_iw_conf(store, config);
+    *tmp = (TieredMergePolicy *)tiered_merge_policy_new();
+    (*tmp)->floor_segment_bytes = 1;
+    (*tmp)->segs_per_tier = 3;
+    (*tmp)->max_merge_at_once = 3;
+    iw_set_merge_policy(iw, (MergePolicy *)*tmp);
+    return iw;
+}
+
+static void test_iw_tiered_merge_policy(TestCase *tc, void *data)
+{
+    int i, j, seg_cnt;
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    TieredMergePolicy *tmp;
+    SegmentInfos *sis;
+    Document **docs = prep_book_list();
+    config.max_buffered_docs = 3;
+
+    /* over a hundred segments are flushed but only three are allowed in
+     * each tier */
+    iw = create_tiered_book_iw(store, &config, &tmp);
+    for (j = 0; j < TMP_BOOK_COPIES; j++) {
+        for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+            iw_add_doc(iw, docs[i]);
+        }
+    }
+    iw_close(iw);
+    seg_cnt = segment_cnt(store);
+    Atrue(seg_cnt > 3 && seg_cnt < 20);
+
+    /* no merge may produce a segment bigger than the maximum */
+    iw = create_tiered_book_iw(store, &config, &tmp);
+    tmp->max_merged_segment_bytes = 4000;
+    for (j = 0; j < TMP_BOOK_COPIES; j++) {
+        for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+            iw_add_doc(iw, docs[i]);
+        }
+    }
+    iw_close(iw);
+    sis = sis_read(store);
+    Atrue(sis->size > seg_cnt);
+    for (i = 0; i < sis->size; i++) {
+        Atrue(si_size(sis->segs[i]) <= 4000);
+    }
+    sis_destroy(sis);
+
+    /* each copy of the book list has one Newby. Segments with fewer than
+     * 10% of their docs deleted are left alone */
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_delete_term(iw, author, "Newby");
+    iw_set_merge_policy(iw, tiered_merge_policy_new());
+    iw_expunge_deletes(iw);
+    iw_close(iw);
+    ir = ir_open(store);
+    Aiequal(BOOK_LIST_LENGTH * TMP_BOOK_COPIES - TMP_BOOK_COPIES,
+            ir->num_docs(ir));
+    Atrue(ir->num_docs(ir) < ir->max_doc(ir));
+    ir_close(ir);
+    sis = sis_read(store);
+    for (i = 0; i < sis->size; i++) {
+        Atrue(si_del_cnt(sis->segs[i]) * 10 <= sis->segs[i]->doc_cnt);
+    }
+    sis_destroy(sis);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    tmp = (TieredMergePolicy *)tiered_merge_policy_new();
+    tmp->expunge_deletes_pct_allowed = 0.0;
+    iw_set_merge_policy(iw, (MergePolicy *)tmp);
+    iw_expunge_deletes(iw);
+    iw_close(iw);
+    ir = ir_open(store);
+    Aiequal(BOOK_LIST_LENGTH * TMP_BOOK_COPIES - TMP_BOOK_COPIES,
+            ir->num_docs(ir));
+    Aiequal(ir->num_docs(ir), ir->max_doc(ir));
+    ir_close(ir);
+
+    /* a floor of zero bytes must cope with segments whose docs are all
+     * deleted */
+    iw = create_tiered_book_iw(store, &config, &tmp);
+    tmp->floor_segment_bytes = 0;
+    for (i = 0; i < 3; i++) {
+        iw_add_doc(iw, docs[0]);
+    }
+    iw_commit(iw);
+    iw_delete_term(iw, author, "Newby");
+    for (i = 1; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    iw_close(iw);
+    ir = ir_open(store);
+    Aiequal(BOOK_LIST_LENGTH - 1, ir->num_docs(ir));
+    ir_close(ir);
+
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+}
+
+/* the log merge policy rewrites every segment with deletions */
+static void test_iw_expunge_deletes(TestCase *tc, void *data)
+{
+    int i;
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    Document **docs = prep_book_list();
+    config.merge_factor = 4;
+    config.max_buffered_docs = 3;
+
+    iw = create_book_iw_conf(store, &config);
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    iw_close(iw);
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_delete_term(iw, author, "Newby");
+    iw_delete_term(iw, author, "Rubens");
+    iw_expunge_deletes(iw);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(BOOK_LIST_LENGTH - 2, ir->num_docs(ir));
+    Aiequal(BOOK_LIST_LENGTH - 2, ir->max_doc(ir));
+    ir_close(ir);
+}
+
+/* the merge's rate limiter sleeps on this clock so the time it paused for
+ * doesn't depend on how long the merge really takes */
+static double merge_clock = 0.0;
+
+static double merge_clock_now(void)
+{
+    return merge_clock;
+}
+
+static void merge_clock_sleep(double secs)
+{
+    merge_clock += secs;
+}
+
+static void test_iw_merge_rate_limit(TestCase *tc, void *data)
+{
+    int i;
+    off_t size;
+    double paused;
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    SegmentInfos *sis;
+    Document **docs = prep_book_list();
+    config.merge_factor = 1000;
+    config.max_buffered_docs = 3;
+
+    iw = create_book_iw_conf(store, &config);
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    iw_close(iw);
+    Atrue(segment_cnt(store) > 1);
+
+    /* merges are only throttled while the store is being searched */
+    config.max_merge_mb_per_sec = 0.5;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw->merge_rate_limiter->now = &merge_clock_now;
+    iw->merge_rate_limiter->sleep = &merge_clock_sleep;
+    store_search_start(store);
+    iw_optimize(iw);
+    store_search_finish(store);
+
+    sis = sis_read(store);
+    Aiequal(1, sis->size);
+    size = si_size(sis->segs[0]);
+    sis_destroy(sis);
+    /* the merge wrote at least the merged segment */
+    paused = iw->merge_rate_limiter->paused;
+    Atrue(paused > 0.9 * size / (0.5 * 1048576.0));
+
+    /* the rate can be changed on an open writer */
+    iw_set_max_merge_mb_per_sec(iw, 0.0);
+    Atrue(0.0 == iw->config.max_merge_mb_per_sec);
+    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    store_search_start(store);
+    iw_optimize(iw);
+    store_search_finish(store);
+    Afequal(paused, iw->merge_rate_limiter->paused);
+    iw_close(iw);
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+
+    ir = ir_open(store);
+    Aiequal(2 * BOOK_LIST_LENGTH, ir->num_docs(ir));
+    ir_close(ir);
+}
+
+/* a merge thread installs its merge without committing the segments flushed
+ * for iw_get_reader. The merge is committed by the next commit */
+static void test_iw_merge_thread_commit(TestCase *tc, void *data)
+{
+    int i;
+    bool merging = true;
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir, *nrt_ir;
+    Document **docs = prep_book_list();
+    config.merge_factor = 3;
+    config.max_buffered_docs = 3;
+    config.merge_threads = 1;
+    /* slow the merge down so the reader is got while it is running */
+    config.max_merge_mb_per_sec = 0.001;
+
+    iw = create_book_iw_conf(store, &config);
+    store_search_start(store);
+    for (i = 0; i < 9; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    iw_add_doc(iw, docs[9]);
+    nrt_ir = iw_get_reader(iw);
+    Aiequal(10, nrt_ir->num_docs(nrt_ir));
+    store_search_finish(store);
+
+    while (merging) {
+        micro_sleep(1000);
+        mutex_lock(&iw->mutex);
+        merging = iw->merge_queue || iw->running_merges > 0;
+        mutex_unlock(&iw->mutex);
+    }
+    Atrue(iw->merges_uncommitted);
+    Aiequal(1, iw->uncommitted_cnt);
+    ir = ir_open(store);
+    Aiequal(9, ir->num_docs(ir));
+    ir_close(ir);
+
+    iw_commit(iw);
+    ir = ir_open(store);
+    Aiequal(10, ir->num_docs(ir));
+    Aiequal(iw->sis->size, ir->sis->size);
+    ir_close(ir);
+    ir_close(nrt_ir);
+    iw_close(iw);
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+}
+
+/* runs of live docs have their stored fields copied in one go so delete docs
+ * at the start, middle and end of segments */
+static void test_iw_merge_stored_fields(TestCase *tc, void *data)
+{
+    static const int deletes[] = {0, 6, 7, 14, 2 * BOOK_LIST_LENGTH - 1};
+    int i, j, k;
+    Config config = default_config;
+    Store *store = (Store *)data;
+    IndexWriter *iw;
+    IndexReader *ir;
+    Document **docs = prep_book_list();
+    config.merge_factor = 1000;
+    config.max_buffered_docs = 7;
+
+    iw = create_book_iw_conf(store, &config);
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+            iw_add_doc(iw, docs[i]);
+        }
+    }
+    iw_close(iw);
+
+    ir = ir_open(store);
+    for (k = 0; k < NELEMS(deletes); k++) {
+        ir_delete_doc(ir, deletes[k]);
+    }
+    ir_close(ir);
+
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    iw_optimize(iw);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(2 * BOOK_LIST_LENGTH - NELEMS(deletes), ir->max_doc(ir));
+    for (i = 0, j = 0, k = 0; i < 2 * BOOK_LIST_LENGTH; i++) {
+        Document *doc;
+        TermVector *tv;
+        DocField *expected = doc_get_field(docs[i % BOOK_LIST_LENGTH], title);
+        if (k < NELEMS(deletes) && deletes[k] == i) {
+            k++;
+            continue;
+        }
+        doc = ir->get_doc(ir, j);
+        Asequal(expected->data[0], doc_get_field(doc, title)->data[0]);
+        Asequal(doc_get_field(docs[i % BOOK_LIST_LENGTH], year)->data[0],
+                doc_get_field(doc, year)->data[0]);
+        doc_destroy(doc);
+        tv = ir->term_vector(ir, j, title);
+        if (Apnotnull(tv)) {
+            Atrue(tv->term_cnt > 0);
+            tv_destroy(tv);
+        }
+        j++;
     }
-
+    ir_close(ir);
     destroy_docs(docs, BOOK_LIST_LENGTH);
-    iw_close(iw);
 }
 
-/*
- * Simulate a corrupt index by removing last byte of
- * latest segments file and make sure we get an
- * IOException trying to open the index:
- */
-static void test_simulated_corrupt_index1(TestCase *tc, void *data)
+#define SORT_DOC_CNT 100
+
+static IndexWriter *create_index_sort_iw(Store *store, const Config *config)
 {
-    int i;
-    long gen;
-    off_t length;
-    Store *store = (Store *)data;
-    IndexWriter *iw;
-    IndexReader *ir;
-    char file_name_in[SEGMENT_NAME_MAX_LENGTH];
-    char file_name_out[SEGMENT_NAME_MAX_LENGTH];
-    InStream *is;
-    OutStream *os;
-    Document **docs = prep_book_list();
-    Config config = default_config;
-    config.max_buffered_docs = 3;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    store->clear_all(store);
+    index_create(store, fis);
+    fis_deref(fis);
+    return iw_open(store, whitespace_analyzer_new(false), config);
+}
 
-    iw = create_book_iw_conf(store, &config);
-    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
-        iw_add_doc(iw, docs[i]);
+/* add docs with the numbers 0...SORT_DOC_CNT in a jumbled order. The term
+ * "n<num>" of each doc is at position num % 5 and the doc's boost depends on
+ * its number so its norm does too */
+static void add_index_sort_docs(IndexWriter *iw, bool with_deletes)
+{
+    char buf[100];
+    int i, j;
+    for (i = 0; i < SORT_DOC_CNT; i++) {
+        const int n = (i * 37) % SORT_DOC_CNT;
+        Document *doc = doc_new();
+        sprintf(buf, "%d", n);
+        doc_add_field(doc, df_add_data(df_new(I("num")), estrdup(buf)))
+            ->destroy_data = true;
+        buf[0] = '\0';
+        for (j = 0; j < n % 5; j++) {
+            strcat(buf, "x ");
+        }
+        sprintf(buf + strlen(buf), "n%d", n);
+        doc_add_field(doc, df_add_data(df_new(text), estrdup(buf)))
+            ->destroy_data = true;
+        doc->boost = (float)(1 + n % 4);
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+        if (with_deletes && i % 10 == 9) {
+            sprintf(buf, "%d", ((i - 5) * 37) % SORT_DOC_CNT);
+            iw_delete_term(iw, I("num"), buf);
+        }
     }
+}
 
-    /* close */
-    iw_close(iw);
-
-    gen = sis_current_segment_generation(store);
-    /* segment generation should be > 1 */
-    Atrue(gen > 1);
+/* each segment's docs are ordered by num and their postings, positions and
+ * norms move with them */
+static void test_iw_index_sort(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data, *unsorted_store = open_ram_store();
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir, *unsorted_ir;
+    uchar norms[SORT_DOC_CNT], *sorted_norms;
+    char buf[20];
+    int i, j, reverse;
 
-    /* Make the next segments file, with last byte
-     * missing, to simulate a writer that crashed while
-     * writing segments file: */
-    sis_curr_seg_file_name(file_name_in, store);
-    fn_for_generation(file_name_out, SEGMENTS_FILE_NAME, "", 1 + gen);
-    is = store->open_input(store, file_name_in);
-    os = store->new_output(store, file_name_out);
-    length = is_length(is);
-    for(i = 0; i < length - 1; i++) {
-        os_write_byte(os, is_read_byte(is));
+    iw = create_index_sort_iw(unsorted_store, &config);
+    add_index_sort_docs(iw, false);
+    iw_close(iw);
+    unsorted_ir = ir_open(unsorted_store);
+    for (i = 0; i < SORT_DOC_CNT; i++) {
+        norms[(i * 37) % SORT_DOC_CNT] = ir_get_norms(unsorted_ir, text)[i];
     }
-    is_close(is);
-    os_close(os);
-    store->remove(store, file_name_in);
+    ir_close(unsorted_ir);
+    store_deref(unsorted_store);
+
+    config.max_buffered_docs = 7;
+    config.merge_factor = 3;
+    config.sort_field = I("num");
+    for (reverse = 0; reverse <= 1; reverse++) {
+        int doc = 0, seg_cnt = 0;
+        config.sort_reverse = reverse;
+        iw = create_index_sort_iw(store, &config);
+        add_index_sort_docs(iw, true);
+        iw_close(iw);
 
-    TRY
         ir = ir_open(store);
+        Aiequal(SORT_DOC_CNT - SORT_DOC_CNT / 10, ir->num_docs(ir));
+        sorted_norms = ir_get_norms(ir, text);
+        for (i = 0; i < ir->sis->size; i++) {
+            SegmentInfo *si = ir->sis->segs[i];
+            const int seg_end = doc + si->doc_cnt;
+            int last = -1;
+            Apequal(I("num"), si->sort_field);
+            Aiequal(reverse, si->sort_reverse);
+            for (; doc < seg_end; doc++) {
+                Document *d;
+                TermDocEnum *tde;
+                int n;
+                if (ir->is_deleted(ir, doc)) {
+                    continue;
+                }
+                d = ir->get_doc(ir, doc);
+                n = atoi(doc_get_field(d, I("num"))->data[0]);
+                doc_destroy(d);
+                if (last >= 0) {
+                    Atrue(reverse ? n < last : n > last);
+                }
+                last = n;
+                sprintf(buf, "n%d", n);
+                tde = ir_term_positions_for(ir, text, buf);
+                Atrue(tde->next(tde));
+                Aiequal(doc, tde->doc_num(tde));
+                Aiequal(n % 5, tde->next_position(tde));
+                Atrue(!tde->next(tde));
+                tde->close(tde);
+                Aiequal(norms[n], sorted_norms[doc]);
+            }
+            seg_cnt++;
+        }
+        Atrue(seg_cnt > 1);
         ir_close(ir);
-        Afail("reader should have failed to open on a crashed index");
-        break;
-    case IO_ERROR:
-        HANDLED();
-        break;
-    default:
-        Afail("reader should have raised an IO_ERROR");
-        HANDLED();
-    XENDTRY
-    destroy_docs(docs, BOOK_LIST_LENGTH);
+
+        /* the sort is kept when the segments are merged into one */
+        iw = iw_open(store, whitespace_analyzer_new(false), &config);
+        iw_optimize(iw);
+        iw_close(iw);
+        ir = ir_open(store);
+        Aiequal(1, ir->sis->size);
+        Apequal(I("num"), ir->sis->segs[0]->sort_field);
+        for (i = j = 0; i < ir->max_doc(ir); i++) {
+            Document *d = ir->get_doc(ir, i);
+            int n = atoi(doc_get_field(d, I("num"))->data[0]);
+            doc_destroy(d);
+            if (i > 0) {
+                Atrue(reverse ? n < j : n > j);
+            }
+            j = n;
+        }
+        ir_close(ir);
+    }
 }
 
-/*
- * Simulate a corrupt index by removing one of the cfs
- * files and make sure we get an IOException trying to
- * open the index:
- */
-static void test_simulated_corrupt_index2(TestCase *tc, void *data)
+/* a flushed segment is written in sorted order, with its term vectors and
+ * doc values moving with the docs, and isn't rewritten afterwards */
+static void test_iw_index_sort_flush(TestCase *tc, void *data)
 {
-    int i;
-    long gen;
     Store *store = (Store *)data;
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES,
+                              TERM_VECTOR_WITH_POSITIONS);
+    FieldInfo *fi = fi_new(I("num"), STORE_YES, INDEX_UNTOKENIZED,
+                           TERM_VECTOR_NO);
+    Config config = default_config;
     IndexWriter *iw;
     IndexReader *ir;
-    Document **docs = prep_book_list();
-    Config config = default_config;
-    config.max_buffered_docs = 10;
-
-    iw = create_book_iw_conf(store, &config);
-    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
-        iw_add_doc(iw, docs[i]);
-    }
+    DocValues *dv;
+    SegmentInfo *si;
+    char buf[SEGMENT_NAME_MAX_LENGTH], num[20];
+    int i;
 
-    /* close */
+    fi->bits |= FI_STORE_DOC_VALUES_BM;
+    fis_add_field(fis, fi);
+    store->clear_all(store);
+    index_create(store, fis);
+    fis_deref(fis);
+    config.sort_field = I("num");
+    config.use_compound_file = false;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    add_index_sort_docs(iw, false);
     iw_close(iw);
 
-    gen = sis_current_segment_generation(store);
-    /* segment generation should be > 1 */
-    Atrue(gen > 1);
+    ir = ir_open(store);
+    Aiequal(1, ir->sis->size);
+    si = ir->sis->segs[0];
+    Apequal(I("num"), si->sort_field);
+    Aiequal(SORT_DOC_CNT, si->doc_cnt);
+    sprintf(buf, "%s.fdt.tmp", si->name);
+    Atrue(!store->exists(store, buf));
+    dv = ir_get_doc_values(ir, I("num"));
+    for (i = 0; i < SORT_DOC_CNT; i++) {
+        Document *d = ir->get_doc(ir, i);
+        TermVector *tv = ir->term_vector(ir, i, text);
+        sprintf(num, "%d", i);
+        Asequal(num, doc_get_field(d, I("num"))->data[0]);
+        doc_destroy(d);
+        if (Apnotnull(dv)) {
+            Asequal(num, dv->values[dv_get_ord(dv, i)]);
+        }
+        if (Apnotnull(tv)) {
+            int t;
+            sprintf(buf, "n%d", i);
+            t = tv_get_term_index(tv, buf);
+            Atrue(t >= 0);
+            if (t >= 0) {
+                Aiequal(i % 5, tv->terms[t].positions[0]);
+            }
+            tv_destroy(tv);
+        }
+    }
+    if (dv) {
+        dv_destroy(dv);
+    }
+    ir_close(ir);
+}
 
-    Atrue(store->exists(store, "_0.cfs"));
-    store->remove(store, "_0.cfs");
+typedef struct SameFilesArg {
+    TestCase *tc;
+    Store *store;
+    Store *other;
+    int file_cnt;
+} SameFilesArg;
 
-    TRY
-        ir = ir_open(store);
-        ir_close(ir);
-        Afail("reader should have failed to open on a crashed index");
-        break;
-    case IO_ERROR:
-        HANDLED();
-    XCATCHALL
-        Afail("reader should have raised an IO_ERROR");
-        HANDLED();
-    XENDTRY
-    destroy_docs(docs, BOOK_LIST_LENGTH);
+/* check that file +fname+ is the same in both stores. The segments files
+ * hold the time they were written so they are skipped */
+static void check_same_file(const char *fname, void *arg)
+{
+    SameFilesArg *sfa = (SameFilesArg *)arg;
+    TestCase *tc = sfa->tc;
+    InStream *is1, *is2;
+    uchar *buf1, *buf2;
+    off_t len;
+    if (0 == strncmp(fname, "segments", 8)) {
+        return;
+    }
+    sfa->file_cnt++;
+    if (!Atrue(sfa->other->exists(sfa->other, fname))) {
+        return;
+    }
+    is1 = sfa->store->open_input(sfa->store, fname);
+    is2 = sfa->other->open_input(sfa->other, fname);
+    len = is_length(is1);
+    if (Aiequal(len, is_length(is2))) {
+        buf1 = ALLOC_N(uchar, len + 1);
+        buf2 = ALLOC_N(uchar, len + 1);
+        is_read_bytes(is1, buf1, len);
+        is_read_bytes(is2, buf2, len);
+        Assert(0 == memcmp(buf1, buf2, len), "%s differs", fname);
+        free(buf1);
+        free(buf2);
+    }
+    is_close(is1);
+    is_close(is2);
 }
 
-static void test_iw_add_docs(TestCase *tc, void *data)
+static void create_merged_book_index(Store *store, int merge_workers,
+                                     int flush_workers)
 {
-    int i;
+    int i, j;
     Config config = default_config;
-    Store *store = (Store *)data;
     IndexWriter *iw;
     Document **docs = prep_book_list();
-    config.merge_factor = 4;
     config.max_buffered_docs = 3;
+    config.merge_workers = merge_workers;
+    config.flush_workers = flush_workers;
 
     iw = create_book_iw_conf(store, &config);
-    for (i = 0; i < BOOK_LIST_LENGTH; i++) {
-        iw_add_doc(iw, docs[i]);
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < BOOK_LIST_LENGTH; i++) {
+            iw_add_doc(iw, docs[i]);
+        }
     }
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+    iw_delete_term(iw, author, "Newby");
     iw_optimize(iw);
-    Aiequal(BOOK_LIST_LENGTH, iw_doc_count(iw));
-    
     iw_close(iw);
-    destroy_docs(docs, BOOK_LIST_LENGTH);
-    if (!Aiequal(3, store->count(store))) {
-        char *buf = store_to_s(store);
-        Tmsg("To many files: %s\n", buf);
-        free(buf);
-    }
 }
 
-void test_iw_add_empty_tv(TestCase *tc, void *data)
+/* merging the parts of the segments on several threads must write exactly
+ * the same index as merging them in turn */
+static void test_iw_merge_workers(TestCase *tc, void *data)
 {
+    int merge_workers;
     Store *store = (Store *)data;
-    IndexWriter *iw;
-    Document *doc;
-    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_YES);
-    fis_add_field(fis, fi_new(I("no_tv"), STORE_YES, INDEX_YES, TERM_VECTOR_NO));
-    index_create(store, fis);
-    fis_deref(fis);
+    Store *other = open_ram_store();
+    IndexReader *ir;
+    SameFilesArg sfa;
+    sfa.tc = tc;
+    sfa.store = store;
+    sfa.other = other;
+
+    create_merged_book_index(store, 1, 1);
+    for (merge_workers = 2; merge_workers <= 4; merge_workers++) {
+        create_merged_book_index(other, merge_workers, 1);
+        sfa.file_cnt = 0;
+        store->each(store, &check_same_file, &sfa);
+        Atrue(sfa.file_cnt > 0);
+        Aiequal(store->count(store), other->count(other));
+    }
 
-    iw = iw_open(store, whitespace_analyzer_new(false), &default_config);
-    doc = doc_new();
-    doc_add_field(doc, df_add_data(df_new(I("tv1")), ""));
-    doc_add_field(doc, df_add_data(df_new(I("tv2")), ""));
-    doc_add_field(doc, df_add_data(df_new(I("no_tv")), "one two three"));
+    ir = ir_open(other);
+    Aiequal(2 * BOOK_LIST_LENGTH - 2, ir->num_docs(ir));
+    Aiequal(2 * BOOK_LIST_LENGTH - 2, ir->max_doc(ir));
+    ir_close(ir);
+    store_deref(other);
+}
 
-    iw_add_doc(iw, doc);
-    iw_commit(iw);
-    Aiequal(1, iw_doc_count(iw));
-    iw_close(iw);
-    doc_destroy(doc);
+/* sorting the fields' terms on several threads at flush must write exactly
+ * the same index as sorting them in turn */
+static void test_iw_flush_workers(TestCase *tc, void *data)
+{
+    int flush_workers;
+    Store *store = (Store *)data;
+    Store *other = open_ram_store();
+    SameFilesArg sfa;
+    sfa.tc = tc;
+    sfa.store = store;
+    sfa.other = other;
+
+    create_merged_book_index(store, 1, 1);
+    for (flush_workers = 2; flush_workers <= 8; flush_workers *= 2) {
+        create_merged_book_index(other, 1, flush_workers);
+        sfa.file_cnt = 0;
+        store->each(store, &check_same_file, &sfa);
+        Atrue(sfa.file_cnt > 0);
+        Aiequal(store->count(store), other->count(other));
+    }
+    store_deref(other);
 }
 
 static void test_iw_del_terms(TestCase *tc, void *data)
@@ -2102,6 +3280,166 @@ static void test_ir_read_while_optimizing(TestCase *tc, void *data)
     ir_close(ir);
 }
 
+/* add books +from+ to +to+ of the book list as a new segment */
+static void add_book_segment(Store *store, Document **docs, int from, int to)
+{
+    Config config = default_config;
+    IndexWriter *iw;
+    int i;
+    config.merge_factor = 100;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = from; i < to; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    iw_close(iw);
+}
+
+static void test_ir_reopen(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Document **docs = prep_book_list();
+    IndexReader *ir, *ir2, *ir3;
+    IndexWriter *iw;
+    MultiReader *mr, *mr2;
+    Document *doc;
+    FieldInfos *fis = prep_book_fis();
+
+    index_create(store, fis);
+    fis_deref(fis);
+    add_book_segment(store, docs, 0, 5);
+    add_book_segment(store, docs, 5, 10);
+
+    ir = ir_open(store);
+    ir2 = ir_reopen(ir);
+    Apnotnull(ir2);
+    Apequal(ir, ir2);
+    ir_close(ir2);
+
+    /* change the deletions of the first segment and add a third */
+    ir3 = ir_open(store);
+    ir_delete_doc(ir3, 1);
+    ir_close(ir3);
+    add_book_segment(store, docs, 10, 15);
+    Atrue(!ir_is_latest(ir));
+
+    ir2 = ir_reopen(ir);
+    Atrue(ir != ir2);
+    Atrue(ir_is_latest(ir2));
+    Atrue(!ir_is_latest(ir));
+    mr = ir_as_multi(ir);
+    mr2 = ir_as_multi(ir2);
+    Apnotnull(mr2);
+    Aiequal(3, mr2->r_cnt);
+    /* only the segments' cores are shared */
+    Atrue(mr->sub_readers[0] != mr2->sub_readers[0]);
+    Atrue(mr->sub_readers[1] != mr2->sub_readers[1]);
+    Aiequal(15, ir2->max_doc(ir2));
+    Aiequal(14, ir2->num_docs(ir2));
+    Atrue(ir2->is_deleted(ir2, 1));
+    Atrue(!ir->is_deleted(ir, 1));
+    Aiequal(10, ir->num_docs(ir));
+
+    /* deleting with the new reader leaves the old reader's snapshot alone */
+    ir_delete_doc(ir2, 6);
+    ir_commit(ir2);
+    Atrue(ir2->is_deleted(ir2, 6));
+    Aiequal(13, ir2->num_docs(ir2));
+    Atrue(!ir->is_deleted(ir, 6));
+    Aiequal(10, ir->num_docs(ir));
+    ir_close(ir);
+
+    /* the new reader still works once the old reader is closed and its
+     * deletions are committed with the new reader */
+    doc = ir2->get_doc(ir2, 7);
+    Asequal("Ruth Prawer Jhabvala", doc_get_field(doc, author)->data[0]);
+    doc_destroy(doc);
+    doc = ir2->get_doc(ir2, 12);
+    Asequal(docs[12]->fields[0]->data[0], doc->fields[0]->data[0]);
+    doc_destroy(doc);
+    ir_delete_doc(ir2, 7);
+    ir_commit(ir2);
+
+    /* reopening a single segment reader */
+    iw = iw_open(store, whitespace_analyzer_new(false), &default_config);
+    iw_optimize(iw);
+    iw_close(iw);
+    ir = ir_reopen(ir2);
+    ir_close(ir2);
+    Apequal(NULL, ir_as_multi(ir));
+    Aiequal(12, ir->num_docs(ir));
+    Aiequal(12, ir->max_doc(ir));
+    ir2 = ir_reopen(ir);
+    Apequal(ir, ir2);
+    ir_close(ir2);
+    ir_close(ir);
+
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+}
+
+static void test_iw_get_reader(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    Document **docs = prep_book_list();
+    IndexWriter *iw = create_book_iw(store);
+    IndexReader *ir, *ir2, *ir3, *ir4;
+    Document *doc;
+    int i, df;
+
+    for (i = 0; i < 5; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    ir = iw_get_reader(iw);
+    Aiequal(5, ir->num_docs(ir));
+    doc = ir->get_doc(ir, 4);
+    Asequal(docs[4]->fields[0]->data[0], doc->fields[0]->data[0]);
+    doc_destroy(doc);
+
+    /* nothing has been committed */
+    ir2 = ir_open(store);
+    Aiequal(0, ir2->num_docs(ir2));
+    ir_close(ir2);
+
+    for (i = 5; i < 10; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    ir2 = iw_get_reader(iw);
+    Aiequal(5, ir->num_docs(ir));
+    Aiequal(10, ir2->num_docs(ir2));
+    Aiequal(2, ir_as_multi(ir2)->r_cnt);
+
+    for (i = 10; i < 15; i++) {
+        iw_add_doc(iw, docs[i]);
+    }
+    ir3 = iw_get_reader(iw);
+    Aiequal(15, ir3->num_docs(ir3));
+    Aiequal(3, ir_as_multi(ir3)->r_cnt);
+    /* each reader has its own segment readers sharing the segment files */
+    Atrue(ir_as_multi(ir2)->sub_readers[0]
+          != ir_as_multi(ir3)->sub_readers[0]);
+    doc = ir3->get_doc(ir3, 7);
+    Asequal(docs[7]->fields[0]->data[0], doc->fields[0]->data[0]);
+    doc_destroy(doc);
+
+    /* deleting commits the writer's segments */
+    df = ir_doc_freq(ir3, author, "Newby");
+    Atrue(df > 0);
+    iw_delete_term(iw, author, "Newby");
+    ir4 = iw_get_reader(iw);
+    Aiequal(15 - df, ir4->num_docs(ir4));
+    Aiequal(15, ir3->num_docs(ir3));
+    ir_close(ir4);
+    ir4 = ir_open(store);
+    Aiequal(15 - df, ir4->num_docs(ir4));
+    ir_close(ir4);
+
+    ir_close(ir);
+    ir_close(ir2);
+    iw_close(iw);
+    Aiequal(15, ir3->num_docs(ir3));
+    ir_close(ir3);
+    destroy_docs(docs, BOOK_LIST_LENGTH);
+}
+
 static void test_ir_multivalue_fields(TestCase *tc, void *data)
 { 
     Store *store = (Store *)data;
@@ -2201,6 +3539,9 @@ TestSuite *ts_index(TestSuite *suite)
     /* TermDocEnum */
     tst_run_test(suite, test_segment_term_doc_enum, store);
     tst_run_test(suite, test_segment_tde_deleted_docs, store);
+    tst_run_test(suite, test_segment_tde_skip_levels, store);
+    tst_run_test(suite, test_segment_tde_block_postings, store);
+    tst_run_test(suite, test_segment_tde_block_bit_widths, store);
 
     suite = ADD_SUITE(suite);
     /* Index */
@@ -2211,10 +3552,30 @@ TestSuite *ts_index(TestSuite *suite)
     /* IndexWriter */
     tst_run_test(suite, test_fld_inverter, store);
     tst_run_test(suite, test_postings_sorter, NULL);
+    tst_run_test(suite, test_byte_block_pool, NULL);
     tst_run_test(suite, test_iw_add_doc, store);
     tst_run_test(suite, test_iw_add_docs, store);
     tst_run_test(suite, test_iw_add_empty_tv, store);
     tst_run_test(suite, test_iw_del_terms, store);
+    tst_run_test(suite, test_iw_tiered_merge_policy, store);
+    tst_run_test(suite, test_iw_expunge_deletes, store);
+    tst_run_test(suite, test_iw_merge_rate_limit, store);
+    tst_run_test(suite, test_iw_merge_thread_commit, store);
+    tst_run_test(suite, test_iw_merge_workers, store);
+    tst_run_test(suite, test_iw_flush_workers, store);
+    tst_run_test(suite, test_iw_merge_stored_fields, store);
+    tst_run_test(suite, test_iw_index_sort, store);
+    tst_run_test_with_name(suite, test_iw_index_sort_flush, store,
+                           "test_iw_index_sort_flush_in_ram");
+    fs_store = open_fs_store(TEST_DIR);
+    tst_run_test_with_name(suite, test_iw_index_sort_flush, fs_store,
+                           "test_iw_index_sort_flush_on_disk");
+    fs_store->clear_all(fs_store);
+    store_deref(fs_store);
+    tst_run_test(suite, test_iw_del_key_terms, store);
+    tst_run_test(suite, test_iw_max_length_terms, store);
+    tst_run_test(suite, test_iw_doc_values, store);
+    tst_run_test(suite, test_iw_max_length_doc_values, store);
     tst_run_test(suite, test_create_with_reader, store);
     tst_run_test(suite, test_simulated_crashed_writer, store);
     tst_run_test(suite, test_simulated_corrupt_index1, store);
@@ -2339,6 +3700,8 @@ TestSuite *ts_index(TestSuite *suite)
     fs_store->clear_all(fs_store);
     store_deref(fs_store);
 
+    tst_run_test(suite, test_ir_reopen, store);
+    tst_run_test(suite, test_iw_get_reader, store);
     tst_run_test(suite, test_ir_multivalue_fields, store);
 
     store_deref(store);
@@ -58,6 +58,44 @@ void test_write_to(TestCase *tc, void *data)
     store_deref(ram_store);
 }
 
+static void remove_file(const char *fname, void *arg)
+{
+    Store *store = (Store *)arg;
+    store->remove(store, fname);
+}
+
+/**
+ * Test that the files of a RAMStore can be used while iterating through
+ * them and that a stream can be closed after its store.
+ */
+void test_each_uses_store(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    Store *copy;
+    OutStream *os;
+    InStream *is;
+    (void)data;
+
+    os = store->new_output(store, "_1.cfs");
+    os_write_vint(os, 1);
+    os_close(os);
+    os = store->new_output(store, "_2.cfs");
+    os_write_vint(os, 2);
+    os_close(os);
+
+    copy = open_ram_store_and_copy(store, false);
+    Aiequal(2, copy->count(copy));
+
+    store->each(store, &remove_file, store);
+    Aiequal(0, store->count(store));
+    store_deref(store);
+
+    is = copy->open_input(copy, "_2.cfs");
+    store_deref(copy);
+    Aiequal(2, is_read_vint(is));
+    is_close(is);
+}
+
 /**
  * Create the RAMStore test suite
  */
@@ -70,6 +108,7 @@ TestSuite *ts_ram_store(TestSuite *suite)
     create_test_store_suite(suite, store);
 
     tst_run_test(suite, test_write_to, NULL);
+    tst_run_test(suite, test_each_uses_store, NULL);
 
     store_deref(store);
 
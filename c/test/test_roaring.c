@@ -0,0 +1,235 @@
+#include "roaring.h"
+#include "testhelper.h"
+#include "test.h"
+
+#define R_MAX_DOC (4 * 65536 + 100)
+
+/* check that +r+ holds exactly the bits set in +bv+ */
+static void check_roaring(TestCase *tc, Roaring *r, BitVector *bv)
+{
+    int buf[100];
+    int i, n, doc, expected;
+
+    Aiequal(bv->count, r->count);
+    for (i = 0; i < 2000; i++) {
+        doc = rand() % R_MAX_DOC;
+        Aiequal(bv_get(bv, doc), roar_get(r, doc));
+        expected = bv_scan_next_from(bv, doc);
+        Aiequal(expected, roar_next_from(r, doc));
+    }
+
+    doc = 0;
+    expected = -1;
+    while ((n = roar_next_n(r, doc, buf, NELEMS(buf))) > 0) {
+        for (i = 0; i < n; i++) {
+            expected = bv_scan_next_from(bv, expected + 1);
+            if (!Aiequal(expected, buf[i])) {
+                return;
+            }
+        }
+        doc = buf[n - 1] + 1;
+    }
+    Aiequal(-1, bv_scan_next_from(bv, expected + 1));
+}
+
+/* set bits with probability 1/+sparsity+ in each chunk of +bv+ and +r+ */
+static void add_random_docs(BitVector *bv, Roaring *r, int from, int to,
+                            int sparsity)
+{
+    int i;
+    for (i = from; i < to; i++) {
+        if (rand() % sparsity == 0) {
+            bv_set(bv, i);
+            roar_add(r, i);
+        }
+    }
+}
+
+static void test_roaring(TestCase *tc, void *data)
+{
+    static const int docs[] = {
+        5, 0, 65535, 65536, 1 << 20, 70000, 3, 65535, 131071, 131072
+    };
+    int i;
+    Roaring *r = roar_new();
+    BitVector *bv = bv_new();
+    (void)data;
+
+    Aiequal(0, r->count);
+    Aiequal(-1, roar_next_from(r, 0));
+    Aiequal(0, roar_get(r, 0));
+    for (i = 0; i < NELEMS(docs); i++) {
+        roar_add(r, docs[i]);
+        bv_set(bv, docs[i]);
+    }
+    Aiequal(9, r->count);
+    Aiequal(4, r->size);
+    check_roaring(tc, r, bv);
+    Aiequal(0, roar_next_from(r, -10));
+    Aiequal(1 << 20, roar_next_from(r, 131073));
+    Aiequal(-1, roar_next_from(r, (1 << 20) + 1));
+
+    roar_destroy(r);
+    bv_destroy(bv);
+}
+
+static void test_roaring_containers(TestCase *tc, void *data)
+{
+    Roaring *r = roar_new();
+    BitVector *bv = bv_new();
+    int memory;
+    (void)data;
+
+    /* a dense chunk, a sparse chunk and a chunk of runs */
+    add_random_docs(bv, r, 0, 65536, 2);
+    add_random_docs(bv, r, 65536, 2 * 65536, 100);
+    bv_set_range(bv, 3 * 65536 + 10, 3 * 65536 + 30000);
+    bv_set_range(bv, 3 * 65536 + 40000, 3 * 65536 + 40010);
+    bv_set(bv, R_MAX_DOC - 1);
+    roar_add(r, R_MAX_DOC - 1);
+    {
+        int i;
+        for (i = 3 * 65536 + 40009; i >= 3 * 65536 + 40000; i--) {
+            roar_add(r, i);
+        }
+        for (i = 3 * 65536 + 10; i < 3 * 65536 + 30000; i++) {
+            roar_add(r, i);
+        }
+    }
+    Aiequal(RC_BITMAP, r->containers[0].type);
+    Aiequal(RC_ARRAY, r->containers[1].type);
+    Aiequal(RC_BITMAP, r->containers[2].type);
+    Aiequal(RC_ARRAY, r->containers[3].type);
+    check_roaring(tc, r, bv);
+
+    memory = roar_memory(r);
+    roar_optimize(r);
+    Aiequal(RC_BITMAP, r->containers[0].type);
+    Aiequal(RC_ARRAY, r->containers[1].type);
+    Aiequal(RC_RUN, r->containers[2].type);
+    Aiequal(4, r->containers[2].len);
+    Atrue(roar_memory(r) < memory);
+    check_roaring(tc, r, bv);
+
+    /* adding to a run container */
+    bv_set(bv, 3 * 65536 + 35000);
+    roar_add(r, 3 * 65536 + 35000);
+    roar_add(r, 3 * 65536 + 20);
+    check_roaring(tc, r, bv);
+
+    roar_destroy(r);
+    bv_destroy(bv);
+}
+
+static void test_roaring_bv(TestCase *tc, void *data)
+{
+    Roaring *r = roar_new(), *r2;
+    BitVector *bv = bv_new(), *bv2;
+    (void)data;
+
+    add_random_docs(bv, r, 0, R_MAX_DOC, 1000);
+    r2 = roar_from_bv(bv, R_MAX_DOC);
+    check_roaring(tc, r2, bv);
+    /* a sparse set takes much less space than a bit per doc */
+    Atrue(roar_memory(r2) * 10 < R_MAX_DOC / 8);
+    bv2 = roar_to_bv(r2);
+    Atrue(bv_eq(bv, bv2));
+    Aiequal(bv->count, bv2->count);
+    bv_destroy(bv2);
+    roar_destroy(r2);
+
+    /* bits past the size limit are dropped */
+    r2 = roar_from_bv(bv, 65536);
+    Aiequal(r->containers[0].card, r2->count);
+    roar_destroy(r2);
+
+    /* a bv which extends as ones is filled up to the size limit */
+    bv_clear(bv);
+    bv_set(bv, 70);
+    bv_not_x(bv);
+    r2 = roar_from_bv(bv, 200);
+    Aiequal(199, r2->count);
+    Aiequal(0, roar_get(r2, 70));
+    Aiequal(1, roar_get(r2, 199));
+    Aiequal(0, roar_get(r2, 200));
+    Aiequal(RC_RUN, r2->containers[0].type);
+    roar_destroy(r2);
+
+    roar_destroy(r);
+    bv_destroy(bv);
+}
+
+static void test_roaring_and(TestCase *tc, void *data)
+{
+    static const int sparsities[] = {1, 2, 50, 3000};
+    int i, j;
+    (void)data;
+
+    for (i = 0; i < NELEMS(sparsities); i++) {
+        for (j = 0; j < NELEMS(sparsities); j++) {
+            Roaring *r1 = roar_new(), *r2 = roar_new(), *r;
+            BitVector *bv1 = bv_new(), *bv2 = bv_new(), *bv;
+            add_random_docs(bv1, r1, 0, 2 * 65536, sparsities[i]);
+            add_random_docs(bv2, r2, 65536, 3 * 65536, sparsities[j]);
+            if (i == 0) {
+                roar_optimize(r1);
+            }
+            r = roar_and(r1, r2);
+            bv = bv_and(bv1, bv2);
+            check_roaring(tc, r, bv);
+            bv_destroy(bv);
+            roar_destroy(r);
+            roar_destroy(r1);
+            roar_destroy(r2);
+            bv_destroy(bv1);
+            bv_destroy(bv2);
+        }
+    }
+}
+
+static void test_roaring_io(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    Roaring *r = roar_new(), *r2;
+    BitVector *bv = bv_new();
+    OutStream *os;
+    InStream *is;
+    (void)data;
+
+    add_random_docs(bv, r, 0, 65536, 3);
+    add_random_docs(bv, r, 65536, 2 * 65536, 500);
+    bv_set_range(bv, 3 * 65536, 3 * 65536 + 5000);
+    r2 = roar_from_bv(bv, R_MAX_DOC);
+
+    os = store->new_output(store, "_0.roar");
+    roar_write(r2, os);
+    os_close(os);
+    roar_destroy(r2);
+
+    is = store->open_input(store, "_0.roar");
+    r2 = roar_read(is);
+    is_close(is);
+    Aiequal(3, r2->size);
+    Aiequal(RC_BITMAP, r2->containers[0].type);
+    Aiequal(RC_ARRAY, r2->containers[1].type);
+    Aiequal(RC_RUN, r2->containers[2].type);
+    check_roaring(tc, r2, bv);
+
+    roar_destroy(r2);
+    roar_destroy(r);
+    bv_destroy(bv);
+    store_deref(store);
+}
+
+TestSuite *ts_roaring(TestSuite *suite)
+{
+    suite = ADD_SUITE(suite);
+
+    tst_run_test(suite, test_roaring, NULL);
+    tst_run_test(suite, test_roaring_containers, NULL);
+    tst_run_test(suite, test_roaring_bv, NULL);
+    tst_run_test(suite, test_roaring_and, NULL);
+    tst_run_test(suite, test_roaring_io, NULL);
+
+    return suite;
+}
@@ -1656,6 +1656,153 @@ static void test_search_unscored(TestCase *tc, void *data)
     q_deref(tq);
 }
 
+#define BMW_DOC_CNT 3000
+#define BMW_WORD_CNT 40
+
+static void prepare_bmw_index(Store *store, PostingsFormat postings_format)
+{
+    int i, j, len;
+    char buf[300];
+    Document *doc;
+    IndexWriter *iw;
+    Config config = default_config;
+    FieldInfos *fis = fis_new(STORE_NO, INDEX_YES, TERM_VECTOR_NO);
+    index_create(store, fis);
+    fis_deref(fis);
+
+    config.max_buffered_docs = 700;
+    config.postings_format = postings_format;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < BMW_DOC_CNT; i++) {
+        buf[0] = '\0';
+        len = 1 + rand() % 30;
+        for (j = 0; j < len; j++) {
+            /* skew the words so we get both rare and common terms */
+            int word = (rand() % BMW_WORD_CNT) * (rand() % BMW_WORD_CNT)
+                / BMW_WORD_CNT;
+            sprintf(buf + strlen(buf), "w%d ", word);
+        }
+        doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(field), buf));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_close(iw);
+}
+
+/* Words prefixed with '-' are prohibited and may be boosted like "w1^2.5" */
+static Query *bmw_query_new(const char *str)
+{
+    char buf[100], *word;
+    Query *bq = bq_new(false);
+    strcpy(buf, str);
+    for (word = strtok(buf, " "); word; word = strtok(NULL, " ")) {
+        BCType occur = BC_SHOULD;
+        char *boost = strchr(word, '^');
+        Query *tq;
+        if ('-' == *word) {
+            occur = BC_MUST_NOT;
+            word++;
+        }
+        if (boost) {
+            *boost++ = '\0';
+        }
+        tq = tq_new(field, word);
+        if (boost) {
+            tq->boost = (float)strtod(boost, NULL);
+        }
+        bq_add_query_nr(bq, tq, occur);
+    }
+    return bq;
+}
+
+/* Compare the top hits of each query with and without total hit counting and
+ * return true if any docs were skipped when not counting them. */
+static bool check_bmw_searches(TestCase *tc, Searcher *searcher)
+{
+    static const char *queries[] = {
+        "w0 w1", "w0 w1 w2 w3 w4 w5 w6 w7 w8 w9", "w0 w20 w35", "w1 w30",
+        "w2^3.0 w9 w1", "w0^0.1 w1 w2^8.0", "w3 w7 -w0", "w36 w37 w38 w39",
+        "w0 w1 w2 w3 nonexistent"
+    };
+    static const int pages[][2] = {{0, 10}, {5, 10}, {0, 1}, {0, 200}};
+    int i, j, k, total_hits = 0, pruned_hits = 0;
+
+    for (i = 0; i < NELEMS(queries); i++) {
+        Query *q = bmw_query_new(queries[i]);
+        for (j = 0; j < NELEMS(pages); j++) {
+            TopDocs *td1, *td2;
+            ((IndexSearcher *)searcher)->count_total_hits = true;
+            td1 = searcher_search(searcher, q, pages[j][0], pages[j][1],
+                                  NULL, NULL, NULL);
+            ((IndexSearcher *)searcher)->count_total_hits = false;
+            td2 = searcher_search(searcher, q, pages[j][0], pages[j][1],
+                                  NULL, NULL, NULL);
+            Aiequal(td1->size, td2->size);
+            Atrue(td2->total_hits <= td1->total_hits);
+            Afequal(td1->max_score, td2->max_score);
+            for (k = 0; k < td1->size && k < td2->size; k++) {
+                float score = td1->hits[k]->score;
+                Afequal(score, td2->hits[k]->score);
+                /* sums may round differently so only check the docs of
+                 * hits whose scores aren't tied. The neighbours of the hits
+                 * on the ends of the page are unknown */
+                if (k > 0 && k < td1->size - 1
+                    && td1->hits[k - 1]->score > score * 1.0001
+                    && td1->hits[k + 1]->score < score * 0.9999) {
+                    Aiequal(td1->hits[k]->doc, td2->hits[k]->doc);
+                }
+            }
+            total_hits += td1->total_hits;
+            pruned_hits += td2->total_hits;
+            td_destroy(td1);
+            td_destroy(td2);
+        }
+        q_deref(q);
+    }
+    ((IndexSearcher *)searcher)->count_total_hits = true;
+    return pruned_hits < total_hits;
+}
+
+static void test_block_max_wand(TestCase *tc, void *data)
+{
+    Store *store = open_ram_store();
+    PostingsFormat postings_format;
+    (void)data;
+
+    for (postings_format = POSTINGS_VINT; postings_format <= POSTINGS_BLOCK;
+         postings_format++) {
+        int i, j;
+        IndexWriter *iw;
+        IndexReader *ir;
+        Searcher *searcher;
+
+        prepare_bmw_index(store, postings_format);
+
+        /* a multi-segment index first then an optimized one */
+        for (i = 0; i < 2; i++) {
+            ir = ir_open(store);
+            Atrue(i == 0 ? ir->sis->size > 1 : ir->sis->size == 1);
+            searcher = isea_new(ir);
+
+            /* pruning must actually skip docs */
+            Atrue(check_bmw_searches(tc, searcher));
+
+            /* set_norm makes the stored impacts stale */
+            for (j = 7; j < BMW_DOC_CNT; j += 97) {
+                ir_set_norm(ir, j, field, 250);
+            }
+            check_bmw_searches(tc, searcher);
+            searcher_close(searcher);
+
+            iw = iw_open(store, whitespace_analyzer_new(false), NULL);
+            iw_optimize(iw);
+            iw_close(iw);
+        }
+    }
+    store_deref(store);
+}
+
 TestSuite *ts_search(TestSuite *suite)
 {
     Store *store = open_ram_store();
@@ -1711,6 +1858,8 @@ TestSuite *ts_search(TestSuite *suite)
 
     tst_run_test(suite, test_search_unscored, (void *)searcher);
 
+    tst_run_test(suite, test_block_max_wand, NULL);
+
     store_deref(store);
     searcher_close(searcher);
     return suite;
@@ -1,6 +1,7 @@
 #include "testhelper.h"
 #include "symbol.h"
 #include "search.h"
+#include "field_index.h"
 #include "test.h"
 
 #define ARRAY_SIZE 20
@@ -57,6 +58,203 @@ static void sort_test_setup(Store *store)
     iw_close(iw);
 }
 
+/* the same data with doc values for the sort fields, written a few documents
+ * per segment so that the sorts read doc values from several segments */
+static void sort_doc_values_test_setup(Store *store)
+{
+    int i;
+    IndexWriter *iw;
+    Config config = default_config;
+    Symbol dv_fields[3];
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_YES);
+
+    dv_fields[0] = string;
+    dv_fields[1] = integer;
+    dv_fields[2] = flt;
+    for (i = 0; i < NELEMS(dv_fields); i++) {
+        FieldInfo *fi = fi_new(dv_fields[i], STORE_YES, INDEX_YES,
+                               TERM_VECTOR_NO);
+        fi->bits |= FI_STORE_DOC_VALUES_BM;
+        fis_add_field(fis, fi);
+    }
+    index_create(store, fis);
+    fis_deref(fis);
+
+    config.max_buffered_docs = 3;
+    config.merge_factor = 100;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+
+    for (i = 0; i < NELEMS(data); i++) {
+        add_sort_test_data(&data[i], iw);
+    }
+    iw_close(iw);
+}
+
+static void test_sort_doc_values(TestCase *tc, void *ir_p)
+{
+    IndexReader *ir = (IndexReader *)ir_p;
+    DocValues *dv = ir_get_doc_values(ir, string);
+    int i;
+
+    Apnotnull(dv);
+    Aiequal(NELEMS(data), dv->size);
+    Aiequal(NELEMS(data) - 1, dv->value_cnt);
+    Apnull(dv->values[0]);
+    for (i = 1; i < dv->value_cnt; i++) {
+        Assert(strcmp(dv->values[i], dv->values[i + 1]) < 0,
+               "values should be sorted");
+    }
+    for (i = 0; i < NELEMS(data); i++) {
+        const char *value = dv->values[dv_get_ord(dv, i)];
+        if (*data[i].string) {
+            Asequal(data[i].string, value);
+        }
+        else {
+            Apnull(value);
+        }
+    }
+    dv_destroy(dv);
+
+    dv = ir_get_doc_values(ir, integer);
+    Aiequal(6, dv->value_cnt);
+    Asequal("1", dv->values[1]);
+    Asequal("6", dv->values[6]);
+    Aiequal(6, dv_get_ord(dv, 0));
+    dv_destroy(dv);
+
+    /* the search field doesn't store doc values */
+    Apnull(ir_get_doc_values(ir, search));
+}
+
+static void test_packed_ints(TestCase *tc, void *data)
+{
+    static const i64 vals[] = {
+        0, 1, -1, 7, 255, 256, -1000, 123456789, -123456789012345LL,
+        0x7fffffffffffffffLL, -0x7fffffffffffffffLL - 1, 42
+    };
+    const int size = 1000;
+    i64 *expected = ALLOC_AND_ZERO_N(i64, size);
+    PackedInts *pi = pi_new(size, 0, 0);
+    int i, bits = 0;
+    (void)data;
+
+    Aiequal(0, pi->bits);
+    for (i = 0; i < size; i++) {
+        Aiequal(0, pi_get(pi, i));
+    }
+    /* the range only widens, so the width never shrinks */
+    for (i = 0; i < 5000; i++) {
+        int doc = rand() % size;
+        expected[doc] = vals[i * NELEMS(vals) / 5000];
+        pi_set(pi, doc, expected[doc]);
+        Atrue(pi->bits >= bits);
+        bits = pi->bits;
+    }
+    Aiequal(64, pi->bits);
+    for (i = 0; i < size; i++) {
+        Assert(expected[i] == pi_get(pi, i), "%d: expected %lld, got %lld", i,
+               (long long)expected[i], (long long)pi_get(pi, i));
+    }
+    pi_destroy(pi);
+
+    pi = pi_new(size, 100, 110);
+    Aiequal(4, pi->bits);
+    Aiequal(100, pi_get(pi, size - 1));
+    pi_set(pi, 3, 110);
+    Aiequal(4, pi->bits);
+    Aiequal(110, pi_get(pi, 3));
+    pi_resize(pi, size * 2);
+    Aiequal(110, pi_get(pi, 3));
+    Aiequal(100, pi_get(pi, size * 2 - 1));
+    pi_destroy(pi);
+
+    pi = pi_new(4, 0, 0);
+    pi_set_float(pi, 0, -1.5f);
+    pi_set_float(pi, 1, 1000.25f);
+    pi_set_float(pi, 2, -0.001f);
+    Afequal(-1.5f, pi_get_float(pi, 0));
+    Afequal(1000.25f, pi_get_float(pi, 1));
+    Afequal(-0.001f, pi_get_float(pi, 2));
+    Afequal(0.0f, pi_get_float(pi, 3));
+    Atrue(pi_get(pi, 0) < pi_get(pi, 2));
+    Atrue(pi_get(pi, 2) < pi_get(pi, 3));
+    Atrue(pi_get(pi, 3) < pi_get(pi, 1));
+    pi_destroy(pi);
+    free(expected);
+}
+
+static void test_field_index_values(TestCase *tc, void *ir_p)
+{
+    IndexReader *ir = (IndexReader *)ir_p;
+    FieldIndex *integer_index, *float_index, *string_index, *byte_index;
+    int i;
+
+    integer_index = field_index_get(ir, integer, &INTEGER_FIELD_INDEX_CLASS);
+    float_index = field_index_get(ir, flt, &FLOAT_FIELD_INDEX_CLASS);
+    string_index = field_index_get(ir, string, &STRING_FIELD_INDEX_CLASS);
+    byte_index = field_index_get(ir, string, &BYTE_FIELD_INDEX_CLASS);
+    for (i = 0; i < NELEMS(data); i++) {
+        float flt_val;
+        sscanf(data[i].flt, "%f", &flt_val);
+        Aiequal(atoi(data[i].integer), get_integer_value(integer_index, i));
+        Afequal(flt_val, get_float_value(float_index, i));
+        if (*data[i].string) {
+            Asequal(data[i].string, get_string_value(string_index, i));
+        }
+        else {
+            Apnull(get_string_value(string_index, i));
+        }
+    }
+    Apnull(get_string_value(integer_index, 0));
+    /* 6 distinct integers and 9 strings only need a few bits each */
+    Aiequal(3, ((PackedInts *)integer_index->index)->bits);
+    Aiequal(4, ((StringIndex *)string_index->index)->index->bits);
+    Aiequal(4, ((PackedInts *)byte_index->index)->bits);
+}
+
+/* a new reader of the same segments reuses the indexes of the segments */
+static void test_field_index_segments(TestCase *tc, void *ir_p)
+{
+    IndexReader *ir = (IndexReader *)ir_p;
+    MultiReader *mr = ir_as_multi(ir);
+    IndexReader *ir2, **sub_readers;
+    FieldIndex *byte_index, *byte_index2, *string_index2;
+    int i, *cache_sizes;
+
+    if (!Apnotnull(mr)) {
+        return;
+    }
+    byte_index = field_index_get(ir, string, &BYTE_FIELD_INDEX_CLASS);
+    cache_sizes = ALLOC_N(int, mr->r_cnt);
+    /* the MultiReader takes the array of sub readers */
+    sub_readers = ALLOC_N(IndexReader *, mr->r_cnt);
+    for (i = 0; i < mr->r_cnt; i++) {
+        Apnotnull(mr->sub_readers[i]->field_index_cache);
+        cache_sizes[i] = mr->sub_readers[i]->field_index_cache->size;
+        sub_readers[i] = mr->sub_readers[i];
+        REF(sub_readers[i]);
+    }
+
+    ir2 = mr_open(sub_readers, mr->r_cnt);
+    byte_index2 = field_index_get(ir2, string, &BYTE_FIELD_INDEX_CLASS);
+    string_index2 = field_index_get(ir2, string, &STRING_FIELD_INDEX_CLASS);
+    for (i = 0; i < mr->r_cnt; i++) {
+        Aiequal(cache_sizes[i], mr->sub_readers[i]->field_index_cache->size);
+    }
+    for (i = 0; i < NELEMS(data); i++) {
+        Aiequal(pi_get((PackedInts *)byte_index->index, i),
+                pi_get((PackedInts *)byte_index2->index, i));
+        if (*data[i].string) {
+            Asequal(data[i].string, get_string_value(string_index2, i));
+        }
+    }
+    /* the next ordinal is kept after the last doc */
+    Aiequal(NELEMS(data), pi_get((PackedInts *)byte_index2->index,
+                                 NELEMS(data)));
+    free(cache_sizes);
+    ir_close(ir2);
+}
+
 static void sort_multi_test_setup(Store *store1, Store *store2)
 {
     int i;
@@ -308,10 +506,93 @@ static void test_sorts(TestCase *tc, void *data)
     q_deref(q);
 }
 
+#define INDEX_SORT_DOC_CNT 200
+
+/* searches sorted the way the index is sorted stop looking in each segment
+ * once they have enough hits. They must find the same hits as a search
+ * which looks at every doc */
+static void test_index_sort_early_stop(TestCase *tc, void *data)
+{
+    static const char *queries[] = {"findall", "even", "odd"};
+    static const int pages[][2] = {{0, 10}, {5, 10}, {0, 1}, {0, 500}};
+    Store *store = open_ram_store();
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    Config config = default_config;
+    IndexWriter *iw;
+    Searcher *sea;
+    char buf[20];
+    int i, j, k, reverse, total_hits = 0, stopped_hits = 0;
+    (void)data;
+
+    index_create(store, fis);
+    fis_deref(fis);
+    config.max_buffered_docs = 30;
+    config.merge_factor = 3;
+    config.sort_field = integer;
+    config.sort_reverse = true;
+    iw = iw_open(store, whitespace_analyzer_new(false), &config);
+    for (i = 0; i < INDEX_SORT_DOC_CNT; i++) {
+        Document *doc = doc_new();
+        /* several docs share each value so ties are broken by doc number */
+        sprintf(buf, "%d", (i * 37) % (INDEX_SORT_DOC_CNT / 4));
+        doc_add_field(doc, df_add_data(df_new(integer), estrdup(buf)))
+            ->destroy_data = true;
+        doc_add_field(doc, df_add_data(df_new(search), (char *)"findall"));
+        doc_add_field(doc, df_add_data(df_new(string),
+                                       (char *)(i % 2 ? "odd" : "even")));
+        iw_add_doc(iw, doc);
+        doc_destroy(doc);
+    }
+    iw_close(iw);
+
+    sea = isea_new(ir_open(store));
+    for (reverse = 0; reverse <= 1; reverse++) {
+        Sort *sort = sort_new();
+        sort_add_sort_field(sort, sort_field_int_new(integer, reverse));
+        if (reverse) {
+            sort_add_sort_field(sort, sort_field_doc_new(false));
+        }
+        for (i = 0; i < NELEMS(queries); i++) {
+            Query *q = tq_new(i ? string : search, queries[i]);
+            for (j = 0; j < NELEMS(pages); j++) {
+                TopDocs *td1, *td2;
+                ((IndexSearcher *)sea)->count_total_hits = true;
+                td1 = searcher_search(sea, q, pages[j][0], pages[j][1],
+                                      NULL, sort, NULL);
+                ((IndexSearcher *)sea)->count_total_hits = false;
+                td2 = searcher_search(sea, q, pages[j][0], pages[j][1],
+                                      NULL, sort, NULL);
+                Aiequal(td1->size, td2->size);
+                Atrue(td2->total_hits <= td1->total_hits);
+                for (k = 0; k < td1->size && k < td2->size; k++) {
+                    Aiequal(td1->hits[k]->doc, td2->hits[k]->doc);
+                }
+                if (reverse) {
+                    total_hits += td1->total_hits;
+                    stopped_hits += td2->total_hits;
+                }
+                else {
+                    /* sorted the other way to the index */
+                    Aiequal(td1->total_hits, td2->total_hits);
+                }
+                td_destroy(td1);
+                td_destroy(td2);
+            }
+            q_deref(q);
+        }
+        sort_destroy(sort);
+    }
+    Atrue(stopped_hits < total_hits);
+    searcher_close(sea);
+    store_deref(store);
+}
+
 TestSuite *ts_sort(TestSuite *suite)
 {
     Searcher *sea, **searchers;
     Store *store = open_ram_store(), *fs_store;
+    IndexWriter *iw;
+    IndexReader *ir;
 
     search = intern("search");
     string = intern("string");
@@ -324,13 +605,37 @@ TestSuite *ts_sort(TestSuite *suite)
 
     tst_run_test(suite, test_sort_field_to_s, NULL);
     tst_run_test(suite, test_sort_to_s, NULL);
+    tst_run_test(suite, test_packed_ints, NULL);
 
-    sea = isea_new(ir_open(store));
+    ir = ir_open(store);
+    sea = isea_new(ir);
 
+    tst_run_test(suite, test_field_index_values, (void *)ir);
     tst_run_test(suite, test_sorts, (void *)sea);
 
     searcher_close(sea);
 
+    sort_doc_values_test_setup(store);
+    ir = ir_open(store);
+    sea = isea_new(ir);
+    tst_run_test(suite, test_sort_doc_values, (void *)ir);
+    tst_run_test(suite, test_field_index_values, (void *)ir);
+    tst_run_test(suite, test_field_index_segments, (void *)ir);
+    tst_run_test(suite, test_sorts, (void *)sea);
+    searcher_close(sea);
+
+    /* and once the segments have been merged */
+    iw = iw_open(store, whitespace_analyzer_new(false), NULL);
+    iw_optimize(iw);
+    iw_close(iw);
+    ir = ir_open(store);
+    sea = isea_new(ir);
+    tst_run_test(suite, test_sort_doc_values, (void *)ir);
+    tst_run_test(suite, test_sorts, (void *)sea);
+    searcher_close(sea);
+
+    tst_run_test(suite, test_index_sort_early_stop, NULL);
+
     do_byte_test = false;
 
 #ifdef POSH_OS_WIN32
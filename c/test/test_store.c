@@ -560,6 +560,88 @@ static void test_read_bytes(TestCase *tc, void *data)
     is_close(istream);
 }
 
+/* a clock for the rate limiters which only moves when they sleep so the
+ * tests don't depend on how long anything really takes */
+static double rl_test_clock = 0.0;
+
+static double rl_test_now(void)
+{
+    return rl_test_clock;
+}
+
+static void rl_test_sleep(double secs)
+{
+    rl_test_clock += secs;
+}
+
+static RateLimiter *rl_test_new(double mb_per_sec, Store *store)
+{
+    RateLimiter *rl = rate_limiter_new(mb_per_sec, store);
+    rl->now = &rl_test_now;
+    rl->sleep = &rl_test_sleep;
+    return rl;
+}
+
+/* write then read back +bytes+ bytes and return how long +rl+ paused for */
+static double rl_test_transfer(Store *store, RateLimiter *rl, int bytes)
+{
+    double paused = rl->paused;
+    OutStream *os = store->new_output(store, "_rate.cfs");
+    InStream *is;
+    int i;
+    for (i = 0; i < bytes; i++) {
+        os_write_byte(os, (uchar)i);
+    }
+    os_close(os);
+    is = store->open_input(store, "_rate.cfs");
+    for (i = 0; i < bytes; i++) {
+        is_read_byte(is);
+    }
+    is_close(is);
+    return rl->paused - paused;
+}
+
+/**
+ * Test that a thread's rate limiter slows down its I/O but only while the
+ * store is being searched.
+ */
+static void test_rate_limiter(TestCase *tc, void *data)
+{
+    Store *store = (Store *)data;
+    /* 200Kb takes 0.098 seconds at 2Mb/s, or twice that if reading isn't
+     * free as it is from memory-mapped files. Up to RL_MIN_PAUSE can still
+     * be owed at the end */
+    RateLimiter *rl = rl_test_new(2.0, store);
+    const double secs = 200 * 1024 / (2.0 * 1048576);
+    double paused;
+
+    thread_set_rate_limiter(rl);
+    Afequal(0.0, rl_test_transfer(store, rl, 200 * 1024));
+
+    Assert(!store_searching(store), "store isn't being searched");
+    store_search_start(store);
+    Assert(store_searching(store), "store is being searched");
+    paused = rl_test_transfer(store, rl, 200 * 1024);
+    Atrue(paused > secs - 0.001);
+    Atrue(paused < 2 * secs + 0.000001);
+
+    /* a rate of 0 means no limit */
+    rate_limiter_set_mb_per_sec(rl, 0.0);
+    Afequal(0.0, rl_test_transfer(store, rl, 200 * 1024));
+    store_search_finish(store);
+
+    /* without a store the rate is always limited */
+    thread_set_rate_limiter(NULL);
+    rate_limiter_destroy(rl);
+    rl = rl_test_new(2.0, NULL);
+    thread_set_rate_limiter(rl);
+    Atrue(rl_test_transfer(store, rl, 200 * 1024) > secs - 0.001);
+    thread_set_rate_limiter(NULL);
+    Afequal(0.0, rl_test_transfer(store, rl, 200 * 1024));
+    rate_limiter_destroy(rl);
+    store->remove(store, "_rate.cfs");
+}
+
 /**
  * Create a test suite for a store. This function can be used to create a test
  * suite for both a FileSystem store and a RAM store and any other type of
@@ -585,6 +667,7 @@ void create_test_store_suite(TestSuite *suite, Store *store)
     tst_run_test(suite, test_buffer_seek, store);
     tst_run_test(suite, test_is_clone, store);
     tst_run_test(suite, test_read_bytes, store);
+    tst_run_test(suite, test_rate_limiter, store);
     tst_run_test(suite, test_lock, store);
 
     store->clear_all(store);
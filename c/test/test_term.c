@@ -82,9 +82,10 @@ static void test_segment_field_index_single_field(TestCase *tc, void *data)
     Store *store = (Store *)data;
     SegmentFieldIndex *sfi;
     SegmentTermIndex *sti;
-    TermInfosWriter *tiw = tiw_open(store, "_0", 32, SKIP_INTERVAL);
+    TermInfosWriter *tiw = tiw_open(store, "_0", 32, SKIP_INTERVAL,
+                                    POSTINGS_VINT);
 
-    tiw_start_field(tiw, 0);
+    tiw_start_field(tiw, 0, false);
 
     for (i = 0; i < DICT_LEN; i++) {
         TermInfo term_info = {(i % 20) + 1, i, i, 0};
@@ -109,12 +110,12 @@ static void add_multi_field_terms(Store *store)
 {
     int i;
     int field_num = 0;
-    TermInfosWriter *tiw = tiw_open(store, "_0", 8, 8);
+    TermInfosWriter *tiw = tiw_open(store, "_0", 8, 8, POSTINGS_VINT);
 
     for (i = 0; i < DICT_LEN; i++) {
         TermInfo term_info = {(i % 20) + 1, i, i, i};
         if (i % 40 == 0) {
-            tiw_start_field(tiw, field_num);
+            tiw_start_field(tiw, field_num, false);
             field_num += 2;
         }
         tiw_add(tiw, DICT[i], strlen(DICT[i]), &term_info);
@@ -334,6 +335,54 @@ static void test_term_infos_reader(TestCase *tc, void *data)
     sfi_close(sfi);
 }
 
+static void test_term_infos_reader_bloom(TestCase *tc, void *data)
+{
+    int i;
+    Store *store = (Store *)data;
+    SegmentFieldIndex *sfi;
+    SegmentTermIndex *sti;
+    TermInfosReader *tir;
+    TermInfo *ti;
+    TermInfosWriter *tiw = tiw_open(store, "_0", 8, 8, POSTINGS_VINT);
+
+    /* field 0 has a Bloom filter holding every second term */
+    for (i = 0; i < 2; i++) {
+        int j;
+        tiw_start_field(tiw, i, 0 == i);
+        for (j = 0; j < DICT_LEN; j += 2) {
+            TermInfo term_info = {1, j, j, 0};
+            tiw_add(tiw, DICT[j], strlen(DICT[j]), &term_info);
+        }
+    }
+    tiw_close(tiw);
+
+    sfi = sfi_open(store, "_0");
+    tir = tir_open(store, sfi, "_0");
+    for (i = 0; i < 2; i++) {
+        int j;
+        tir_set_field(tir, i);
+        for (j = 0; j < DICT_LEN; j++) {
+            ti = tir_get_ti(tir, DICT[j]);
+            if (j % 2) {
+                Apnull(ti);
+            }
+            else if (Apnotnull(ti)) {
+                Aiequal(j, ti->frq_ptr);
+            }
+        }
+        Asequal(DICT[2], tir_get_term(tir, 1));
+    }
+    sti = (SegmentTermIndex *)h_get_int(sfi->field_dict, 0);
+    Apnotnull(sti->bloom);
+    Aiequal(BLOOM_HASH_CNT, sti->bloom_hash_cnt);
+    Atrue(sti->bloom_len * 8 >= (DICT_LEN / 2) * BLOOM_BITS_PER_TERM);
+    sti = (SegmentTermIndex *)h_get_int(sfi->field_dict, 1);
+    Apnull(sti->bloom);
+
+    tir_close(tir);
+    sfi_close(sfi);
+}
+
 TestSuite *ts_term(TestSuite *suite)
 {
     Store *store = open_ram_store();
@@ -344,6 +393,7 @@ TestSuite *ts_term(TestSuite *suite)
     tst_run_test(suite, test_segment_field_index_multi_field, store);
     tst_run_test(suite, test_segment_term_enum, store);
     tst_run_test(suite, test_term_infos_reader, store);
+    tst_run_test(suite, test_term_infos_reader_bloom, store);
 
     store_deref(store);
 
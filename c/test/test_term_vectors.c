@@ -8,27 +8,28 @@
 static void test_posting(TestCase *tc, void *data)
 {
     MemoryPool *mp = (MemoryPool *)data;
-    PostingList *pl;
-    Posting *p = p_new(mp, 0, 10);
-    Aiequal(0, p->doc_num);
-    Aiequal(1, p->freq);
-    Aiequal(10, p->first_occ->pos);
-    Apnull(p->first_occ->next);
-
-    pl = pl_new(mp, "seven", 5, p);
+    PostingList *pl = pl_new(mp, "seven", 5);
     Aiequal(5, pl->term_len);
     Asequal("seven", pl->term);
-    Apequal(p->first_occ, pl->last_occ);
+    Aiequal(0, pl->freq);
+    Apnull(pl->first_occ);
+    Apnull(pl->last_occ);
+
+    pl_add_occ(mp, pl, 10);
+    Apequal(pl->first_occ, pl->last_occ);
+    Aiequal(1, pl->freq);
+    Aiequal(10, pl->first_occ->pos);
+    Apnull(pl->first_occ->next);
 
     pl_add_occ(mp, pl, 50);
-    Apequal(pl->last_occ, p->first_occ->next);
-    Aiequal(2, p->freq);
+    Apequal(pl->last_occ, pl->first_occ->next);
+    Aiequal(2, pl->freq);
     Aiequal(50,  pl->last_occ->pos);
     Apnull(pl->last_occ->next);
 
     pl_add_occ(mp, pl, 345);
-    Apequal(pl->last_occ, p->first_occ->next->next);
-    Aiequal(3, p->freq);
+    Apequal(pl->last_occ, pl->first_occ->next->next);
+    Aiequal(3, pl->freq);
     Aiequal(345, pl->last_occ->pos);
     Apnull(pl->last_occ->next);
 }
@@ -72,9 +73,8 @@ static PostingList **create_tv_plists(MemoryPool *mp, char **terms)
     PostingList **plists, *pl;
     plists = MP_ALLOC_N(mp, PostingList *, NUM_TERMS);
     for (i = 0; i < NUM_TERMS; i++) {
-        pl = plists[i] =
-            pl_new(mp, terms[i], 9, p_new(mp, 0, 0));
-        for (j = 1; j <= i; j++) {
+        pl = plists[i] = pl_new(mp, terms[i], 9);
+        for (j = 0; j <= i; j++) {
             pl_add_occ(mp, pl, j);
         }
     }
@@ -2,6 +2,7 @@
 #include "symbol.h"
 #include "internal.h"
 #include "ind.h"
+#include "array.h"
 #include "testhelper.h"
 #include "test.h"
 
@@ -150,6 +151,172 @@ static void test_threading(TestCase *tc, void *data)
     }
 }
 
+#define IW_THREAD_DOCS 300
+
+struct IndexingArg
+{
+    IndexWriter *iw;
+    int thread_num;
+    Symbol field;
+};
+
+static void *iw_adding_thread(void *p)
+{
+    struct IndexingArg *arg = (struct IndexingArg *)p;
+    int i;
+
+    for (i = 0; i < IW_THREAD_DOCS; i++) {
+        Document *doc = doc_new();
+        doc_add_field(doc, df_add_data(df_new(I(id)),
+            strfmt("%d", arg->thread_num * IW_THREAD_DOCS + i)))
+            ->destroy_data = true;
+        doc_add_field(doc, df_add_data(df_new(I(contents)), num_to_str(i)))
+            ->destroy_data = true;
+        doc_add_field(doc, df_add_data(df_new(arg->field), "yes"));
+        iw_add_doc(arg->iw, doc);
+        doc_destroy(doc);
+    }
+    return NULL;
+}
+
+static void iw_add_docs_in_threads(IndexWriter *iw)
+{
+    int i;
+    pthread_t thread_id[NTHREADS];
+    struct IndexingArg args[NTHREADS];
+    char field[20];
+
+    for (i = 0; i < NTHREADS; i++) {
+        args[i].iw = iw;
+        args[i].thread_num = i;
+        /* each thread adds a field of its own as well. The symbol table
+         * isn't thread safe so the names are interned before the threads
+         * start */
+        sprintf(field, "thread%d", i);
+        args[i].field = I(field);
+        pthread_create(&thread_id[i], NULL, &iw_adding_thread, &args[i]);
+    }
+    for (i = 0; i < NTHREADS; i++) {
+        pthread_join(thread_id[i], NULL);
+    }
+}
+
+static void test_iw_threads(TestCase *tc, void *data)
+{
+    int i;
+    Store *store = open_ram_store();
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir;
+    char field[20];
+    (void)data;
+
+    config.max_buffered_docs = 37;
+    fis_add_field(fis, fi_new(I(id), STORE_YES, INDEX_UNTOKENIZED,
+                              TERM_VECTOR_NO));
+    index_create(store, fis);
+    fis_deref(fis);
+    iw = iw_open(store, letter_analyzer_new(true), &config);
+    iw_add_docs_in_threads(iw);
+    Aiequal(NTHREADS * IW_THREAD_DOCS, iw_doc_count(iw));
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(NTHREADS * IW_THREAD_DOCS, ir->num_docs(ir));
+    Aiequal(NTHREADS, ir_doc_freq(ir, I(contents), "zero"));
+    for (i = 0; i < NTHREADS; i++) {
+        char id_str[20];
+        sprintf(field, "thread%d", i);
+        Aiequal(IW_THREAD_DOCS, ir_doc_freq(ir, I(field), "yes"));
+        sprintf(id_str, "%d", i * IW_THREAD_DOCS + IW_THREAD_DOCS - 1);
+        Aiequal(1, ir_doc_freq(ir, I(id), id_str));
+    }
+    ir_close(ir);
+    store_deref(store);
+}
+
+/* the buffer memory limit is for all of the threads' DocWriters together */
+static void test_iw_threads_buffer_memory(TestCase *tc, void *data)
+{
+    int i, used = 0;
+    Store *store = open_ram_store();
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir;
+    (void)data;
+
+    config.chunk_size = 0x4000;
+    config.max_buffer_memory = 0x40000;
+    fis_add_field(fis, fi_new(I(id), STORE_YES, INDEX_UNTOKENIZED,
+                              TERM_VECTOR_NO));
+    index_create(store, fis);
+    fis_deref(fis);
+    iw = iw_open(store, letter_analyzer_new(true), &config);
+    iw_add_docs_in_threads(iw);
+    for (i = 0; i < ary_size(iw->dws); i++) {
+        used += dw_used(iw->dws[i]);
+    }
+    Aiequal(used, iw->buffered_memory);
+    Atrue(used <= config.max_buffer_memory);
+    Aiequal(NTHREADS * IW_THREAD_DOCS, iw_doc_count(iw));
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(NTHREADS * IW_THREAD_DOCS, ir->num_docs(ir));
+    ir_close(ir);
+    store_deref(store);
+}
+
+static void test_iw_merge_threads(TestCase *tc, void *data)
+{
+    int i, del_cnt = 0;
+    Store *store = open_ram_store();
+    FieldInfos *fis = fis_new(STORE_YES, INDEX_YES, TERM_VECTOR_NO);
+    Config config = default_config;
+    IndexWriter *iw;
+    IndexReader *ir;
+    char id_str[20];
+    (void)data;
+
+    config.max_buffered_docs = 7;
+    config.merge_factor = 3;
+    config.merge_threads = 2;
+    fis_add_field(fis, fi_new(I(id), STORE_YES, INDEX_UNTOKENIZED,
+                              TERM_VECTOR_NO));
+    index_create(store, fis);
+    fis_deref(fis);
+    iw = iw_open(store, letter_analyzer_new(true), &config);
+    iw_add_docs_in_threads(iw);
+    /* merges may still be running so these deletions have to be carried
+     * over to the merged segments */
+    for (i = 0; i < IW_THREAD_DOCS; i += 7, del_cnt++) {
+        sprintf(id_str, "%d", i);
+        iw_delete_term(iw, I(id), id_str);
+    }
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(NTHREADS * IW_THREAD_DOCS - del_cnt, ir->num_docs(ir));
+    ir_close(ir);
+
+    iw = iw_open(store, letter_analyzer_new(true), &config);
+    iw_optimize(iw);
+    iw_close(iw);
+
+    ir = ir_open(store);
+    Aiequal(NTHREADS * IW_THREAD_DOCS - del_cnt, ir->num_docs(ir));
+    Aiequal(ir->num_docs(ir), ir->max_doc(ir));
+    for (i = 0; i < IW_THREAD_DOCS; i++) {
+        sprintf(id_str, "%d", i);
+        Aiequal(i % 7 == 0 ? 0 : 1, ir_doc_freq(ir, I(id), id_str));
+    }
+    Aiequal(NTHREADS - 1, ir_doc_freq(ir, I(contents), "zero"));
+    ir_close(ir);
+    store_deref(store);
+}
+
 TestSuite *ts_threading(TestSuite *suite)
 {
     Analyzer *a = letter_analyzer_new(true);
@@ -176,6 +343,9 @@ TestSuite *ts_threading(TestSuite *suite)
     tst_run_test(suite, test_number_to_str, NULL);
     tst_run_test(suite, test_threading_test, index);
     tst_run_test(suite, test_threading, index);
+    tst_run_test(suite, test_iw_threads, NULL);
+    tst_run_test(suite, test_iw_threads_buffer_memory, NULL);
+    tst_run_test(suite, test_iw_merge_threads, NULL);
 
     index_destroy(index);
 
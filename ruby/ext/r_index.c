@@ -56,6 +56,9 @@ static VALUE sym_with_positions;
 static VALUE sym_with_offsets;
 static VALUE sym_with_positions_offsets;
 
+static VALUE sym_key;
+static VALUE sym_doc_values;
+
 static Symbol fsym_content;
 
 static ID id_term;
@@ -178,7 +181,7 @@ frb_get_field_info(FieldInfo *fi)
  *
  *  Create a new FieldInfo object with the name +name+ and the properties
  *  specified in +options+. The available options are [:store, :index,
- *  :term_vector, :boost]. See the description of FieldInfo for more
+ *  :term_vector, :boost, :key, :doc_values]. See the description of FieldInfo for more
  *  information on these properties. 
  */
 static VALUE
@@ -197,6 +200,12 @@ frb_fi_init(int argc, VALUE *argv, VALUE self)
     }
     fi = fi_new(frb_field(rname), store, index, term_vector);
     fi->boost = boost;
+    if (argc > 1 && RTEST(rb_hash_aref(roptions, sym_key))) {
+        fi->bits |= FI_IS_KEY_BM;
+    }
+    if (argc > 1 && RTEST(rb_hash_aref(roptions, sym_doc_values))) {
+        fi->bits |= FI_STORE_DOC_VALUES_BM;
+    }
     Frt_Wrap_Struct(self, NULL, &frb_fi_free, fi);
     object_add(fi, self);
     return self;
@@ -329,6 +338,34 @@ frb_fi_store_offsets(VALUE self)
     return fi_store_offsets(fi) ? Qtrue : Qfalse;
 }
 
+/*
+ *  call-seq:
+ *     fi.key? -> bool
+ *
+ *  Return true if this field is a key field. Key fields have a Bloom filter
+ *  in each segment so that looking up a unique id is cheap.
+ */
+static VALUE
+frb_fi_is_key(VALUE self)
+{
+    FieldInfo *fi = (FieldInfo *)DATA_PTR(self);
+    return fi_is_key(fi) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     fi.doc_values? -> bool
+ *
+ *  Return true if this field stores doc values. Sorting by a field with doc
+ *  values reads them from each segment instead of walking its postings.
+ */
+static VALUE
+frb_fi_store_doc_values(VALUE self)
+{
+    FieldInfo *fi = (FieldInfo *)DATA_PTR(self);
+    return fi_store_doc_values(fi) ? Qtrue : Qfalse;
+}
+
 /*
  *  call-seq:
  *     fi.has_norms? -> bool
@@ -549,6 +586,12 @@ frb_fis_add_field(int argc, VALUE *argv, VALUE self)
     }
     fi = fi_new(frb_field(rname), store, index, term_vector);
     fi->boost = boost;
+    if (argc > 1 && RTEST(rb_hash_aref(roptions, sym_key))) {
+        fi->bits |= FI_IS_KEY_BM;
+    }
+    if (argc > 1 && RTEST(rb_hash_aref(roptions, sym_doc_values))) {
+        fi->bits |= FI_STORE_DOC_VALUES_BM;
+    }
     fis_add_field(fis, fi);
     return self;
 }
@@ -2803,6 +2846,22 @@ frb_ir_version(VALUE self)
  *                  |                         | create the field. All values
  *                  |                         | should be positive.
  *                  |                         | 
+ *     -------------|-------------------------|------------------------------
+ *     :key         | false (default)         | Set to true for fields
+ *                  |                         | holding a unique id which is
+ *                  |                         | used to update or delete
+ *                  |                         | documents. Each segment then
+ *                  |                         | stores a Bloom filter of the
+ *                  |                         | field's terms so that segments
+ *                  |                         | without the id are skipped.
+ *     -------------|-------------------------|------------------------------
+ *     :doc_values  | false (default)         | Set to true for fields which
+ *                  |                         | you sort by. Each segment then
+ *                  |                         | stores the field's value for
+ *                  |                         | every document so the sort
+ *                  |                         | cache is loaded directly
+ *                  |                         | rather than being built from
+ *                  |                         | the field's postings.
  *
  *  == Examples
  *
@@ -2835,6 +2894,9 @@ Init_FieldInfo(void)
     sym_with_offsets = ID2SYM(rb_intern("with_offsets"));
     sym_with_positions_offsets = ID2SYM(rb_intern("with_positions_offsets"));
 
+    sym_key = ID2SYM(rb_intern("key"));
+    sym_doc_values = ID2SYM(rb_intern("doc_values"));
+
     cFieldInfo = rb_define_class_under(mIndex, "FieldInfo", rb_cObject);
     rb_define_alloc_func(cFieldInfo, frb_data_alloc);
 
@@ -2851,6 +2913,8 @@ Init_FieldInfo(void)
                                                 frb_fi_store_positions, 0);
     rb_define_method(cFieldInfo, "store_offsets?",
                                                 frb_fi_store_offsets, 0);
+    rb_define_method(cFieldInfo, "key?",        frb_fi_is_key, 0);
+    rb_define_method(cFieldInfo, "doc_values?", frb_fi_store_doc_values, 0);
     rb_define_method(cFieldInfo, "has_norms?",  frb_fi_has_norms, 0);
     rb_define_method(cFieldInfo, "boost",       frb_fi_boost, 0);
     rb_define_method(cFieldInfo, "to_s",        frb_fi_to_s, 0);
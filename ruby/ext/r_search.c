@@ -1996,10 +1996,13 @@ frb_f_get_bits(VALUE self, VALUE rindex_reader)
 {
     BitVector *bv;
     IndexReader *ir;
+    VALUE rbv;
     GET_F();
     Data_Get_Struct(rindex_reader, IndexReader, ir);
     bv = filt_get_bv(f, ir);
-    return frb_get_bv(bv);
+    rbv = frb_get_bv(bv);
+    bv_destroy(bv);
+    return rbv;
 }
 
 /****************************************************************************
@@ -2641,6 +2644,8 @@ frb_get_cwrapped_filter(VALUE rval)
         filter->hash         = &cwfilt_hash;
         filter->eq           = &cwfilt_eq;
         filter->get_bv_i     = &cwfilt_get_bv_i;
+        /* the ruby filter can only be handed readers which ruby knows */
+        filter->per_segment  = false;
         CWF(filter)->rfilter = rval;
     }
     return filter;